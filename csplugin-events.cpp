@@ -21,21 +21,28 @@
 #include <clearsync/csplugin.h>
 
 #include <sstream>
+#include <deque>
 #include <iomanip>
 
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/socket.h>
 #include <linux/un.h>
 #include <sqlite3.h>
 
+#include <sys/time.h>
 #include <sys/sysinfo.h>
 #include <sys/statvfs.h>
 
 #include <openssl/sha.h>
 
-#include "events-conf.h"
 #include "events-alert.h"
 #include "events-db.h"
+#include "events-db-log.h"
+#include "events-spool.h"
+#include "events-ring.h"
+#include "events-conf.h"
+#include "events-histogram.h"
 #include "events-socket.h"
 #include "events-syslog.h"
 #include "csplugin-events.h"
@@ -43,8 +50,13 @@
 csPluginEvents::csPluginEvents(const string &name,
     csEventClient *parent, size_t stack_size)
     : csPlugin(name, parent, stack_size),
-    events_conf(NULL), events_db(NULL), events_syslog(NULL),
-    events_socket_server(NULL)
+    events_conf(NULL), events_db(NULL), events_db_ready(false),
+    events_spool(NULL), events_histogram(NULL),
+    events_syslog(NULL), events_socket_server(NULL),
+    events_datagram_server(NULL), events_ring_server(NULL), backup_active(false), backup_client(NULL), backup_reported(0),
+    backup_percent(0), backup_pages(0), purge_next(0),
+    publish_active(false), publish_seq(0), publish_pushed(0), publish_dropped(0),
+    datagram_dropped(0), ring_dropped(0)
 {
     ::csGetLocale(locale);
     size_t uscore_delim = locale.find_first_of('_');
@@ -70,8 +82,12 @@ csPluginEvents::~csPluginEvents()
 
     if (events_conf != NULL) delete events_conf;
     if (events_db != NULL) delete events_db;
+    if (events_spool != NULL) delete events_spool;
+    if (events_histogram != NULL) delete events_histogram;
     if (events_syslog != NULL) delete events_syslog;
     if (events_socket_server != NULL) delete events_socket_server;
+    if (events_datagram_server != NULL) delete events_datagram_server;
+    if (events_ring_server != NULL) delete events_ring_server;
     for (csPluginEventsClientMap::iterator i = events_socket_client.begin();
         i != events_socket_client.end(); i++) delete i->second;
     for (csEventsSyslogRegExVector::iterator i = events_syslog_rx.begin();
@@ -99,7 +115,25 @@ void csPluginEvents::SetConfigurationFile(const string &conf_filename)
     events_conf->Reload();
 
     if (events_db != NULL) delete events_db;
-    events_db = new csEventsDb_sqlite(events_conf->GetSqliteDbFilename());
+    switch (events_conf->GetDbType()) {
+    case csEventsDb::csDBT_LOG:
+        events_db = new csEventsDb_log(events_conf->GetLogDbPath(),
+            events_conf->GetLogSegmentSize(), events_conf->GetLogSegmentAge(),
+            events_conf->GetLogSegmentsMax());
+        break;
+    default:
+        events_db = new csEventsDb_sqlite(events_conf->GetSqliteDbFilename(),
+            events_conf->GetSqliteFullTextSearch(),
+            events_conf->GetSqliteTemplateEncoding());
+        break;
+    }
+    events_db->SetBusyDeadline(events_conf->GetDbBusyTimeout());
+    if (events_spool != NULL) delete events_spool;
+    events_spool = new csEventsSpool(events_conf->GetSpoolFilename(),
+        events_conf->GetSpoolSync(), events_conf->GetSpoolSyncInterval(),
+        events_conf->GetSpoolMaxSize());
+    if (events_histogram != NULL) delete events_histogram;
+    events_histogram = new csEventsHistogram(events_conf->GetHistogramFilename());
     if (events_syslog != NULL) delete events_syslog;
     events_syslog = new csEventsSyslog(events_conf->GetSyslogSocketPath());
 
@@ -112,6 +146,36 @@ void csPluginEvents::SetConfigurationFile(const string &conf_filename)
             "%s: %s: %s", name.c_str(), e.estring.c_str(), e.what());
     }
 
+    try {
+        if (events_datagram_server != NULL) delete events_datagram_server;
+        events_datagram_server = NULL;
+        if (events_conf->GetInsertSocketPath().length() > 0) {
+            events_datagram_server = new csEventsDatagramServer(
+                events_conf->GetInsertSocketPath());
+        }
+    } catch (csEventsSocketException &e) {
+        csLog::Log(csLog::Error,
+            "%s: %s: %s", name.c_str(), e.estring.c_str(), e.what());
+    }
+
+    try {
+        if (events_ring_server != NULL) delete events_ring_server;
+        events_ring_server = NULL;
+        if (events_conf->IsRingEnabled()) {
+            csEventsRing *ring = new csEventsRing(
+                events_conf->GetRingSlots(), events_conf->GetRingSlotSize());
+            try {
+                events_ring_server = new csEventsRingServer(ring);
+            } catch (csException &e) {
+                delete ring;
+                throw;
+            }
+        }
+    } catch (csException &e) {
+        csLog::Log(csLog::Error,
+            "%s: %s: %s", name.c_str(), e.estring.c_str(), e.what());
+    }
+
     csAlertSourceConfigVector alert_sources;
     events_conf->GetAlertSourceConfigs(alert_sources);
 
@@ -205,24 +269,23 @@ void csPluginEvents::LoadAlertConfig(csEventsAlertSourceConfig_sysinfo *sysinfo_
 void *csPluginEvents::Entry(void)
 {
     int rc;
-    fd_set fds_read;
+    fd_set fds_read, fds_write;
     struct timeval tv;
 
     csLog::Log(csLog::Debug, "%s: Started", name.c_str());
 
     try {
-        events_db->Open();
-        if (events_conf->InitDb()) events_db->Drop();
-        events_db->Create();
-
-        RefreshAlertTypes();
-        RefreshLevelOverrides();
+        events_spool->Open();
     }
-    catch (csEventsDbException &e) {
+    catch (csEventsSpoolException &e) {
         csLog::Log(csLog::Error,
-            "%s: Database exception: %s", name.c_str(), e.estring.c_str());
+            "%s: Spool exception: %s", name.c_str(), e.estring.c_str());
     }
 
+    OpenDatabase(events_conf->InitDb());
+
+    events_histogram->Load();
+
     csTimer *purge_timer = new csTimer(_CSPLUGIN_EVENTS_PURGE_TIMER_ID,
         _CSPLUGIN_EVENTS_PURGE_TIMER, _CSPLUGIN_EVENTS_PURGE_TIMER, this
     );
@@ -233,16 +296,37 @@ void *csPluginEvents::Entry(void)
     );
     sysinfo_timer->Start();
 
+    csTimer *histogram_timer = new csTimer(_CSPLUGIN_EVENTS_HISTOGRAM_TIMER_ID,
+        events_conf->GetHistogramSaveInterval(),
+        events_conf->GetHistogramSaveInterval(), this
+    );
+    histogram_timer->Start();
+
+    csTimer *spool_timer = new csTimer(_CSPLUGIN_EVENTS_SPOOL_TIMER_ID,
+        _CSPLUGIN_EVENTS_SPOOL_TIMER, _CSPLUGIN_EVENTS_SPOOL_TIMER, this
+    );
+    spool_timer->Start();
+
+    csTimer *client_timer = new csTimer(_CSPLUGIN_EVENTS_CLIENT_TIMER_ID,
+        _CSPLUGIN_EVENTS_CLIENT_TIMER, _CSPLUGIN_EVENTS_CLIENT_TIMER, this
+    );
+    client_timer->Start();
+
     for (bool run = true; run; ) {
 
         int max_fd = events_socket_server->GetDescriptor();
 
         FD_ZERO(&fds_read);
+        FD_ZERO(&fds_write);
         FD_SET(max_fd, &fds_read);
 
+        bool packet_ready = false, ring_pending = false;
+
         for (csPluginEventsClientMap::iterator i = events_socket_client.begin();
             i != events_socket_client.end(); i++) {
             FD_SET(i->first, &fds_read);
+            if (i->second->IsWritePending()) FD_SET(i->first, &fds_write);
+            if (i->second->IsPacketReady()) packet_ready = true;
             if (i->first > max_fd) max_fd = i->first;
         }
 
@@ -250,11 +334,44 @@ void *csPluginEvents::Entry(void)
         if (events_syslog->GetDescriptor() > max_fd)
             max_fd = events_syslog->GetDescriptor();
 
+        if (events_datagram_server != NULL) {
+            FD_SET(events_datagram_server->GetDescriptor(), &fds_read);
+            if (events_datagram_server->GetDescriptor() > max_fd)
+                max_fd = events_datagram_server->GetDescriptor();
+        }
+
+        if (events_ring_server != NULL) {
+            FD_SET(events_ring_server->GetDescriptor(), &fds_read);
+            if (events_ring_server->GetDescriptor() > max_fd)
+                max_fd = events_ring_server->GetDescriptor();
+            if (events_ring_server->IsReady()) packet_ready = true;
+            ring_pending = events_ring_server->IsPending();
+        }
+
         tv.tv_sec = 1; tv.tv_usec = 0;
 
-        rc = select(max_fd + 1, &fds_read, NULL, NULL, &tv);
+        // Wake up in time for the next backup step
+        if (backup_active) {
+            struct timeval now;
+            gettimeofday(&now, NULL);
+            if (timercmp(&backup_next, &now, >))
+                timersub(&backup_next, &now, &tv);
+            else
+                tv.tv_sec = tv.tv_usec = 0;
+            if (tv.tv_sec > 1) { tv.tv_sec = 1; tv.tv_usec = 0; }
+        }
+
+        // Buffered requests are waiting; just poll
+        if (packet_ready) tv.tv_sec = tv.tv_usec = 0;
+
+        rc = select(max_fd + 1, &fds_read, &fds_write, NULL, &tv);
+
+        if (rc > 0 || (rc == 0 && (packet_ready || ring_pending)))
+            ProcessEventSelect(fds_read, fds_write);
+
+        if (backup_active) BackupStep();
 
-        if (rc > 0) ProcessEventSelect(fds_read);
+        if (publish_active) Publish();
 
         csTimer *timer;
         csEvent *event = EventPop();
@@ -262,8 +379,14 @@ void *csPluginEvents::Entry(void)
         if (event != NULL) {
             switch (event->GetId()) {
             case csEVENT_QUIT:
+                if (backup_active) BackupEnd("Backup aborted");
                 purge_timer->Stop();
                 sysinfo_timer->Stop();
+                histogram_timer->Stop();
+                spool_timer->Stop();
+                client_timer->Stop();
+                if (events_histogram->IsDirty()) events_histogram->Save();
+                events_spool->Sync(true);
                 csLog::Log(csLog::Debug, "%s: Terminated.", name.c_str());
                 run = false;
                 break;
@@ -271,12 +394,28 @@ void *csPluginEvents::Entry(void)
             case csEVENT_TIMER:
                 timer = static_cast<csEventTimer *>(event)->GetTimer();
 
-                if (timer->GetId() == _CSPLUGIN_EVENTS_PURGE_TIMER_ID &&
-                    events_conf->GetMaxAgeTTL()) {
-                    events_db->PurgeAlerts(csEventsAlert(),
-                        time(NULL) - events_conf->GetMaxAgeTTL());
+                if (timer->GetId() == _CSPLUGIN_EVENTS_PURGE_TIMER_ID) {
+                    // Nothing is prepared until the database opens
+                    if (events_db_ready) {
+                        try {
+                            PurgeAlerts();
+                            events_db->EnforceLimits(events_conf->GetDbMaxSize(),
+                                events_conf->GetDbMaxAlerts());
+                        }
+                        catch (csEventsDbException &e) {
+                            csLog::Log(csLog::Error, "%s: Database exception: %s",
+                                name.c_str(), e.estring.c_str());
+                        }
+                    }
                 } else if (timer->GetId() == _CSPLUGIN_EVENTS_SYSINFO_TIMER_ID)
                     ProcessSysinfoRefresh();
+                else if (timer->GetId() == _CSPLUGIN_EVENTS_HISTOGRAM_TIMER_ID &&
+                    events_histogram->IsDirty())
+                    events_histogram->Save();
+                else if (timer->GetId() == _CSPLUGIN_EVENTS_SPOOL_TIMER_ID)
+                    SpoolReplay();
+                else if (timer->GetId() == _CSPLUGIN_EVENTS_CLIENT_TIMER_ID)
+                    ExpireClients();
                 break;
             }
 
@@ -292,11 +431,14 @@ void *csPluginEvents::Entry(void)
 
     delete purge_timer;
     delete sysinfo_timer;
+    delete histogram_timer;
+    delete spool_timer;
+    delete client_timer;
 
     return NULL;
 }
 
-void csPluginEvents::ProcessEventSelect(fd_set &fds)
+void csPluginEvents::ProcessEventSelect(fd_set &fds, fd_set &fds_write)
 {
     vector<string> syslog_messages;
     csPluginEventsClientMap::iterator sci;
@@ -323,8 +465,10 @@ void csPluginEvents::ProcessEventSelect(fd_set &fds)
                     if (rx->Execute((*i).c_str()) != 0) continue;
                     if ((*j)->exclude) break;
 
-                    string text;
-                    SyslogTextSubstitute(text, rx, rx_config);
+                    string text, text_template;
+                    vector<string> text_params;
+                    SyslogTextSubstitute(text,
+                        text_template, text_params, rx, rx_config);
                     if (text.length() == 0) continue;
 
                     csLog::Log(csLog::Debug, "%s: %s", name.c_str(), (*i).c_str());
@@ -336,6 +480,7 @@ void csPluginEvents::ProcessEventSelect(fd_set &fds)
                     if ((*j)->auto_resolve)
                         alert.SetFlag(csEventsAlert::csAF_FLG_AUTO_RESOLVE);
                     alert.SetDescription(text);
+                    alert.SetTemplate(text_template, text_params);
                     alert.SetUUID(text);
                     alert.SetUser();
                     alert.SetOrigin("internal-syslog");
@@ -348,9 +493,33 @@ void csPluginEvents::ProcessEventSelect(fd_set &fds)
             }
         }
 
+        if (events_datagram_server != NULL &&
+            FD_ISSET(events_datagram_server->GetDescriptor(), &fds))
+            ProcessDatagrams();
+
+        // Records claimed but not yet published don't ring the doorbell
+        // until they are, and never will if their producer died; check
+        // back each pass
+        if (events_ring_server != NULL &&
+            (FD_ISSET(events_ring_server->GetDescriptor(), &fds) ||
+            events_ring_server->IsPending()))
+            ProcessRing();
+
+        for (csPluginEventsClientMap::iterator i = events_socket_client.begin();
+            i != events_socket_client.end(); i++) {
+            if (FD_ISSET(i->first, &fds_write)) i->second->Flush();
+        }
+
         for (csPluginEventsClientMap::iterator i = events_socket_client.begin();
             i != events_socket_client.end(); i++) {
-            if (FD_ISSET(i->first, &fds)) ProcessClientRequest(i->second);
+            if (FD_ISSET(i->first, &fds)) i->second->Receive();
+
+            // Serve pipelined requests in one pass, up to a budget so one
+            // busy client can't starve the others; any left over are
+            // picked up on the next (polled) pass
+            for (int n = 0; n < _CSPLUGIN_EVENTS_CLIENT_BUDGET &&
+                i->second->IsPacketReady(); n++)
+                ProcessClientRequest(i->second);
         }
 
         if (FD_ISSET(events_socket_server->GetDescriptor(), &fds)) {
@@ -417,11 +586,72 @@ void csPluginEvents::ProcessEventSelect(fd_set &fds)
     }
 }
 
+void csPluginEvents::ExpireClients(void)
+{
+    time_t now = time(NULL);
+    csPluginEventsClientMap::iterator i = events_socket_client.begin();
+
+    while (i != events_socket_client.end()) {
+        time_t deadline = i->second->GetDeadline();
+        if (deadline == 0 || deadline > now) {
+            i++;
+            continue;
+        }
+
+        csLog::Log(csLog::Error, "%s: Socket time-out: %d",
+            name.c_str(), i->first);
+
+        delete i->second;
+        events_socket_client.erase(i++);
+    }
+}
+
+void csPluginEvents::ProcessDatagrams(void)
+{
+    vector<csEventsAlert *> alerts;
+    csEventsInsertResultVector results;
+
+    events_datagram_server->AlertInsert(alerts);
+    if (alerts.size() == 0) return;
+
+    InsertAlerts(alerts, results);
+
+    // Nobody to report to; count alerts that were neither stored nor
+    // spooled
+    for (size_t i = 0; i < alerts.size(); i++) {
+        if (results[i].status == csSMIS_DROPPED ||
+            results[i].status == csSMIS_ERROR) datagram_dropped++;
+        delete alerts[i];
+    }
+}
+
+void csPluginEvents::ProcessRing(void)
+{
+    vector<csEventsAlert *> alerts;
+    csEventsInsertResultVector results;
+
+    events_ring_server->AlertInsert(alerts);
+
+    if (alerts.size() > 0) {
+        InsertAlerts(alerts, results);
+
+        for (size_t i = 0; i < alerts.size(); i++) {
+            if (results[i].status == csSMIS_DROPPED ||
+                results[i].status == csSMIS_ERROR) ring_dropped++;
+            delete alerts[i];
+        }
+    }
+
+    // Drained; have the next producer ring the doorbell.  Otherwise the
+    // loop polls until it is.
+    if (! events_ring_server->IsReady()) events_ring_server->Sleep();
+}
+
 void csPluginEvents::ProcessClientRequest(csEventsSocketClient *client)
 {
     csEventsAlert alert;
     string alert_type, alert_basename;
-    uint32_t type = 0, flags = csEventsAlert::csAF_NULL;
+    uint32_t type = 0, flags = csEventsAlert::csAF_NULL, max_age = 0;
 
     if (client->GetProtoVersion() == 0) {
         client->VersionExchange();
@@ -432,23 +662,83 @@ void csPluginEvents::ProcessClientRequest(csEventsSocketClient *client)
         return;
     }
 
+    // Subscribed connections are push-only; anything readable is either
+    // a hang-up (thrown by Receive) or a protocol error.
+    if (client->IsSubscriber()) {
+        client->ReadPacket();
+        throw csEventsSocketProtocolException(client->GetDescriptor(),
+            "Request on subscribed connection");
+    }
+
     switch (client->ReadPacket()) {
     case csSMOC_ALERT_INSERT:
         client->AlertInsert(alert);
         InsertAlert(alert);
         break;
+    case csSMOC_ALERT_INSERT_BATCH:
+        {
+            vector<csEventsAlert *> alerts;
+            csEventsInsertResultVector results;
+
+            client->AlertInsertBatch(alerts);
+            InsertAlerts(alerts, results);
+
+            for (vector<csEventsAlert *>::iterator i = alerts.begin();
+                i != alerts.end(); i++) delete (*i);
+
+            client->AlertInsertBatch(results);
+        }
+        break;
+    case csSMOC_RING_ATTACH:
+        {
+            csEventsRing *ring = (events_ring_server != NULL) ?
+                events_ring_server->GetRing() : NULL;
+            client->RingAttach(ring);
+        }
+        break;
     case csSMOC_ALERT_SELECT:
         client->AlertSelect(events_db);
         break;
+    case csSMOC_ALERT_SELECT_RAW:
+        client->AlertSelect(events_db, true);
+        break;
+    case csSMOC_ALERT_SEARCH:
+        client->AlertSearch(events_db);
+        break;
+    case csSMOC_ALERT_SELECT_GROUP:
+        client->AlertSelectGroup(events_db);
+        break;
+    case csSMOC_ALERT_CHANGES:
+        client->AlertChanges(events_db);
+        break;
+    case csSMOC_ALERT_SUBSCRIBE:
+        {
+            csEventsSubscription filter;
+            client->AlertSubscribe(filter);
+            Subscribe(client, filter);
+        }
+        break;
     case csSMOC_ALERT_MARK_AS_RESOLVED:
         client->AlertMarkAsResolved(alert);
         events_db->MarkAsResolved(alert.GetType());
         break;
+    case csSMOC_ALERT_RESOLVE:
+        client->AlertResolve(events_db);
+        break;
+    case csSMOC_ALERT_SUMMARY:
+        client->AlertSummary(events_db);
+        break;
+    case csSMOC_ALERT_AGGREGATE:
+        client->AlertAggregate(events_db);
+        break;
+    case csSMOC_HISTOGRAM_SELECT:
+        client->HistogramSelect(events_histogram);
+        break;
     case csSMOC_TYPE_REGISTER:
-        client->TypeRegister(alert_type, alert_basename);
-        csLog::Log(csLog::Debug, "%s: Register custom type: %s (%s)",
-            name.c_str(), alert_type.c_str(), alert_basename.c_str());
-        events_db->InsertType(alert_type, alert_basename);
+        client->TypeRegister(alert_type, alert_basename, max_age);
+        csLog::Log(csLog::Debug, "%s: Register custom type: %s (%s), max-age: %u",
+            name.c_str(), alert_type.c_str(), alert_basename.c_str(), max_age);
+        events_db->InsertType(alert_type, alert_basename, (time_t)max_age);
         RefreshAlertTypes();
         break;
     case csSMOC_TYPE_DEREGISTER:
@@ -458,6 +748,43 @@ void csPluginEvents::ProcessClientRequest(csEventsSocketClient *client)
         events_db->DeleteType(alert_type);
         RefreshAlertTypes();
         break;
+    case csSMOC_DB_BACKUP:
+        client->DbBackup(alert_type);
+        BackupBegin(client, alert_type);
+        break;
+    case csSMOC_STATS:
+        {
+            csEventsStatsMap stats;
+            events_db->GetStats(stats);
+            if (events_spool != NULL) {
+                stats["spool.pending"] = events_spool->GetPending();
+                stats["spool.dropped"] = events_spool->GetDropped();
+                stats["spool.bytes"] = (uint64_t)events_spool->GetSize();
+            }
+            uint64_t subscribers = 0;
+            for (csPluginEventsClientMap::iterator i = events_socket_client.begin();
+                i != events_socket_client.end(); i++) {
+                if (i->second->IsSubscriber()) subscribers++;
+            }
+            stats["subscribers.active"] = subscribers;
+            stats["subscribers.pushed"] = publish_pushed;
+            stats["subscribers.dropped"] = publish_dropped;
+            if (events_datagram_server != NULL) {
+                stats["datagram.accepted"] = events_datagram_server->GetAccepted();
+                stats["datagram.rejected"] = events_datagram_server->GetRejected();
+                stats["datagram.dropped"] = datagram_dropped;
+            }
+            if (events_ring_server != NULL) {
+                csEventsRing *ring = events_ring_server->GetRing();
+                stats["ring.accepted"] = events_ring_server->GetAccepted();
+                stats["ring.rejected"] = events_ring_server->GetRejected();
+                stats["ring.full"] = ring->GetFull();
+                stats["ring.abandoned"] = ring->GetAbandoned();
+                stats["ring.dropped"] = ring_dropped;
+            }
+            client->Stats(stats);
+        }
+        break;
     case csSMOC_OVERRIDE_SET:
         client->OverrideSet(type, flags);
         csLog::Log(csLog::Debug, "%s: Set alert level override: %u: 0x%08x",
@@ -564,7 +891,8 @@ void csPluginEvents::ProcessSysinfoThreshold(
 {
     size_t pos;
     ostringstream value;
-    string description;
+    string description, description_template;
+    vector<string> description_params;
 
     if (threshold >= config->threshold) {
         if (config->trigger_start_time == 0)
@@ -593,6 +921,8 @@ void csPluginEvents::ProcessSysinfoThreshold(
                 }
             }
 
+            description_template = description;
+
             for (vector<string>::iterator i = events_sysinfo_keys.begin();
                 i != events_sysinfo_keys.end(); i++) {
 
@@ -608,9 +938,16 @@ void csPluginEvents::ProcessSysinfoThreshold(
 
                 while ((pos = description.find((*i))) != string::npos)
                     description.replace(pos, (*i).length(), value.str());
+
+                if (description_template.find((*i)) == string::npos) continue;
+
+                description_params.push_back(value.str());
+                csEventsAlert::TemplateSubstitute(description_template,
+                    (*i), description_params.size());
             }
 
             alert.SetDescription(description);
+            alert.SetTemplate(description_template, description_params);
             alert.SetOrigin("internal-sysinfo");
             alert.SetBasename("csplugin-events");
             alert.SetUser();
@@ -621,30 +958,53 @@ void csPluginEvents::ProcessSysinfoThreshold(
             InsertAlert(alert);
         }
     }
-    else if (config->trigger_start_time > 0) {
+    else {
         config->trigger_start_time = 0;
-        if (config->auto_resolve && config->trigger_active) {
+        // Leave trigger_active set until the resolve is stored, so it is
+        // retried on the next refresh if the database is unavailable.
+        if (!config->auto_resolve || !config->trigger_active) return;
+        if (!events_db_ready) return;
+        try {
+            uint32_t resolved = 0;
+            // Volume alerts carry their path as UUID; resolve just this one
+            if (key == csEventsAlertSourceConfig_sysinfo::csSIK_VOL_USAGE)
+                resolved = events_db->MarkAsResolvedByUUID(config->path, config->type);
+            else
+                resolved = events_db->MarkAsResolved(config->type);
             config->trigger_active = false;
-            events_db->MarkAsResolved(config->type);
             csLog::Log(csLog::Debug,
-                "%s: Auto-resolved sysinfo alert", name.c_str());
+                "%s: Auto-resolved sysinfo alert: %u", name.c_str(), resolved);
+        }
+        catch (csEventsDbException &e) {
+            csLog::Log(csLog::Warning, "%s: Sysinfo auto-resolve deferred: %s",
+                name.c_str(), e.estring.c_str());
         }
     }
 }
 
 void csPluginEvents::SyslogTextSubstitute(string &dst,
+    string &dst_template, vector<string> &dst_params,
     csRegEx *rx, csAlertSourceConfig_syslog_pattern *rx_config)
 {
     size_t pos;
     dst = rx_config->text;
+    dst_template = rx_config->text;
+    dst_params.clear();
     csAlertSourceConfig_syslog_match::iterator i;
     for (i = rx_config->match.begin(); i != rx_config->match.end(); i++) {
         if (strlen(rx->GetMatch(i->first)) == 0) {
             dst.clear();
+            dst_template.clear();
+            dst_params.clear();
             return;
         }
         while ((pos = dst.find(i->second)) != string::npos)
             dst.replace(pos, i->second.length(), rx->GetMatch(i->first));
+
+        // Variables are numbered by position in the parameter list
+        dst_params.push_back(rx->GetMatch(i->first));
+        csEventsAlert::TemplateSubstitute(dst_template,
+            i->second, dst_params.size());
     }
 }
 
@@ -653,6 +1013,52 @@ void csPluginEvents::RefreshAlertTypes(void)
     csAlertIdMap alert_types;
     events_db->SelectTypes(&alert_types);
     events_conf->MergeRegisteredAlertTypes(alert_types);
+
+    RefreshRetention();
+}
+
+void csPluginEvents::RefreshRetention(void)
+{
+    csAlertRetentionMap registered;
+    events_db->SelectTypeRetention(&registered);
+    events_conf->MergeRegisteredRetention(registered);
+
+    events_conf->GetAlertRetention(retention);
+    events_db->SetRetention(retention);
+
+    csLog::Log(csLog::Debug, "%s: Retention policies:", name.c_str());
+    for (csAlertRetentionMap::iterator i = retention.begin();
+        i != retention.end(); i++) {
+        csLog::Log(csLog::Debug, "  %u: %lds", i->first, (long)i->second);
+    }
+}
+
+void csPluginEvents::PurgeAlerts(void)
+{
+    time_t now = time(NULL);
+
+    // Types without a policy fall under the global TTL
+    if (events_conf->GetMaxAgeTTL())
+        events_db->PurgeAlerts(csEventsAlert(), now - events_conf->GetMaxAgeTTL());
+
+    if (retention.size() == 0) return;
+
+    // Visit policies round-robin, starting where the last tick's budget
+    // ran out, so no one busy type can starve the others.
+    uint32_t budget = _CSPLUGIN_EVENTS_PURGE_BUDGET;
+    csAlertRetentionMap::iterator i = retention.lower_bound(purge_next);
+
+    for (size_t n = 0; n < retention.size() && budget > 0; n++, i++) {
+        if (i == retention.end()) i = retention.begin();
+
+        uint32_t purged = events_db->PurgeAlerts(i->first, now - i->second, budget);
+        if (purged)
+            csLog::Log(csLog::Debug, "%s: Purged %u alert(s) of type %u",
+                name.c_str(), purged, i->first);
+
+        budget -= purged;
+        purge_next = (budget == 0) ? i->first : i->first + 1;
+    }
 }
 
 void csPluginEvents::RefreshLevelOverrides(void)
@@ -667,7 +1073,151 @@ void csPluginEvents::RefreshLevelOverrides(void)
     }
 }
 
-void csPluginEvents::InsertAlert(csEventsAlert &alert)
+void csPluginEvents::BackupBegin(
+    csEventsSocketClient *client, const string &filename)
+{
+    const char *error = NULL;
+
+    if (backup_active)
+        error = "Backup already in progress";
+    else if (filename.length() == 0 || filename[0] != '/')
+        error = "Backup path must be absolute";
+
+    if (error == NULL) {
+        try {
+            events_db->BackupBegin(filename);
+        }
+        catch (csEventsDbException &e) {
+            csLog::Log(csLog::Error, "%s: Backup: %s: %s",
+                name.c_str(), filename.c_str(), e.estring.c_str());
+            error = "Unable to start backup";
+        }
+    }
+
+    if (error != NULL) {
+        client->WriteError(error);
+        return;
+    }
+
+    csLog::Log(csLog::Info, "%s: Backup started: %s", name.c_str(), filename.c_str());
+
+    backup_active = true;
+    backup_client = client;
+    backup_percent = 0;
+    backup_pages = 0;
+    gettimeofday(&backup_start, NULL);
+    backup_next = backup_start;
+    backup_reported = backup_start.tv_sec;
+}
+
+void csPluginEvents::BackupStep(void)
+{
+    struct timeval now, sleep;
+    uint32_t remaining = 0, total = 0;
+
+    gettimeofday(&now, NULL);
+    if (timercmp(&now, &backup_next, <)) return;
+
+    try {
+        if (!events_db->BackupStep(
+            events_conf->GetBackupPagesPerStep(), remaining, total)) {
+            backup_pages = total;
+            BackupEnd();
+            return;
+        }
+    }
+    catch (csEventsDbException &e) {
+        csLog::Log(csLog::Error, "%s: Backup: %s",
+            name.c_str(), e.estring.c_str());
+        BackupEnd("Backup failed");
+        return;
+    }
+
+    sleep.tv_sec = events_conf->GetBackupSleep() / 1000;
+    sleep.tv_usec = (events_conf->GetBackupSleep() % 1000) * 1000;
+    timeradd(&now, &sleep, &backup_next);
+
+    // Report progress on each whole percent, or at least once a second
+    uint32_t percent = (total > 0) ? (total - remaining) * 100 / total : 0;
+    if (percent == backup_percent && now.tv_sec == backup_reported) return;
+
+    backup_percent = percent;
+    backup_reported = now.tv_sec;
+
+    csLog::Log(csLog::Debug, "%s: Backup: %u/%u pages",
+        name.c_str(), total - remaining, total);
+
+    csPluginEventsClientMap::iterator i;
+    for (i = events_socket_client.begin(); i != events_socket_client.end(); i++) {
+        if (i->second == backup_client) break;
+    }
+    if (i == events_socket_client.end()) {
+        backup_client = NULL;
+        return;
+    }
+
+    uint32_t duration = BackupElapsed();
+
+    try {
+        backup_client->DbBackupProgress(remaining, total, duration);
+    }
+    catch (csEventsSocketException &e) {
+        // Keep going; the backup doesn't depend on the requester
+        csLog::Log(csLog::Warning, "%s: Backup: progress: %s",
+            name.c_str(), e.estring.c_str());
+        backup_client = NULL;
+    }
+}
+
+void csPluginEvents::BackupEnd(const char *error)
+{
+    uint32_t duration = BackupElapsed();
+
+    if (error != NULL) events_db->BackupEnd();
+    else {
+        csLog::Log(csLog::Info, "%s: Backup complete: %u pages in %u ms",
+            name.c_str(), backup_pages, duration);
+    }
+
+    backup_active = false;
+
+    csPluginEventsClientMap::iterator i;
+    for (i = events_socket_client.begin(); i != events_socket_client.end(); i++) {
+        if (i->second == backup_client) break;
+    }
+
+    // Requester may have hung-up already
+    if (i == events_socket_client.end()) {
+        backup_client = NULL;
+        return;
+    }
+
+    try {
+        if (error != NULL) backup_client->WriteError(error);
+        else {
+            uint32_t result[2] = { backup_pages, duration };
+            backup_client->WriteResult(csSMPR_OK, result, sizeof(result));
+        }
+    }
+    catch (csEventsSocketException &e) {
+        csLog::Log(csLog::Warning, "%s: Backup: result: %s",
+            name.c_str(), e.estring.c_str());
+    }
+
+    backup_client = NULL;
+}
+
+uint32_t csPluginEvents::BackupElapsed(void)
+{
+    struct timeval now, elapsed;
+
+    gettimeofday(&now, NULL);
+    timersub(&now, &backup_start, &elapsed);
+
+    return (uint32_t)(elapsed.tv_sec * 1000 + elapsed.tv_usec / 1000);
+}
+
+bool csPluginEvents::ApplyLevelOverride(csEventsAlert &alert)
 {
     csEventsLevelOverrideMap::iterator i = overrides.find(alert.GetType());
 
@@ -675,7 +1225,7 @@ void csPluginEvents::InsertAlert(csEventsAlert &alert)
         if (i->second == csEventsAlert::csAF_FLG_IGNORE) {
             csLog::Log(csLog::Debug, "%s: Level override ignore: %u",
                 name.c_str(), i->first);
-            return;
+            return false;
         }
 
         uint32_t flags = alert.GetFlags();
@@ -688,7 +1238,286 @@ void csPluginEvents::InsertAlert(csEventsAlert &alert)
         alert.SetFlags(flags);
     }
 
-    events_db->InsertAlert(alert);
+    return true;
+}
+
+void csPluginEvents::InsertAlert(csEventsAlert &alert)
+{
+    if (! ApplyLevelOverride(alert)) return;
+
+    // Once anything is spooled, new alerts queue behind it to keep order
+    bool spool = (!events_db_ready || events_spool->GetPending() > 0);
+
+    if (!spool) {
+        try {
+            events_db->InsertAlert(alert);
+        }
+        catch (csEventsDbException &e) {
+            // Spooling only helps if the database will take it later
+            if (!events_db->IsUnavailable(e)) {
+                csLog::Log(csLog::Error, "%s: Database insert failed: %s",
+                    name.c_str(), e.estring.c_str());
+                return;
+            }
+            csLog::Log(csLog::Warning, "%s: Database insert failed, spooling: %s",
+                name.c_str(), e.estring.c_str());
+            spool = true;
+        }
+        catch (csException &e) {
+            csLog::Log(csLog::Error, "%s: Database insert failed: %s",
+                name.c_str(), e.estring.c_str());
+            return;
+        }
+    }
+
+    if (spool && !events_spool->Append(alert)) {
+        csLog::Log(csLog::Debug, "%s: Alert dropped (%llu total)",
+            name.c_str(), (unsigned long long)events_spool->GetDropped());
+        return;
+    }
+
+    events_histogram->Add(alert.GetType(), alert.GetFlags(), alert.GetUpdated());
+}
+
+void csPluginEvents::InsertAlerts(vector<csEventsAlert *> &alerts,
+    csEventsInsertResultVector &results)
+{
+    vector<csEventsAlert *>::iterator i;
+
+    results.resize(alerts.size());
+    for (size_t n = 0; n < results.size(); n++) {
+        results[n].status = csSMIS_IGNORED;
+        results[n].id = 0;
+    }
+
+    // Once anything is spooled, new alerts queue behind it to keep order
+    bool spool = (!events_db_ready || events_spool->GetPending() > 0);
+
+    if (!spool) {
+        bool begun = false;
+
+        try {
+            events_db->Begin();
+            begun = true;
+
+            for (i = alerts.begin(); i != alerts.end(); i++) {
+                csEventsInsertResult &result = results[i - alerts.begin()];
+                if (! ApplyLevelOverride(*(*i))) continue;
+
+                try {
+                    events_db->InsertAlert(*(*i));
+                    result.status = csSMIS_STORED;
+                    result.id = (*i)->GetId();
+                }
+                catch (csEventsDbException &e) {
+                    // Let the whole batch spool if the database went away
+                    if (events_db->IsUnavailable(e)) throw;
+                    result.status = csSMIS_ERROR;
+                    result.error = e.estring;
+                }
+                catch (csException &e) {
+                    result.status = csSMIS_ERROR;
+                    result.error = e.estring;
+                }
+            }
+
+            events_db->Commit();
+        }
+        catch (csEventsDbException &e) {
+            try {
+                events_db->Rollback();
+            } catch (csException &) { }
+
+            if (!begun || events_db->IsUnavailable(e)) {
+                csLog::Log(csLog::Warning,
+                    "%s: Database batch insert failed, spooling: %s",
+                    name.c_str(), e.estring.c_str());
+                spool = true;
+            }
+            else {
+                csLog::Log(csLog::Error,
+                    "%s: Database batch insert failed: %s",
+                    name.c_str(), e.estring.c_str());
+
+                // Nothing from the batch was kept
+                for (size_t n = 0; n < results.size(); n++) {
+                    if (results[n].status != csSMIS_STORED) continue;
+                    results[n].status = csSMIS_ERROR;
+                    results[n].id = 0;
+                    results[n].error = e.estring;
+                }
+            }
+        }
+    }
+
+    for (i = alerts.begin(); i != alerts.end(); i++) {
+        csEventsInsertResult &result = results[i - alerts.begin()];
+
+        if (spool) {
+            if (! ApplyLevelOverride(*(*i))) {
+                result.status = csSMIS_IGNORED;
+                continue;
+            }
+
+            result.id = 0;
+            result.error.clear();
+
+            if (events_spool->Append(*(*i)))
+                result.status = csSMIS_SPOOLED;
+            else {
+                result.status = csSMIS_DROPPED;
+                csLog::Log(csLog::Debug, "%s: Alert dropped (%llu total)",
+                    name.c_str(),
+                    (unsigned long long)events_spool->GetDropped());
+                continue;
+            }
+        }
+        else if (result.status != csSMIS_STORED) continue;
+
+        events_histogram->Add((*i)->GetType(),
+            (*i)->GetFlags(), (*i)->GetUpdated());
+    }
+}
+
+void csPluginEvents::OpenDatabase(bool initdb, bool retry)
+{
+    try {
+        events_db->Open();
+        if (initdb) events_db->Drop();
+        events_db->Create();
+
+        RefreshAlertTypes();
+        RefreshLevelOverrides();
+
+        events_db_ready = true;
+    }
+    catch (csEventsDbException &e) {
+        csLog::Log((retry) ? csLog::Debug : csLog::Error,
+            "%s: Database exception: %s", name.c_str(), e.estring.c_str());
+        events_db_ready = false;
+    }
+}
+
+void csPluginEvents::SpoolReplay(void)
+{
+    events_spool->Sync();
+
+    if (!events_db_ready) {
+        OpenDatabase(false, true);
+        if (!events_db_ready) return;
+        csLog::Log(csLog::Info, "%s: Database available, %u spooled alert(s)",
+            name.c_str(), events_spool->GetPending());
+    }
+
+    if (events_spool->GetPending() == 0) return;
+
+    try {
+        for (int i = 0; i < _CSPLUGIN_EVENTS_SPOOL_BATCHES &&
+            events_spool->GetPending() > 0; i++)
+            events_spool->Replay(events_db, events_conf->GetSpoolBatch());
+    }
+    catch (csException &e) {
+        csLog::Log(csLog::Warning, "%s: Spool replay deferred: %s",
+            name.c_str(), e.estring.c_str());
+        return;
+    }
+
+    if (events_spool->GetPending() == 0)
+        csLog::Log(csLog::Info, "%s: Spool drained", name.c_str());
+}
+
+void csPluginEvents::Subscribe(csEventsSocketClient *client,
+    const csEventsSubscription &filter)
+{
+    // The first subscriber starts the publish cursor at the current change
+    if (! publish_active) {
+        csEventsChangeVector changes;
+        uint64_t last = 0, horizon = 0;
+
+        try {
+            events_db->SelectChanges(0, 1, &changes, &last, &horizon);
+        }
+        catch (csEventsDbException &e) {
+            client->WriteError(e.estring);
+            return;
+        }
+
+        for (csEventsChangeVector::iterator i = changes.begin();
+            i != changes.end(); i++) delete (*i).alert;
+
+        publish_seq = last;
+        publish_active = true;
+    }
+
+    client->SetSubscription(filter);
+    client->WriteResult(csSMPR_OK);
+
+    csLog::Log(csLog::Debug, "%s: Subscribed client: %d: types: %lu, level: 0x%08x",
+        name.c_str(), client->GetDescriptor(),
+        (unsigned long)filter.types.size(), filter.level_mask);
+}
+
+void csPluginEvents::Publish(void)
+{
+    csPluginEventsClientMap::iterator sci;
+    csEventsChangeVector changes;
+    uint64_t last = 0, horizon = 0;
+    map<int, bool> slow;
+
+    for (sci = events_socket_client.begin(); sci != events_socket_client.end(); sci++) {
+        if (sci->second->IsSubscriber()) break;
+    }
+    if (sci == events_socket_client.end()) {
+        publish_active = false;
+        return;
+    }
+
+    if (! events_db_ready) return;
+
+    try {
+        events_db->SelectChanges(publish_seq,
+            _CSPLUGIN_EVENTS_PUBLISH_BATCH, &changes, &last, &horizon);
+    }
+    catch (csEventsDbException &e) {
+        csLog::Log(csLog::Debug, "%s: Publish: %s", name.c_str(), e.estring.c_str());
+        return;
+    }
+
+    // Re-initialized database; start over from its current change
+    if (publish_seq > last) publish_seq = last;
+
+    for (csEventsChangeVector::iterator i = changes.begin(); i != changes.end(); i++) {
+        publish_seq = (*i).seq;
+        if ((*i).alert == NULL) continue;
+
+        for (sci = events_socket_client.begin();
+            sci != events_socket_client.end(); sci++) {
+            if (! sci->second->IsSubscribed(*(*i).alert)) continue;
+            if (slow.find(sci->first) != slow.end()) continue;
+
+            if (sci->second->AlertPush(*(*i).alert)) {
+                publish_pushed++;
+                continue;
+            }
+
+            // Slow consumer; drop it rather than let its queue grow
+            csLog::Log(csLog::Warning,
+                "%s: Subscriber queue full, dropping client: %d",
+                name.c_str(), sci->first);
+            slow[sci->first] = true;
+        }
+
+        delete (*i).alert;
+    }
+
+    for (map<int, bool>::iterator i = slow.begin(); i != slow.end(); i++) {
+        sci = events_socket_client.find(i->first);
+        if (sci == events_socket_client.end()) continue;
+
+        delete sci->second;
+        events_socket_client.erase(sci);
+        publish_dropped++;
+    }
 }
 
 csPluginInit(csPluginEvents);
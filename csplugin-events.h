@@ -19,7 +19,21 @@
 
 #define _CSPLUGIN_EVENTS_PURGE_TIMER_ID     500
 #define _CSPLUGIN_EVENTS_PURGE_TIMER        60
+// Alerts deleted by per-type retention policies per purge tick
+#define _CSPLUGIN_EVENTS_PURGE_BUDGET       1024
 #define _CSPLUGIN_EVENTS_SYSINFO_TIMER_ID   501
+#define _CSPLUGIN_EVENTS_HISTOGRAM_TIMER_ID 502
+#define _CSPLUGIN_EVENTS_SPOOL_TIMER_ID     503
+#define _CSPLUGIN_EVENTS_SPOOL_TIMER        1
+// Spool batches replayed per spool timer tick
+#define _CSPLUGIN_EVENTS_SPOOL_BATCHES      16
+// Stalled client connections are dropped on this timer
+#define _CSPLUGIN_EVENTS_CLIENT_TIMER_ID    504
+#define _CSPLUGIN_EVENTS_CLIENT_TIMER       1
+// Requests served per client per event loop pass
+#define _CSPLUGIN_EVENTS_CLIENT_BUDGET      64
+// Changes published to subscribers per event loop pass
+#define _CSPLUGIN_EVENTS_PUBLISH_BATCH      256
 
 typedef map<int, csEventsSocketClient *> csPluginEventsClientMap;
 typedef map<int, string> csEventsSyslogTextSubIndexMap;
@@ -72,31 +86,76 @@ protected:
     void LoadAlertConfig(csEventsAlertSourceConfig_syslog *syslog_config);
     void LoadAlertConfig(csEventsAlertSourceConfig_sysinfo *sysinfo_config);
 
-    void ProcessEventSelect(fd_set &fds);
+    void ProcessEventSelect(fd_set &fds, fd_set &fds_write);
     void ProcessClientRequest(csEventsSocketClient *client);
+    void ExpireClients(void);
+    void ProcessDatagrams(void);
+    void ProcessRing(void);
     void ProcessSysinfoRefresh(void);
     void ProcessSysinfoThreshold(
         csEventsAlertSourceConfig_sysinfo::csEventsAlertSource_sysinfo_key key,
         csEventsSysinfoConfig *config, float threshold);
 
     void SyslogTextSubstitute(string &dst,
+        string &dst_template, vector<string> &dst_params,
         csRegEx *rx, csAlertSourceConfig_syslog_pattern *rx_config);
 
     void RefreshAlertTypes(void);
     void RefreshLevelOverrides(void);
+    void RefreshRetention(void);
 
+    void PurgeAlerts(void);
+
+    void OpenDatabase(bool initdb = false, bool retry = false);
+    bool ApplyLevelOverride(csEventsAlert &alert);
     void InsertAlert(csEventsAlert &alert);
+    void InsertAlerts(vector<csEventsAlert *> &alerts,
+        csEventsInsertResultVector &results);
+    void SpoolReplay(void);
+
+    void BackupBegin(csEventsSocketClient *client, const string &filename);
+    void BackupStep(void);
+    void BackupEnd(const char *error = NULL);
+    uint32_t BackupElapsed(void);
+
+    void Subscribe(csEventsSocketClient *client,
+        const csEventsSubscription &filter);
+    void Publish(void);
 
     string locale;
     csEventsConf *events_conf;
     csEventsDb *events_db;
+    bool events_db_ready;
+    csEventsSpool *events_spool;
+    csEventsHistogram *events_histogram;
     csEventsSyslog *events_syslog;
     csEventsSocketServer *events_socket_server;
+    csEventsDatagramServer *events_datagram_server;
+    csEventsRingServer *events_ring_server;
     csPluginEventsClientMap events_socket_client;
     csEventsSyslogRegExVector events_syslog_rx;
     csEventsSysinfoConfigMap events_sysinfo;
     vector<string> events_sysinfo_keys;
     csEventsLevelOverrideMap overrides;
+
+    bool backup_active;
+    csEventsSocketClient *backup_client;
+    struct timeval backup_start;
+    struct timeval backup_next;
+    time_t backup_reported;
+    uint32_t backup_percent;
+    uint32_t backup_pages;
+
+    csAlertRetentionMap retention;
+    uint32_t purge_next;
+
+    bool publish_active;
+    uint64_t publish_seq;
+    uint64_t publish_pushed;
+    uint64_t publish_dropped;
+
+    uint64_t datagram_dropped;
+    uint64_t ring_dropped;
 };
 
 #endif // _CSPLUGIN_EVENTS_H
@@ -24,6 +24,7 @@
 
 #include <unistd.h>
 #include <pwd.h>
+#include <grp.h>
 #include <openssl/sha.h>
 
 #include "events-alert.h"
@@ -69,6 +70,8 @@ void csEventsAlert::Reset(void)
     data.basename.clear();
     data.uuid.clear();
     data.desc.clear();
+    data.desc_template.clear();
+    data.desc_params.clear();
 }
 
 void csEventsAlert::AddGroup(gid_t gid)
@@ -84,6 +87,19 @@ void csEventsAlert::AddGroup(gid_t gid)
     if (!found) data.groups.push_back(gid);
 }
 
+void csEventsAlert::AddGroup(const string &group)
+{
+    struct group *grent = NULL;
+
+    grent = getgrnam(group.c_str());
+    if (grent == NULL) {
+        unsigned long long gid = strtoull(group.c_str(), NULL, 0);
+        if ((grent = getgrgid((gid_t)gid)) == NULL)
+            throw csException(ENOENT, "Group not found");
+    }
+    AddGroup(grent->gr_gid);
+}
+
 void csEventsAlert::GetGroups(vector<gid_t> &groups)
 {
     groups.clear();
@@ -109,6 +125,41 @@ void csEventsAlert::SetData(const csEventsAlertData &data)
     SetBasename(data.basename);
     SetUUID(data.uuid);
     SetDescription(data.desc);
+    SetTemplate(data.desc_template, data.desc_params);
+}
+
+// Take data's fields without copying strings or vectors; data is left
+// holding whatever they replaced.
+void csEventsAlert::SwapData(csEventsAlertData &data)
+{
+    csEventsAlertData &d = this->data;
+
+    d.id = data.id;
+    d.created = data.created;
+    d.updated = data.updated;
+    d.flags = data.flags;
+    d.type = data.type;
+    d.user = data.user;
+    d.groups.swap(data.groups);
+    d.origin.swap(data.origin);
+    d.basename.swap(data.basename);
+    d.uuid.swap(data.uuid);
+    d.desc.swap(data.desc);
+    d.desc_template.swap(data.desc_template);
+    d.desc_params.swap(data.desc_params);
+
+    // Drop duplicate groups, as AddGroup() would have
+    vector<gid_t> &groups = d.groups;
+    for (size_t i = 1; i < groups.size(); ) {
+        bool found = false;
+        for (size_t j = 0; j < i; j++) {
+            if (groups[j] != groups[i]) continue;
+            found = true;
+            break;
+        }
+        if (found) groups.erase(groups.begin() + i);
+        else i++;
+    }
 }
 
 void csEventsAlert::SetUser(const string &user)
@@ -129,6 +180,75 @@ void csEventsAlert::SetUser(void)
     data.user = geteuid();
 }
 
+void csEventsAlert::TemplateSubstitute(string &desc_template,
+    const string &name, size_t index)
+{
+    size_t pos;
+    string marker;
+
+    // Too many parameters to encode; store the rendered text instead
+    if (index == 0 || index > 0xff) {
+        desc_template.clear();
+        return;
+    }
+
+    marker.push_back(_EVENTS_ALERT_TEMPLATE_MARKER);
+    marker.push_back((char)index);
+
+    while ((pos = desc_template.find(name)) != string::npos)
+        desc_template.replace(pos, name.length(), marker);
+}
+
+void csEventsAlert::TemplateRender(const string &desc_template,
+    const vector<string> &desc_params, string &desc)
+{
+    desc.clear();
+    desc.reserve(desc_template.length());
+
+    for (size_t i = 0; i < desc_template.length(); i++) {
+        if (desc_template[i] != _EVENTS_ALERT_TEMPLATE_MARKER ||
+            i + 1 == desc_template.length()) {
+            desc.push_back(desc_template[i]);
+            continue;
+        }
+
+        size_t index = (size_t)((uint8_t)desc_template[++i]);
+        if (index > 0 && index <= desc_params.size())
+            desc.append(desc_params[index - 1]);
+    }
+}
+
+void csEventsAlert::TemplateEncodeParams(
+    const vector<string> &desc_params, string &encoded)
+{
+    encoded.clear();
+
+    for (vector<string>::const_iterator i = desc_params.begin();
+        i != desc_params.end(); i++) {
+        if (i != desc_params.begin()) encoded.push_back(_EVENTS_ALERT_PARAM_DELIM);
+        for (string::const_iterator j = (*i).begin(); j != (*i).end(); j++) {
+            // Delimiter can't appear in syslog text; map it to a space
+            encoded.push_back(((*j) == _EVENTS_ALERT_PARAM_DELIM) ? ' ' : (*j));
+        }
+    }
+}
+
+void csEventsAlert::TemplateDecodeParams(
+    const string &encoded, vector<string> &desc_params)
+{
+    size_t start = 0, pos;
+
+    desc_params.clear();
+
+    do {
+        pos = encoded.find(_EVENTS_ALERT_PARAM_DELIM, start);
+        desc_params.push_back(encoded.substr(start,
+            (pos == string::npos) ? string::npos : pos - start));
+        start = pos + 1;
+    }
+    while (pos != string::npos);
+}
+
 void csEventsAlert::UpdateHash(void)
 {
     SHA_CTX ctx;
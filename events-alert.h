@@ -17,6 +17,11 @@
 #ifndef _EVENTS_ALERT_H
 #define _EVENTS_ALERT_H
 
+// Description templates: variables are replaced by a marker byte followed
+// by a one-based parameter index; parameters are stored delimited.
+#define _EVENTS_ALERT_TEMPLATE_MARKER   '\x1a'
+#define _EVENTS_ALERT_PARAM_DELIM       '\x1f'
+
 class csEventsAlert
 {
 public:
@@ -32,6 +37,8 @@ public:
         string basename;
         string uuid;
         string desc;
+        string desc_template;
+        vector<string> desc_params;
     } csEventsAlertData;
 
     enum csAlertFlags {
@@ -91,8 +98,12 @@ public:
     string GetDescription(void) const { return data.desc; };
     const char *GetDescriptionChar(void) const { return data.desc.c_str(); };
     int GetDescriptionLength(void) const { return static_cast<int>(data.desc.length()); };
+    string GetTemplate(void) const { return data.desc_template; };
+    const vector<string> &GetTemplateParams(void) const { return data.desc_params; };
+    bool HasTemplate(void) const { return data.desc_template.length() > 0; };
 
     void SetData(const csEventsAlertData &data);
+    void SwapData(csEventsAlertData &data);
 
     void SetId(int64_t id) { data.id = id; };
     void SetCreated(void) { data.created = time(NULL); };
@@ -107,11 +118,27 @@ public:
     void SetUser(uid_t uid) { data.user = uid; };
     void SetUser(void);
     void AddGroup(gid_t gid);
+    void AddGroup(const string &group);
     void ClearGroups(void) { data.groups.clear(); };
     void SetOrigin(const string &origin) { data.origin = origin; };
     void SetBasename(const string &basename) { data.basename = basename; };
     void SetUUID(const string &uuid) { data.uuid = uuid; };
     void SetDescription(const string &desc) { data.desc = desc; };
+    void SetTemplate(const string &desc_template, const vector<string> &desc_params)
+    {
+        data.desc_template = desc_template;
+        data.desc_params = desc_params;
+    };
+    void ClearTemplate(void) { data.desc_template.clear(); data.desc_params.clear(); };
+
+    static void TemplateSubstitute(string &desc_template,
+        const string &name, size_t index);
+    static void TemplateRender(const string &desc_template,
+        const vector<string> &desc_params, string &desc);
+    static void TemplateEncodeParams(
+        const vector<string> &desc_params, string &encoded);
+    static void TemplateDecodeParams(
+        const string &encoded, vector<string> &desc_params);
 
     void UpdateHash(void);
     string GetHash(void) { return hash_str; };
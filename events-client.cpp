@@ -0,0 +1,385 @@
+// ClearSync: System Monitor plugin.
+// Copyright (C) 2011 ClearFoundation <http://www.clearfoundation.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <clearsync/csplugin.h>
+
+#include <deque>
+
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <linux/un.h>
+
+#include <sqlite3.h>
+#include <openssl/sha.h>
+
+#include "events-alert.h"
+#include "events-db.h"
+#include "events-histogram.h"
+#include "events-ring.h"
+#include "events-socket.h"
+#include "events-client.h"
+
+static void csEventsClient_deadline(struct timespec &ts,
+    const struct timeval &from, unsigned msec)
+{
+    struct timeval tv, delta;
+
+    delta.tv_sec = msec / 1000;
+    delta.tv_usec = (msec % 1000) * 1000;
+    timeradd(&from, &delta, &tv);
+
+    ts.tv_sec = tv.tv_sec;
+    ts.tv_nsec = tv.tv_usec * 1000;
+}
+
+csEventsAsyncClient::csEventsAsyncClient(const string &socket_path,
+    size_t batch, unsigned linger, size_t queue_max)
+    : socket_path(socket_path), batch(batch), linger(linger),
+    queue_max(queue_max), started(false), running(false), queued(0),
+    answered(0), urgent(0), socket(NULL), retry_next(0),
+    retry_delay(_EVENTS_CLIENT_RETRY_MIN), connects(0)
+{
+    if (batch == 0 || batch > _EVENTS_SOCKET_BATCH_MAX)
+        throw csEventsClientException(EINVAL, "Invalid batch size");
+
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&wakeup, NULL);
+    pthread_cond_init(&done, NULL);
+}
+
+csEventsAsyncClient::~csEventsAsyncClient()
+{
+    Stop();
+    Disconnect();
+
+    // Never started; still, every alert gets its answer
+    vector<csAsyncEntry> entries(queue.begin(), queue.end());
+    queue.clear();
+    Fail(entries, "Client destroyed");
+
+    pthread_cond_destroy(&done);
+    pthread_cond_destroy(&wakeup);
+    pthread_mutex_destroy(&lock);
+}
+
+void csEventsAsyncClient::Start(void)
+{
+    pthread_mutex_lock(&lock);
+
+    if (started) {
+        pthread_mutex_unlock(&lock);
+        return;
+    }
+
+    running = true;
+
+    int rc = pthread_create(&thread, NULL, Entry, (void *)this);
+    if (rc != 0) {
+        running = false;
+        pthread_mutex_unlock(&lock);
+        throw csEventsClientException(rc, "pthread_create");
+    }
+
+    started = true;
+    pthread_mutex_unlock(&lock);
+}
+
+void csEventsAsyncClient::Stop(void)
+{
+    pthread_mutex_lock(&lock);
+
+    if (! started) {
+        pthread_mutex_unlock(&lock);
+        return;
+    }
+
+    running = false;
+    pthread_cond_signal(&wakeup);
+    pthread_mutex_unlock(&lock);
+
+    pthread_join(thread, NULL);
+    started = false;
+}
+
+bool csEventsAsyncClient::AlertInsert(const csEventsAlert &alert,
+    csEventsAsyncCallback *callback)
+{
+    csAsyncEntry entry;
+
+    entry.alert = new csEventsAlert(alert);
+    entry.callback = callback;
+    gettimeofday(&entry.queued, NULL);
+
+    pthread_mutex_lock(&lock);
+
+    if (queue.size() >= queue_max) {
+        pthread_mutex_unlock(&lock);
+        delete entry.alert;
+        return false;
+    }
+
+    queue.push_back(entry);
+    queued++;
+
+    // Critical alerts don't wait for company
+    if (alert.GetFlags() & csEventsAlert::csAF_LVL_CRIT) urgent = queued;
+
+    // An idle thread needs waking to start the linger clock
+    if (queue.size() == 1 || queue.size() >= batch || urgent > answered)
+        pthread_cond_signal(&wakeup);
+
+    pthread_mutex_unlock(&lock);
+
+    return true;
+}
+
+bool csEventsAsyncClient::Flush(time_t timeout)
+{
+    struct timeval now;
+    struct timespec deadline;
+
+    gettimeofday(&now, NULL);
+    csEventsClient_deadline(deadline, now, (unsigned)timeout * 1000);
+
+    pthread_mutex_lock(&lock);
+
+    uint64_t target = queued;
+    if (urgent < target) urgent = target;
+    pthread_cond_signal(&wakeup);
+
+    while (answered < target) {
+        if (pthread_cond_timedwait(&done, &lock, &deadline) == ETIMEDOUT)
+            break;
+    }
+
+    bool flushed = (answered >= target);
+    pthread_mutex_unlock(&lock);
+
+    return flushed;
+}
+
+size_t csEventsAsyncClient::GetQueued(void)
+{
+    pthread_mutex_lock(&lock);
+    size_t count = queue.size();
+    pthread_mutex_unlock(&lock);
+
+    return count;
+}
+
+void *csEventsAsyncClient::Entry(void *param)
+{
+    csEventsAsyncClient *client = reinterpret_cast<csEventsAsyncClient *>(param);
+    client->Run();
+
+    return NULL;
+}
+
+void csEventsAsyncClient::Run(void)
+{
+    struct timeval now;
+    struct timespec deadline;
+    time_t stop_deadline = 0;
+    vector<csAsyncEntry> entries;
+
+    pthread_mutex_lock(&lock);
+
+    for ( ;; ) {
+        // Wait for a full batch, the oldest alert to linger long enough,
+        // an urgent alert or Flush(), or Stop()
+        while (running && urgent <= answered && queue.size() < batch) {
+            if (queue.size() == 0) {
+                pthread_cond_wait(&wakeup, &lock);
+                continue;
+            }
+
+            gettimeofday(&now, NULL);
+            csEventsClient_deadline(deadline, queue.front().queued, linger);
+            if (now.tv_sec > deadline.tv_sec ||
+                (now.tv_sec == deadline.tv_sec &&
+                now.tv_usec * 1000 >= deadline.tv_nsec)) break;
+
+            pthread_cond_timedwait(&wakeup, &lock, &deadline);
+        }
+
+        if (! running && stop_deadline == 0)
+            stop_deadline = time(NULL) + _EVENTS_CLIENT_STOP_TIMEOUT;
+
+        if (queue.size() == 0) {
+            if (! running) break;
+            continue;
+        }
+
+        size_t count = (queue.size() < batch) ? queue.size() : batch;
+        entries.assign(queue.begin(), queue.begin() + count);
+        bool give_up = (! running && time(NULL) >= stop_deadline);
+
+        // Producers only ever append, so the entries taken stay put at
+        // the head of the queue while unlocked
+        pthread_mutex_unlock(&lock);
+
+        bool sent = Send(entries);
+        if (! sent && give_up) {
+            Fail(entries, "Not delivered");
+            sent = true;
+        }
+
+        pthread_mutex_lock(&lock);
+
+        if (sent) {
+            queue.erase(queue.begin(), queue.begin() + count);
+            answered += count;
+            pthread_cond_broadcast(&done);
+            continue;
+        }
+
+        // Back off; new alerts, Flush() and Stop() wake us early, but
+        // Connect() won't try again before it's time
+        deadline.tv_sec = retry_next;
+        if (! running && stop_deadline < retry_next)
+            deadline.tv_sec = stop_deadline;
+        deadline.tv_nsec = 0;
+        pthread_cond_timedwait(&wakeup, &lock, &deadline);
+    }
+
+    pthread_mutex_unlock(&lock);
+
+    Disconnect();
+}
+
+bool csEventsAsyncClient::Connect(void)
+{
+    time_t now = time(NULL);
+    if (now < retry_next) return false;
+
+    try {
+        socket = new csEventsSocketClient(socket_path);
+        socket->Connect(1);
+
+        if (socket->VersionExchange() != csSMPR_OK) {
+            throw csEventsSocketProtocolException(socket->GetDescriptor(),
+                "Protocol version mismatch");
+        }
+        if (socket->GetProtoVersion() < _EVENTS_SOCKET_PROTOVER_BATCH) {
+            throw csEventsSocketProtocolException(socket->GetDescriptor(),
+                "Batch insert requires a newer protocol version");
+        }
+    } catch (csEventsSocketException &e) {
+        csLog::Log(csLog::Debug, "Events client: %s: %s (retry in %lds)",
+            socket_path.c_str(), e.estring.c_str(), (long)retry_delay);
+
+        Disconnect(true);
+        return false;
+    }
+
+    connects++;
+
+    return true;
+}
+
+void csEventsAsyncClient::Disconnect(bool backoff)
+{
+    if (socket != NULL) delete socket;
+    socket = NULL;
+
+    if (! backoff) return;
+
+    retry_next = time(NULL) + retry_delay;
+    retry_delay *= 2;
+    if (retry_delay > _EVENTS_CLIENT_RETRY_MAX)
+        retry_delay = _EVENTS_CLIENT_RETRY_MAX;
+}
+
+bool csEventsAsyncClient::Send(vector<csAsyncEntry> &entries)
+{
+    vector<csEventsAlert *> alerts;
+    csEventsInsertResultVector results;
+
+    if (socket == NULL && ! Connect()) return false;
+
+    for (vector<csAsyncEntry>::iterator i = entries.begin();
+        i != entries.end(); i++) alerts.push_back((*i).alert);
+
+    // A batch that keeps breaking the connection backs off like a failed
+    // connect does
+    try {
+        socket->AlertInsertBatch(alerts, results);
+    } catch (csEventsSocketHangupException &e) {
+        Disconnect(true);
+        return false;
+    } catch (csEventsSocketTimeoutException &e) {
+        Disconnect(true);
+        return false;
+    } catch (csEventsSocketProtocolException &e) {
+        Disconnect(true);
+        return false;
+    } catch (csEventsSocketException &e) {
+        // The plugin turned the whole batch down; sending it again won't
+        // help.  Anything else is a broken connection.
+        if (e.eint != EINVAL) {
+            Disconnect(true);
+            return false;
+        }
+
+        Fail(entries, e.estring);
+        return true;
+    }
+
+    retry_delay = _EVENTS_CLIENT_RETRY_MIN;
+
+    Complete(entries, results);
+    return true;
+}
+
+void csEventsAsyncClient::Complete(vector<csAsyncEntry> &entries,
+    const csEventsInsertResultVector &results)
+{
+    csEventsInsertResult missing;
+
+    missing.status = csSMIS_ERROR;
+    missing.id = 0;
+    missing.error = "No result";
+
+    for (size_t i = 0; i < entries.size(); i++) {
+        if (entries[i].callback != NULL) {
+            entries[i].callback->AlertInserted(*entries[i].alert,
+                (i < results.size()) ? results[i] : missing);
+        }
+        delete entries[i].alert;
+    }
+}
+
+void csEventsAsyncClient::Fail(vector<csAsyncEntry> &entries,
+    const string &error)
+{
+    csEventsInsertResultVector results;
+    csEventsInsertResult result;
+
+    result.status = csSMIS_ERROR;
+    result.id = 0;
+    result.error = error;
+
+    results.assign(entries.size(), result);
+    Complete(entries, results);
+}
+
+// vi: expandtab shiftwidth=4 softtabstop=4 tabstop=4
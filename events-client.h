@@ -0,0 +1,128 @@
+// ClearSync: System Monitor plugin.
+// Copyright (C) 2011 ClearFoundation <http://www.clearfoundation.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef _EVENTS_CLIENT_H
+#define _EVENTS_CLIENT_H
+
+// Alerts sent per csSMOC_ALERT_INSERT_BATCH
+#define _EVENTS_CLIENT_BATCH            256
+// Milliseconds a queued alert may wait for a batch to fill
+#define _EVENTS_CLIENT_LINGER           100
+// Alerts queued before AlertInsert() refuses more
+#define _EVENTS_CLIENT_QUEUE_MAX        65536
+// Reconnect back-off bounds, in seconds
+#define _EVENTS_CLIENT_RETRY_MIN        1
+#define _EVENTS_CLIENT_RETRY_MAX        30
+// Seconds Stop() keeps trying to deliver what's still queued
+#define _EVENTS_CLIENT_STOP_TIMEOUT     10
+
+class csEventsClientException : public csException
+{
+public:
+    explicit csEventsClientException(int e, const char *s)
+        : csException(e, s) { }
+};
+
+// Told the outcome of each alert handed to csEventsAsyncClient; called
+// from the client's thread, so implementations must be thread-safe and
+// shouldn't block for long
+class csEventsAsyncCallback
+{
+public:
+    virtual ~csEventsAsyncCallback() { }
+
+    virtual void AlertInserted(const csEventsAlert &alert,
+        const csEventsInsertResult &result) = 0;
+};
+
+// Persistent events socket client.  Alerts are queued by the caller and
+// sent by a background thread in csSMOC_ALERT_INSERT_BATCH packets, once
+// a batch fills, its oldest alert has lingered long enough, or straight
+// away for critical alerts.  The connection is re-established as needed,
+// backing off between attempts; a batch cut off part-way is sent again in
+// full, so an alert may (rarely) be inserted twice.
+class csEventsAsyncClient
+{
+public:
+    csEventsAsyncClient(const string &socket_path,
+        size_t batch = _EVENTS_CLIENT_BATCH,
+        unsigned linger = _EVENTS_CLIENT_LINGER,
+        size_t queue_max = _EVENTS_CLIENT_QUEUE_MAX);
+    virtual ~csEventsAsyncClient();
+
+    void Start(void);
+    // Deliver what's queued (giving up after _EVENTS_CLIENT_STOP_TIMEOUT
+    // seconds; anything left fails with csSMIS_ERROR), then stop
+    void Stop(void);
+
+    // Queue a copy of alert; callback, if any, is told how it went.  False
+    // if the queue is full.
+    bool AlertInsert(const csEventsAlert &alert,
+        csEventsAsyncCallback *callback = NULL);
+
+    // Send whatever is queued now and wait until it's all been answered;
+    // false on time-out
+    bool Flush(time_t timeout = _EVENTS_SOCKET_TIMEOUT_RW);
+
+    size_t GetQueued(void);
+    uint64_t GetConnects(void) { return connects; }
+
+protected:
+    typedef struct {
+        csEventsAlert *alert;
+        csEventsAsyncCallback *callback;
+        struct timeval queued;
+    } csAsyncEntry;
+
+    static void *Entry(void *param);
+    void Run(void);
+    bool Connect(void);
+    // Optionally hold off the next Connect(), for longer each time
+    void Disconnect(bool backoff = false);
+    bool Send(vector<csAsyncEntry> &entries);
+    void Complete(vector<csAsyncEntry> &entries,
+        const csEventsInsertResultVector &results);
+    void Fail(vector<csAsyncEntry> &entries, const string &error);
+
+    string socket_path;
+    size_t batch;
+    unsigned linger;
+    size_t queue_max;
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup;
+    pthread_cond_t done;
+
+    bool started;
+    bool running;
+    deque<csAsyncEntry> queue;
+    // Alerts queued, and answered or failed, since construction; Flush()
+    // waits for the one to catch up with the other
+    uint64_t queued;
+    uint64_t answered;
+    // Send without lingering until answered gets this far
+    uint64_t urgent;
+
+    csEventsSocketClient *socket;
+    time_t retry_next;
+    time_t retry_delay;
+    uint64_t connects;
+};
+
+#endif // _EVENTS_CLIENT_H
+
+// vi: expandtab shiftwidth=4 softtabstop=4 tabstop=4
@@ -27,10 +27,15 @@
 #include <unistd.h>
 #include <dirent.h>
 
+#include <sqlite3.h>
 #include <openssl/sha.h>
 
-#include "events-conf.h"
 #include "events-alert.h"
+#include "events-db.h"
+#include "events-db-log.h"
+#include "events-spool.h"
+#include "events-ring.h"
+#include "events-conf.h"
 
 #include "inih/cpp/INIReader.h"
 
@@ -269,19 +274,126 @@ void csPluginXmlParser::ParseElementClose(csXmlTag *tag)
         if (!tag->ParamExists("socket"))
             ParseError("socket parameter missing");
         _conf->events_socket_path = tag->GetParamValue("socket");
+        if (tag->ParamExists("insert-socket"))
+            _conf->insert_socket_path = tag->GetParamValue("insert-socket");
+    }
+    else if ((*tag) == "ring") {
+        if (!stack.size() || (*stack.back()) != "plugin")
+            ParseError("unexpected tag: " + tag->GetName());
+        _conf->ring_enabled = true;
+        if (tag->ParamExists("slots")) {
+            _conf->ring_slots = (uint32_t)strtoul(
+                tag->GetParamValue("slots").c_str(), NULL, 0);
+        }
+        if (tag->ParamExists("slot-size")) {
+            _conf->ring_slot_size = (uint32_t)strtoul(
+                tag->GetParamValue("slot-size").c_str(), NULL, 0);
+        }
     }
     else if ((*tag) == "db") {
         if (!stack.size() || (*stack.back()) != "plugin")
             ParseError("unexpected tag: " + tag->GetName());
         if (!tag->ParamExists("type"))
             ParseError("type parameter missing");
+        if (tag->ParamExists("max-size")) {
+            _conf->db_max_size = (off_t)strtoll(
+                tag->GetParamValue("max-size").c_str(), NULL, 0);
+        }
+        if (tag->ParamExists("max-alerts")) {
+            _conf->db_max_alerts = (uint32_t)strtoul(
+                tag->GetParamValue("max-alerts").c_str(), NULL, 0);
+        }
+        if (tag->ParamExists("busy-timeout")) {
+            _conf->db_busy_timeout = (uint32_t)strtoul(
+                tag->GetParamValue("busy-timeout").c_str(), NULL, 0);
+        }
         if (tag->GetParamValue("type") == "sqlite") {
             if (!tag->ParamExists("db_filename"))
                 ParseError("db_filename parameter missing");
+            _conf->db_type = csEventsDb::csDBT_SQLITE;
             _conf->sqlite_db_filename = tag->GetParamValue("db_filename");
+            if (tag->ParamExists("fts") && tag->GetParamValue("fts") == "true")
+                _conf->sqlite_fts = true;
+            if (tag->ParamExists("desc-encoding")) {
+                if (tag->GetParamValue("desc-encoding") == "template")
+                    _conf->sqlite_templates = true;
+                else if (tag->GetParamValue("desc-encoding") != "text")
+                    ParseError("invalid desc-encoding: " +
+                        tag->GetParamValue("desc-encoding"));
+            }
+        }
+        else if (tag->GetParamValue("type") == "log") {
+            if (!tag->ParamExists("path"))
+                ParseError("path parameter missing");
+            _conf->db_type = csEventsDb::csDBT_LOG;
+            _conf->log_db_path = tag->GetParamValue("path");
+            if (tag->ParamExists("segment-size")) {
+                off_t size = (off_t)(atol(tag->GetParamValue("segment-size").c_str()));
+                if (size > 0) _conf->log_segment_size = size;
+            }
+            if (tag->ParamExists("segment-age")) {
+                time_t age = (time_t)(atoi(tag->GetParamValue("segment-age").c_str()));
+                if (age > 0) _conf->log_segment_age = age;
+            }
+            if (tag->ParamExists("segments-max")) {
+                uint32_t max = (uint32_t)(atoi(tag->GetParamValue("segments-max").c_str()));
+                if (max > 0) _conf->log_segments_max = max;
+            }
         }
         else ParseError("invalid type parameter");
     }
+    else if ((*tag) == "histogram") {
+        if (!stack.size() || (*stack.back()) != "plugin")
+            ParseError("unexpected tag: " + tag->GetName());
+        if (!tag->ParamExists("path"))
+            ParseError("path parameter missing");
+        _conf->histogram_filename = tag->GetParamValue("path");
+        if (tag->ParamExists("save-interval")) {
+            time_t interval = (time_t)(atoi(tag->GetParamValue("save-interval").c_str()));
+            if (interval > 0) _conf->histogram_save_interval = interval;
+        }
+    }
+    else if ((*tag) == "backup") {
+        if (!stack.size() || (*stack.back()) != "plugin")
+            ParseError("unexpected tag: " + tag->GetName());
+        if (tag->ParamExists("pages-per-step")) {
+            int pages = atoi(tag->GetParamValue("pages-per-step").c_str());
+            if (pages > 0) _conf->backup_pages = pages;
+        }
+        if (tag->ParamExists("sleep")) {
+            int sleep = atoi(tag->GetParamValue("sleep").c_str());
+            if (sleep >= 0) _conf->backup_sleep = sleep;
+        }
+    }
+    else if ((*tag) == "spool") {
+        if (!stack.size() || (*stack.back()) != "plugin")
+            ParseError("unexpected tag: " + tag->GetName());
+        if (tag->ParamExists("path"))
+            _conf->spool_filename = tag->GetParamValue("path");
+        if (tag->ParamExists("sync")) {
+            if (tag->GetParamValue("sync") == "always")
+                _conf->spool_sync = csEventsSpool::csSS_ALWAYS;
+            else if (tag->GetParamValue("sync") == "interval")
+                _conf->spool_sync = csEventsSpool::csSS_INTERVAL;
+            else if (tag->GetParamValue("sync") == "none")
+                _conf->spool_sync = csEventsSpool::csSS_NONE;
+            else
+                ParseError("invalid sync parameter");
+        }
+        if (tag->ParamExists("sync-interval")) {
+            time_t interval = (time_t)atoi(tag->GetParamValue("sync-interval").c_str());
+            if (interval > 0) _conf->spool_sync_interval = interval;
+        }
+        if (tag->ParamExists("max-size")) {
+            _conf->spool_max_size = (off_t)strtoll(
+                tag->GetParamValue("max-size").c_str(), NULL, 0);
+        }
+        if (tag->ParamExists("batch")) {
+            uint32_t batch = (uint32_t)strtoul(
+                tag->GetParamValue("batch").c_str(), NULL, 0);
+            if (batch > 0) _conf->spool_batch = batch;
+        }
+    }
     else if ((*tag) == "source") {
         if (!stack.size() || (*stack.back()) != "plugin")
             ParseError("unexpected tag: " + tag->GetName());
@@ -334,6 +446,13 @@ void csPluginXmlParser::ParseElementClose(csXmlTag *tag)
             ParseError("alert type already defined");
 
         _conf->alert_types[id] = tag->GetParamValue("type");
+
+        if (tag->ParamExists("max-age")) {
+            time_t max_age = (time_t)atol(tag->GetParamValue("max-age").c_str());
+            if (max_age < 0)
+                ParseError("invalid max-age value");
+            if (max_age > 0) _conf->alert_retention[id] = max_age;
+        }
     }
 }
 
@@ -563,9 +682,24 @@ csEventsConf::csEventsConf(csPluginEvents *parent,
         : csConf(filename, parser), parent(parent), alerts_parser(NULL),
         initdb(false), max_age_ttl(0), enable_status(true),
         events_socket_path(_EVENTS_CONF_EVENTS_SOCKET),
-        sqlite_db_filename(_EVENTS_CONF_SQLITE_DB),
+        insert_socket_path(_EVENTS_CONF_INSERT_SOCKET), ring_enabled(false),
+        ring_slots(_EVENTS_RING_SLOTS), ring_slot_size(_EVENTS_RING_SLOT_SIZE),
+        db_type(csEventsDb::csDBT_SQLITE), db_max_size(0), db_max_alerts(0),
+        db_busy_timeout(_EVENTS_DB_BUSY_DEADLINE),
+        sqlite_db_filename(_EVENTS_CONF_SQLITE_DB), sqlite_fts(false), sqlite_templates(false),
+        log_db_path(_EVENTS_CONF_LOG_DB_PATH),
+        log_segment_size(_EVENTS_DB_LOG_SEGMENT_SIZE),
+        log_segment_age(_EVENTS_DB_LOG_SEGMENT_AGE),
+        log_segments_max(_EVENTS_DB_LOG_SEGMENTS_MAX),
         syslog_socket_path(_EVENTS_CONF_SYSLOG_SOCKET),
-        sysinfo_refresh(_EVENTS_CONF_SYSINFO_REFRESH)
+        sysinfo_refresh(_EVENTS_CONF_SYSINFO_REFRESH),
+        histogram_filename(_EVENTS_CONF_HISTOGRAM_FILE),
+        histogram_save_interval(_EVENTS_CONF_HISTOGRAM_SAVE),
+        backup_pages(_EVENTS_CONF_BACKUP_PAGES),
+        backup_sleep(_EVENTS_CONF_BACKUP_SLEEP),
+        spool_filename(_EVENTS_CONF_SPOOL_FILE),
+        spool_sync(csEventsSpool::csSS_ALWAYS), spool_sync_interval(1),
+        spool_max_size(_EVENTS_SPOOL_MAX_SIZE), spool_batch(_EVENTS_SPOOL_BATCH)
 {
     alerts_parser = new csAlertsXmlParser();
     alerts_parser->SetConf(this);
@@ -650,6 +784,34 @@ void csEventsConf::MergeRegisteredAlertTypes(csAlertIdMap &types)
     }
 }
 
+void csEventsConf::GetAlertRetention(csAlertRetentionMap &retention)
+{
+    retention.clear();
+    csAlertRetentionMap::const_iterator i;
+    for (i = alert_retention.begin(); i != alert_retention.end(); i++)
+        retention[i->first] = i->second;
+}
+
+void csEventsConf::MergeRegisteredRetention(csAlertRetentionMap &retention)
+{
+    uint32_t registered_base = 0;
+    try {
+        registered_base = GetAlertId("REGISTERED_BASE");
+    } catch (csException &e) { }
+
+    if (registered_base == 0)
+        throw csException(EINVAL, "REGISTERED_BASE not defined");
+
+    // Policies from a previous merge, and any configured past the base,
+    // are replaced by those registered with the type.
+    alert_retention.erase(
+        alert_retention.upper_bound(registered_base), alert_retention.end());
+
+    csAlertRetentionMap::iterator i;
+    for (i = retention.begin(); i != retention.end(); i++)
+        alert_retention[i->first + registered_base] = i->second;
+}
+
 void csEventsConf::GetAlertSourceConfigs(csAlertSourceConfigVector &configs)
 {
     configs.clear();
@@ -18,13 +18,21 @@
 #define _EVENTS_CONF_H
 
 #define _EVENTS_CONF_SQLITE_DB      "/var/lib/csplugin-events/events.db"
+#define _EVENTS_CONF_LOG_DB_PATH    "/var/lib/csplugin-events/events.log"
 #define _EVENTS_CONF_EVENTS_SOCKET  "/var/lib/csplugin-events/events.socket"
+#define _EVENTS_CONF_INSERT_SOCKET  "/var/lib/csplugin-events/insert.socket"
 #define _EVENTS_CONF_SYSLOG_SOCKET  "/var/lib/csplugin-events/syslog.socket"
 #define _EVENTS_CONF_SYSINFO_REFRESH 5
+#define _EVENTS_CONF_HISTOGRAM_FILE "/var/lib/csplugin-events/histogram.dat"
+#define _EVENTS_CONF_HISTOGRAM_SAVE 300
+#define _EVENTS_CONF_BACKUP_PAGES   64
+#define _EVENTS_CONF_BACKUP_SLEEP   50
+#define _EVENTS_CONF_SPOOL_FILE     "/var/lib/csplugin-events/spool.dat"
 
 #define ISDOT(a)    (a[0] == '.' && (!a[1] || (a[1] == '.' && !a[2])))
 
 typedef map<uint32_t, string> csAlertIdMap;
+typedef map<uint32_t, time_t> csAlertRetentionMap;
 
 class csEventsInvalidAlertIdException : public csException
 {
@@ -199,14 +207,39 @@ public:
     const string GetExternConfig(void) const { return extern_config; }
     const string GetAlertConfig(void) const { return alert_config; }
     const string GetEventsSocketPath(void) const { return events_socket_path; }
+    const string GetInsertSocketPath(void) const { return insert_socket_path; }
+    bool IsRingEnabled(void) const { return ring_enabled; }
+    uint32_t GetRingSlots(void) const { return ring_slots; }
+    uint32_t GetRingSlotSize(void) const { return ring_slot_size; }
+    csEventsDb::csDbType GetDbType(void) const { return db_type; }
+    off_t GetDbMaxSize(void) const { return db_max_size; }
+    uint32_t GetDbMaxAlerts(void) const { return db_max_alerts; }
+    uint32_t GetDbBusyTimeout(void) const { return db_busy_timeout; }
     const string GetSqliteDbFilename(void) const { return sqlite_db_filename; }
+    bool GetSqliteFullTextSearch(void) const { return sqlite_fts; }
+    bool GetSqliteTemplateEncoding(void) const { return sqlite_templates; }
+    const string GetLogDbPath(void) const { return log_db_path; }
+    off_t GetLogSegmentSize(void) const { return log_segment_size; }
+    time_t GetLogSegmentAge(void) const { return log_segment_age; }
+    uint32_t GetLogSegmentsMax(void) const { return log_segments_max; }
     const string GetSyslogSocketPath(void) const { return syslog_socket_path; }
     const time_t GetSysinfoRefresh(void) const { return sysinfo_refresh; }
+    const string GetHistogramFilename(void) const { return histogram_filename; }
+    const time_t GetHistogramSaveInterval(void) const { return histogram_save_interval; }
+    int GetBackupPagesPerStep(void) const { return backup_pages; }
+    int GetBackupSleep(void) const { return backup_sleep; }
+    const string GetSpoolFilename(void) const { return spool_filename; }
+    csEventsSpool::csSpoolSync GetSpoolSync(void) const { return spool_sync; }
+    time_t GetSpoolSyncInterval(void) const { return spool_sync_interval; }
+    off_t GetSpoolMaxSize(void) const { return spool_max_size; }
+    uint32_t GetSpoolBatch(void) const { return spool_batch; }
     uint32_t GetAlertId(const string &type);
     string GetAlertType(uint32_t id);
     uint32_t GetAlertLevel(const string &level);
     void GetAlertTypes(csAlertIdMap &types);
     void MergeRegisteredAlertTypes(csAlertIdMap &types);
+    void GetAlertRetention(csAlertRetentionMap &retention);
+    void MergeRegisteredRetention(csAlertRetentionMap &retention);
     void GetAlertSourceConfigs(csAlertSourceConfigVector &configs);
 
 protected:
@@ -222,10 +255,34 @@ protected:
     string extern_config;
     string alert_config;
     string events_socket_path;
+    string insert_socket_path;
+    bool ring_enabled;
+    uint32_t ring_slots;
+    uint32_t ring_slot_size;
+    csEventsDb::csDbType db_type;
+    off_t db_max_size;
+    uint32_t db_max_alerts;
+    uint32_t db_busy_timeout;
     string sqlite_db_filename;
+    bool sqlite_fts;
+    bool sqlite_templates;
+    string log_db_path;
+    off_t log_segment_size;
+    time_t log_segment_age;
+    uint32_t log_segments_max;
     string syslog_socket_path;
     time_t sysinfo_refresh;
+    string histogram_filename;
+    time_t histogram_save_interval;
+    int backup_pages;
+    int backup_sleep;
+    string spool_filename;
+    csEventsSpool::csSpoolSync spool_sync;
+    time_t spool_sync_interval;
+    off_t spool_max_size;
+    uint32_t spool_batch;
     csAlertIdMap alert_types;
+    csAlertRetentionMap alert_retention;
     csAlertSourceConfigVector alert_source_config;
 };
 
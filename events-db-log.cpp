@@ -0,0 +1,2093 @@
+// ClearSync: System Monitor plugin.
+// Copyright (C) 2011 ClearFoundation <http://www.clearfoundation.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <clearsync/csplugin.h>
+
+#include <sstream>
+#include <fstream>
+#include <algorithm>
+#include <set>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <stddef.h>
+#include <string.h>
+#include <sqlite3.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+
+#include <openssl/sha.h>
+
+#include "events-alert.h"
+#include "events-db.h"
+#include "events-db-log.h"
+
+static uint32_t csEventsDb_log_crc_table[256];
+static bool csEventsDb_log_crc_init = false;
+
+uint32_t csEventsDb_log_crc32(uint32_t crc, const uint8_t *data, size_t length)
+{
+    if (!csEventsDb_log_crc_init) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int j = 0; j < 8; j++)
+                c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+            csEventsDb_log_crc_table[i] = c;
+        }
+        csEventsDb_log_crc_init = true;
+    }
+
+    crc = ~crc;
+    for (size_t i = 0; i < length; i++)
+        crc = csEventsDb_log_crc_table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+
+    return ~crc;
+}
+
+static void csEventsDb_log_put(vector<uint8_t> &payload, const void *v, size_t length)
+{
+    const uint8_t *ptr = (const uint8_t *)v;
+    payload.insert(payload.end(), ptr, ptr + length);
+}
+
+static void csEventsDb_log_put(vector<uint8_t> &payload, const string &v)
+{
+    uint32_t length = (uint32_t)v.length();
+    csEventsDb_log_put(payload, (const void *)&length, sizeof(uint32_t));
+    payload.insert(payload.end(), v.begin(), v.end());
+}
+
+static void csEventsDb_log_get(const vector<uint8_t> &payload,
+    size_t &index, void *v, size_t length)
+{
+    if (index + length > payload.size())
+        throw csEventsDbException(EINVAL, "Truncated log record");
+    memcpy(v, (const void *)&payload[index], length);
+    index += length;
+}
+
+static void csEventsDb_log_get(const vector<uint8_t> &payload,
+    size_t &index, string &v)
+{
+    uint32_t length;
+    csEventsDb_log_get(payload, index, (void *)&length, sizeof(uint32_t));
+    if (index + length > payload.size())
+        throw csEventsDbException(EINVAL, "Truncated log record");
+    v.assign((const char *)&payload[index], length);
+    index += length;
+}
+
+class csEventsDb_log_sort_rows
+{
+public:
+    csEventsDb_log_sort_rows(const csEventsDb_log::csLogIndexSlot *slots,
+        csEventsDb_log::csLogFilterColumn order, bool descending)
+        : slots(slots), order(order), descending(descending) { }
+
+    bool operator()(const csEventsDb_log::csLogRow &a,
+        const csEventsDb_log::csLogRow &b) const
+    {
+        int64_t va = Value(a), vb = Value(b);
+        return (descending) ? va > vb : va < vb;
+    }
+
+protected:
+    int64_t Value(const csEventsDb_log::csLogRow &row) const
+    {
+        switch (order) {
+        case csEventsDb_log::csLFC_ID:
+            return slots[row.first].id;
+        case csEventsDb_log::csLFC_TYPE:
+            return slots[row.first].type;
+        case csEventsDb_log::csLFC_FLAGS:
+            return slots[row.first].flags;
+        default:
+            return row.second;
+        }
+    }
+
+    const csEventsDb_log::csLogIndexSlot *slots;
+    csEventsDb_log::csLogFilterColumn order;
+    bool descending;
+};
+
+static void csEventsDb_log_tokenize(const string &where, vector<string> &tokens)
+{
+    static const char *operators[] = {
+        "<=", ">=", "!=", "<>", "==", "=", "<", ">", "&", "(", ")", NULL
+    };
+
+    for (size_t i = 0; i < where.length(); ) {
+        char c = where[i];
+
+        if (isspace(c)) {
+            i++;
+            continue;
+        }
+
+        if (isalnum(c) || c == '_' || c == '.' || c == '-') {
+            size_t j = i + 1;
+            while (j < where.length() && (isalnum(where[j]) ||
+                where[j] == '_' || where[j] == '.')) j++;
+            tokens.push_back(where.substr(i, j - i));
+            i = j;
+            continue;
+        }
+
+        // String literals keep their opening quote to tell them apart
+        if (c == '\'') {
+            string literal(1, c);
+            for (i++; ; i++) {
+                if (i >= where.length()) {
+                    throw csEventsDbException(EINVAL,
+                        "Unterminated string in where clause");
+                }
+                if (where[i] != '\'') literal.push_back(where[i]);
+                else if (i + 1 < where.length() && where[i + 1] == '\'') {
+                    literal.push_back(where[i]);
+                    i++;
+                }
+                else break;
+            }
+            tokens.push_back(literal);
+            i++;
+            continue;
+        }
+
+        const char **op;
+        for (op = operators; *op != NULL; op++) {
+            if (where.compare(i, strlen(*op), *op) == 0) break;
+        }
+        if (*op == NULL) {
+            throw csEventsDbException(EINVAL,
+                "Unsupported where clause for database type");
+        }
+        tokens.push_back(*op);
+        i += strlen(*op);
+    }
+}
+
+static csEventsDb_log::csLogFilterColumn csEventsDb_log_column(const string &token)
+{
+    string name(token);
+
+    if (strncasecmp(name.c_str(), "alerts.", 7) == 0)
+        name = name.substr(7);
+    else if (strncasecmp(name.c_str(), "stamps.", 7) == 0) {
+        name = name.substr(7);
+        if (strcasecmp(name.c_str(), "stamp") != 0)
+            return csEventsDb_log::csLFC_NONE;
+    }
+
+    if (strcasecmp(name.c_str(), "id") == 0)
+        return csEventsDb_log::csLFC_ID;
+    if (strcasecmp(name.c_str(), "type") == 0)
+        return csEventsDb_log::csLFC_TYPE;
+    if (strcasecmp(name.c_str(), "flags") == 0)
+        return csEventsDb_log::csLFC_FLAGS;
+    if (strcasecmp(name.c_str(), "updated") == 0)
+        return csEventsDb_log::csLFC_UPDATED;
+    if (strcasecmp(name.c_str(), "stamp") == 0)
+        return csEventsDb_log::csLFC_STAMP;
+    if (strcasecmp(name.c_str(), "origin") == 0)
+        return csEventsDb_log::csLFC_ORIGIN;
+    if (strcasecmp(name.c_str(), "basename") == 0)
+        return csEventsDb_log::csLFC_BASENAME;
+
+    return csEventsDb_log::csLFC_NONE;
+}
+
+static bool csEventsDb_log_integer(const string &token, int64_t &value)
+{
+    char *end = NULL;
+
+    if (token.length() == 0 || token[0] == '\'') return false;
+
+    errno = 0;
+    value = (int64_t)strtoll(token.c_str(), &end, 0);
+
+    return (errno == 0 && end != NULL && *end == '\0');
+}
+
+template <class T>
+static bool csEventsDb_log_compare(const T &a, csEventsDb_log::csLogFilterOp op, const T &b)
+{
+    switch (op) {
+    case csEventsDb_log::csLFO_EQ:
+        return a == b;
+    case csEventsDb_log::csLFO_NE:
+        return a != b;
+    case csEventsDb_log::csLFO_LT:
+        return a < b;
+    case csEventsDb_log::csLFO_LE:
+        return a <= b;
+    case csEventsDb_log::csLFO_GT:
+        return a > b;
+    case csEventsDb_log::csLFO_GE:
+        return a >= b;
+    }
+    return false;
+}
+
+csEventsDb_log::csEventsDb_log(const string &db_path,
+    off_t segment_size, time_t segment_age, uint32_t segments_max)
+    : csEventsDb(csDBT_LOG), db_path(db_path), segment_size(segment_size),
+    segment_age(segment_age), segments_max(segments_max),
+    read_only(false), fd_lock(-1), fd_index(-1), fd_active(-1),
+    active_segment(1), active_offset(0), active_created(0),
+    index(NULL), slots(NULL), index_length(0), update_depth(0),
+    time_block_records(0), types_next_id(1)
+{
+    memset(&time_block, 0, sizeof(csLogTimeBlock));
+}
+
+void csEventsDb_log::Open(void)
+{
+    Close();
+
+    if (mkdir(db_path.c_str(), S_IRWXU | S_IRWXG) < 0 && errno != EEXIST)
+        throw csEventsDbException(errno, strerror(errno));
+    SetOwnership(db_path);
+
+    // Only one writer; everyone else (ex: eventsctl) gets a read-only view
+    string path = db_path + "/" + _EVENTS_DB_LOG_LOCK_FILE;
+    if ((fd_lock = open(path.c_str(), O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP)) < 0)
+        throw csEventsDbException(errno, strerror(errno));
+    if (flock(fd_lock, LOCK_EX | LOCK_NB) < 0) {
+        if (errno != EWOULDBLOCK)
+            throw csEventsDbException(errno, strerror(errno));
+        csLog::Log(csLog::Debug, "%s: %s: locked, opening read-only",
+            __PRETTY_FUNCTION__, db_path.c_str());
+        read_only = true;
+    }
+
+    LoadMeta();
+
+    path = db_path + "/" + _EVENTS_DB_LOG_INDEX_FILE;
+    if (read_only)
+        fd_index = open(path.c_str(), O_RDONLY);
+    else {
+        fd_index = open(path.c_str(), O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+        if (fd_index < 0) throw csEventsDbException(errno, strerror(errno));
+        SetOwnership(path);
+    }
+
+    bool valid = false;
+    csLogIndexHeader header;
+    struct stat index_stat;
+
+    // A writer only needs a cleanly closed index; a read-only view may
+    // also copy the writer's live index, between updates.
+    for (int retry = 0; !valid && retry < _EVENTS_DB_LOG_INDEX_RETRY; retry++) {
+        if (fd_index < 0 || fstat(fd_index, &index_stat) != 0 ||
+            pread(fd_index, &header, sizeof(csLogIndexHeader), 0) !=
+            (ssize_t)sizeof(csLogIndexHeader)) break;
+
+        if (header.magic != _EVENTS_DB_LOG_INDEX_MAGIC ||
+            header.version != _EVENTS_DB_LOG_INDEX_VERSION ||
+            header.capacity == 0 ||
+            index_stat.st_size < (off_t)(sizeof(csLogIndexHeader) +
+                header.capacity * sizeof(csLogIndexSlot))) break;
+
+        if (!header.clean && (!read_only || (header.generation & 1))) {
+            if (!read_only) break;
+            usleep(1000);
+            continue;
+        }
+
+        // The writer may have appended past the active position since
+        struct stat segment_stat;
+        string segment_path = SegmentPath(header.active_segment);
+        if (stat(segment_path.c_str(), &segment_stat) == 0) {
+            if (header.clean &&
+                segment_stat.st_size != (off_t)header.active_offset) break;
+            if (segment_stat.st_size < (off_t)header.active_offset) break;
+        }
+        else if (header.active_offset != 0) break;
+
+        if (!read_only) {
+            MapIndex(header.capacity);
+            valid = true;
+        }
+        else valid = CopyIndex();
+    }
+
+    if (valid) {
+        for (uint32_t i = 0; i < index->capacity; i++) {
+            if (slots[i].state != csLIS_USED) continue;
+            id_slots[slots[i].id] = i;
+        }
+        active_segment = index->active_segment;
+        active_offset = (off_t)index->active_offset;
+        LoadTimeIndex();
+        if (!index->clean) ScanTimeTail();
+    }
+    else {
+        csLog::Log(csLog::Debug, "%s: %s: rebuilding index",
+            __PRETTY_FUNCTION__, db_path.c_str());
+        ResetIndex(_EVENTS_DB_LOG_INDEX_CAPACITY);
+        Rebuild();
+    }
+
+    active_segment = index->active_segment;
+    active_offset = (off_t)index->active_offset;
+
+    if (!read_only) {
+        index->clean = 0;
+        if (index->generation & 1) index->generation++;
+        msync(index, sizeof(csLogIndexHeader), MS_SYNC);
+    }
+}
+
+bool csEventsDb_log::IsUnavailable(const csEventsDbException &e)
+{
+    switch (e.eint) {
+    case EIO:
+    case EAGAIN:
+    case EINTR:
+    case ENOSPC:
+    case EDQUOT:
+    case EROFS:
+    case EBADF:
+        return true;
+    }
+
+    return false;
+}
+
+void csEventsDb_log::Close(void)
+{
+    if (fd_active >= 0) {
+        fdatasync(fd_active);
+        close(fd_active);
+        fd_active = -1;
+    }
+
+    for (map<uint32_t, int>::iterator i = segment_fds.begin();
+        i != segment_fds.end(); i++) close(i->second);
+    segment_fds.clear();
+
+    if (index != NULL && !read_only) {
+        SaveTimeIndex();
+        index->active_segment = active_segment;
+        index->active_offset = (uint32_t)active_offset;
+        index->clean = 1;
+        msync(index, index_length, MS_SYNC);
+    }
+
+    UnmapIndex();
+
+    if (fd_index >= 0) {
+        close(fd_index);
+        fd_index = -1;
+    }
+
+    if (fd_lock >= 0) {
+        close(fd_lock);
+        fd_lock = -1;
+    }
+
+    id_slots.clear();
+    time_blocks.clear();
+    time_block_records = 0;
+    read_only = false;
+}
+
+void csEventsDb_log::Create(void)
+{
+    if (read_only || fd_active >= 0) return;
+
+    csEventsDbLogUpdate update(this);
+    OpenActiveSegment(active_segment);
+}
+
+void csEventsDb_log::Drop(void)
+{
+    CheckWritable();
+    csEventsDbLogUpdate update(this);
+
+    if (fd_active >= 0) {
+        close(fd_active);
+        fd_active = -1;
+    }
+    for (map<uint32_t, int>::iterator i = segment_fds.begin();
+        i != segment_fds.end(); i++) close(i->second);
+    segment_fds.clear();
+
+    vector<uint32_t> segments;
+    ScanSegments(segments);
+    for (vector<uint32_t>::iterator i = segments.begin(); i != segments.end(); i++)
+        unlink(SegmentPath(*i).c_str());
+
+    ResetIndex(_EVENTS_DB_LOG_INDEX_CAPACITY);
+    active_segment = 1;
+    active_offset = 0;
+
+    time_blocks.clear();
+    time_block_records = 0;
+    SaveTimeIndex();
+
+    types.clear();
+    types_next_id = 1;
+    overrides.clear();
+    SaveMeta();
+}
+
+int64_t csEventsDb_log::GetLastId(const string &table)
+{
+    if (table == "alerts")
+        return (index != NULL) ? index->next_id - 1 : 0;
+    if (table == "types")
+        return (int64_t)types_next_id - 1;
+    return 0;
+}
+
+uint32_t csEventsDb_log::SelectAlert(const string &where, vector<csEventsAlert *> *result)
+{
+    csLogFilter filter;
+    vector<csLogRow> rows;
+
+    ParseFilter(where, filter);
+    SelectRows(filter, rows);
+
+    SortRows(rows, (filter.ordered) ? filter.order : csLFC_STAMP, filter.descending);
+    if (filter.limit > 0 && rows.size() > filter.limit)
+        rows.resize(filter.limit);
+
+    // Only the rows that survived the filter and limit are read back; a
+    // ranged select can return the same alert more than once
+    map<uint32_t, csEventsAlert> cache;
+
+    for (vector<csLogRow>::iterator i = rows.begin(); i != rows.end(); i++) {
+        map<uint32_t, csEventsAlert>::iterator j = cache.find(i->first);
+        if (j == cache.end()) {
+            csEventsAlert alert;
+            ReadAlert(slots[i->first].segment, slots[i->first].offset, alert);
+            alert.SetFlags(slots[i->first].flags);
+            j = cache.insert(pair<uint32_t, csEventsAlert>(i->first, alert)).first;
+        }
+
+        csEventsAlert *alert = new csEventsAlert(j->second);
+        alert->SetUpdated((time_t)i->second);
+        result->push_back(alert);
+    }
+
+    return (uint32_t)result->size();
+}
+
+uint32_t csEventsDb_log::SearchAlerts(const string &query, uint32_t limit,
+    vector<csEventsAlert *> *result)
+{
+    // No text index here; case-insensitive substring match, most recent
+    // first.  Records are read in that order until the limit is reached.
+    csLogFilter filter;
+    vector<csLogRow> rows;
+    csEventsAlert alert;
+    size_t matches = 0;
+
+    ParseFilter("", filter);
+    SelectRows(filter, rows);
+    SortRows(rows, csLFC_STAMP, true);
+
+    for (vector<csLogRow>::iterator i = rows.begin();
+        i != rows.end() && (limit == 0 || matches < limit); i++) {
+        ReadAlert(slots[i->first].segment, slots[i->first].offset, alert);
+        if (strcasestr(alert.GetDescriptionChar(), query.c_str()) == NULL &&
+            strcasestr(alert.GetOriginChar(), query.c_str()) == NULL &&
+            strcasestr(alert.GetBasenameChar(), query.c_str()) == NULL) continue;
+
+        alert.SetFlags(slots[i->first].flags);
+        alert.SetUpdated((time_t)i->second);
+        result->push_back(new csEventsAlert(alert));
+        matches++;
+    }
+
+    return (uint32_t)result->size();
+}
+
+uint32_t csEventsDb_log::SelectAlertsByGroup(gid_t gid, uint32_t limit,
+    vector<csEventsAlert *> *result)
+{
+    // Groups aren't indexed here; scan newest first as with sqlite, reading
+    // records until the limit is reached
+    csLogFilter filter;
+    vector<csLogRow> rows;
+    csEventsAlert alert;
+    vector<gid_t> groups;
+    size_t matches = 0;
+
+    ParseFilter("", filter);
+    SelectRows(filter, rows);
+    SortRows(rows, csLFC_ID, true);
+
+    for (vector<csLogRow>::iterator i = rows.begin();
+        i != rows.end() && (limit == 0 || matches < limit); i++) {
+        ReadAlert(slots[i->first].segment, slots[i->first].offset, alert);
+        groups.clear();
+        alert.GetGroups(groups);
+        if (find(groups.begin(), groups.end(), gid) == groups.end()) continue;
+
+        alert.SetFlags(slots[i->first].flags);
+        alert.SetUpdated((time_t)i->second);
+        result->push_back(new csEventsAlert(alert));
+        matches++;
+    }
+
+    return (uint32_t)result->size();
+}
+
+void csEventsDb_log::InsertAlert(csEventsAlert &alert)
+{
+    uint32_t segment, offset;
+    vector<uint8_t> payload;
+
+    CheckWritable();
+    csEventsDbLogUpdate update(this);
+
+    alert.UpdateHash();
+    const uint8_t *hash = alert.GetHashBin();
+    uint32_t desc_crc = csEventsDb_log_crc32(0,
+        (const uint8_t *)alert.GetDescriptionChar(), alert.GetDescriptionLength());
+
+    csLogIndexSlot *slot = FindSlot(hash, false);
+
+    if (slot == NULL) {
+        alert.SetId(index->next_id++);
+
+        EncodeAlert(alert, hash, payload);
+        Append(csLRT_ALERT, &payload[0], payload.size(), segment, offset);
+
+        slot = FindSlot(hash, true);
+        slot->segment = segment;
+        slot->offset = offset;
+        slot->type = alert.GetType();
+        slot->flags = alert.GetFlags();
+        slot->desc_crc = desc_crc;
+        slot->id = alert.GetId();
+        slot->updated = (int64_t)alert.GetUpdated();
+        id_slots[slot->id] = (uint32_t)(slot - slots);
+    }
+    else {
+        alert.SetId(slot->id);
+
+        // Repeated alerts usually only need a new stamp; the full record
+        // is rewritten only when the level or rendered text has changed.
+        if (slot->flags != alert.GetFlags() || slot->desc_crc != desc_crc) {
+            csEventsAlert previous;
+            ReadAlert(slot->segment, slot->offset, previous);
+            alert.SetCreated(previous.GetCreated());
+
+            EncodeAlert(alert, hash, payload);
+            Append(csLRT_ALERT, &payload[0], payload.size(), segment, offset);
+
+            slot = FindSlot(hash, false);
+            slot->segment = segment;
+            slot->offset = offset;
+            slot->flags = alert.GetFlags();
+            slot->desc_crc = desc_crc;
+        }
+
+        if ((int64_t)alert.GetUpdated() > slot->updated)
+            slot->updated = (int64_t)alert.GetUpdated();
+    }
+
+    int64_t id = alert.GetId(), stamp = (int64_t)alert.GetUpdated();
+    payload.clear();
+    csEventsDb_log_put(payload, (const void *)&id, sizeof(int64_t));
+    csEventsDb_log_put(payload, (const void *)&stamp, sizeof(int64_t));
+    Append(csLRT_STAMP, &payload[0], payload.size(), segment, offset);
+
+    AddTimeStamp((time_t)stamp, segment, offset);
+}
+
+void csEventsDb_log::PurgeAlerts(const csEventsAlert &alert, time_t age)
+{
+    uint32_t segment, offset;
+
+    CheckWritable();
+    csEventsDbLogUpdate update(this);
+
+    for (uint32_t i = 0; i < index->capacity; i++) {
+        if (slots[i].state != csLIS_USED) continue;
+        if (!(slots[i].flags & csEventsAlert::csAF_FLG_RESOLVED)) continue;
+        if (slots[i].updated >= (int64_t)age) continue;
+        if (retention.find(slots[i].type) != retention.end()) continue;
+
+        int64_t id = slots[i].id;
+        Append(csLRT_DELETE, (const uint8_t *)&id, sizeof(int64_t), segment, offset);
+        RemoveSlot(&slots[i]);
+    }
+
+    Compact();
+}
+
+uint32_t csEventsDb_log::PurgeAlerts(uint32_t type, time_t age, uint32_t limit)
+{
+    uint32_t segment, offset, purged = 0;
+
+    CheckWritable();
+    csEventsDbLogUpdate update(this);
+
+    // No per-type index here; the slot table is scanned, but the work
+    // done (appends, removals) is still bounded by limit.
+    for (uint32_t i = 0; i < index->capacity && purged < limit; i++) {
+        if (slots[i].state != csLIS_USED) continue;
+        if (slots[i].type != type) continue;
+        if (!(slots[i].flags & csEventsAlert::csAF_FLG_RESOLVED)) continue;
+        if (slots[i].updated >= (int64_t)age) continue;
+
+        int64_t id = slots[i].id;
+        Append(csLRT_DELETE, (const uint8_t *)&id, sizeof(int64_t), segment, offset);
+        RemoveSlot(&slots[i]);
+        purged++;
+    }
+
+    return purged;
+}
+
+uint32_t csEventsDb_log::MarkAsResolved(uint32_t type)
+{
+    uint32_t resolved = 0;
+
+    CheckWritable();
+    csEventsDbLogUpdate update(this);
+
+    for (uint32_t i = 0; i < index->capacity; i++) {
+        if (slots[i].state != csLIS_USED) continue;
+        if (slots[i].type != type) continue;
+        if (ResolveSlot(&slots[i])) resolved++;
+    }
+
+    return resolved;
+}
+
+uint32_t csEventsDb_log::MarkAsResolvedById(int64_t id)
+{
+    CheckWritable();
+    csEventsDbLogUpdate update(this);
+
+    map<int64_t, uint32_t>::iterator i = id_slots.find(id);
+    if (i == id_slots.end()) return 0;
+
+    return (ResolveSlot(&slots[i->second])) ? 1 : 0;
+}
+
+uint32_t csEventsDb_log::MarkAsResolvedByUUID(const string &uuid, uint32_t type)
+{
+    uint32_t resolved = 0;
+
+    CheckWritable();
+    csEventsDbLogUpdate update(this);
+
+    // UUIDs aren't indexed; only unresolved candidates are read back
+    for (uint32_t i = 0; i < index->capacity; i++) {
+        if (slots[i].state != csLIS_USED) continue;
+        if (type != 0 && slots[i].type != type) continue;
+        if (slots[i].flags & csEventsAlert::csAF_FLG_RESOLVED) continue;
+
+        csEventsAlert alert;
+        ReadAlert(slots[i].segment, slots[i].offset, alert);
+        if (alert.GetUUID() != uuid) continue;
+
+        if (ResolveSlot(&slots[i])) resolved++;
+    }
+
+    return resolved;
+}
+
+uint32_t csEventsDb_log::MarkAsResolvedByHash(const string &hash)
+{
+    uint8_t digest[SHA_DIGEST_LENGTH];
+
+    CheckWritable();
+    csEventsDbLogUpdate update(this);
+
+    if (hash.length() != SHA_DIGEST_LENGTH * 2) return 0;
+
+    for (size_t i = 0; i < SHA_DIGEST_LENGTH; i++) {
+        char hex[3] = { hash[i * 2], hash[i * 2 + 1], '\0' };
+        char *end = NULL;
+        digest[i] = (uint8_t)strtoul(hex, &end, 16);
+        if (end != hex + 2) return 0;
+    }
+
+    csLogIndexSlot *slot = FindSlot(digest, false);
+    if (slot == NULL) return 0;
+
+    return (ResolveSlot(slot)) ? 1 : 0;
+}
+
+bool csEventsDb_log::ResolveSlot(csLogIndexSlot *slot)
+{
+    uint32_t segment, offset;
+    vector<uint8_t> payload;
+
+    if (slot->flags & csEventsAlert::csAF_FLG_RESOLVED) return false;
+
+    slot->flags |= csEventsAlert::csAF_FLG_RESOLVED;
+
+    csEventsDb_log_put(payload, (const void *)&slot->id, sizeof(int64_t));
+    csEventsDb_log_put(payload, (const void *)&slot->flags, sizeof(uint32_t));
+    Append(csLRT_FLAGS, &payload[0], payload.size(), segment, offset);
+
+    return true;
+}
+
+uint32_t csEventsDb_log::SelectSummary(csEventsSummaryVector *result)
+{
+    // The slot table already holds type, flags and last update for every
+    // live alert, so the summary is folded from it rather than kept apart.
+    map<uint64_t, csEventsSummary> summary;
+
+    for (uint32_t i = 0; i < index->capacity; i++) {
+        if (slots[i].state != csLIS_USED) continue;
+
+        csEventsSummary row;
+        row.type = slots[i].type;
+        row.level = slots[i].flags & (csEventsAlert::csAF_LVL_NORM |
+            csEventsAlert::csAF_LVL_WARN | csEventsAlert::csAF_LVL_CRIT);
+        row.resolved = (slots[i].flags & csEventsAlert::csAF_FLG_RESOLVED) != 0;
+
+        uint64_t key = ((uint64_t)row.type << 32) |
+            (row.level << 1) | (row.resolved ? 1 : 0);
+
+        map<uint64_t, csEventsSummary>::iterator j = summary.find(key);
+        if (j == summary.end()) {
+            row.count = 1;
+            row.updated = (time_t)slots[i].updated;
+            summary[key] = row;
+        }
+        else {
+            j->second.count++;
+            if ((time_t)slots[i].updated > j->second.updated)
+                j->second.updated = (time_t)slots[i].updated;
+        }
+    }
+
+    for (map<uint64_t, csEventsSummary>::iterator i = summary.begin();
+        i != summary.end(); i++) result->push_back(i->second);
+
+    return (uint32_t)result->size();
+}
+
+static bool csEventsDb_log_sort_count(
+    const csEventsAggregate &a, const csEventsAggregate &b)
+{
+    if (a.count != b.count) return a.count > b.count;
+    if (a.key != b.key) return a.key < b.key;
+    return a.name < b.name;
+}
+
+static bool csEventsDb_log_sort_bucket(
+    const csEventsAggregate &a, const csEventsAggregate &b)
+{
+    return a.key > b.key;
+}
+
+uint32_t csEventsDb_log::SelectAggregate(csAggregateKey key, uint32_t bucket,
+    const string &where, uint32_t limit, csEventsAggregateVector *result)
+{
+    if (key >= csAK_MAX)
+        throw csEventsDbException(EINVAL, "Invalid aggregate key");
+    if (key == csAK_BUCKET && bucket == 0)
+        throw csEventsDbException(EINVAL, "Invalid aggregate bucket");
+
+    // Same filter set as SelectAlert(), less the clauses that follow the
+    // conditions there
+    csLogFilter filter;
+    ParseFilter(where, filter);
+    if (filter.ordered || filter.limit > 0) {
+        throw csEventsDbException(EINVAL,
+            "Unsupported aggregate filter for database type");
+    }
+
+    vector<csLogRow> rows;
+    SelectRows(filter, rows);
+
+    // Without a time bound each alert is a single row, so count equals
+    // alerts; a ranged filter counts every occurrence in the range
+    map<pair<int64_t, string>, csEventsAggregate> groups;
+    map<pair<int64_t, string>, set<uint32_t> > group_alerts;
+    map<uint32_t, string> names;
+    csEventsAlert alert;
+
+    for (vector<csLogRow>::iterator i = rows.begin(); i != rows.end(); i++) {
+        const csLogIndexSlot &slot = slots[i->first];
+        pair<int64_t, string> k(0, "");
+
+        switch (key) {
+        case csAK_TYPE:
+            k.first = slot.type;
+            break;
+        case csAK_LEVEL:
+            k.first = slot.flags & (csEventsAlert::csAF_LVL_NORM |
+                csEventsAlert::csAF_LVL_WARN | csEventsAlert::csAF_LVL_CRIT);
+            break;
+        case csAK_ORIGIN:
+        case csAK_BASENAME:
+            {
+                map<uint32_t, string>::iterator j = names.find(i->first);
+                if (j == names.end()) {
+                    ReadAlert(slot.segment, slot.offset, alert);
+                    j = names.insert(pair<uint32_t, string>(i->first,
+                        (key == csAK_ORIGIN) ?
+                            alert.GetOrigin() : alert.GetBasename())).first;
+                }
+                k.second = j->second;
+            }
+            break;
+        case csAK_BUCKET:
+            k.first = (i->second / bucket) * bucket;
+            break;
+        default:
+            break;
+        }
+
+        map<pair<int64_t, string>, csEventsAggregate>::iterator j = groups.find(k);
+        if (j == groups.end()) {
+            csEventsAggregate row;
+            row.key = k.first;
+            row.name = k.second;
+            row.count = 1;
+            row.alerts = 0;
+            row.updated = (time_t)i->second;
+            j = groups.insert(
+                pair<pair<int64_t, string>, csEventsAggregate>(k, row)).first;
+        }
+        else {
+            j->second.count++;
+            if ((time_t)i->second > j->second.updated)
+                j->second.updated = (time_t)i->second;
+        }
+
+        if (group_alerts[k].insert(i->first).second) j->second.alerts++;
+    }
+
+    if (key == csAK_NONE && groups.size() == 0) {
+        csEventsAggregate row;
+        row.key = 0;
+        row.count = row.alerts = 0;
+        row.updated = 0;
+        result->push_back(row);
+        return (uint32_t)result->size();
+    }
+
+    size_t first = result->size();
+    for (map<pair<int64_t, string>, csEventsAggregate>::iterator i = groups.begin();
+        i != groups.end(); i++) result->push_back(i->second);
+
+    sort(result->begin() + first, result->end(), (key == csAK_BUCKET) ?
+        csEventsDb_log_sort_bucket : csEventsDb_log_sort_count);
+
+    if (limit > 0 && result->size() - first > limit)
+        result->resize(first + limit);
+
+    return (uint32_t)result->size();
+}
+
+void csEventsDb_log::InsertType(const string &tag,
+    const string &basename, time_t max_age)
+{
+    CheckWritable();
+
+    for (vector<csLogType>::iterator i = types.begin(); i != types.end(); i++) {
+        if (i->tag != tag) continue;
+        csLog::Log(csLog::Debug, "%s:%d: Custom type already registered: %s",
+            __PRETTY_FUNCTION__, __LINE__, tag.c_str());
+        return;
+    }
+
+    csLogType type;
+    type.id = types_next_id++;
+    type.tag = tag;
+    type.basename = basename;
+    type.max_age = max_age;
+    types.push_back(type);
+
+    SaveMeta();
+}
+
+void csEventsDb_log::DeleteType(const string &tag)
+{
+    CheckWritable();
+
+    for (vector<csLogType>::iterator i = types.begin(); i != types.end(); i++) {
+        if (i->tag != tag) continue;
+        types.erase(i);
+        SaveMeta();
+        break;
+    }
+}
+
+uint32_t csEventsDb_log::SelectTypes(map<uint32_t, string> *result)
+{
+    for (vector<csLogType>::iterator i = types.begin(); i != types.end(); i++)
+        (*result)[i->id] = i->tag;
+
+    return (uint32_t)result->size();
+}
+
+uint32_t csEventsDb_log::SelectTypeRetention(map<uint32_t, time_t> *result)
+{
+    for (vector<csLogType>::iterator i = types.begin(); i != types.end(); i++) {
+        if (i->max_age > 0) (*result)[i->id] = i->max_age;
+    }
+
+    return (uint32_t)result->size();
+}
+
+void csEventsDb_log::SetRetention(const map<uint32_t, time_t> &retention)
+{
+    this->retention = retention;
+}
+
+uint32_t csEventsDb_log::SelectOverride(uint32_t type)
+{
+    map<uint32_t, uint32_t>::iterator i = overrides.find(type);
+    if (i == overrides.end()) return csEventsAlert::csAF_NULL;
+    return i->second;
+}
+
+uint32_t csEventsDb_log::SelectOverrides(map<uint32_t, uint32_t> *result)
+{
+    for (map<uint32_t, uint32_t>::iterator i = overrides.begin();
+        i != overrides.end(); i++) (*result)[i->first] = i->second;
+
+    return (uint32_t)result->size();
+}
+
+void csEventsDb_log::InsertOverride(uint32_t type, uint32_t level)
+{
+    CheckWritable();
+    overrides[type] = level;
+    SaveMeta();
+}
+
+void csEventsDb_log::UpdateOverride(uint32_t type, uint32_t level)
+{
+    CheckWritable();
+    map<uint32_t, uint32_t>::iterator i = overrides.find(type);
+    if (i == overrides.end()) return;
+    i->second = level;
+    SaveMeta();
+}
+
+void csEventsDb_log::DeleteOverride(uint32_t type)
+{
+    CheckWritable();
+    overrides.erase(type);
+    SaveMeta();
+}
+
+void csEventsDb_log::Compact(void)
+{
+    uint32_t segment, offset;
+    csLogRecordHeader header;
+    vector<uint8_t> payload;
+    vector<uint32_t> segments;
+
+    CheckWritable();
+    csEventsDbLogUpdate update(this);
+
+    ScanSegments(segments);
+    if (segments.size() <= segments_max) return;
+
+    uint32_t oldest = segments[0];
+    if (oldest == active_segment) return;
+
+    csLog::Log(csLog::Debug, "%s: compacting segment: %u",
+        __PRETTY_FUNCTION__, oldest);
+
+    // Rewrite live records from the oldest segment to the head of the log.
+    // Alert records are rewritten with their current flags and update time
+    // so flag records that referred to them can be dropped.
+    off_t offset_read = sizeof(csLogSegmentHeader);
+    while (ReadRecord(oldest, (uint32_t)offset_read, header, payload)) {
+        uint32_t record_offset = (uint32_t)offset_read;
+        offset_read += sizeof(csLogRecordHeader) + header.length;
+
+        if (header.type == csLRT_ALERT) {
+            csEventsAlert alert;
+            uint8_t hash[SHA_DIGEST_LENGTH];
+            DecodeAlert(payload, alert, hash);
+
+            csLogIndexSlot *slot = FindSlot(hash, false);
+            if (slot == NULL || slot->segment != oldest ||
+                slot->offset != record_offset) continue;
+
+            alert.SetFlags(slot->flags);
+            alert.SetUpdated((time_t)slot->updated);
+
+            vector<uint8_t> rewrite;
+            EncodeAlert(alert, hash, rewrite);
+            Append(csLRT_ALERT, &rewrite[0], rewrite.size(), segment, offset);
+
+            slot = FindSlot(hash, false);
+            slot->segment = segment;
+            slot->offset = offset;
+        }
+        else if (header.type == csLRT_STAMP) {
+            int64_t id, stamp;
+            size_t index = 0;
+            csEventsDb_log_get(payload, index, (void *)&id, sizeof(int64_t));
+            csEventsDb_log_get(payload, index, (void *)&stamp, sizeof(int64_t));
+            if (id_slots.find(id) == id_slots.end()) continue;
+
+            Append(csLRT_STAMP, &payload[0], payload.size(), segment, offset);
+            AddTimeStamp((time_t)stamp, segment, offset);
+        }
+    }
+
+    map<uint32_t, int>::iterator i = segment_fds.find(oldest);
+    if (i != segment_fds.end()) {
+        close(i->second);
+        segment_fds.erase(i);
+    }
+
+    fdatasync(fd_active);
+    unlink(SegmentPath(oldest).c_str());
+
+    vector<csLogTimeBlock> blocks;
+    for (vector<csLogTimeBlock>::iterator j = time_blocks.begin();
+        j != time_blocks.end(); j++) {
+        if (j->segment != oldest) blocks.push_back(*j);
+    }
+    time_blocks.swap(blocks);
+    SaveTimeIndex();
+}
+
+string csEventsDb_log::SegmentPath(uint32_t segment)
+{
+    char name[16];
+    snprintf(name, sizeof(name), "%08x.log", segment);
+    return db_path + "/" + name;
+}
+
+void csEventsDb_log::ScanSegments(vector<uint32_t> &segments)
+{
+    segments.clear();
+
+    DIR *dh = opendir(db_path.c_str());
+    if (dh == NULL) throw csEventsDbException(errno, strerror(errno));
+
+    struct dirent *entry;
+    while ((entry = readdir(dh)) != NULL) {
+        size_t length = strlen(entry->d_name);
+        if (length != 12 || strcmp(entry->d_name + 8, ".log")) continue;
+        segments.push_back((uint32_t)strtoul(entry->d_name, NULL, 16));
+    }
+
+    closedir(dh);
+
+    sort(segments.begin(), segments.end());
+}
+
+int csEventsDb_log::GetSegmentDescriptor(uint32_t segment)
+{
+    map<uint32_t, int>::iterator i = segment_fds.find(segment);
+    if (i != segment_fds.end()) return i->second;
+
+    int fd = open(SegmentPath(segment).c_str(), O_RDONLY);
+    if (fd >= 0) segment_fds[segment] = fd;
+
+    return fd;
+}
+
+void csEventsDb_log::OpenActiveSegment(uint32_t segment)
+{
+    string path = SegmentPath(segment);
+
+    fd_active = open(path.c_str(), O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+    if (fd_active < 0) throw csEventsDbException(errno, strerror(errno));
+
+    csLogSegmentHeader header;
+    ssize_t bytes = pread(fd_active, &header, sizeof(csLogSegmentHeader), 0);
+
+    if (bytes == (ssize_t)sizeof(csLogSegmentHeader) &&
+        header.magic == _EVENTS_DB_LOG_SEGMENT_MAGIC) {
+        struct stat segment_stat;
+        if (fstat(fd_active, &segment_stat) < 0)
+            throw csEventsDbException(errno, strerror(errno));
+        active_created = (time_t)header.created;
+        active_offset = segment_stat.st_size;
+    }
+    else {
+        header.magic = _EVENTS_DB_LOG_SEGMENT_MAGIC;
+        header.segment = segment;
+        header.created = (int64_t)time(NULL);
+        if (ftruncate(fd_active, 0) < 0 ||
+            pwrite(fd_active, &header, sizeof(csLogSegmentHeader), 0) !=
+            (ssize_t)sizeof(csLogSegmentHeader))
+            throw csEventsDbException(errno, strerror(errno));
+        SetOwnership(path);
+        active_created = (time_t)header.created;
+        active_offset = sizeof(csLogSegmentHeader);
+    }
+
+    active_segment = segment;
+    index->active_segment = active_segment;
+    index->active_offset = (uint32_t)active_offset;
+}
+
+void csEventsDb_log::RollSegment(void)
+{
+    fdatasync(fd_active);
+    close(fd_active);
+    fd_active = -1;
+
+    if (time_block_records > 0) PushTimeBlock();
+
+    OpenActiveSegment(active_segment + 1);
+
+    csLog::Log(csLog::Debug, "%s: new segment: %u",
+        __PRETTY_FUNCTION__, active_segment);
+}
+
+void csEventsDb_log::Append(csLogRecordType type,
+    const uint8_t *payload, uint32_t length, uint32_t &segment, uint32_t &offset)
+{
+    CheckWritable();
+
+    if (fd_active < 0) OpenActiveSegment(active_segment);
+
+    csLogRecordHeader header;
+    off_t record_length = sizeof(csLogRecordHeader) + length;
+
+    if (active_offset > (off_t)sizeof(csLogSegmentHeader) &&
+        (active_offset + record_length > segment_size ||
+        time(NULL) - active_created > segment_age)) RollSegment();
+
+    header.magic = _EVENTS_DB_LOG_RECORD_MAGIC;
+    header.length = length;
+    header.type = (uint8_t)type;
+    header.crc = csEventsDb_log_crc32(0, &header.type, sizeof(uint8_t));
+    header.crc = csEventsDb_log_crc32(header.crc, payload, length);
+
+    vector<uint8_t> buffer;
+    buffer.reserve(record_length);
+    csEventsDb_log_put(buffer, (const void *)&header, sizeof(csLogRecordHeader));
+    buffer.insert(buffer.end(), payload, payload + length);
+
+    for (off_t written = 0; written < record_length; ) {
+        ssize_t bytes = pwrite(fd_active, &buffer[written],
+            record_length - written, active_offset + written);
+        if (bytes < 0) {
+            if (errno == EINTR) continue;
+            throw csEventsDbException(errno, strerror(errno));
+        }
+        written += bytes;
+    }
+
+    segment = active_segment;
+    offset = (uint32_t)active_offset;
+
+    active_offset += record_length;
+    index->active_offset = (uint32_t)active_offset;
+}
+
+bool csEventsDb_log::ReadRecord(uint32_t segment, uint32_t offset,
+    csLogRecordHeader &header, vector<uint8_t> &payload)
+{
+    int fd = GetSegmentDescriptor(segment);
+    if (fd < 0) return false;
+
+    if (pread(fd, &header, sizeof(csLogRecordHeader), offset) !=
+        (ssize_t)sizeof(csLogRecordHeader)) return false;
+
+    if (header.magic != _EVENTS_DB_LOG_RECORD_MAGIC ||
+        header.length > _EVENTS_DB_LOG_RECORD_MAX) {
+        csLog::Log(csLog::Warning, "%s: %s:%u: invalid record header",
+            __PRETTY_FUNCTION__, SegmentPath(segment).c_str(), offset);
+        return false;
+    }
+
+    payload.resize(header.length);
+    if (header.length > 0 &&
+        pread(fd, &payload[0], header.length, offset + sizeof(csLogRecordHeader)) !=
+        (ssize_t)header.length) return false;
+
+    uint32_t crc = csEventsDb_log_crc32(0, &header.type, sizeof(uint8_t));
+    if (header.length > 0)
+        crc = csEventsDb_log_crc32(crc, &payload[0], header.length);
+    if (crc != header.crc) {
+        csLog::Log(csLog::Warning, "%s: %s:%u: record CRC mis-match",
+            __PRETTY_FUNCTION__, SegmentPath(segment).c_str(), offset);
+        return false;
+    }
+
+    return true;
+}
+
+void csEventsDb_log::ReadAlert(uint32_t segment, uint32_t offset, csEventsAlert &alert)
+{
+    csLogRecordHeader header;
+    vector<uint8_t> payload;
+    uint8_t hash[SHA_DIGEST_LENGTH];
+
+    if (!ReadRecord(segment, offset, header, payload) || header.type != csLRT_ALERT)
+        throw csEventsDbException(EINVAL, "Invalid alert record");
+
+    DecodeAlert(payload, alert, hash);
+}
+
+void csEventsDb_log::EncodeAlert(const csEventsAlert &alert,
+    const uint8_t *hash, vector<uint8_t> &payload)
+{
+    const csEventsAlert::csEventsAlertData *data = alert.GetDataPtr();
+    int64_t stamp;
+
+    payload.clear();
+    csEventsDb_log_put(payload, (const void *)hash, SHA_DIGEST_LENGTH);
+    csEventsDb_log_put(payload, (const void *)&data->id, sizeof(int64_t));
+    stamp = (int64_t)data->created;
+    csEventsDb_log_put(payload, (const void *)&stamp, sizeof(int64_t));
+    stamp = (int64_t)data->updated;
+    csEventsDb_log_put(payload, (const void *)&stamp, sizeof(int64_t));
+    csEventsDb_log_put(payload, (const void *)&data->flags, sizeof(uint32_t));
+    csEventsDb_log_put(payload, (const void *)&data->type, sizeof(uint32_t));
+    csEventsDb_log_put(payload, (const void *)&data->user, sizeof(uint32_t));
+
+    uint32_t groups = (uint32_t)data->groups.size();
+    csEventsDb_log_put(payload, (const void *)&groups, sizeof(uint32_t));
+    for (vector<gid_t>::const_iterator i = data->groups.begin();
+        i != data->groups.end(); i++)
+        csEventsDb_log_put(payload, (const void *)&(*i), sizeof(uint32_t));
+
+    csEventsDb_log_put(payload, data->origin);
+    csEventsDb_log_put(payload, data->basename);
+    csEventsDb_log_put(payload, data->uuid);
+    csEventsDb_log_put(payload, data->desc);
+}
+
+void csEventsDb_log::DecodeAlert(const vector<uint8_t> &payload,
+    csEventsAlert &alert, uint8_t *hash)
+{
+    csEventsAlert::csEventsAlertData data;
+    size_t index = 0;
+    int64_t stamp;
+    uint32_t groups, gid;
+
+    csEventsDb_log_get(payload, index, (void *)hash, SHA_DIGEST_LENGTH);
+    csEventsDb_log_get(payload, index, (void *)&data.id, sizeof(int64_t));
+    csEventsDb_log_get(payload, index, (void *)&stamp, sizeof(int64_t));
+    data.created = (time_t)stamp;
+    csEventsDb_log_get(payload, index, (void *)&stamp, sizeof(int64_t));
+    data.updated = (time_t)stamp;
+    csEventsDb_log_get(payload, index, (void *)&data.flags, sizeof(uint32_t));
+    csEventsDb_log_get(payload, index, (void *)&data.type, sizeof(uint32_t));
+    csEventsDb_log_get(payload, index, (void *)&data.user, sizeof(uint32_t));
+
+    csEventsDb_log_get(payload, index, (void *)&groups, sizeof(uint32_t));
+    for (uint32_t i = 0; i < groups; i++) {
+        csEventsDb_log_get(payload, index, (void *)&gid, sizeof(uint32_t));
+        data.groups.push_back((gid_t)gid);
+    }
+
+    csEventsDb_log_get(payload, index, data.origin);
+    csEventsDb_log_get(payload, index, data.basename);
+    csEventsDb_log_get(payload, index, data.uuid);
+    csEventsDb_log_get(payload, index, data.desc);
+
+    alert.Reset();
+    alert.SetData(data);
+}
+
+void csEventsDb_log::SetOwnership(const string &path)
+{
+    uid_t uid = ::csGetUserId(_EVENTS_DB_SQLITE_USER);
+    gid_t gid = ::csGetGroupId(_EVENTS_DB_SQLITE_GROUP);
+    if (chown(path.c_str(), uid, gid) < 0) {
+        csLog::Log(csLog::Debug, "%s: chown(%s): %s",
+            __PRETTY_FUNCTION__, path.c_str(), strerror(errno));
+    }
+}
+
+void csEventsDb_log::ResetIndex(uint32_t capacity)
+{
+    csLogIndexHeader previous;
+    uint32_t generation = 0;
+
+    // Keep counting from the old generation so a reader that sampled it
+    // can't mistake the new index for the one it started copying.
+    if (!read_only && pread(fd_index, &previous, sizeof(csLogIndexHeader), 0) ==
+        (ssize_t)sizeof(csLogIndexHeader) &&
+        previous.magic == _EVENTS_DB_LOG_INDEX_MAGIC)
+        generation = previous.generation;
+
+    UnmapIndex();
+    id_slots.clear();
+
+    if (!read_only && ftruncate(fd_index, 0) < 0)
+        throw csEventsDbException(errno, strerror(errno));
+
+    MapIndex(capacity);
+    memset((void *)index, 0, index_length);
+
+    index->magic = _EVENTS_DB_LOG_INDEX_MAGIC;
+    index->version = _EVENTS_DB_LOG_INDEX_VERSION;
+    index->capacity = capacity;
+    index->generation = generation | 1;
+    index->next_id = 1;
+    index->active_segment = 1;
+}
+
+void csEventsDb_log::MapIndex(uint32_t capacity)
+{
+    index_length = sizeof(csLogIndexHeader) + capacity * sizeof(csLogIndexSlot);
+
+    void *addr;
+
+    if (!read_only) {
+        if (ftruncate(fd_index, index_length) < 0)
+            throw csEventsDbException(errno, strerror(errno));
+        addr = mmap(NULL, index_length,
+            PROT_READ | PROT_WRITE, MAP_SHARED, fd_index, 0);
+    }
+    else {
+        // A read-only view works on its own copy (see CopyIndex()); the
+        // writer keeps changing the file underneath.
+        addr = mmap(NULL, index_length,
+            PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+
+    if (addr == MAP_FAILED) {
+        index_length = 0;
+        throw csEventsDbException(errno, strerror(errno));
+    }
+
+    index = (csLogIndexHeader *)addr;
+    slots = (csLogIndexSlot *)((uint8_t *)addr + sizeof(csLogIndexHeader));
+}
+
+bool csEventsDb_log::CopyIndex(void)
+{
+    csLogIndexHeader header;
+
+    if (pread(fd_index, &header, sizeof(csLogIndexHeader), 0) !=
+        (ssize_t)sizeof(csLogIndexHeader) || (header.generation & 1))
+        return false;
+
+    MapIndex(header.capacity);
+
+    // Only a copy taken between two updates is consistent
+    uint32_t generation = 0;
+    if (pread(fd_index, (void *)index, index_length, 0) != (ssize_t)index_length ||
+        pread(fd_index, &generation, sizeof(uint32_t),
+            offsetof(csLogIndexHeader, generation)) != (ssize_t)sizeof(uint32_t) ||
+        index->generation != header.generation ||
+        index->capacity != header.capacity ||
+        generation != header.generation) {
+        UnmapIndex();
+        return false;
+    }
+
+    return true;
+}
+
+void csEventsDb_log::BeginUpdate(void)
+{
+    if (update_depth++ > 0 || read_only || index == NULL) return;
+
+    index->generation++;
+    __sync_synchronize();
+}
+
+void csEventsDb_log::EndUpdate(void)
+{
+    if (--update_depth > 0 || read_only || index == NULL) return;
+
+    __sync_synchronize();
+    index->generation++;
+}
+
+void csEventsDb_log::UnmapIndex(void)
+{
+    if (index == NULL) return;
+
+    munmap((void *)index, index_length);
+
+    index = NULL;
+    slots = NULL;
+    index_length = 0;
+}
+
+void csEventsDb_log::ResizeIndex(uint32_t capacity)
+{
+    vector<csLogIndexSlot> used;
+    for (uint32_t i = 0; i < index->capacity; i++) {
+        if (slots[i].state == csLIS_USED) used.push_back(slots[i]);
+    }
+
+    csLogIndexHeader header = *index;
+
+    UnmapIndex();
+    MapIndex(capacity);
+
+    memset((void *)slots, 0, capacity * sizeof(csLogIndexSlot));
+    *index = header;
+    index->capacity = capacity;
+    index->count = 0;
+    index->tombstones = 0;
+
+    id_slots.clear();
+    for (vector<csLogIndexSlot>::iterator i = used.begin(); i != used.end(); i++) {
+        csLogIndexSlot *slot = FindSlot(i->hash, true);
+        *slot = *i;
+        id_slots[slot->id] = (uint32_t)(slot - slots);
+    }
+
+    csLog::Log(csLog::Debug, "%s: index capacity: %u (%u used)",
+        __PRETTY_FUNCTION__, capacity, index->count);
+}
+
+csEventsDb_log::csLogIndexSlot *csEventsDb_log::FindSlot(const uint8_t *hash, bool insert)
+{
+    if (insert && (index->count + index->tombstones + 1) * 10 > index->capacity * 7) {
+        ResizeIndex((index->count + 1) * 10 > index->capacity * 5 ?
+            index->capacity * 2 : index->capacity);
+    }
+
+    uint32_t start;
+    memcpy(&start, hash, sizeof(uint32_t));
+    start %= index->capacity;
+
+    csLogIndexSlot *deleted = NULL;
+
+    for (uint32_t n = 0; n < index->capacity; n++) {
+        csLogIndexSlot *slot = &slots[(start + n) % index->capacity];
+
+        if (slot->state == csLIS_USED) {
+            if (memcmp(slot->hash, hash, SHA_DIGEST_LENGTH) == 0) return slot;
+            continue;
+        }
+        if (slot->state == csLIS_DELETED) {
+            if (deleted == NULL) deleted = slot;
+            continue;
+        }
+
+        if (!insert) return NULL;
+        if (deleted == NULL) deleted = slot;
+        break;
+    }
+
+    if (!insert || deleted == NULL) return NULL;
+
+    if (deleted->state == csLIS_DELETED) index->tombstones--;
+    memset((void *)deleted, 0, sizeof(csLogIndexSlot));
+    deleted->state = csLIS_USED;
+    memcpy(deleted->hash, hash, SHA_DIGEST_LENGTH);
+    index->count++;
+
+    return deleted;
+}
+
+void csEventsDb_log::RemoveSlot(csLogIndexSlot *slot)
+{
+    id_slots.erase(slot->id);
+    slot->state = csLIS_DELETED;
+    index->count--;
+    index->tombstones++;
+}
+
+void csEventsDb_log::Rebuild(void)
+{
+    csLogRecordHeader header;
+    vector<uint8_t> payload;
+    vector<uint32_t> segments;
+
+    time_blocks.clear();
+    time_block_records = 0;
+    pending_stamps.clear();
+
+    ScanSegments(segments);
+
+    for (vector<uint32_t>::iterator i = segments.begin(); i != segments.end(); i++) {
+        off_t offset = sizeof(csLogSegmentHeader);
+        while (ReadRecord((*i), (uint32_t)offset, header, payload)) {
+            try {
+                ReplayRecord((*i), (uint32_t)offset, header, payload);
+            }
+            catch (csEventsDbException &e) {
+                csLog::Log(csLog::Warning, "%s: %s:%u: %s", __PRETTY_FUNCTION__,
+                    SegmentPath(*i).c_str(), (uint32_t)offset, e.estring.c_str());
+            }
+            offset += sizeof(csLogRecordHeader) + header.length;
+        }
+
+        if (time_block_records > 0) PushTimeBlock();
+
+        index->active_segment = (*i);
+        index->active_offset = (uint32_t)offset;
+
+        // Drop a torn write at the tail of the newest segment
+        if (i + 1 == segments.end() && !read_only) {
+            if (truncate(SegmentPath(*i).c_str(), offset) < 0) {
+                csLog::Log(csLog::Warning, "%s: truncate(%s): %s", __PRETTY_FUNCTION__,
+                    SegmentPath(*i).c_str(), strerror(errno));
+            }
+        }
+    }
+
+    for (map<int64_t, int64_t>::iterator i = pending_stamps.begin();
+        i != pending_stamps.end(); i++) {
+        map<int64_t, uint32_t>::iterator j = id_slots.find(i->first);
+        if (j == id_slots.end()) continue;
+        if (i->second > slots[j->second].updated) slots[j->second].updated = i->second;
+    }
+    pending_stamps.clear();
+
+    if (!read_only) SaveTimeIndex();
+
+    csLog::Log(csLog::Debug, "%s: %u alerts in %u segments", __PRETTY_FUNCTION__,
+        index->count, (uint32_t)segments.size());
+}
+
+void csEventsDb_log::ReplayRecord(uint32_t segment, uint32_t offset,
+    const csLogRecordHeader &header, const vector<uint8_t> &payload)
+{
+    int64_t id, stamp;
+    uint32_t flags;
+    size_t index = 0;
+    csLogIndexSlot *slot;
+    map<int64_t, uint32_t>::iterator i;
+
+    switch (header.type) {
+    case csLRT_ALERT:
+    {
+        csEventsAlert alert;
+        uint8_t hash[SHA_DIGEST_LENGTH];
+        DecodeAlert(payload, alert, hash);
+
+        i = id_slots.find(alert.GetId());
+        if (i != id_slots.end())
+            slot = &slots[i->second];
+        else {
+            slot = FindSlot(hash, true);
+            if (slot->id != 0) id_slots.erase(slot->id);
+            slot->id = alert.GetId();
+            slot->updated = (int64_t)alert.GetUpdated();
+            id_slots[slot->id] = (uint32_t)(slot - slots);
+        }
+
+        slot->segment = segment;
+        slot->offset = offset;
+        slot->type = alert.GetType();
+        slot->flags = alert.GetFlags();
+        slot->desc_crc = csEventsDb_log_crc32(0,
+            (const uint8_t *)alert.GetDescriptionChar(), alert.GetDescriptionLength());
+        if ((int64_t)alert.GetUpdated() > slot->updated)
+            slot->updated = (int64_t)alert.GetUpdated();
+
+        if (alert.GetId() >= this->index->next_id)
+            this->index->next_id = alert.GetId() + 1;
+        break;
+    }
+    case csLRT_STAMP:
+        csEventsDb_log_get(payload, index, (void *)&id, sizeof(int64_t));
+        csEventsDb_log_get(payload, index, (void *)&stamp, sizeof(int64_t));
+
+        // Compaction may move an alert record after its stamps
+        i = id_slots.find(id);
+        if (i == id_slots.end()) {
+            if (pending_stamps[id] < stamp) pending_stamps[id] = stamp;
+        }
+        else if (stamp > slots[i->second].updated)
+            slots[i->second].updated = stamp;
+
+        AddTimeStamp((time_t)stamp, segment, offset);
+        break;
+
+    case csLRT_FLAGS:
+        csEventsDb_log_get(payload, index, (void *)&id, sizeof(int64_t));
+        csEventsDb_log_get(payload, index, (void *)&flags, sizeof(uint32_t));
+
+        i = id_slots.find(id);
+        if (i != id_slots.end()) slots[i->second].flags = flags;
+        break;
+
+    case csLRT_DELETE:
+        csEventsDb_log_get(payload, index, (void *)&id, sizeof(int64_t));
+
+        pending_stamps.erase(id);
+        i = id_slots.find(id);
+        if (i != id_slots.end()) RemoveSlot(&slots[i->second]);
+        break;
+
+    default:
+        throw csEventsDbException(EINVAL, "Unknown log record type");
+    }
+}
+
+void csEventsDb_log::ParseFilter(const string &where, csLogFilter &filter)
+{
+    vector<string> tokens;
+    size_t i = 0;
+
+    filter.terms.clear();
+    filter.ordered = false;
+    filter.order = csLFC_NONE;
+    filter.descending = false;
+    filter.limit = 0;
+    filter.ranged = false;
+    filter.from = 0;
+    filter.to = _EVENTS_DB_LOG_STAMP_MAX;
+
+    csEventsDb_log_tokenize(where, tokens);
+
+    // Clauses must come in SQL order: conditions, ORDER BY, LIMIT
+    enum { TERMS, ORDER, LIMIT, DONE } state = TERMS;
+    bool valid = true;
+
+    while (i < tokens.size()) {
+        valid = false;
+
+        if (state == TERMS && strcasecmp(tokens[i].c_str(), "AND") == 0) {
+            csLogFilterTerm term;
+            term.mask = 0;
+            term.value = 0;
+
+            if (++i < tokens.size() && tokens[i] == "(") {
+                if (i + 4 >= tokens.size() || tokens[i + 2] != "&" ||
+                    tokens[i + 4] != ")" ||
+                    !csEventsDb_log_integer(tokens[i + 3], term.mask)) break;
+                term.column = csEventsDb_log_column(tokens[i + 1]);
+                i += 5;
+            }
+            else if (i < tokens.size())
+                term.column = csEventsDb_log_column(tokens[i++]);
+            else break;
+
+            if (term.column == csLFC_NONE || i + 1 >= tokens.size()) break;
+
+            if (tokens[i] == "=" || tokens[i] == "==") term.op = csLFO_EQ;
+            else if (tokens[i] == "!=" || tokens[i] == "<>") term.op = csLFO_NE;
+            else if (tokens[i] == "<") term.op = csLFO_LT;
+            else if (tokens[i] == "<=") term.op = csLFO_LE;
+            else if (tokens[i] == ">") term.op = csLFO_GT;
+            else if (tokens[i] == ">=") term.op = csLFO_GE;
+            else break;
+
+            const string &value = tokens[i + 1];
+            i += 2;
+
+            if (term.column == csLFC_ORIGIN || term.column == csLFC_BASENAME) {
+                if (term.mask != 0 || value[0] != '\'' ||
+                    (term.op != csLFO_EQ && term.op != csLFO_NE)) break;
+                term.text = value.substr(1);
+            }
+            else if (!csEventsDb_log_integer(value, term.value)) break;
+
+            if (term.column == csLFC_STAMP && term.mask == 0) {
+                int64_t from = filter.from, to = filter.to;
+                switch (term.op) {
+                case csLFO_EQ:
+                    from = to = term.value;
+                    break;
+                case csLFO_GT:
+                    from = term.value + 1;
+                    break;
+                case csLFO_GE:
+                    from = term.value;
+                    break;
+                case csLFO_LT:
+                    to = term.value - 1;
+                    break;
+                case csLFO_LE:
+                    to = term.value;
+                    break;
+                default:
+                    break;
+                }
+                if (term.op != csLFO_NE) {
+                    filter.ranged = true;
+                    if (from > filter.from) filter.from = from;
+                    if (to < filter.to) filter.to = to;
+                }
+            }
+
+            filter.terms.push_back(term);
+            valid = true;
+            continue;
+        }
+
+        if (state <= ORDER && strcasecmp(tokens[i].c_str(), "ORDER") == 0) {
+            if (i + 2 >= tokens.size() ||
+                strcasecmp(tokens[i + 1].c_str(), "BY") != 0) break;
+            // As with sqlite, updated names the occurrence time here
+            filter.order = csEventsDb_log_column(tokens[i + 2]);
+            if (filter.order == csLFC_UPDATED) filter.order = csLFC_STAMP;
+            if (filter.order == csLFC_NONE || filter.order == csLFC_ORIGIN ||
+                filter.order == csLFC_BASENAME) break;
+            filter.ordered = true;
+            i += 3;
+            if (i < tokens.size() && strcasecmp(tokens[i].c_str(), "DESC") == 0) {
+                filter.descending = true;
+                i++;
+            }
+            else if (i < tokens.size() && strcasecmp(tokens[i].c_str(), "ASC") == 0)
+                i++;
+            state = LIMIT;
+            valid = true;
+            continue;
+        }
+
+        if (state <= LIMIT && strcasecmp(tokens[i].c_str(), "LIMIT") == 0) {
+            int64_t limit;
+            if (i + 1 >= tokens.size() ||
+                !csEventsDb_log_integer(tokens[i + 1], limit) || limit < 0) break;
+            filter.limit = (uint32_t)limit;
+            i += 2;
+            state = DONE;
+            valid = true;
+            continue;
+        }
+
+        break;
+    }
+
+    if (!valid) {
+        throw csEventsDbException(EINVAL,
+            "Unsupported where clause for database type");
+    }
+}
+
+void csEventsDb_log::SelectRows(const csLogFilter &filter, vector<csLogRow> &rows)
+{
+    vector<csLogRow> candidates;
+
+    if (filter.ranged) {
+        if (filter.from > filter.to) return;
+        ScanTimeIndex(filter.from, filter.to, candidates);
+    }
+    else {
+        for (uint32_t i = 0; i < index->capacity; i++) {
+            if (slots[i].state != csLIS_USED) continue;
+            candidates.push_back(csLogRow(i, slots[i].updated));
+        }
+    }
+
+    // Origin and basename live in the alert record; read it only for rows
+    // that got past the indexed columns, and only once per alert
+    map<uint32_t, bool> text_matches;
+    csEventsAlert alert;
+
+    for (vector<csLogRow>::iterator i = candidates.begin(); i != candidates.end(); i++) {
+        const csLogIndexSlot &slot = slots[i->first];
+        bool match = true, text = false;
+
+        for (vector<csLogFilterTerm>::const_iterator j = filter.terms.begin();
+            j != filter.terms.end() && match; j++) {
+            int64_t value;
+
+            switch (j->column) {
+            case csLFC_ID:
+                value = slot.id;
+                break;
+            case csLFC_TYPE:
+                value = slot.type;
+                break;
+            case csLFC_FLAGS:
+                value = slot.flags;
+                break;
+            case csLFC_UPDATED:
+                value = slot.updated;
+                break;
+            case csLFC_STAMP:
+                value = i->second;
+                break;
+            default:
+                text = true;
+                continue;
+            }
+
+            if (j->mask != 0) value &= j->mask;
+            match = csEventsDb_log_compare(value, j->op, j->value);
+        }
+
+        if (match && text) {
+            map<uint32_t, bool>::iterator j = text_matches.find(i->first);
+            if (j == text_matches.end()) {
+                ReadAlert(slot.segment, slot.offset, alert);
+
+                bool text_match = true;
+                for (vector<csLogFilterTerm>::const_iterator k = filter.terms.begin();
+                    k != filter.terms.end() && text_match; k++) {
+                    if (k->column == csLFC_ORIGIN) {
+                        text_match = csEventsDb_log_compare(
+                            alert.GetOrigin(), k->op, k->text);
+                    }
+                    else if (k->column == csLFC_BASENAME) {
+                        text_match = csEventsDb_log_compare(
+                            alert.GetBasename(), k->op, k->text);
+                    }
+                }
+
+                j = text_matches.insert(
+                    pair<uint32_t, bool>(i->first, text_match)).first;
+            }
+            match = j->second;
+        }
+
+        if (match) rows.push_back(*i);
+    }
+}
+
+void csEventsDb_log::SortRows(vector<csLogRow> &rows,
+    csLogFilterColumn order, bool descending)
+{
+    stable_sort(rows.begin(), rows.end(),
+        csEventsDb_log_sort_rows(slots, order, descending));
+}
+
+void csEventsDb_log::ScanTimeIndex(int64_t from, int64_t to, vector<csLogRow> &rows)
+{
+    vector<csLogTimeBlock> blocks = time_blocks;
+    if (time_block_records > 0) blocks.push_back(time_block);
+
+    csLogRecordHeader header;
+    vector<uint8_t> payload;
+
+    for (size_t i = 0; i < blocks.size(); i++) {
+        if (blocks[i].max_stamp < from || blocks[i].min_stamp > to) continue;
+
+        uint32_t segment = blocks[i].segment;
+        off_t end = 0;
+
+        if (i + 1 < blocks.size() && blocks[i + 1].segment == segment)
+            end = (off_t)blocks[i + 1].offset;
+        else if (segment == active_segment)
+            end = active_offset;
+        else {
+            struct stat segment_stat;
+            int fd = GetSegmentDescriptor(segment);
+            if (fd < 0 || fstat(fd, &segment_stat) < 0) continue;
+            end = segment_stat.st_size;
+        }
+
+        for (off_t offset = blocks[i].offset; offset < end; ) {
+            if (!ReadRecord(segment, (uint32_t)offset, header, payload)) break;
+            offset += sizeof(csLogRecordHeader) + header.length;
+
+            if (header.type != csLRT_STAMP) continue;
+
+            int64_t id, stamp;
+            size_t index = 0;
+            csEventsDb_log_get(payload, index, (void *)&id, sizeof(int64_t));
+            csEventsDb_log_get(payload, index, (void *)&stamp, sizeof(int64_t));
+            if (stamp < from || stamp > to) continue;
+
+            map<int64_t, uint32_t>::iterator slot = id_slots.find(id);
+            if (slot == id_slots.end()) continue;
+
+            rows.push_back(csLogRow(slot->second, stamp));
+        }
+    }
+}
+
+void csEventsDb_log::AddTimeStamp(time_t stamp, uint32_t segment, uint32_t offset)
+{
+    if (time_block_records > 0 && time_block.segment != segment) PushTimeBlock();
+
+    if (time_block_records == 0) {
+        time_block.min_stamp = time_block.max_stamp = (int64_t)stamp;
+        time_block.segment = segment;
+        time_block.offset = offset;
+    }
+    else {
+        if ((int64_t)stamp < time_block.min_stamp) time_block.min_stamp = (int64_t)stamp;
+        if ((int64_t)stamp > time_block.max_stamp) time_block.max_stamp = (int64_t)stamp;
+    }
+
+    if (++time_block_records == _EVENTS_DB_LOG_TIME_STRIDE) PushTimeBlock();
+}
+
+void csEventsDb_log::PushTimeBlock(void)
+{
+    time_blocks.push_back(time_block);
+    time_block_records = 0;
+
+    // While the log is open for writing, filled blocks are appended to the
+    // time index file too, so read-only views only scan the tail.
+    if (read_only || fd_active < 0) return;
+
+    string path = db_path + "/" + _EVENTS_DB_LOG_TIME_FILE;
+    int fd = open(path.c_str(), O_WRONLY | O_APPEND | O_CREAT,
+        S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+    if (fd < 0) return;
+
+    if (write(fd, &time_block, sizeof(csLogTimeBlock)) != (ssize_t)sizeof(csLogTimeBlock)) {
+        csLog::Log(csLog::Debug, "%s: %s: %s",
+            __PRETTY_FUNCTION__, path.c_str(), strerror(errno));
+    }
+
+    close(fd);
+}
+
+void csEventsDb_log::ScanTimeTail(void)
+{
+    csLogRecordHeader header;
+    vector<uint8_t> payload;
+    vector<uint32_t> segments;
+    uint32_t segment = 0;
+    off_t offset = 0;
+
+    // The last block saved may since have filled up; redo it, and add the
+    // stamps after it up to the active position.
+    if (time_blocks.size() > 0) {
+        segment = time_blocks.back().segment;
+        offset = (off_t)time_blocks.back().offset;
+        time_blocks.pop_back();
+    }
+
+    ScanSegments(segments);
+
+    for (vector<uint32_t>::iterator i = segments.begin(); i != segments.end(); i++) {
+        if ((*i) < segment) continue;
+        if ((*i) > active_segment) break;
+
+        off_t position = ((*i) == segment) ? offset : sizeof(csLogSegmentHeader);
+
+        while (((*i) != active_segment || position < active_offset) &&
+            ReadRecord((*i), (uint32_t)position, header, payload)) {
+            uint32_t record_offset = (uint32_t)position;
+            position += sizeof(csLogRecordHeader) + header.length;
+
+            if (header.type != csLRT_STAMP) continue;
+
+            int64_t id, stamp;
+            size_t index = 0;
+            csEventsDb_log_get(payload, index, (void *)&id, sizeof(int64_t));
+            csEventsDb_log_get(payload, index, (void *)&stamp, sizeof(int64_t));
+            AddTimeStamp((time_t)stamp, (*i), record_offset);
+        }
+
+        if (time_block_records > 0 && (*i) != active_segment) PushTimeBlock();
+    }
+}
+
+void csEventsDb_log::LoadTimeIndex(void)
+{
+    time_blocks.clear();
+    time_block_records = 0;
+
+    string path = db_path + "/" + _EVENTS_DB_LOG_TIME_FILE;
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return;
+
+    csLogTimeBlock block;
+    while (read(fd, &block, sizeof(csLogTimeBlock)) == (ssize_t)sizeof(csLogTimeBlock))
+        time_blocks.push_back(block);
+
+    close(fd);
+}
+
+void csEventsDb_log::SaveTimeIndex(void)
+{
+    vector<csLogTimeBlock> blocks = time_blocks;
+    if (time_block_records > 0) blocks.push_back(time_block);
+
+    string path = db_path + "/" + _EVENTS_DB_LOG_TIME_FILE;
+    string path_tmp = path + ".tmp";
+
+    int fd = open(path_tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC,
+        S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+    if (fd < 0) throw csEventsDbException(errno, strerror(errno));
+
+    if (blocks.size() > 0 &&
+        write(fd, &blocks[0], blocks.size() * sizeof(csLogTimeBlock)) !=
+        (ssize_t)(blocks.size() * sizeof(csLogTimeBlock))) {
+        close(fd);
+        throw csEventsDbException(errno, strerror(errno));
+    }
+
+    close(fd);
+    rename(path_tmp.c_str(), path.c_str());
+}
+
+void csEventsDb_log::LoadMeta(void)
+{
+    string line;
+
+    types.clear();
+    types_next_id = 1;
+    overrides.clear();
+
+    ifstream types_file((db_path + "/" + _EVENTS_DB_LOG_TYPES_FILE).c_str());
+    while (getline(types_file, line)) {
+        istringstream is(line);
+        csLogType type;
+        if (!(is >> type.id >> type.tag >> type.basename)) continue;
+        // Optional fourth column: retention TTL (seconds)
+        if (!(is >> type.max_age)) type.max_age = 0;
+        if (type.id == 0) {
+            types_next_id = strtoul(type.tag.c_str(), NULL, 0);
+            continue;
+        }
+        types.push_back(type);
+        if (type.id >= types_next_id) types_next_id = type.id + 1;
+    }
+
+    ifstream overrides_file((db_path + "/" + _EVENTS_DB_LOG_OVERRIDES_FILE).c_str());
+    while (getline(overrides_file, line)) {
+        istringstream is(line);
+        uint32_t type, level;
+        if (!(is >> type >> level)) continue;
+        overrides[type] = level;
+    }
+}
+
+void csEventsDb_log::SaveMeta(void)
+{
+    string path = db_path + "/" + _EVENTS_DB_LOG_TYPES_FILE;
+    string path_tmp = path + ".tmp";
+
+    ofstream types_file(path_tmp.c_str());
+    // Line zero records the next type ID so IDs are never re-used
+    types_file << 0 << " " << types_next_id << " -" << endl;
+    for (vector<csLogType>::iterator i = types.begin(); i != types.end(); i++)
+        types_file << i->id << " " << i->tag << " " << i->basename <<
+            " " << i->max_age << endl;
+    types_file.close();
+    if (!types_file || rename(path_tmp.c_str(), path.c_str()) < 0)
+        throw csEventsDbException(EIO, "Error saving log types");
+
+    path = db_path + "/" + _EVENTS_DB_LOG_OVERRIDES_FILE;
+    path_tmp = path + ".tmp";
+
+    ofstream overrides_file(path_tmp.c_str());
+    for (map<uint32_t, uint32_t>::iterator i = overrides.begin();
+        i != overrides.end(); i++)
+        overrides_file << i->first << " " << i->second << endl;
+    overrides_file.close();
+    if (!overrides_file || rename(path_tmp.c_str(), path.c_str()) < 0)
+        throw csEventsDbException(EIO, "Error saving log overrides");
+}
+
+void csEventsDb_log::CheckWritable(void)
+{
+    if (index == NULL)
+        throw csEventsDbException(EBADF, "Log database not open");
+    if (read_only)
+        throw csEventsDbException(EROFS, "Log database opened read-only");
+}
+
+// vi: expandtab shiftwidth=4 softtabstop=4 tabstop=4
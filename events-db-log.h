@@ -0,0 +1,313 @@
+// ClearSync: System Monitor plugin.
+// Copyright (C) 2011 ClearFoundation <http://www.clearfoundation.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef _EVENTS_DB_LOG_H
+#define _EVENTS_DB_LOG_H
+
+#define _EVENTS_DB_LOG_SEGMENT_MAGIC    0x47455645  // "EVEG"
+#define _EVENTS_DB_LOG_RECORD_MAGIC     0x52564545  // "EEVR"
+#define _EVENTS_DB_LOG_RECORD_MAX       (16 * 1024 * 1024)
+#define _EVENTS_DB_LOG_INDEX_MAGIC      0x58495645  // "EVIX"
+#define _EVENTS_DB_LOG_INDEX_VERSION    2
+#define _EVENTS_DB_LOG_INDEX_RETRY      8
+#define _EVENTS_DB_LOG_INDEX_CAPACITY   4096
+#define _EVENTS_DB_LOG_TIME_STRIDE      64
+#define _EVENTS_DB_LOG_SEGMENT_SIZE     (8 * 1024 * 1024)
+#define _EVENTS_DB_LOG_SEGMENT_AGE      86400
+#define _EVENTS_DB_LOG_SEGMENTS_MAX     8
+#define _EVENTS_DB_LOG_STAMP_MAX        0x7fffffffffffffffLL
+
+#define _EVENTS_DB_LOG_INDEX_FILE       "index"
+#define _EVENTS_DB_LOG_TIME_FILE        "time.idx"
+#define _EVENTS_DB_LOG_TYPES_FILE       "types"
+#define _EVENTS_DB_LOG_OVERRIDES_FILE   "overrides"
+#define _EVENTS_DB_LOG_LOCK_FILE        "lock"
+
+uint32_t csEventsDb_log_crc32(uint32_t crc, const uint8_t *data, size_t length);
+
+class csEventsDb_log : public csEventsDb
+{
+public:
+    enum csLogRecordType {
+        csLRT_NULL,
+        csLRT_ALERT,
+        csLRT_STAMP,
+        csLRT_FLAGS,
+        csLRT_DELETE,
+    };
+
+    typedef struct __attribute__ ((__packed__)) {
+        uint32_t magic;
+        uint32_t segment;
+        int64_t created;
+    } csLogSegmentHeader;
+
+    typedef struct __attribute__ ((__packed__)) {
+        uint32_t magic;
+        uint32_t crc;
+        uint32_t length;
+        uint8_t type;
+    } csLogRecordHeader;
+
+    typedef struct __attribute__ ((__packed__)) {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t capacity;
+        uint32_t count;
+        uint32_t tombstones;
+        uint32_t clean;
+        // Odd while the writer is changing the index, even once it again
+        // matches the log up to the active position; read-only openers copy
+        // a live index only when this is even and unchanged by the copy.
+        uint32_t generation;
+        int64_t next_id;
+        uint32_t active_segment;
+        uint32_t active_offset;
+    } csLogIndexHeader;
+
+    enum csLogIndexSlotState {
+        csLIS_EMPTY,
+        csLIS_USED,
+        csLIS_DELETED,
+    };
+
+    typedef struct __attribute__ ((__packed__)) {
+        uint8_t state;
+        uint8_t hash[SHA_DIGEST_LENGTH];
+        uint32_t segment;
+        uint32_t offset;
+        uint32_t type;
+        uint32_t flags;
+        uint32_t desc_crc;
+        int64_t id;
+        int64_t updated;
+    } csLogIndexSlot;
+
+    typedef struct __attribute__ ((__packed__)) {
+        int64_t min_stamp;
+        int64_t max_stamp;
+        uint32_t segment;
+        uint32_t offset;
+    } csLogTimeBlock;
+
+    // Where clauses are not SQL here; a small subset is understood:
+    //   AND <column> <op> <value>
+    //   AND (<column> & <mask>) <op> <value>
+    //   ORDER BY <column> [ASC|DESC]
+    //   LIMIT <count>
+    // Columns: id, type, flags, updated (the latest occurrence), stamp
+    // (each occurrence), origin and basename, optionally prefixed with
+    // alerts. or stamps.  Operators: =, !=, <>, <, <=, >, >=; origin and
+    // basename only compare equal or not equal to a quoted string.
+    // Anything else is rejected.
+    enum csLogFilterColumn {
+        csLFC_NONE,
+        csLFC_ID,
+        csLFC_TYPE,
+        csLFC_FLAGS,
+        csLFC_UPDATED,
+        csLFC_STAMP,
+        csLFC_ORIGIN,
+        csLFC_BASENAME,
+    };
+
+    enum csLogFilterOp {
+        csLFO_EQ,
+        csLFO_NE,
+        csLFO_LT,
+        csLFO_LE,
+        csLFO_GT,
+        csLFO_GE,
+    };
+
+    typedef struct {
+        csLogFilterColumn column;
+        csLogFilterOp op;
+        int64_t mask;
+        int64_t value;
+        string text;
+    } csLogFilterTerm;
+
+    typedef struct {
+        vector<csLogFilterTerm> terms;
+        bool ordered;
+        csLogFilterColumn order;
+        bool descending;
+        uint32_t limit;
+        // A bound on the occurrence time is served from the time index, one
+        // row per occurrence as with sqlite; without one, only the latest
+        // occurrence of each alert is returned.
+        bool ranged;
+        int64_t from;
+        int64_t to;
+    } csLogFilter;
+
+    // Slot index and update time
+    typedef pair<uint32_t, int64_t> csLogRow;
+
+    csEventsDb_log(const string &db_path,
+        off_t segment_size = _EVENTS_DB_LOG_SEGMENT_SIZE,
+        time_t segment_age = _EVENTS_DB_LOG_SEGMENT_AGE,
+        uint32_t segments_max = _EVENTS_DB_LOG_SEGMENTS_MAX);
+    virtual ~csEventsDb_log() { Close(); };
+
+    void Open(void);
+    void Close(void);
+    void Create(void);
+    void Drop(void);
+    virtual int64_t GetLastId(const string &table);
+
+    bool IsUnavailable(const csEventsDbException &e);
+
+    uint32_t SelectAlert(const string &where, vector<csEventsAlert *> *result);
+    uint32_t SearchAlerts(const string &query, uint32_t limit,
+        vector<csEventsAlert *> *result);
+    uint32_t SelectAlertsByGroup(gid_t gid, uint32_t limit,
+        vector<csEventsAlert *> *result);
+    void InsertAlert(csEventsAlert &alert);
+    void PurgeAlerts(const csEventsAlert &alert, time_t age);
+    uint32_t PurgeAlerts(uint32_t type, time_t age, uint32_t limit);
+
+    uint32_t MarkAsResolved(uint32_t type);
+    uint32_t MarkAsResolvedById(int64_t id);
+    uint32_t MarkAsResolvedByUUID(const string &uuid, uint32_t type = 0);
+    uint32_t MarkAsResolvedByHash(const string &hash);
+
+    uint32_t SelectSummary(csEventsSummaryVector *result);
+    uint32_t SelectAggregate(csAggregateKey key, uint32_t bucket,
+        const string &where, uint32_t limit, csEventsAggregateVector *result);
+
+    void InsertType(const string &tag, const string &basename, time_t max_age = 0);
+    void DeleteType(const string &tag);
+    uint32_t SelectTypes(map<uint32_t, string> *result);
+    uint32_t SelectTypeRetention(map<uint32_t, time_t> *result);
+    void SetRetention(const map<uint32_t, time_t> &retention);
+
+    uint32_t SelectOverride(uint32_t type);
+    uint32_t SelectOverrides(map<uint32_t, uint32_t> *result);
+    void InsertOverride(uint32_t type, uint32_t level);
+    void UpdateOverride(uint32_t type, uint32_t level);
+    void DeleteOverride(uint32_t type);
+
+    void Compact(void);
+
+protected:
+    typedef struct {
+        uint32_t id;
+        string tag;
+        string basename;
+        time_t max_age;
+    } csLogType;
+
+    string SegmentPath(uint32_t segment);
+    void ScanSegments(vector<uint32_t> &segments);
+    int GetSegmentDescriptor(uint32_t segment);
+    void OpenActiveSegment(uint32_t segment);
+    void RollSegment(void);
+
+    void Append(csLogRecordType type, const uint8_t *payload, uint32_t length,
+        uint32_t &segment, uint32_t &offset);
+    bool ReadRecord(uint32_t segment, uint32_t offset,
+        csLogRecordHeader &header, vector<uint8_t> &payload);
+    void ReadAlert(uint32_t segment, uint32_t offset, csEventsAlert &alert);
+
+    void EncodeAlert(const csEventsAlert &alert,
+        const uint8_t *hash, vector<uint8_t> &payload);
+    void DecodeAlert(const vector<uint8_t> &payload,
+        csEventsAlert &alert, uint8_t *hash);
+
+    void SetOwnership(const string &path);
+
+    void ResetIndex(uint32_t capacity);
+    void MapIndex(uint32_t capacity);
+    void UnmapIndex(void);
+    void ResizeIndex(uint32_t capacity);
+    bool CopyIndex(void);
+    void BeginUpdate(void);
+    void EndUpdate(void);
+    csLogIndexSlot *FindSlot(const uint8_t *hash, bool insert);
+    void RemoveSlot(csLogIndexSlot *slot);
+    bool ResolveSlot(csLogIndexSlot *slot);
+    void Rebuild(void);
+    void ReplayRecord(uint32_t segment, uint32_t offset,
+        const csLogRecordHeader &header, const vector<uint8_t> &payload);
+
+    void ParseFilter(const string &where, csLogFilter &filter);
+    void SelectRows(const csLogFilter &filter, vector<csLogRow> &rows);
+    void SortRows(vector<csLogRow> &rows,
+        csLogFilterColumn order, bool descending);
+    void ScanTimeIndex(int64_t from, int64_t to, vector<csLogRow> &rows);
+
+    void AddTimeStamp(time_t stamp, uint32_t segment, uint32_t offset);
+    void PushTimeBlock(void);
+    void ScanTimeTail(void);
+    void LoadTimeIndex(void);
+    void SaveTimeIndex(void);
+
+    void LoadMeta(void);
+    void SaveMeta(void);
+
+    void CheckWritable(void);
+
+    string db_path;
+    off_t segment_size;
+    time_t segment_age;
+    uint32_t segments_max;
+
+    bool read_only;
+    int fd_lock;
+    int fd_index;
+    int fd_active;
+    uint32_t active_segment;
+    off_t active_offset;
+    time_t active_created;
+
+    csLogIndexHeader *index;
+    csLogIndexSlot *slots;
+    size_t index_length;
+    uint32_t update_depth;
+    map<int64_t, uint32_t> id_slots;
+
+    map<uint32_t, int> segment_fds;
+
+    vector<csLogTimeBlock> time_blocks;
+    csLogTimeBlock time_block;
+    uint32_t time_block_records;
+
+    map<int64_t, int64_t> pending_stamps;
+
+    vector<csLogType> types;
+    uint32_t types_next_id;
+    map<uint32_t, uint32_t> overrides;
+    map<uint32_t, time_t> retention;
+
+    friend class csEventsDbLogUpdate;
+};
+
+// Holds the index generation odd (changing) while in scope
+class csEventsDbLogUpdate
+{
+public:
+    csEventsDbLogUpdate(csEventsDb_log *db) : db(db) { db->BeginUpdate(); }
+    ~csEventsDbLogUpdate() { db->EndUpdate(); }
+
+protected:
+    csEventsDb_log *db;
+};
+
+#endif // _EVENTS_DB_LOG_H
+
+// vi: expandtab shiftwidth=4 softtabstop=4 tabstop=4
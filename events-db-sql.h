@@ -17,6 +17,22 @@
 #ifndef _EVENTS_DB_SQL_H
 #define _EVENTS_DB_SQL_H
 
+// Transaction SQL defines
+
+// Immediate, so a database locked past the busy deadline fails at Begin()
+// rather than part-way through a batch
+#define _EVENTS_DB_SQLITE_BEGIN "\
+BEGIN IMMEDIATE \
+;"
+
+#define _EVENTS_DB_SQLITE_COMMIT "\
+COMMIT \
+;"
+
+#define _EVENTS_DB_SQLITE_ROLLBACK "\
+ROLLBACK \
+;"
+
 // Pragma SQL defines
 
 #define _EVENTS_DB_SQLITE_PRAGMA_FOREIGN_KEY "\
@@ -38,9 +54,34 @@ CREATE TABLE IF NOT EXISTS alerts( \
     origin TEXT, \
     basename TEXT, \
     uuid TEXT, \
-    desc TEXT NOT NULL \
+    desc TEXT NOT NULL, \
+    tid INTEGER, \
+    params TEXT \
 );"
 
+// Description templates; alerts reference a template by id (tid) and store
+// only their \x1f-delimited parameters (params), leaving desc empty.
+
+#define _EVENTS_DB_SQLITE_CREATE_TEMPLATES "\
+CREATE TABLE IF NOT EXISTS templates( \
+    id INTEGER PRIMARY KEY AUTOINCREMENT, \
+    text TEXT NOT NULL UNIQUE \
+);"
+
+#define _EVENTS_DB_SQLITE_SELECT_TEMPLATE_COLUMNS "\
+SELECT name \
+FROM pragma_table_info('alerts') \
+WHERE name = 'tid' \
+;"
+
+#define _EVENTS_DB_SQLITE_ALTER_ALERTS_TID "\
+ALTER TABLE alerts ADD COLUMN tid INTEGER \
+;"
+
+#define _EVENTS_DB_SQLITE_ALTER_ALERTS_PARAMS "\
+ALTER TABLE alerts ADD COLUMN params TEXT \
+;"
+
 #define _EVENTS_DB_SQLITE_CREATE_GROUPS "\
 CREATE TABLE IF NOT EXISTS groups( \
     id INTEGER NOT NULL, \
@@ -60,9 +101,37 @@ CREATE TABLE IF NOT EXISTS stamps( \
 CREATE TABLE IF NOT EXISTS types( \
     id INTEGER PRIMARY KEY AUTOINCREMENT, \
     tag TEXT NOT NULL, \
-    basename TEXT NOT NULL \
+    basename TEXT NOT NULL, \
+    max_age INTEGER NOT NULL DEFAULT 0 \
 );"
 
+#define _EVENTS_DB_SQLITE_SELECT_TYPES_MAX_AGE_COLUMN "\
+SELECT name \
+FROM pragma_table_info('types') \
+WHERE name = 'max_age' \
+;"
+
+#define _EVENTS_DB_SQLITE_ALTER_TYPES_MAX_AGE "\
+ALTER TABLE types ADD COLUMN max_age INTEGER NOT NULL DEFAULT 0 \
+;"
+
+// Per-type retention policies; a connection-local table, refreshed from
+// configuration and registered types, so purges can exclude them.
+
+#define _EVENTS_DB_SQLITE_CREATE_RETENTION "\
+CREATE TEMP TABLE IF NOT EXISTS retention( \
+    type INTEGER PRIMARY KEY, \
+    max_age INTEGER NOT NULL \
+);"
+
+#define _EVENTS_DB_SQLITE_DELETE_RETENTION "\
+DELETE FROM temp.retention \
+;"
+
+#define _EVENTS_DB_SQLITE_INSERT_RETENTION "\
+INSERT INTO temp.retention (type, max_age) \
+VALUES"
+
 #define _EVENTS_DB_SQLITE_CREATE_OVERRIDES "\
 CREATE TABLE IF NOT EXISTS overrides( \
     id INTEGER PRIMARY KEY AUTOINCREMENT, \
@@ -70,8 +139,297 @@ CREATE TABLE IF NOT EXISTS overrides( \
     level INTEGER NOT NULL \
 );"
 
+// Alert summary, maintained by triggers on the alerts table.
+// Level mask 0x7 is csAF_LVL_*, 0x200 is csAF_FLG_RESOLVED.
+
+#define _EVENTS_DB_SQLITE_CREATE_SUMMARY "\
+CREATE TABLE IF NOT EXISTS summary( \
+    type INTEGER NOT NULL, \
+    level INTEGER NOT NULL, \
+    resolved INTEGER NOT NULL, \
+    count INTEGER NOT NULL, \
+    updated INTEGER NOT NULL, \
+    PRIMARY KEY (type, level, resolved) \
+);"
+
+#define _EVENTS_DB_SQLITE_CREATE_SUMMARY_POPULATE "\
+INSERT OR IGNORE INTO summary \
+SELECT type, flags & 7, (flags & 512) != 0, COUNT(*), MAX(updated) \
+FROM alerts \
+WHERE NOT EXISTS (SELECT 1 FROM summary) \
+GROUP BY 1, 2, 3 \
+;"
+
+#define _EVENTS_DB_SQLITE_CREATE_SUMMARY_INSERT "\
+CREATE TRIGGER IF NOT EXISTS summary_insert AFTER INSERT ON alerts \
+BEGIN \
+    INSERT OR IGNORE INTO summary \
+        VALUES (new.type, new.flags & 7, (new.flags & 512) != 0, 0, 0); \
+    UPDATE summary SET count = count + 1, updated = MAX(updated, new.updated) \
+        WHERE type = new.type AND level = new.flags & 7 \
+        AND resolved = ((new.flags & 512) != 0); \
+END;"
+
+#define _EVENTS_DB_SQLITE_CREATE_SUMMARY_UPDATE "\
+CREATE TRIGGER IF NOT EXISTS summary_update \
+AFTER UPDATE OF type, flags, updated ON alerts \
+BEGIN \
+    UPDATE summary SET count = count - 1 \
+        WHERE type = old.type AND level = old.flags & 7 \
+        AND resolved = ((old.flags & 512) != 0); \
+    DELETE FROM summary \
+        WHERE type = old.type AND level = old.flags & 7 \
+        AND resolved = ((old.flags & 512) != 0) AND count <= 0; \
+    INSERT OR IGNORE INTO summary \
+        VALUES (new.type, new.flags & 7, (new.flags & 512) != 0, 0, 0); \
+    UPDATE summary SET count = count + 1, updated = MAX(updated, new.updated) \
+        WHERE type = new.type AND level = new.flags & 7 \
+        AND resolved = ((new.flags & 512) != 0); \
+END;"
+
+#define _EVENTS_DB_SQLITE_CREATE_SUMMARY_DELETE "\
+CREATE TRIGGER IF NOT EXISTS summary_delete AFTER DELETE ON alerts \
+BEGIN \
+    UPDATE summary SET count = count - 1 \
+        WHERE type = old.type AND level = old.flags & 7 \
+        AND resolved = ((old.flags & 512) != 0); \
+    DELETE FROM summary \
+        WHERE type = old.type AND level = old.flags & 7 \
+        AND resolved = ((old.flags & 512) != 0) AND count <= 0; \
+END;"
+
+// Row counters for size limits, maintained by triggers (avoids COUNT(*) scans)
+
+#define _EVENTS_DB_SQLITE_CREATE_COUNTERS "\
+CREATE TABLE IF NOT EXISTS counters( \
+    name TEXT PRIMARY KEY, \
+    value INTEGER NOT NULL \
+);"
+
+#define _EVENTS_DB_SQLITE_CREATE_COUNTERS_POPULATE "\
+INSERT OR IGNORE INTO counters \
+SELECT 'alerts', COUNT(*) FROM alerts \
+WHERE NOT EXISTS (SELECT 1 FROM counters WHERE name = 'alerts'); \
+"
+
+#define _EVENTS_DB_SQLITE_CREATE_COUNTERS_TRIGGERS "\
+CREATE TRIGGER IF NOT EXISTS counters_alerts_insert AFTER INSERT ON alerts \
+BEGIN \
+    UPDATE counters SET value = value + 1 WHERE name = 'alerts'; \
+END; \
+CREATE TRIGGER IF NOT EXISTS counters_alerts_delete AFTER DELETE ON alerts \
+BEGIN \
+    UPDATE counters SET value = value - 1 WHERE name = 'alerts'; \
+END; \
+"
+
+// Change sequence; one row per alert, re-numbered by triggers on every
+// insert or update.  Deleted alerts leave a tombstone until pruned, and
+// the highest pruned sequence is kept as the 'changes_horizon' counter.
+
+#define _EVENTS_DB_SQLITE_CREATE_CHANGES "\
+CREATE TABLE IF NOT EXISTS changes( \
+    seq INTEGER PRIMARY KEY AUTOINCREMENT, \
+    aid INTEGER NOT NULL UNIQUE, \
+    deleted INTEGER NOT NULL DEFAULT 0 \
+);"
+
+#define _EVENTS_DB_SQLITE_CREATE_CHANGES_POPULATE "\
+INSERT INTO changes (aid) \
+SELECT id FROM alerts \
+WHERE NOT EXISTS (SELECT 1 FROM changes) \
+ORDER BY id; \
+INSERT OR IGNORE INTO counters VALUES ('changes_horizon', 0); \
+"
+
+#define _EVENTS_DB_SQLITE_CREATE_CHANGES_TRIGGERS "\
+CREATE TRIGGER IF NOT EXISTS changes_alerts_insert AFTER INSERT ON alerts \
+BEGIN \
+    INSERT OR REPLACE INTO changes (aid, deleted) VALUES (new.id, 0); \
+END; \
+CREATE TRIGGER IF NOT EXISTS changes_alerts_update AFTER UPDATE ON alerts \
+BEGIN \
+    INSERT OR REPLACE INTO changes (aid, deleted) VALUES (new.id, 0); \
+END; \
+CREATE TRIGGER IF NOT EXISTS changes_alerts_delete AFTER DELETE ON alerts \
+BEGIN \
+    INSERT OR REPLACE INTO changes (aid, deleted) VALUES (old.id, 1); \
+END; \
+"
+
+#define _EVENTS_DB_SQLITE_CREATE_INDEX_CHANGES_TOMBSTONES "\
+CREATE INDEX IF NOT EXISTS changes_tombstones ON changes(seq) WHERE deleted = 1 \
+;"
+
+#define _EVENTS_DB_SQLITE_SELECT_TOMBSTONE_HORIZON "\
+SELECT seq \
+FROM changes \
+WHERE deleted = 1 \
+ORDER BY seq DESC \
+LIMIT 1 OFFSET @keep \
+;"
+
+#define _EVENTS_DB_SQLITE_UPDATE_CHANGES_HORIZON "\
+UPDATE counters \
+SET value = @seq \
+WHERE name = 'changes_horizon' \
+;"
+
+#define _EVENTS_DB_SQLITE_PURGE_TOMBSTONES "\
+DELETE FROM changes \
+WHERE deleted = 1 AND seq <= @seq \
+;"
+
+#define _EVENTS_DB_SQLITE_SELECT_CHANGES_HORIZON "\
+SELECT value \
+FROM counters \
+WHERE name = 'changes_horizon' \
+;"
+
+// Indexes used by eviction
+
+#define _EVENTS_DB_SQLITE_CREATE_INDEX_STAMPS_AID "\
+CREATE INDEX IF NOT EXISTS stamps_aid ON stamps(aid, id) \
+;"
+
+#define _EVENTS_DB_SQLITE_CREATE_INDEX_ALERTS_UPDATED "\
+CREATE INDEX IF NOT EXISTS alerts_updated ON alerts(updated) \
+;"
+
+#define _EVENTS_DB_SQLITE_CREATE_INDEX_ALERTS_TYPE_UPDATED "\
+CREATE INDEX IF NOT EXISTS alerts_type_updated ON alerts(type, updated) \
+;"
+
+#define _EVENTS_DB_SQLITE_CREATE_INDEX_ALERTS_HASH "\
+CREATE INDEX IF NOT EXISTS alerts_hash ON alerts(hash) \
+;"
+
+#define _EVENTS_DB_SQLITE_CREATE_INDEX_ALERTS_UUID "\
+CREATE INDEX IF NOT EXISTS alerts_uuid ON alerts(uuid) \
+;"
+
+// Time windows over select rows, as aggregates over recent alerts use
+
+#define _EVENTS_DB_SQLITE_CREATE_INDEX_STAMPS_STAMP "\
+CREATE INDEX IF NOT EXISTS stamps_stamp ON stamps(stamp) \
+;"
+
+// Group visibility: selects by gid, and cascaded deletes by alert id
+
+#define _EVENTS_DB_SQLITE_CREATE_INDEX_GROUPS_GID "\
+CREATE INDEX IF NOT EXISTS groups_gid ON groups(gid, id) \
+;"
+
+#define _EVENTS_DB_SQLITE_CREATE_INDEX_GROUPS_ID "\
+CREATE INDEX IF NOT EXISTS groups_id ON groups(id) \
+;"
+
+// Full-text search (FTS5); contentless index over alerts, kept in sync by triggers
+
+#define _EVENTS_DB_SQLITE_SELECT_FTS_EXISTS "\
+SELECT name \
+FROM sqlite_master \
+WHERE type = 'table' AND name = 'alerts_fts' \
+;"
+
+#define _EVENTS_DB_SQLITE_CREATE_FTS "\
+CREATE VIRTUAL TABLE IF NOT EXISTS alerts_fts USING fts5( \
+    description, \
+    origin, \
+    basename, \
+    content = '' \
+);"
+
+#define _EVENTS_DB_SQLITE_CREATE_FTS_POPULATE "\
+INSERT INTO alerts_fts ( \
+    rowid, \
+    description, \
+    origin, \
+    basename \
+) \
+SELECT alerts.id, \
+    alerts.desc || ' ' || ifnull(templates.text, '') || ' ' || ifnull(alerts.params, ''), \
+    alerts.origin, alerts.basename \
+FROM alerts LEFT JOIN templates ON templates.id = alerts.tid \
+;"
+
+#define _EVENTS_DB_SQLITE_DROP_FTS_TRIGGERS "\
+DROP TRIGGER IF EXISTS alerts_fts_insert; \
+DROP TRIGGER IF EXISTS alerts_fts_update; \
+DROP TRIGGER IF EXISTS alerts_fts_delete; \
+"
+
+#define _EVENTS_DB_SQLITE_CREATE_FTS_INSERT "\
+CREATE TRIGGER IF NOT EXISTS alerts_fts_insert AFTER INSERT ON alerts \
+BEGIN \
+    INSERT INTO alerts_fts (rowid, description, origin, basename) \
+        VALUES (new.id, \
+        new.desc || ' ' || \
+        ifnull((SELECT text FROM templates WHERE id = new.tid), '') || ' ' || \
+        ifnull(new.params, ''), \
+        new.origin, new.basename); \
+END;"
+
+#define _EVENTS_DB_SQLITE_CREATE_FTS_UPDATE "\
+CREATE TRIGGER IF NOT EXISTS alerts_fts_update \
+AFTER UPDATE OF desc, tid, params, origin, basename ON alerts \
+WHEN old.desc IS NOT new.desc OR old.tid IS NOT new.tid \
+    OR old.params IS NOT new.params OR old.origin IS NOT new.origin \
+    OR old.basename IS NOT new.basename \
+BEGIN \
+    INSERT INTO alerts_fts (alerts_fts, rowid, description, origin, basename) \
+        VALUES ('delete', old.id, \
+        old.desc || ' ' || \
+        ifnull((SELECT text FROM templates WHERE id = old.tid), '') || ' ' || \
+        ifnull(old.params, ''), \
+        old.origin, old.basename); \
+    INSERT INTO alerts_fts (rowid, description, origin, basename) \
+        VALUES (new.id, \
+        new.desc || ' ' || \
+        ifnull((SELECT text FROM templates WHERE id = new.tid), '') || ' ' || \
+        ifnull(new.params, ''), \
+        new.origin, new.basename); \
+END;"
+
+#define _EVENTS_DB_SQLITE_CREATE_FTS_DELETE "\
+CREATE TRIGGER IF NOT EXISTS alerts_fts_delete AFTER DELETE ON alerts \
+BEGIN \
+    INSERT INTO alerts_fts (alerts_fts, rowid, description, origin, basename) \
+        VALUES ('delete', old.id, \
+        old.desc || ' ' || \
+        ifnull((SELECT text FROM templates WHERE id = old.tid), '') || ' ' || \
+        ifnull(old.params, ''), \
+        old.origin, old.basename); \
+END;"
+
 // Select SQL defines
 
+// Stands in for alerts where clients supply the where clause: desc holds
+// the rendered text of template-encoded alerts (see render_desc()), and
+// stored_desc the column as stored.  The subquery is flattened, so
+// descriptions are only rendered for clauses that reference desc.
+#define _EVENTS_DB_SQLITE_ALERTS_RENDERED "\
+( \
+SELECT \
+    alerts.id AS id, \
+    alerts.hash AS hash, \
+    alerts.created AS created, \
+    alerts.updated AS updated, \
+    alerts.flags AS flags, \
+    alerts.type AS type, \
+    alerts.user AS user, \
+    alerts.origin AS origin, \
+    alerts.basename AS basename, \
+    alerts.uuid AS uuid, \
+    CASE WHEN alerts.tid IS NULL THEN alerts.desc ELSE render_desc( \
+        (SELECT text FROM templates WHERE templates.id = alerts.tid), \
+        alerts.params) END AS desc, \
+    alerts.desc AS stored_desc, \
+    alerts.tid AS tid, \
+    alerts.params AS params \
+FROM alerts \
+) AS alerts"
+
 #define _EVENTS_DB_SQLITE_SELECT_ALERT "\
 SELECT \
     alerts.id AS id, \
@@ -83,17 +441,116 @@ SELECT \
     alerts.origin AS origin, \
     alerts.basename AS basename, \
     alerts.uuid AS uuid, \
-    alerts.desc AS desc \
-FROM alerts, stamps \
+    alerts.stored_desc AS desc, \
+    alerts.params AS params, \
+    templates.text AS template \
+FROM " _EVENTS_DB_SQLITE_ALERTS_RENDERED " \
+    LEFT JOIN templates ON templates.id = alerts.tid, stamps \
 WHERE stamps.aid = alerts.id \
 "
 
+#define _EVENTS_DB_SQLITE_SEARCH_ALERTS_FTS "\
+SELECT \
+    alerts.id AS id, \
+    alerts.created AS created, \
+    alerts.updated AS updated, \
+    alerts.flags AS flags, \
+    alerts.type AS type, \
+    alerts.user AS user, \
+    alerts.origin AS origin, \
+    alerts.basename AS basename, \
+    alerts.uuid AS uuid, \
+    alerts.desc AS desc, \
+    alerts.params AS params, \
+    templates.text AS template \
+FROM alerts_fts, alerts LEFT JOIN templates ON templates.id = alerts.tid \
+WHERE alerts_fts MATCH @query AND alerts.id = alerts_fts.rowid \
+ORDER BY alerts_fts.rank, alerts.updated DESC \
+LIMIT @limit \
+;"
+
+#define _EVENTS_DB_SQLITE_SEARCH_ALERTS_LIKE "\
+SELECT \
+    alerts.id AS id, \
+    alerts.created AS created, \
+    alerts.updated AS updated, \
+    alerts.flags AS flags, \
+    alerts.type AS type, \
+    alerts.user AS user, \
+    alerts.origin AS origin, \
+    alerts.basename AS basename, \
+    alerts.uuid AS uuid, \
+    alerts.desc AS desc, \
+    alerts.params AS params, \
+    templates.text AS template \
+FROM alerts LEFT JOIN templates ON templates.id = alerts.tid \
+WHERE alerts.desc LIKE @query ESCAPE '\\' \
+    OR templates.text LIKE @query ESCAPE '\\' \
+    OR alerts.params LIKE @query ESCAPE '\\' \
+    OR alerts.origin LIKE @query ESCAPE '\\' \
+    OR alerts.basename LIKE @query ESCAPE '\\' \
+ORDER BY alerts.updated DESC \
+LIMIT @limit \
+;"
+
+#define _EVENTS_DB_SQLITE_SELECT_ALERTS_GROUP "\
+SELECT \
+    alerts.id AS id, \
+    alerts.created AS created, \
+    alerts.updated AS updated, \
+    alerts.flags AS flags, \
+    alerts.type AS type, \
+    alerts.user AS user, \
+    alerts.origin AS origin, \
+    alerts.basename AS basename, \
+    alerts.uuid AS uuid, \
+    alerts.desc AS desc, \
+    alerts.params AS params, \
+    templates.text AS template, \
+    (SELECT group_concat(gid) FROM groups AS g WHERE g.id = alerts.id) AS groups \
+FROM groups CROSS JOIN alerts LEFT JOIN templates ON templates.id = alerts.tid \
+WHERE groups.gid = @gid AND alerts.id = groups.id \
+ORDER BY groups.id DESC \
+LIMIT @limit \
+;"
+
+#define _EVENTS_DB_SQLITE_SELECT_CHANGES "\
+SELECT \
+    alerts.id AS id, \
+    alerts.created AS created, \
+    alerts.updated AS updated, \
+    alerts.flags AS flags, \
+    alerts.type AS type, \
+    alerts.user AS user, \
+    alerts.origin AS origin, \
+    alerts.basename AS basename, \
+    alerts.uuid AS uuid, \
+    alerts.desc AS desc, \
+    alerts.params AS params, \
+    templates.text AS template, \
+    (SELECT group_concat(gid) FROM groups AS g WHERE g.id = alerts.id) AS groups, \
+    changes.seq AS seq, \
+    changes.aid AS aid, \
+    changes.deleted AS deleted \
+FROM changes LEFT JOIN alerts ON alerts.id = changes.aid \
+    LEFT JOIN templates ON templates.id = alerts.tid \
+WHERE changes.seq > @seq \
+ORDER BY changes.seq \
+LIMIT @limit \
+;"
+
 #define _EVENTS_DB_SQLITE_SELECT_ALERT_BY_HASH "\
 SELECT id \
 FROM alerts \
 WHERE hash = @hash \
 ;"
 
+#define _EVENTS_DB_SQLITE_SELECT_TEMPLATE "\
+SELECT id \
+FROM templates \
+WHERE text = @text \
+;"
+
 #define _EVENTS_DB_SQLITE_SELECT_GROUP "\
 SELECT * \
 FROM groups \
@@ -117,12 +574,70 @@ SELECT id, tag \
 FROM types \
 ;"
 
+#define _EVENTS_DB_SQLITE_SELECT_TYPE_RETENTION "\
+SELECT id, max_age \
+FROM types \
+WHERE max_age > 0 \
+;"
+
 #define _EVENTS_DB_SQLITE_SELECT_OVERRIDE "\
 SELECT type, level \
 FROM overrides \
 WHERE type = @type \
 ;"
 
+#define _EVENTS_DB_SQLITE_SELECT_SUMMARY "\
+SELECT type, level, resolved, count, updated \
+FROM summary \
+ORDER BY type, level, resolved \
+;"
+
+// Aggregates: the rows select returns for the same where clause, each
+// tagged with a group key, then folded into one row per key.  The key
+// expression and where clause go between the two halves.
+
+#define _EVENTS_DB_SQLITE_SELECT_AGGREGATE "\
+SELECT \
+    key, \
+    COUNT(*) AS count, \
+    COUNT(DISTINCT id) AS alerts, \
+    MAX(updated) AS updated \
+FROM ( \
+SELECT \
+    alerts.id AS id, \
+    stamps.stamp AS updated, \
+"
+
+#define _EVENTS_DB_SQLITE_SELECT_AGGREGATE_FROM " \
+    AS key \
+FROM " _EVENTS_DB_SQLITE_ALERTS_RENDERED " \
+    LEFT JOIN templates ON templates.id = alerts.tid, stamps \
+WHERE stamps.aid = alerts.id \
+"
+
+#define _EVENTS_DB_SQLITE_SELECT_AGGREGATE_GROUP " \
+GROUP BY key \
+ORDER BY count DESC, key \
+LIMIT @limit \
+;"
+
+#define _EVENTS_DB_SQLITE_SELECT_AGGREGATE_BUCKETS " \
+GROUP BY key \
+ORDER BY key DESC \
+LIMIT @limit \
+;"
+
+#define _EVENTS_DB_SQLITE_SELECT_COUNTER_ALERTS "\
+SELECT value \
+FROM counters \
+WHERE name = 'alerts' \
+;"
+
+#define _EVENTS_DB_SQLITE_SELECT_DB_SIZE "\
+SELECT (page_count - freelist_count) * page_size AS value \
+FROM pragma_page_count, pragma_freelist_count, pragma_page_size \
+;"
+
 #define _EVENTS_DB_SQLITE_SELECT_OVERRIDES "\
 SELECT type, level \
 FROM overrides \
@@ -141,7 +656,9 @@ INSERT INTO alerts ( \
     origin, \
     basename, \
     uuid, \
-    desc \
+    desc, \
+    tid, \
+    params \
 ) \
 VALUES ( \
     @created, \
@@ -153,7 +670,17 @@ VALUES ( \
     @origin, \
     @basename, \
     @uuid, \
-    @desc \
+    @desc, \
+    @tid, \
+    @params \
+);"
+
+#define _EVENTS_DB_SQLITE_INSERT_TEMPLATE "\
+INSERT INTO templates ( \
+    text \
+) \
+VALUES ( \
+    @text \
 );"
 
 #define _EVENTS_DB_SQLITE_INSERT_STAMP "\
@@ -166,14 +693,26 @@ VALUES ( \
     @stamp \
 );"
 
+#define _EVENTS_DB_SQLITE_INSERT_GROUP "\
+INSERT INTO groups ( \
+    id, \
+    gid \
+) \
+VALUES ( \
+    @id, \
+    @gid \
+);"
+
 #define _EVENTS_DB_SQLITE_INSERT_TYPE "\
 INSERT INTO types ( \
     tag, \
-    basename \
+    basename, \
+    max_age \
 ) \
 VALUES ( \
     @tag, \
-    @basename \
+    @basename, \
+    @max_age \
 );"
 
 #define _EVENTS_DB_SQLITE_INSERT_OVERRIDE "\
@@ -190,14 +729,34 @@ VALUES ( \
 
 #define _EVENTS_DB_SQLITE_UPDATE_ALERT "\
 UPDATE alerts \
-SET updated = @stamp, flags = @flags, desc = @desc \
+SET updated = @stamp, flags = @flags, desc = @desc, \
+    tid = @tid, params = @params \
 WHERE id = @id \
 ;"
 
 #define _EVENTS_DB_SQLITE_MARK_RESOLVED "\
 UPDATE alerts \
 SET flags = flags | @csAF_FLG_RESOLVED \
-WHERE type = @type \
+WHERE type = @type AND (flags & @csAF_FLG_RESOLVED) = 0 \
+;"
+
+#define _EVENTS_DB_SQLITE_MARK_RESOLVED_ID "\
+UPDATE alerts \
+SET flags = flags | @csAF_FLG_RESOLVED \
+WHERE id = @id AND (flags & @csAF_FLG_RESOLVED) = 0 \
+;"
+
+#define _EVENTS_DB_SQLITE_MARK_RESOLVED_UUID "\
+UPDATE alerts \
+SET flags = flags | @csAF_FLG_RESOLVED \
+WHERE uuid = @uuid AND (@type = 0 OR type = @type) AND \
+    (flags & @csAF_FLG_RESOLVED) = 0 \
+;"
+
+#define _EVENTS_DB_SQLITE_MARK_RESOLVED_HASH "\
+UPDATE alerts \
+SET flags = flags | @csAF_FLG_RESOLVED \
+WHERE hash = @hash AND (flags & @csAF_FLG_RESOLVED) = 0 \
 ;"
 
 #define _EVENTS_DB_SQLITE_UPDATE_OVERRIDE "\
@@ -212,13 +771,43 @@ WHERE type = @type \
 DELETE FROM alerts \
 WHERE updated < @max_age \
 AND flags & @csAF_FLG_RESOLVED \
+AND type NOT IN (SELECT type FROM temp.retention) \
 ;"
 
+#define _EVENTS_DB_SQLITE_PURGE_ALERTS_TYPE "\
+DELETE FROM alerts \
+WHERE id IN ( \
+    SELECT id FROM alerts \
+    WHERE type = @type AND updated < @max_age \
+    AND flags & @csAF_FLG_RESOLVED \
+    LIMIT @limit \
+);"
+
 #define _EVENTS_DB_SQLITE_PURGE_STAMPS "\
 DELETE FROM stamps \
 WHERE stamp < @max_age \
 ;"
 
+#define _EVENTS_DB_SQLITE_EVICT_STAMPS "\
+DELETE FROM stamps \
+WHERE id IN ( \
+    SELECT s.id FROM stamps AS s \
+    WHERE EXISTS ( \
+        SELECT 1 FROM stamps AS n WHERE n.aid = s.aid AND n.id > s.id \
+    ) \
+    ORDER BY s.id \
+    LIMIT @limit \
+);"
+
+#define _EVENTS_DB_SQLITE_EVICT_ALERTS "\
+DELETE FROM alerts \
+WHERE id IN ( \
+    SELECT id FROM alerts \
+    WHERE flags & @mask = @flags \
+    ORDER BY updated \
+    LIMIT @limit \
+);"
+
 #define _EVENTS_DB_SQLITE_DELETE_STAMP "\
 DELETE FROM stamps \
 WHERE aid = @aid \
@@ -24,20 +24,64 @@
 
 #include <unistd.h>
 #include <string.h>
+#include <time.h>
 #include <sqlite3.h>
 #include <sys/stat.h>
 
 #include <openssl/sha.h>
 
 #include "events-alert.h"
-#include "events-conf.h"
 #include "events-db.h"
+#include "events-db-log.h"
+#include "events-spool.h"
+#include "events-conf.h"
 
 csEventsDb::csEventsDb(csDbType type)
     : type(type)
 {
 }
 
+uint32_t csEventsDb::ResolveAlerts(csResolveKey key,
+    const vector<string> &values, uint32_t type)
+{
+    uint32_t resolved = 0;
+
+    // One transaction for the lot; a failure leaves every alert unresolved
+    Begin();
+
+    try {
+        for (vector<string>::const_iterator i = values.begin();
+            i != values.end(); i++) {
+            switch (key) {
+            case csRK_TYPE:
+                resolved += MarkAsResolved(
+                    (uint32_t)strtoul((*i).c_str(), NULL, 0));
+                break;
+            case csRK_ID:
+                resolved += MarkAsResolvedById(
+                    (int64_t)strtoll((*i).c_str(), NULL, 0));
+                break;
+            case csRK_UUID:
+                resolved += MarkAsResolvedByUUID((*i), type);
+                break;
+            case csRK_HASH:
+                resolved += MarkAsResolvedByHash((*i));
+                break;
+            default:
+                throw csEventsDbException(EINVAL, "Invalid resolve key");
+            }
+        }
+
+        Commit();
+    }
+    catch (csException &e) {
+        Rollback();
+        throw;
+    }
+
+    return resolved;
+}
+
 static void *csEventsDb_sqlite_log(void *param, int i, const char *s)
 {
     return NULL;
@@ -57,6 +101,7 @@ static int csEventsDb_sqlite_select_alert(
     if (argc == 0) return 0;
 
     unsigned long long v;
+    const char *desc_params = NULL, *desc_template = NULL;
     csEventsAlert *alert = new csEventsAlert();
 
     for (int i = 0; i < argc; i++) {
@@ -97,6 +142,22 @@ static int csEventsDb_sqlite_select_alert(
         else if (!strcasecmp(colname[i], "desc")) {
             alert->SetDescription(argv[i]);
         }
+        else if (!strcasecmp(colname[i], "params")) {
+            desc_params = argv[i];
+        }
+        else if (!strcasecmp(colname[i], "template")) {
+            desc_template = argv[i];
+        }
+    }
+
+    if (desc_template != NULL) {
+        string desc;
+        vector<string> params;
+        if (desc_params != NULL)
+            csEventsAlert::TemplateDecodeParams(desc_params, params);
+        csEventsAlert::TemplateRender(desc_template, params, desc);
+        alert->SetDescription(desc);
+        alert->SetTemplate(desc_template, params);
     }
 
     vector<csEventsAlert *> *result = reinterpret_cast<vector<csEventsAlert *> *>(param);
@@ -130,6 +191,63 @@ static int csEventsDb_sqlite_select_types(
     return 0;
 }
 
+static uint64_t csEventsDb_sqlite_msec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int csEventsDb_sqlite_busy(void *param, int count)
+{
+    return reinterpret_cast<csEventsDb_sqlite *>(param)->BusyHandler(count);
+}
+
+// render_desc(template, params): an alert's description as clients see it,
+// so where clauses on desc also match template-encoded alerts
+static void csEventsDb_sqlite_render_desc(
+    sqlite3_context *context, int argc, sqlite3_value **argv)
+{
+    if (sqlite3_value_type(argv[0]) == SQLITE_NULL) {
+        sqlite3_result_null(context);
+        return;
+    }
+
+    string desc;
+    vector<string> params;
+    if (sqlite3_value_type(argv[1]) != SQLITE_NULL) {
+        csEventsAlert::TemplateDecodeParams(
+            (const char *)sqlite3_value_text(argv[1]), params);
+    }
+    csEventsAlert::TemplateRender(
+        (const char *)sqlite3_value_text(argv[0]), params, desc);
+
+    sqlite3_result_text(context, desc.c_str(), (int)desc.length(), SQLITE_TRANSIENT);
+}
+
+static int csEventsDb_sqlite_select_retention(
+    void *param, int argc, char **argv, char **colname)
+{
+    if (argc == 0) return 0;
+
+    uint32_t id = 0;
+    time_t max_age = 0;
+    map<uint32_t, time_t> *result = reinterpret_cast<map<uint32_t, time_t> *>(param);
+
+    for (int i = 0; i < argc; i++) {
+        csLog::Log(csLog::Debug, "%s = %s", colname[i], argv[i] ? argv[i] : "(null)");
+
+        if (!strcasecmp(colname[i], "id"))
+            id = (uint32_t)strtoul(argv[i], NULL, 0);
+        else if (!strcasecmp(colname[i], "max_age"))
+            max_age = (time_t)strtoll(argv[i], NULL, 0);
+    }
+
+    if (id != 0 && max_age > 0) (*result)[id] = max_age;
+
+    return 0;
+}
+
 static int csEventsDb_sqlite_select_overrides(
     void *param, int argc, char **argv, char **colname)
 {
@@ -152,15 +270,155 @@ static int csEventsDb_sqlite_select_overrides(
     return 0;
 }
 
-csEventsDb_sqlite::csEventsDb_sqlite(const string &db_filename)
+static int csEventsDb_sqlite_select_summary(
+    void *param, int argc, char **argv, char **colname)
+{
+    if (argc == 0) return 0;
+
+    csEventsSummary summary;
+    memset(&summary, 0, sizeof(csEventsSummary));
+    csEventsSummaryVector *result = reinterpret_cast<csEventsSummaryVector *>(param);
+
+    for (int i = 0; i < argc; i++) {
+        csLog::Log(csLog::Debug, "%s = %s", colname[i], argv[i] ? argv[i] : "(null)");
+        if (argv[i] == NULL) continue;
+
+        if (!strcasecmp(colname[i], "type"))
+            summary.type = (uint32_t)strtoul(argv[i], NULL, 0);
+        else if (!strcasecmp(colname[i], "level"))
+            summary.level = (uint32_t)strtoul(argv[i], NULL, 0);
+        else if (!strcasecmp(colname[i], "resolved"))
+            summary.resolved = (atoi(argv[i]) != 0);
+        else if (!strcasecmp(colname[i], "count"))
+            summary.count = (uint32_t)strtoul(argv[i], NULL, 0);
+        else if (!strcasecmp(colname[i], "updated"))
+            summary.updated = (time_t)strtoull(argv[i], NULL, 0);
+    }
+
+    result->push_back(summary);
+
+    return 0;
+}
+
+static int csEventsDb_sqlite_value(
+    void *param, int argc, char **argv, char **colname)
+{
+    if (argc == 0 || argv[0] == NULL) return 0;
+
+    *reinterpret_cast<int64_t *>(param) = (int64_t)strtoll(argv[0], NULL, 0);
+    return 0;
+}
+
+static int csEventsDb_sqlite_count(
+    void *param, int argc, char **argv, char **colname)
+{
+    (*reinterpret_cast<uint32_t *>(param))++;
+    return 0;
+}
+
+void csEventsDbStatement::Prepare(const char *query)
+{
+    Finalize();
+
+    int rc = sqlite3_prepare_v2(db->handle, query, strlen(query) + 1, &stmt, NULL);
+    if (rc != SQLITE_OK) {
+        csLog::Log(csLog::Debug, "%s: sqlite3_prepare(%s): %s",
+            __PRETTY_FUNCTION__, name, sqlite3_errstr(rc));
+        throw csEventsDbException(rc, sqlite3_errstr(rc));
+    }
+
+    stats = &db->step_stats[name];
+}
+
+void csEventsDbStatement::Finalize(void)
+{
+    if (stmt != NULL) {
+        sqlite3_finalize(stmt);
+        stmt = NULL;
+    }
+}
+
+int csEventsDbStatement::GetIndex(const char *param)
+{
+    int index = (stmt != NULL) ? sqlite3_bind_parameter_index(stmt, param) : 0;
+    if (index > 0) return index;
+
+    csLog::Log(csLog::Debug, "%s: %s: SQL parameter missing: %s",
+        __PRETTY_FUNCTION__, name, param);
+    throw csEventsDbException(EINVAL, "SQL parameter missing");
+}
+
+void csEventsDbStatement::Bind(int index, int64_t value)
+{
+    int rc = sqlite3_bind_int64(stmt, index, static_cast<sqlite3_int64>(value));
+    if (rc != SQLITE_OK) {
+        csLog::Log(csLog::Debug, "%s: sqlite3_bind(%s, %d): %s",
+            __PRETTY_FUNCTION__, name, index, sqlite3_errstr(rc));
+        throw csEventsDbException(rc, sqlite3_errstr(rc));
+    }
+}
+
+void csEventsDbStatement::Bind(int index, const char *value, size_t length)
+{
+    int rc = sqlite3_bind_text(stmt, index, value, (int)length, SQLITE_STATIC);
+    if (rc != SQLITE_OK) {
+        csLog::Log(csLog::Debug, "%s: sqlite3_bind(%s, %d): %s",
+            __PRETTY_FUNCTION__, name, index, sqlite3_errstr(rc));
+        throw csEventsDbException(rc, sqlite3_errstr(rc));
+    }
+}
+
+void csEventsDbStatement::BindNull(int index)
+{
+    int rc = sqlite3_bind_null(stmt, index);
+    if (rc != SQLITE_OK) {
+        csLog::Log(csLog::Debug, "%s: sqlite3_bind(%s, %d): %s",
+            __PRETTY_FUNCTION__, name, index, sqlite3_errstr(rc));
+        throw csEventsDbException(rc, sqlite3_errstr(rc));
+    }
+}
+
+int csEventsDbStatement::Step(void)
+{
+    return db->Step(stmt, name, stats);
+}
+
+void csEventsDbStatement::Reset(void)
+{
+    if (stmt == NULL) return;
+
+    // Bound text isn't copied, so don't leave it referenced past here
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+}
+
+csEventsDb_sqlite::csEventsDb_sqlite(const string &db_filename,
+    bool fts, bool templates)
     : csEventsDb(csDBT_SQLITE), handle(NULL),
-    insert_alert(NULL), update_alert(NULL), purge_alerts(NULL),
-    insert_stamp(NULL), delete_stamp(NULL), purge_stamps(NULL),
-    last_id(NULL), mark_resolved(NULL), select_by_hash(NULL),
-    insert_type(NULL), delete_type(NULL), select_type(NULL),
-    select_override(NULL), insert_override(NULL),
-    update_override(NULL), delete_override(NULL),
-    db_filename(db_filename)
+    transaction(false), busy_deadline(_EVENTS_DB_BUSY_DEADLINE),
+    busy_start(0), busy_stats(NULL),
+    insert_alert(this, "insert_alert"), update_alert(this, "update_alert"),
+    purge_alerts(this, "purge_alerts"), purge_alerts_type(this, "purge_alerts_type"),
+    insert_stamp(this, "insert_stamp"), delete_stamp(this, "delete_stamp"),
+    insert_group(this, "insert_group"),
+    purge_stamps(this, "purge_stamps"), last_id(this, "last_id"),
+    mark_resolved(this, "mark_resolved"), mark_resolved_id(this, "mark_resolved_id"),
+    mark_resolved_uuid(this, "mark_resolved_uuid"),
+    mark_resolved_hash(this, "mark_resolved_hash"),
+    select_by_hash(this, "select_by_hash"),
+    insert_type(this, "insert_type"), delete_type(this, "delete_type"),
+    select_type(this, "select_type"), select_override(this, "select_override"),
+    insert_override(this, "insert_override"), update_override(this, "update_override"),
+    delete_override(this, "delete_override"), search_alerts(this, "search_alerts"),
+    select_group(this, "select_group"),
+    select_template(this, "select_template"), insert_template(this, "insert_template"),
+    evict_stamps(this, "evict_stamps"), evict_alerts(this, "evict_alerts"),
+    select_changes(this, "select_changes"),
+    tombstone_horizon(this, "tombstone_horizon"),
+    update_horizon(this, "update_horizon"),
+    purge_tombstones(this, "purge_tombstones"),
+    db_filename(db_filename), fts(fts), templates(templates),
+    backup_handle(NULL), backup(NULL)
 {
     csLog::Log(csLog::Debug, "SQLite version: %s", sqlite3_libversion());
 
@@ -175,6 +433,14 @@ void csEventsDb_sqlite::Open(void)
     if ((rc = sqlite3_open(db_filename.c_str(), &handle)))
         throw csEventsDbException(rc, sqlite3_errstr(rc));
 
+    // Lock waits back off in BusyHandler() until busy_deadline
+    sqlite3_busy_handler(handle, csEventsDb_sqlite_busy, (void *)this);
+
+    if ((rc = sqlite3_create_function(handle, "render_desc", 2,
+        SQLITE_UTF8 | SQLITE_DETERMINISTIC, NULL,
+        csEventsDb_sqlite_render_desc, NULL, NULL)) != SQLITE_OK)
+        throw csEventsDbException(rc, sqlite3_errmsg(handle));
+
     // Enable foreign keys
     sql.str("");
     sql << _EVENTS_DB_SQLITE_PRAGMA_FOREIGN_KEY;
@@ -198,50 +464,40 @@ void csEventsDb_sqlite::Open(void)
 
 void csEventsDb_sqlite::Close(void)
 {
-    if (handle != NULL)
+    csEventsDbStatement *stmt[] = {
+        &insert_alert, &update_alert, &purge_alerts, &purge_alerts_type,
+        &insert_stamp, &delete_stamp, &insert_group, &purge_stamps, &last_id,
+        &mark_resolved, &mark_resolved_id, &mark_resolved_uuid,
+        &mark_resolved_hash, &select_by_hash, &insert_type, &delete_type,
+        &select_type, &select_override, &insert_override, &update_override,
+        &delete_override, &search_alerts, &select_group,
+        &select_template, &insert_template,
+        &evict_stamps, &evict_alerts, &select_changes, &tombstone_horizon,
+        &update_horizon, &purge_tombstones, NULL
+    };
+
+    BackupEnd();
+
+    // Statements must be finalized before the handle will close
+    for (int i = 0; stmt[i] != NULL; i++) stmt[i]->Finalize();
+
+    if (handle != NULL) {
         sqlite3_close(handle);
-    if (insert_alert != NULL)
-        sqlite3_finalize(insert_alert);
-    if (update_alert != NULL)
-        sqlite3_finalize(update_alert);
-    if (purge_alerts != NULL)
-        sqlite3_finalize(purge_alerts);
-    if (insert_stamp != NULL)
-        sqlite3_finalize(insert_stamp);
-    if (delete_stamp != NULL)
-        sqlite3_finalize(delete_stamp);
-    if (purge_stamps != NULL)
-        sqlite3_finalize(purge_stamps);
-    if (last_id != NULL)
-        sqlite3_finalize(last_id);
-    if (mark_resolved != NULL)
-        sqlite3_finalize(mark_resolved);
-    if (select_by_hash != NULL)
-        sqlite3_finalize(select_by_hash);
-    if (insert_type != NULL)
-        sqlite3_finalize(insert_type);
-    if (delete_type != NULL)
-        sqlite3_finalize(delete_type);
-    if (select_type != NULL)
-        sqlite3_finalize(select_type);
-    if (select_override != NULL)
-        sqlite3_finalize(select_override);
-    if (insert_override != NULL)
-        sqlite3_finalize(insert_override);
-    if (update_override != NULL)
-        sqlite3_finalize(update_override);
-    if (delete_override != NULL)
-        sqlite3_finalize(delete_override);
+        handle = NULL;
+    }
+
+    transaction = false;
+    template_ids.clear();
 }
 
 void csEventsDb_sqlite::Create(void)
 {
-    int rc;
-
     // Create alerts
     sql.str("");
     sql << _EVENTS_DB_SQLITE_CREATE_ALERTS;
     Exec(csEventsDb_sqlite_exec);
+    // Create description templates
+    CreateTemplates();
     // Create stamps
     sql.str("");
     sql << _EVENTS_DB_SQLITE_CREATE_STAMPS;
@@ -254,181 +510,268 @@ void csEventsDb_sqlite::Create(void)
     sql.str("");
     sql << _EVENTS_DB_SQLITE_CREATE_TYPES;
     Exec(csEventsDb_sqlite_exec);
+    // Create retention policies
+    CreateRetention();
     // Create level overrides
     sql.str("");
     sql << _EVENTS_DB_SQLITE_CREATE_OVERRIDES;
     Exec(csEventsDb_sqlite_exec);
+    // Create alert summary
+    sql.str("");
+    sql << _EVENTS_DB_SQLITE_CREATE_SUMMARY;
+    Exec(csEventsDb_sqlite_exec);
+    sql.str("");
+    sql << _EVENTS_DB_SQLITE_CREATE_SUMMARY_POPULATE;
+    Exec(csEventsDb_sqlite_exec);
+    sql.str("");
+    sql << _EVENTS_DB_SQLITE_CREATE_SUMMARY_INSERT;
+    Exec(csEventsDb_sqlite_exec);
+    sql.str("");
+    sql << _EVENTS_DB_SQLITE_CREATE_SUMMARY_UPDATE;
+    Exec(csEventsDb_sqlite_exec);
+    sql.str("");
+    sql << _EVENTS_DB_SQLITE_CREATE_SUMMARY_DELETE;
+    Exec(csEventsDb_sqlite_exec);
+    // Create row counters
+    sql.str("");
+    sql << _EVENTS_DB_SQLITE_CREATE_COUNTERS;
+    Exec(csEventsDb_sqlite_exec);
+    sql.str("");
+    sql << _EVENTS_DB_SQLITE_CREATE_COUNTERS_POPULATE;
+    Exec(csEventsDb_sqlite_exec);
+    sql.str("");
+    sql << _EVENTS_DB_SQLITE_CREATE_COUNTERS_TRIGGERS;
+    Exec(csEventsDb_sqlite_exec);
+    // Create change sequence
+    sql.str("");
+    sql << _EVENTS_DB_SQLITE_CREATE_CHANGES;
+    Exec(csEventsDb_sqlite_exec);
+    sql.str("");
+    sql << _EVENTS_DB_SQLITE_CREATE_CHANGES_POPULATE;
+    Exec(csEventsDb_sqlite_exec);
+    sql.str("");
+    sql << _EVENTS_DB_SQLITE_CREATE_CHANGES_TRIGGERS;
+    Exec(csEventsDb_sqlite_exec);
+    // Create indexes
+    sql.str("");
+    sql << _EVENTS_DB_SQLITE_CREATE_INDEX_STAMPS_AID;
+    Exec(csEventsDb_sqlite_exec);
+    sql.str("");
+    sql << _EVENTS_DB_SQLITE_CREATE_INDEX_ALERTS_UPDATED;
+    Exec(csEventsDb_sqlite_exec);
+    sql.str("");
+    sql << _EVENTS_DB_SQLITE_CREATE_INDEX_STAMPS_STAMP;
+    Exec(csEventsDb_sqlite_exec);
+    sql.str("");
+    sql << _EVENTS_DB_SQLITE_CREATE_INDEX_ALERTS_TYPE_UPDATED;
+    Exec(csEventsDb_sqlite_exec);
+    sql.str("");
+    sql << _EVENTS_DB_SQLITE_CREATE_INDEX_ALERTS_HASH;
+    Exec(csEventsDb_sqlite_exec);
+    sql.str("");
+    sql << _EVENTS_DB_SQLITE_CREATE_INDEX_ALERTS_UUID;
+    Exec(csEventsDb_sqlite_exec);
+    sql.str("");
+    sql << _EVENTS_DB_SQLITE_CREATE_INDEX_GROUPS_GID;
+    Exec(csEventsDb_sqlite_exec);
+    sql.str("");
+    sql << _EVENTS_DB_SQLITE_CREATE_INDEX_GROUPS_ID;
+    Exec(csEventsDb_sqlite_exec);
+    sql.str("");
+    sql << _EVENTS_DB_SQLITE_CREATE_INDEX_CHANGES_TOMBSTONES;
+    Exec(csEventsDb_sqlite_exec);
+    // Create full-text search index
+    if (fts) CreateFullTextSearch();
 
     // Prepare statements
-    rc = sqlite3_prepare_v2(handle,
-        _EVENTS_DB_SQLITE_SELECT_LAST_ID,
-        strlen(_EVENTS_DB_SQLITE_SELECT_LAST_ID) + 1,
-        &last_id, NULL);
-    if (rc != SQLITE_OK) {
-        csLog::Log(csLog::Debug, "%s: sqlite3_prepare(%s): %s",
-            __PRETTY_FUNCTION__, "last_id", sqlite3_errstr(rc));
-        throw csEventsDbException(rc, sqlite3_errstr(rc));
-    }
+    last_id.Prepare(_EVENTS_DB_SQLITE_SELECT_LAST_ID);
+    select_by_hash.Prepare(_EVENTS_DB_SQLITE_SELECT_ALERT_BY_HASH);
+    insert_alert.Prepare(_EVENTS_DB_SQLITE_INSERT_ALERT);
+    update_alert.Prepare(_EVENTS_DB_SQLITE_UPDATE_ALERT);
+    purge_alerts.Prepare(_EVENTS_DB_SQLITE_PURGE_ALERTS);
+    purge_alerts_type.Prepare(_EVENTS_DB_SQLITE_PURGE_ALERTS_TYPE);
+    insert_stamp.Prepare(_EVENTS_DB_SQLITE_INSERT_STAMP);
+    delete_stamp.Prepare(_EVENTS_DB_SQLITE_DELETE_STAMP);
+    insert_group.Prepare(_EVENTS_DB_SQLITE_INSERT_GROUP);
+    purge_stamps.Prepare(_EVENTS_DB_SQLITE_PURGE_STAMPS);
+    mark_resolved.Prepare(_EVENTS_DB_SQLITE_MARK_RESOLVED);
+    mark_resolved_id.Prepare(_EVENTS_DB_SQLITE_MARK_RESOLVED_ID);
+    mark_resolved_uuid.Prepare(_EVENTS_DB_SQLITE_MARK_RESOLVED_UUID);
+    mark_resolved_hash.Prepare(_EVENTS_DB_SQLITE_MARK_RESOLVED_HASH);
+    insert_type.Prepare(_EVENTS_DB_SQLITE_INSERT_TYPE);
+    delete_type.Prepare(_EVENTS_DB_SQLITE_DELETE_TYPE);
+    select_type.Prepare(_EVENTS_DB_SQLITE_SELECT_TYPE);
+    select_override.Prepare(_EVENTS_DB_SQLITE_SELECT_OVERRIDE);
+    insert_override.Prepare(_EVENTS_DB_SQLITE_INSERT_OVERRIDE);
+    update_override.Prepare(_EVENTS_DB_SQLITE_UPDATE_OVERRIDE);
+    delete_override.Prepare(_EVENTS_DB_SQLITE_DELETE_OVERRIDE);
+    search_alerts.Prepare((fts) ?
+        _EVENTS_DB_SQLITE_SEARCH_ALERTS_FTS : _EVENTS_DB_SQLITE_SEARCH_ALERTS_LIKE);
+    select_group.Prepare(_EVENTS_DB_SQLITE_SELECT_ALERTS_GROUP);
+    select_template.Prepare(_EVENTS_DB_SQLITE_SELECT_TEMPLATE);
+    insert_template.Prepare(_EVENTS_DB_SQLITE_INSERT_TEMPLATE);
+    evict_stamps.Prepare(_EVENTS_DB_SQLITE_EVICT_STAMPS);
+    evict_alerts.Prepare(_EVENTS_DB_SQLITE_EVICT_ALERTS);
+    select_changes.Prepare(_EVENTS_DB_SQLITE_SELECT_CHANGES);
+    tombstone_horizon.Prepare(_EVENTS_DB_SQLITE_SELECT_TOMBSTONE_HORIZON);
+    update_horizon.Prepare(_EVENTS_DB_SQLITE_UPDATE_CHANGES_HORIZON);
+    purge_tombstones.Prepare(_EVENTS_DB_SQLITE_PURGE_TOMBSTONES);
+
+    select_by_hash_index.hash = select_by_hash.GetIndex("@hash");
+    insert_alert_index.created = insert_alert.GetIndex("@created");
+    insert_alert_index.updated = insert_alert.GetIndex("@updated");
+    insert_alert_index.hash = insert_alert.GetIndex("@hash");
+    insert_alert_index.flags = insert_alert.GetIndex("@flags");
+    insert_alert_index.type = insert_alert.GetIndex("@type");
+    insert_alert_index.user = insert_alert.GetIndex("@user");
+    insert_alert_index.origin = insert_alert.GetIndex("@origin");
+    insert_alert_index.basename = insert_alert.GetIndex("@basename");
+    insert_alert_index.uuid = insert_alert.GetIndex("@uuid");
+    insert_alert_index.desc = insert_alert.GetIndex("@desc");
+    insert_alert_index.tid = insert_alert.GetIndex("@tid");
+    insert_alert_index.params = insert_alert.GetIndex("@params");
+    update_alert_index.id = update_alert.GetIndex("@id");
+    update_alert_index.stamp = update_alert.GetIndex("@stamp");
+    update_alert_index.flags = update_alert.GetIndex("@flags");
+    update_alert_index.desc = update_alert.GetIndex("@desc");
+    update_alert_index.tid = update_alert.GetIndex("@tid");
+    update_alert_index.params = update_alert.GetIndex("@params");
+    insert_group_index.id = insert_group.GetIndex("@id");
+    insert_group_index.gid = insert_group.GetIndex("@gid");
+    insert_stamp_index.aid = insert_stamp.GetIndex("@aid");
+    insert_stamp_index.stamp = insert_stamp.GetIndex("@stamp");
+    delete_stamp_index.aid = delete_stamp.GetIndex("@aid");
+}
 
-    rc = sqlite3_prepare_v2(handle,
-        _EVENTS_DB_SQLITE_SELECT_ALERT_BY_HASH,
-        strlen(_EVENTS_DB_SQLITE_SELECT_ALERT_BY_HASH) + 1,
-        &select_by_hash, NULL);
-    if (rc != SQLITE_OK) {
-        csLog::Log(csLog::Debug, "%s: sqlite3_prepare(%s): %s",
-            __PRETTY_FUNCTION__, "select_by_hash", sqlite3_errstr(rc));
-        throw csEventsDbException(rc, sqlite3_errstr(rc));
-    }
+void csEventsDb_sqlite::CreateTemplates(void)
+{
+    uint32_t exists = 0;
 
-    rc = sqlite3_prepare_v2(handle,
-        _EVENTS_DB_SQLITE_INSERT_ALERT,
-        strlen(_EVENTS_DB_SQLITE_INSERT_ALERT) + 1,
-        &insert_alert, NULL);
-    if (rc != SQLITE_OK) {
-        csLog::Log(csLog::Debug, "%s: sqlite3_prepare(%s): %s",
-            __PRETTY_FUNCTION__, "insert_alert", sqlite3_errstr(rc));
-        throw csEventsDbException(rc, sqlite3_errstr(rc));
-    }
+    sql.str("");
+    sql << _EVENTS_DB_SQLITE_CREATE_TEMPLATES;
+    Exec(csEventsDb_sqlite_exec);
 
-    rc = sqlite3_prepare_v2(handle,
-        _EVENTS_DB_SQLITE_UPDATE_ALERT,
-        strlen(_EVENTS_DB_SQLITE_UPDATE_ALERT) + 1,
-        &update_alert, NULL);
-    if (rc != SQLITE_OK) {
-        csLog::Log(csLog::Debug, "%s: sqlite3_prepare(%s): %s",
-            __PRETTY_FUNCTION__, "update_alert", sqlite3_errstr(rc));
-        throw csEventsDbException(rc, sqlite3_errstr(rc));
-    }
+    // Databases created before templates need the reference columns added
+    sql.str("");
+    sql << _EVENTS_DB_SQLITE_SELECT_TEMPLATE_COLUMNS;
+    Exec(csEventsDb_sqlite_count, (void *)&exists);
 
-    rc = sqlite3_prepare_v2(handle,
-        _EVENTS_DB_SQLITE_PURGE_ALERTS,
-        strlen(_EVENTS_DB_SQLITE_PURGE_ALERTS) + 1,
-        &purge_alerts, NULL);
-    if (rc != SQLITE_OK) {
-        csLog::Log(csLog::Debug, "%s: sqlite3_prepare(%s): %s",
-            __PRETTY_FUNCTION__, "purge_alerts", sqlite3_errstr(rc));
-        throw csEventsDbException(rc, sqlite3_errstr(rc));
-    }
+    if (exists) return;
 
-    rc = sqlite3_prepare_v2(handle,
-        _EVENTS_DB_SQLITE_INSERT_STAMP,
-        strlen(_EVENTS_DB_SQLITE_INSERT_STAMP) + 1,
-        &insert_stamp, NULL);
-    if (rc != SQLITE_OK) {
-        csLog::Log(csLog::Debug, "%s: sqlite3_prepare(%s): %s",
-            __PRETTY_FUNCTION__, "insert_stamp", sqlite3_errstr(rc));
-        throw csEventsDbException(rc, sqlite3_errstr(rc));
-    }
+    sql.str("");
+    sql << _EVENTS_DB_SQLITE_ALTER_ALERTS_TID;
+    Exec(csEventsDb_sqlite_exec);
+    sql.str("");
+    sql << _EVENTS_DB_SQLITE_ALTER_ALERTS_PARAMS;
+    Exec(csEventsDb_sqlite_exec);
+}
 
-    rc = sqlite3_prepare_v2(handle,
-        _EVENTS_DB_SQLITE_DELETE_STAMP,
-        strlen(_EVENTS_DB_SQLITE_DELETE_STAMP) + 1,
-        &delete_stamp, NULL);
-    if (rc != SQLITE_OK) {
-        csLog::Log(csLog::Debug, "%s: sqlite3_prepare(%s): %s",
-            __PRETTY_FUNCTION__, "delete_stamp", sqlite3_errstr(rc));
-        throw csEventsDbException(rc, sqlite3_errstr(rc));
-    }
+void csEventsDb_sqlite::CreateRetention(void)
+{
+    uint32_t exists = 0;
 
-    rc = sqlite3_prepare_v2(handle,
-        _EVENTS_DB_SQLITE_PURGE_STAMPS,
-        strlen(_EVENTS_DB_SQLITE_PURGE_STAMPS) + 1,
-        &purge_stamps, NULL);
-    if (rc != SQLITE_OK) {
-        csLog::Log(csLog::Debug, "%s: sqlite3_prepare(%s): %s",
-            __PRETTY_FUNCTION__, "purge_stamps", sqlite3_errstr(rc));
-        throw csEventsDbException(rc, sqlite3_errstr(rc));
-    }
+    // Databases created before retention policies need the column added
+    sql.str("");
+    sql << _EVENTS_DB_SQLITE_SELECT_TYPES_MAX_AGE_COLUMN;
+    Exec(csEventsDb_sqlite_count, (void *)&exists);
 
-    rc = sqlite3_prepare_v2(handle,
-        _EVENTS_DB_SQLITE_MARK_RESOLVED,
-        strlen(_EVENTS_DB_SQLITE_MARK_RESOLVED) + 1,
-        &mark_resolved, NULL);
-    if (rc != SQLITE_OK) {
-        csLog::Log(csLog::Debug, "%s: sqlite3_prepare(%s): %s",
-            __PRETTY_FUNCTION__, "mark_resolved", sqlite3_errstr(rc));
-        throw csEventsDbException(rc, sqlite3_errstr(rc));
+    if (! exists) {
+        sql.str("");
+        sql << _EVENTS_DB_SQLITE_ALTER_TYPES_MAX_AGE;
+        Exec(csEventsDb_sqlite_exec);
     }
 
-    rc = sqlite3_prepare_v2(handle,
-        _EVENTS_DB_SQLITE_INSERT_TYPE,
-        strlen(_EVENTS_DB_SQLITE_INSERT_TYPE) + 1,
-        &insert_type, NULL);
-    if (rc != SQLITE_OK) {
-        csLog::Log(csLog::Debug, "%s: sqlite3_prepare(%s): %s",
-            __PRETTY_FUNCTION__, "insert_type", sqlite3_errstr(rc));
-        throw csEventsDbException(rc, sqlite3_errstr(rc));
-    }
+    sql.str("");
+    sql << _EVENTS_DB_SQLITE_CREATE_RETENTION;
+    Exec(csEventsDb_sqlite_exec);
+}
 
-    rc = sqlite3_prepare_v2(handle,
-        _EVENTS_DB_SQLITE_DELETE_TYPE,
-        strlen(_EVENTS_DB_SQLITE_DELETE_TYPE) + 1,
-        &delete_type, NULL);
-    if (rc != SQLITE_OK) {
-        csLog::Log(csLog::Debug, "%s: sqlite3_prepare(%s): %s",
-            __PRETTY_FUNCTION__, "delete_type", sqlite3_errstr(rc));
-        throw csEventsDbException(rc, sqlite3_errstr(rc));
-    }
+int64_t csEventsDb_sqlite::SelectTemplate(const string &text)
+{
+    int64_t id = -1;
 
-    rc = sqlite3_prepare_v2(handle,
-        _EVENTS_DB_SQLITE_SELECT_TYPE,
-        strlen(_EVENTS_DB_SQLITE_SELECT_TYPE) + 1,
-        &select_type, NULL);
-    if (rc != SQLITE_OK) {
-        csLog::Log(csLog::Debug, "%s: sqlite3_prepare(%s): %s",
-            __PRETTY_FUNCTION__, "select_type", sqlite3_errstr(rc));
-        throw csEventsDbException(rc, sqlite3_errstr(rc));
-    }
+    map<string, int64_t>::iterator i = template_ids.find(text);
+    if (i != template_ids.end()) return i->second;
 
-    rc = sqlite3_prepare_v2(handle,
-        _EVENTS_DB_SQLITE_SELECT_OVERRIDE,
-        strlen(_EVENTS_DB_SQLITE_SELECT_OVERRIDE) + 1,
-        &select_override, NULL);
-    if (rc != SQLITE_OK) {
-        csLog::Log(csLog::Debug, "%s: sqlite3_prepare(%s): %s",
-            __PRETTY_FUNCTION__, "select_override", sqlite3_errstr(rc));
-        throw csEventsDbException(rc, sqlite3_errstr(rc));
-    }
+    {
+        csEventsDbStatementScope scope(select_template);
 
-    rc = sqlite3_prepare_v2(handle,
-        _EVENTS_DB_SQLITE_INSERT_OVERRIDE,
-        strlen(_EVENTS_DB_SQLITE_INSERT_OVERRIDE) + 1,
-        &insert_override, NULL);
-    if (rc != SQLITE_OK) {
-        csLog::Log(csLog::Debug, "%s: sqlite3_prepare(%s): %s",
-            __PRETTY_FUNCTION__, "insert_override", sqlite3_errstr(rc));
-        throw csEventsDbException(rc, sqlite3_errstr(rc));
-    }
+        select_template.Bind("@text", text);
 
-    rc = sqlite3_prepare_v2(handle,
-        _EVENTS_DB_SQLITE_UPDATE_OVERRIDE,
-        strlen(_EVENTS_DB_SQLITE_UPDATE_OVERRIDE) + 1,
-        &update_override, NULL);
-    if (rc != SQLITE_OK) {
-        csLog::Log(csLog::Debug, "%s: sqlite3_prepare(%s): %s",
-            __PRETTY_FUNCTION__, "update_override", sqlite3_errstr(rc));
-        throw csEventsDbException(rc, sqlite3_errstr(rc));
+        if (select_template.Step() == SQLITE_ROW)
+            id = select_template.GetInt64(0);
     }
 
-    rc = sqlite3_prepare_v2(handle,
-        _EVENTS_DB_SQLITE_DELETE_OVERRIDE,
-        strlen(_EVENTS_DB_SQLITE_DELETE_OVERRIDE) + 1,
-        &delete_override, NULL);
-    if (rc != SQLITE_OK) {
-        csLog::Log(csLog::Debug, "%s: sqlite3_prepare(%s): %s",
-            __PRETTY_FUNCTION__, "delete_override", sqlite3_errstr(rc));
-        throw csEventsDbException(rc, sqlite3_errstr(rc));
+    if (id < 0) {
+        csEventsDbStatementScope scope(insert_template);
+
+        insert_template.Bind("@text", text);
+        insert_template.Step();
+
+        id = static_cast<int64_t>(sqlite3_last_insert_rowid(handle));
     }
+
+    template_ids[text] = id;
+
+    return id;
 }
 
-void csEventsDb_sqlite::Drop(void)
+void csEventsDb_sqlite::CreateFullTextSearch(void)
 {
-    vector<string> tables;
-    tables.push_back("alerts");
-    tables.push_back("stamps");
+    uint32_t exists = 0;
+
+    sql.str("");
+    sql << _EVENTS_DB_SQLITE_SELECT_FTS_EXISTS;
+    Exec(csEventsDb_sqlite_count, (void *)&exists);
+
+    try {
+        sql.str("");
+        sql << _EVENTS_DB_SQLITE_CREATE_FTS;
+        Exec(csEventsDb_sqlite_exec);
+    }
+    catch (csEventsDbException &e) {
+        // SQLite built without FTS5; fall back to LIKE scans
+        csLog::Log(csLog::Warning, "%s: Full-text search unavailable: %s",
+            __PRETTY_FUNCTION__, e.estring.c_str());
+        fts = false;
+        return;
+    }
+
+    if (!exists) {
+        sql.str("");
+        sql << _EVENTS_DB_SQLITE_CREATE_FTS_POPULATE;
+        Exec(csEventsDb_sqlite_exec);
+    }
+
+    // Replace triggers from older versions which didn't index templates
+    sql.str("");
+    sql << _EVENTS_DB_SQLITE_DROP_FTS_TRIGGERS;
+    Exec(csEventsDb_sqlite_exec);
+
+    sql.str("");
+    sql << _EVENTS_DB_SQLITE_CREATE_FTS_INSERT;
+    Exec(csEventsDb_sqlite_exec);
+    sql.str("");
+    sql << _EVENTS_DB_SQLITE_CREATE_FTS_UPDATE;
+    Exec(csEventsDb_sqlite_exec);
+    sql.str("");
+    sql << _EVENTS_DB_SQLITE_CREATE_FTS_DELETE;
+    Exec(csEventsDb_sqlite_exec);
+}
+
+void csEventsDb_sqlite::Drop(void)
+{
+    vector<string> tables;
+    tables.push_back("alerts");
+    tables.push_back("stamps");
     tables.push_back("groups");
     tables.push_back("types");
     tables.push_back("overrides");
+    tables.push_back("summary");
+    tables.push_back("alerts_fts");
+    tables.push_back("templates");
+    tables.push_back("counters");
+    tables.push_back("changes");
 
     for (vector<string>::iterator i = tables.begin(); i != tables.end(); i++) {
         sql.str("");
@@ -437,43 +780,53 @@ void csEventsDb_sqlite::Drop(void)
     }
 }
 
+void csEventsDb_sqlite::Begin(void)
+{
+    if (transaction) return;
+
+    sql.str("");
+    sql << _EVENTS_DB_SQLITE_BEGIN;
+    Exec(csEventsDb_sqlite_exec);
+
+    transaction = true;
+}
+
+void csEventsDb_sqlite::Commit(void)
+{
+    if (! transaction) return;
+
+    sql.str("");
+    sql << _EVENTS_DB_SQLITE_COMMIT;
+    Exec(csEventsDb_sqlite_exec);
+
+    transaction = false;
+}
+
+void csEventsDb_sqlite::Rollback(void)
+{
+    if (! transaction) return;
+
+    transaction = false;
+
+    // A failed statement may already have rolled the transaction back
+    if (sqlite3_get_autocommit(handle)) return;
+
+    sql.str("");
+    sql << _EVENTS_DB_SQLITE_ROLLBACK;
+    Exec(csEventsDb_sqlite_exec);
+}
+
 int64_t csEventsDb_sqlite::GetLastId(const string &table)
 {
     int64_t id = 0;
-    int rc, index = 0;
-
-    try {
-        // Table name
-        index = sqlite3_bind_parameter_index(last_id, "@table_name");
-        if (index == 0) throw csException(EINVAL, "SQL parameter missing: table_name");
-        if ((rc = sqlite3_bind_text(last_id, index,
-            table.c_str(), table.length(), SQLITE_TRANSIENT)) != SQLITE_OK)
-            throw csEventsDbException(rc, sqlite3_errstr(rc));
-
-        do {
-            rc = sqlite3_step(last_id);
-            if (rc == SQLITE_BUSY) { usleep(5000); continue; }
-            if (rc == SQLITE_ROW) {
-                id = static_cast<int64_t>(sqlite3_column_int64(last_id, 0));
-                break;
-            }
-        }
-        while (rc != SQLITE_DONE && rc != SQLITE_ERROR);
+    csEventsDbStatementScope scope(last_id);
 
-        if (rc == SQLITE_ERROR) {
-            rc = sqlite3_errcode(handle);
-            throw csEventsDbException(rc, sqlite3_errstr(rc));
-        }
+    last_id.Bind("@table_name", table);
 
-        csLog::Log(csLog::Debug, "%s:%d: %p: %d",
-            __PRETTY_FUNCTION__, __LINE__, handle, id);
+    if (last_id.Step() == SQLITE_ROW) id = last_id.GetInt64(0);
 
-        sqlite3_reset(last_id);
-    }
-    catch (csException &e) {
-        sqlite3_reset(last_id);
-        throw;
-    }
+    csLog::Log(csLog::Debug, "%s:%d: %p: %d",
+        __PRETTY_FUNCTION__, __LINE__, handle, id);
 
     return id;
 }
@@ -488,508 +841,580 @@ uint32_t csEventsDb_sqlite::SelectAlert(const string &where, vector<csEventsAler
     return (uint32_t)result->size();
 }
 
-void csEventsDb_sqlite::InsertAlert(csEventsAlert &alert)
+csEventsAlert *csEventsDb_sqlite::ReadAlert(csEventsDbStatement &stmt)
 {
-    int rc, index = 0;
-    int64_t hash_id = -1;
+    csEventsAlert *alert = new csEventsAlert();
 
-    alert.UpdateHash();
+    alert->SetId(stmt.GetInt64(0));
+    alert->SetCreated(static_cast<time_t>(stmt.GetInt64(1)));
+    alert->SetUpdated(static_cast<time_t>(stmt.GetInt64(2)));
+    alert->SetFlags(static_cast<uint32_t>(stmt.GetInt64(3)));
+    alert->SetType(static_cast<uint32_t>(stmt.GetInt64(4)));
+    alert->SetUser(static_cast<uid_t>(stmt.GetInt64(5)));
+    if (! stmt.IsNull(6))
+        alert->SetOrigin(stmt.GetText(6));
+    if (! stmt.IsNull(7))
+        alert->SetBasename(stmt.GetText(7));
+    if (! stmt.IsNull(8))
+        alert->SetUUID(stmt.GetText(8));
+    alert->SetDescription(stmt.GetText(9));
+    if (! stmt.IsNull(11)) {
+        string desc;
+        vector<string> params;
+        string desc_template(stmt.GetText(11));
+        if (! stmt.IsNull(10))
+            csEventsAlert::TemplateDecodeParams(stmt.GetText(10), params);
+        csEventsAlert::TemplateRender(desc_template, params, desc);
+        alert->SetDescription(desc);
+        alert->SetTemplate(desc_template, params);
+    }
 
-    try {
-        // Hash
-        index = sqlite3_bind_parameter_index(select_by_hash, "@hash");
-        if (index == 0) throw csException(EINVAL, "SQL parameter missing: hash");
-        if ((rc = sqlite3_bind_text(select_by_hash, index,
-            alert.GetHashChar(), alert.GetHashLength(), SQLITE_TRANSIENT)) != SQLITE_OK) {
-            csLog::Log(csLog::Debug, "%s: sqlite3_bind(%s, %s): %s",
-                __PRETTY_FUNCTION__, "select_by_hash", "hash", sqlite3_errstr(rc));
-            throw csEventsDbException(rc, sqlite3_errstr(rc));
-        }
+    return alert;
+}
 
-        do {
-            rc = sqlite3_step(select_by_hash);
-            if (rc == SQLITE_BUSY) { usleep(5000); continue; }
-            if (rc == SQLITE_ROW) {
-                hash_id = static_cast<int64_t>(sqlite3_column_int64(select_by_hash, 0));
-                break;
-            }
-        }
-        while (rc != SQLITE_DONE && rc != SQLITE_ERROR);
+void csEventsDb_sqlite::ReadAlertGroups(csEventsDbStatement &stmt,
+    int column, csEventsAlert *alert)
+{
+    if (stmt.IsNull(column)) return;
+
+    // Comma-separated, from group_concat()
+    const char *p = stmt.GetText(column);
+    while (*p != '\0') {
+        char *end = NULL;
+        alert->AddGroup(static_cast<gid_t>(strtoul(p, &end, 10)));
+        if (end == p) break;
+        p = (*end == ',') ? end + 1 : end;
+    }
+}
 
-        if (rc == SQLITE_ERROR) {
-            rc = sqlite3_errcode(handle);
-            csLog::Log(csLog::Debug, "%s: sqlite3_step(%s): %s",
-                __PRETTY_FUNCTION__, "select_by_hash", sqlite3_errstr(rc));
-            throw csEventsDbException(rc, sqlite3_errstr(rc));
-        }
+uint32_t csEventsDb_sqlite::SearchAlerts(const string &query, uint32_t limit,
+    vector<csEventsAlert *> *result)
+{
+    string pattern;
 
-        sqlite3_reset(select_by_hash);
-    }
-    catch (csException &e) {
-        sqlite3_reset(select_by_hash);
-        throw;
+    if (fts) pattern = query;
+    else {
+        pattern = "%";
+        for (string::const_iterator i = query.begin(); i != query.end(); i++) {
+            if ((*i) == '%' || (*i) == '_' || (*i) == '\\') pattern.push_back('\\');
+            pattern.push_back(*i);
+        }
+        pattern.push_back('%');
     }
 
-    if (hash_id < 0) {
-        try {
-            // Created
-            index = sqlite3_bind_parameter_index(insert_alert, "@created");
-            if (index == 0) throw csException(EINVAL, "SQL parameter missing: created");
-            if ((rc = sqlite3_bind_int64(insert_alert,
-                index, static_cast<sqlite3_int64>(alert.GetCreated()))) != SQLITE_OK) {
-                csLog::Log(csLog::Debug, "%s: sqlite3_bind(%s, %s): %s",
-                    __PRETTY_FUNCTION__, "insert_alert", "hash", sqlite3_errstr(rc));
-                throw csEventsDbException(rc, sqlite3_errstr(rc));
-            }
-            // Updated
-            time_t updated = alert.GetCreated();
-            index = sqlite3_bind_parameter_index(insert_alert, "@updated");
-            if (index == 0) throw csException(EINVAL, "SQL parameter missing: updated");
-            if ((rc = sqlite3_bind_int64(insert_alert,
-                index, static_cast<sqlite3_int64>(updated))) != SQLITE_OK) {
-                csLog::Log(csLog::Debug, "%s: sqlite3_bind(%s, %s): %s",
-                    __PRETTY_FUNCTION__, "insert_alert", "updated", sqlite3_errstr(rc));
-                throw csEventsDbException(rc, sqlite3_errstr(rc));
-            }
-            // Hash
-            index = sqlite3_bind_parameter_index(insert_alert, "@hash");
-            if (index == 0) throw csException(EINVAL, "SQL parameter missing: hash");
-            if ((rc = sqlite3_bind_text(insert_alert, index,
-                alert.GetHashChar(), alert.GetHashLength(), SQLITE_TRANSIENT)) != SQLITE_OK) {
-                csLog::Log(csLog::Debug, "%s: sqlite3_bind(%s, %s): %s",
-                    __PRETTY_FUNCTION__, "insert_alert", "hash", sqlite3_errstr(rc));
-                throw csEventsDbException(rc, sqlite3_errstr(rc));
-            }
-            // Flags
-            index = sqlite3_bind_parameter_index(insert_alert, "@flags");
-            if (index == 0) throw csException(EINVAL, "SQL parameter missing: flags");
-            if ((rc = sqlite3_bind_int64(insert_alert,
-                index, static_cast<sqlite3_int64>(alert.GetFlags()))) != SQLITE_OK) {
-                csLog::Log(csLog::Debug, "%s: sqlite3_bind(%s, %s): %s",
-                    __PRETTY_FUNCTION__, "insert_alert", "flags", sqlite3_errstr(rc));
-                throw csEventsDbException(rc, sqlite3_errstr(rc));
-            }
-            // Type
-            index = sqlite3_bind_parameter_index(insert_alert, "@type");
-            if (index == 0) throw csException(EINVAL, "SQL parameter missing: type");
-            if ((rc = sqlite3_bind_int64(insert_alert,
-                index, static_cast<sqlite3_int64>(alert.GetType()))) != SQLITE_OK) {
-                csLog::Log(csLog::Debug, "%s: sqlite3_bind(%s, %s): %s",
-                    __PRETTY_FUNCTION__, "insert_alert", "type", sqlite3_errstr(rc));
-                throw csEventsDbException(rc, sqlite3_errstr(rc));
-            }
-            // User
-            index = sqlite3_bind_parameter_index(insert_alert, "@user");
-            if (index == 0) throw csException(EINVAL, "SQL parameter missing: user");
-            if ((rc = sqlite3_bind_int64(insert_alert,
-                index, static_cast<sqlite3_int64>(alert.GetUser()))) != SQLITE_OK) {
-                csLog::Log(csLog::Debug, "%s: sqlite3_bind(%s, %s): %s",
-                    __PRETTY_FUNCTION__, "insert_alert", "user", sqlite3_errstr(rc));
-                throw csEventsDbException(rc, sqlite3_errstr(rc));
-            }
-            // Origin
-            index = sqlite3_bind_parameter_index(insert_alert, "@origin");
-            if (index == 0) throw csException(EINVAL, "SQL parameter missing: origin");
-            if ((rc = sqlite3_bind_text(insert_alert, index,
-                alert.GetOriginChar(), alert.GetOriginLength(), SQLITE_TRANSIENT)) != SQLITE_OK) {
-                csLog::Log(csLog::Debug, "%s: sqlite3_bind(%s, %s): %s",
-                    __PRETTY_FUNCTION__, "insert_alert", "origin", sqlite3_errstr(rc));
-                throw csEventsDbException(rc, sqlite3_errstr(rc));
-            }
-            // Basename
-            index = sqlite3_bind_parameter_index(insert_alert, "@basename");
-            if (index == 0) throw csException(EINVAL, "SQL parameter missing: basename");
-            if ((rc = sqlite3_bind_text(insert_alert, index,
-                alert.GetBasenameChar(), alert.GetBasenameLength(), SQLITE_TRANSIENT)) != SQLITE_OK) {
-                csLog::Log(csLog::Debug, "%s: sqlite3_bind(%s, %s): %s",
-                    __PRETTY_FUNCTION__, "insert_alert", "basename", sqlite3_errstr(rc));
-                throw csEventsDbException(rc, sqlite3_errstr(rc));
-            }
-            // UUID
-            index = sqlite3_bind_parameter_index(insert_alert, "@uuid");
-            if (index == 0) throw csException(EINVAL, "SQL parameter missing: uuid");
-            if ((rc = sqlite3_bind_text(insert_alert, index,
-                alert.GetUUIDChar(), alert.GetUUIDLength(), SQLITE_TRANSIENT)) != SQLITE_OK) {
-                csLog::Log(csLog::Debug, "%s: sqlite3_bind(%s, %s): %s",
-                    __PRETTY_FUNCTION__, "insert_alert", "uuid", sqlite3_errstr(rc));
-                throw csEventsDbException(rc, sqlite3_errstr(rc));
-            }
-            // Description
-            index = sqlite3_bind_parameter_index(insert_alert, "@desc");
-            if (index == 0) throw csException(EINVAL, "SQL parameter missing: desc");
-            if ((rc = sqlite3_bind_text(insert_alert, index,
-                alert.GetDescriptionChar(), alert.GetDescriptionLength(),
-                SQLITE_TRANSIENT)) != SQLITE_OK) {
-                csLog::Log(csLog::Debug, "%s: sqlite3_bind(%s, %s): %s",
-                    __PRETTY_FUNCTION__, "insert_alert", "desc", sqlite3_errstr(rc));
-                throw csEventsDbException(rc, sqlite3_errstr(rc));
-            }
+    csEventsDbStatementScope scope(search_alerts);
 
-            do {
-                rc = sqlite3_step(insert_alert);
-                if (rc == SQLITE_BUSY) { usleep(5000); continue; }
-            }
-            while (rc != SQLITE_DONE && rc != SQLITE_ERROR);
+    search_alerts.Bind("@query", pattern);
+    search_alerts.Bind("@limit", (limit > 0) ? static_cast<int64_t>(limit) : -1);
 
-            if (rc == SQLITE_ERROR) {
-                rc = sqlite3_errcode(handle);
-                csLog::Log(csLog::Debug, "%s: sqlite3_step(%s): %s",
-                    __PRETTY_FUNCTION__, "insert_alert", sqlite3_errstr(rc));
-                throw csEventsDbException(rc, sqlite3_errstr(rc));
-            }
+    while (search_alerts.Step() == SQLITE_ROW)
+        result->push_back(ReadAlert(search_alerts));
 
-            alert.SetId(GetLastId("alerts"));
+    return (uint32_t)result->size();
+}
 
-            sqlite3_reset(insert_alert);
-        }
-        catch (csException &e) {
-            sqlite3_reset(insert_alert);
-            throw;
-        }
+uint32_t csEventsDb_sqlite::SelectAlertsByGroup(gid_t gid, uint32_t limit,
+    vector<csEventsAlert *> *result)
+{
+    csEventsDbStatementScope scope(select_group);
+
+    select_group.Bind("@gid", static_cast<int64_t>(gid));
+    select_group.Bind("@limit", (limit > 0) ? static_cast<int64_t>(limit) : -1);
+
+    while (select_group.Step() == SQLITE_ROW) {
+        csEventsAlert *alert = ReadAlert(select_group);
+        ReadAlertGroups(select_group, 12, alert);
+        result->push_back(alert);
     }
-    else {
-        try {
-            // ID
-            index = sqlite3_bind_parameter_index(update_alert, "@id");
-            if (index == 0) throw csException(EINVAL, "SQL parameter missing: id");
-            if ((rc = sqlite3_bind_int64(update_alert,
-                index, static_cast<sqlite3_int64>(hash_id))) != SQLITE_OK) {
-                csLog::Log(csLog::Debug, "%s: sqlite3_bind(%s, %s): %s",
-                    __PRETTY_FUNCTION__, "update_alert", "id", sqlite3_errstr(rc));
-                throw csEventsDbException(rc, sqlite3_errstr(rc));
-            }
-            // Stamp
-            index = sqlite3_bind_parameter_index(update_alert, "@stamp");
-            if (index == 0) throw csException(EINVAL, "SQL parameter missing: stamp");
-            if ((rc = sqlite3_bind_int64(update_alert,
-                index, static_cast<sqlite3_int64>(time(NULL)))) != SQLITE_OK) {
-                csLog::Log(csLog::Debug, "%s: sqlite3_bind(%s, %s): %s",
-                    __PRETTY_FUNCTION__, "update_alert", "stamp", sqlite3_errstr(rc));
-                throw csEventsDbException(rc, sqlite3_errstr(rc));
-            }
-            // Flags
-            index = sqlite3_bind_parameter_index(update_alert, "@flags");
-            if (index == 0) throw csException(EINVAL, "SQL parameter missing: flags");
-            if ((rc = sqlite3_bind_int64(update_alert,
-                index, static_cast<sqlite3_int64>(alert.GetFlags()))) != SQLITE_OK) {
-                csLog::Log(csLog::Debug, "%s: sqlite3_bind(%s, %s): %s",
-                    __PRETTY_FUNCTION__, "update_alert", "flags", sqlite3_errstr(rc));
-                throw csEventsDbException(rc, sqlite3_errstr(rc));
-            }
-            // Description
-            index = sqlite3_bind_parameter_index(update_alert, "@desc");
-            if (index == 0) throw csException(EINVAL, "SQL parameter missing: desc");
-            if ((rc = sqlite3_bind_text(update_alert, index,
-                alert.GetDescriptionChar(), alert.GetDescriptionLength(),
-                SQLITE_TRANSIENT)) != SQLITE_OK) {
-                csLog::Log(csLog::Debug, "%s: sqlite3_bind(%s, %s): %s",
-                    __PRETTY_FUNCTION__, "update_alert", "desc", sqlite3_errstr(rc));
-                throw csEventsDbException(rc, sqlite3_errstr(rc));
-            }
 
-            do {
-                rc = sqlite3_step(update_alert);
-                if (rc == SQLITE_BUSY) { usleep(5000); continue; }
-            }
-            while (rc != SQLITE_DONE && rc != SQLITE_ERROR);
+    return (uint32_t)result->size();
+}
 
-            if (rc == SQLITE_ERROR) {
-                rc = sqlite3_errcode(handle);
-                csLog::Log(csLog::Debug, "%s: sqlite3_step(%s): %s",
-                    __PRETTY_FUNCTION__, "update_alert", sqlite3_errstr(rc));
-                throw csEventsDbException(rc, sqlite3_errstr(rc));
-            }
+void csEventsDb_sqlite::InsertAlert(csEventsAlert &alert)
+{
+    int64_t hash_id = -1, tid = -1;
+    string params;
 
-            alert.SetId(hash_id);
+    alert.UpdateHash();
 
-            sqlite3_reset(update_alert);
-        }
-        catch (csException &e) {
-            sqlite3_reset(update_alert);
-            throw;
-        }
+    // Store a template reference and parameters in place of the description
+    if (templates && alert.HasTemplate()) {
+        tid = SelectTemplate(alert.GetTemplate());
+        csEventsAlert::TemplateEncodeParams(alert.GetTemplateParams(), params);
     }
 
-    try {
-        // Purge any previoius stamp entries for "auto-resolve" alerts?
-        if (hash_id >= 0 && alert.GetFlags() & csEventsAlert::csAF_FLG_AUTO_RESOLVE) {
-            // ID
-            index = sqlite3_bind_parameter_index(delete_stamp, "@aid");
-            if (index == 0) throw csException(EINVAL, "SQL parameter missing: aid");
-            if ((rc = sqlite3_bind_int64(delete_stamp,
-                index, static_cast<sqlite3_int64>(alert.GetId()))) != SQLITE_OK) {
-                csLog::Log(csLog::Debug, "%s: sqlite3_bind(%s, %s): %s",
-                    __PRETTY_FUNCTION__, "delete_stamp", "aid", sqlite3_errstr(rc));
-                throw csEventsDbException(rc, sqlite3_errstr(rc));
-            }
+    {
+        csEventsDbStatementScope scope(select_by_hash);
 
-            do {
-                rc = sqlite3_step(delete_stamp);
-                if (rc == SQLITE_BUSY) { usleep(5000); continue; }
-            }
-            while (rc != SQLITE_DONE && rc != SQLITE_ERROR);
+        select_by_hash.Bind(select_by_hash_index.hash,
+            alert.GetHashChar(), alert.GetHashLength());
 
-            if (rc == SQLITE_ERROR) {
-                rc = sqlite3_errcode(handle);
-                csLog::Log(csLog::Debug, "%s: sqlite3_step(%s): %s",
-                    __PRETTY_FUNCTION__, "delete_stamp", sqlite3_errstr(rc));
-                throw csEventsDbException(rc, sqlite3_errstr(rc));
-            }
+        if (select_by_hash.Step() == SQLITE_ROW)
+            hash_id = select_by_hash.GetInt64(0);
+    }
 
-            sqlite3_reset(delete_stamp);
+    if (hash_id < 0) {
+        csEventsDbStatementScope scope(insert_alert);
+
+        insert_alert.Bind(insert_alert_index.created,
+            static_cast<int64_t>(alert.GetCreated()));
+        insert_alert.Bind(insert_alert_index.updated,
+            static_cast<int64_t>(alert.GetCreated()));
+        insert_alert.Bind(insert_alert_index.hash,
+            alert.GetHashChar(), alert.GetHashLength());
+        insert_alert.Bind(insert_alert_index.flags,
+            static_cast<int64_t>(alert.GetFlags()));
+        insert_alert.Bind(insert_alert_index.type,
+            static_cast<int64_t>(alert.GetType()));
+        insert_alert.Bind(insert_alert_index.user,
+            static_cast<int64_t>(alert.GetUser()));
+        insert_alert.Bind(insert_alert_index.origin,
+            alert.GetOriginChar(), alert.GetOriginLength());
+        insert_alert.Bind(insert_alert_index.basename,
+            alert.GetBasenameChar(), alert.GetBasenameLength());
+        insert_alert.Bind(insert_alert_index.uuid,
+            alert.GetUUIDChar(), alert.GetUUIDLength());
+        if (tid < 0) {
+            insert_alert.Bind(insert_alert_index.desc,
+                alert.GetDescriptionChar(), alert.GetDescriptionLength());
+            insert_alert.BindNull(insert_alert_index.tid);
+            insert_alert.BindNull(insert_alert_index.params);
         }
+        else {
+            insert_alert.Bind(insert_alert_index.desc, "", 0);
+            insert_alert.Bind(insert_alert_index.tid, tid);
+            insert_alert.Bind(insert_alert_index.params, params);
+        }
+
+        insert_alert.Step();
+
+        alert.SetId(GetLastId("alerts"));
 
-        // ID
-        index = sqlite3_bind_parameter_index(insert_stamp, "@aid");
-        if (index == 0) throw csException(EINVAL, "SQL parameter missing: aid");
-        if ((rc = sqlite3_bind_int64(insert_stamp,
-            index, static_cast<sqlite3_int64>(alert.GetId()))) != SQLITE_OK) {
-            csLog::Log(csLog::Debug, "%s: sqlite3_bind(%s, %s): %s",
-                __PRETTY_FUNCTION__, "insert_stamp", "aid", sqlite3_errstr(rc));
-            throw csEventsDbException(rc, sqlite3_errstr(rc));
+        // Group membership belongs to the first occurrence, like the hash
+        vector<gid_t> groups;
+        alert.GetGroups(groups);
+        for (vector<gid_t>::const_iterator i = groups.begin(); i != groups.end(); i++) {
+            csEventsDbStatementScope scope(insert_group);
+
+            insert_group.Bind(insert_group_index.id, alert.GetId());
+            insert_group.Bind(insert_group_index.gid, static_cast<int64_t>((*i)));
+            insert_group.Step();
         }
-        // Stamp
-        index = sqlite3_bind_parameter_index(insert_stamp, "@stamp");
-        if (index == 0) throw csException(EINVAL, "SQL parameter missing: stamp");
-        if ((rc = sqlite3_bind_int64(insert_stamp,
-            index, static_cast<sqlite3_int64>(alert.GetUpdated()))) != SQLITE_OK) {
-            csLog::Log(csLog::Debug, "%s: sqlite3_bind(%s, %s): %s",
-                __PRETTY_FUNCTION__, "insert_stamp", "stamp", sqlite3_errstr(rc));
-            throw csEventsDbException(rc, sqlite3_errstr(rc));
+    }
+    else {
+        csEventsDbStatementScope scope(update_alert);
+
+        update_alert.Bind(update_alert_index.id, hash_id);
+        // Replayed occurrences keep the time they happened, not the replay's
+        update_alert.Bind(update_alert_index.stamp,
+            static_cast<int64_t>(alert.GetUpdated()));
+        update_alert.Bind(update_alert_index.flags,
+            static_cast<int64_t>(alert.GetFlags()));
+        if (tid < 0) {
+            update_alert.Bind(update_alert_index.desc,
+                alert.GetDescriptionChar(), alert.GetDescriptionLength());
+            update_alert.BindNull(update_alert_index.tid);
+            update_alert.BindNull(update_alert_index.params);
         }
-
-        do {
-            rc = sqlite3_step(insert_stamp);
-            if (rc == SQLITE_BUSY) { usleep(5000); continue; }
+        else {
+            update_alert.Bind(update_alert_index.desc, "", 0);
+            update_alert.Bind(update_alert_index.tid, tid);
+            update_alert.Bind(update_alert_index.params, params);
         }
-        while (rc != SQLITE_DONE && rc != SQLITE_ERROR);
 
-        if (rc == SQLITE_ERROR) {
-            rc = sqlite3_errcode(handle);
-            csLog::Log(csLog::Debug, "%s: sqlite3_step(%s): %s",
-                __PRETTY_FUNCTION__, "insert_stamp", sqlite3_errstr(rc));
-            throw csEventsDbException(rc, sqlite3_errstr(rc));
-        }
+        update_alert.Step();
 
-        sqlite3_reset(insert_stamp);
+        alert.SetId(hash_id);
     }
-    catch (csException &e) {
-        sqlite3_reset(delete_stamp);
-        sqlite3_reset(insert_stamp);
-        throw;
+
+    // Purge any previoius stamp entries for "auto-resolve" alerts?
+    if (hash_id >= 0 && alert.GetFlags() & csEventsAlert::csAF_FLG_AUTO_RESOLVE) {
+        csEventsDbStatementScope scope(delete_stamp);
+
+        delete_stamp.Bind(delete_stamp_index.aid, alert.GetId());
+        delete_stamp.Step();
     }
+
+    csEventsDbStatementScope scope(insert_stamp);
+
+    insert_stamp.Bind(insert_stamp_index.aid, alert.GetId());
+    insert_stamp.Bind(insert_stamp_index.stamp,
+        static_cast<int64_t>(alert.GetUpdated()));
+    insert_stamp.Step();
 }
 
 void csEventsDb_sqlite::PurgeAlerts(const csEventsAlert &alert, time_t age)
 {
-    int rc, index = 0;
+    csEventsDbStatementScope scope(purge_alerts);
 
-    try {
-        // Max age (alerts)
-        index = sqlite3_bind_parameter_index(purge_alerts, "@max_age");
-        if (index == 0) throw csException(EINVAL, "SQL parameter missing: max_age");
-        if ((rc = sqlite3_bind_int64(purge_alerts,
-            index, static_cast<sqlite3_int64>(age))) != SQLITE_OK)
-            throw csEventsDbException(rc, sqlite3_errstr(rc));
-        // csAF_FLG_RESOLVED (alerts)
-        index = sqlite3_bind_parameter_index(purge_alerts, "@csAF_FLG_RESOLVED");
-        if (index == 0) throw csException(EINVAL, "SQL parameter missing: csAF_FLG_RESOLVED");
-        if ((rc = sqlite3_bind_int64(purge_alerts, index,
-            static_cast<sqlite3_int64>(csEventsAlert::csAF_FLG_RESOLVED))) != SQLITE_OK)
-            throw csEventsDbException(rc, sqlite3_errstr(rc));
+    purge_alerts.Bind("@max_age", static_cast<int64_t>(age));
+    purge_alerts.Bind("@csAF_FLG_RESOLVED",
+        static_cast<int64_t>(csEventsAlert::csAF_FLG_RESOLVED));
 /*
-        // Max age (stamps)
-        index = sqlite3_bind_parameter_index(purge_stamps, "@max_age");
-        if (index == 0) throw csException(EINVAL, "SQL parameter missing: max_age");
-        if ((rc = sqlite3_bind_int64(purge_stamps,
-            index, static_cast<sqlite3_int64>(age))) != SQLITE_OK)
-            throw csEventsDbException(rc, sqlite3_errstr(rc));
-*/
-        // Run purge alerts
-        do {
-            rc = sqlite3_step(purge_alerts);
-            if (rc == SQLITE_BUSY) { usleep(5000); continue; }
-        }
-        while (rc != SQLITE_DONE && rc != SQLITE_ERROR);
+    csEventsDbStatementScope scope_stamps(purge_stamps);
 
-        if (rc == SQLITE_ERROR) {
-            rc = sqlite3_errcode(handle);
-            throw csEventsDbException(rc, sqlite3_errstr(rc));
-        }
+    purge_stamps.Bind("@max_age", static_cast<int64_t>(age));
+*/
+    // Run purge alerts
+    purge_alerts.Step();
 /*
-        // Run purge stamps
-        do {
-            rc = sqlite3_step(purge_stamps);
-            if (rc == SQLITE_BUSY) { usleep(5000); continue; }
+    // Run purge stamps
+    purge_stamps.Step();
+*/
+}
+
+uint32_t csEventsDb_sqlite::PurgeAlerts(uint32_t type, time_t age, uint32_t limit)
+{
+    csEventsDbStatementScope scope(purge_alerts_type);
+
+    purge_alerts_type.Bind("@type", static_cast<int64_t>(type));
+    purge_alerts_type.Bind("@max_age", static_cast<int64_t>(age));
+    purge_alerts_type.Bind("@csAF_FLG_RESOLVED",
+        static_cast<int64_t>(csEventsAlert::csAF_FLG_RESOLVED));
+    purge_alerts_type.Bind("@limit", static_cast<int64_t>(limit));
+
+    // Run purge alerts (alerts_type_updated index range)
+    purge_alerts_type.Step();
+
+    return (uint32_t)sqlite3_changes(handle);
+}
+
+void csEventsDb_sqlite::EnforceLimits(off_t max_size, uint32_t max_alerts)
+{
+    // Eviction order; unresolved critical alerts are never evicted.
+    // A zero mask selects redundant stamps rather than alerts.
+    static const struct {
+        const char *name;
+        uint32_t mask;
+        uint32_t flags;
+    } tiers[] = {
+        { "stamps", 0, 0 },
+        { "resolved normal alerts",
+            _EVENTS_DB_EVICT_MASK,
+            csEventsAlert::csAF_LVL_NORM | csEventsAlert::csAF_FLG_RESOLVED },
+        { "resolved warning alerts",
+            _EVENTS_DB_EVICT_MASK,
+            csEventsAlert::csAF_LVL_WARN | csEventsAlert::csAF_FLG_RESOLVED },
+        { "resolved critical alerts",
+            _EVENTS_DB_EVICT_MASK,
+            csEventsAlert::csAF_LVL_CRIT | csEventsAlert::csAF_FLG_RESOLVED },
+        { "normal alerts",
+            _EVENTS_DB_EVICT_MASK,
+            csEventsAlert::csAF_LVL_NORM },
+        { "warning alerts",
+            _EVENTS_DB_EVICT_MASK,
+            csEventsAlert::csAF_LVL_WARN },
+        { NULL, 0, 0 }
+    };
+
+    PurgeTombstones(_EVENTS_DB_TOMBSTONES_MAX);
+
+    if (max_size == 0 && max_alerts == 0) return;
+
+    uint32_t batches = 0;
+
+    for (int i = 0; tiers[i].name != NULL; i++) {
+        uint32_t evicted = 0;
+
+        while (batches < _EVENTS_DB_EVICT_BATCHES) {
+            int64_t alerts = SelectValue(_EVENTS_DB_SQLITE_SELECT_COUNTER_ALERTS);
+            int64_t size = (max_size > 0) ?
+                SelectValue(_EVENTS_DB_SQLITE_SELECT_DB_SIZE) : 0;
+
+            bool over_size = (max_size > 0 && size > (int64_t)max_size);
+            bool over_alerts = (max_alerts > 0 && alerts > (int64_t)max_alerts);
+
+            if (!over_size && !over_alerts) break;
+            // Evicting stamps doesn't reduce the alert count
+            if (!over_size && tiers[i].mask == 0) break;
+
+            uint32_t limit = _EVENTS_DB_EVICT_BATCH;
+            if (tiers[i].mask != 0 && !over_size &&
+                alerts - (int64_t)max_alerts < (int64_t)limit)
+                limit = (uint32_t)(alerts - (int64_t)max_alerts);
+
+            uint32_t changes = Evict(
+                (tiers[i].mask == 0) ? evict_stamps : evict_alerts,
+                tiers[i].mask, tiers[i].flags, limit);
+
+            batches++;
+            evicted += changes;
+            if (changes == 0) break;
         }
-        while (rc != SQLITE_DONE && rc != SQLITE_ERROR);
 
-        if (rc == SQLITE_ERROR) {
-            rc = sqlite3_errcode(handle);
-            throw csEventsDbException(rc, sqlite3_errstr(rc));
+        if (evicted > 0) {
+            evicted_total[tiers[i].name] += evicted;
+            csLog::Log(csLog::Info,
+                "Database limit exceeded; evicted %u %s (%llu total)",
+                evicted, tiers[i].name,
+                (unsigned long long)evicted_total[tiers[i].name]);
         }
-*/
-        sqlite3_reset(purge_alerts);
-//        sqlite3_reset(purge_stamps);
-    }
-    catch (csException &e) {
-        sqlite3_reset(purge_alerts);
-        sqlite3_reset(purge_stamps);
-        throw;
+
+        if (batches >= _EVENTS_DB_EVICT_BATCHES) break;
     }
 }
 
-void csEventsDb_sqlite::MarkAsResolved(uint32_t type)
+void csEventsDb_sqlite::PurgeTombstones(uint32_t keep)
 {
-    int rc, index = 0;
+    int64_t seq = -1;
 
-    try {
-        // csAF_FLG_RESOLVED
-        index = sqlite3_bind_parameter_index(mark_resolved, "@csAF_FLG_RESOLVED");
-        if (index == 0) throw csException(EINVAL, "SQL parameter missing: csAF_FLG_RESOLVED");
-        if ((rc = sqlite3_bind_int64(mark_resolved, index,
-            static_cast<sqlite3_int64>(csEventsAlert::csAF_FLG_RESOLVED))) != SQLITE_OK)
-            throw csEventsDbException(rc, sqlite3_errstr(rc));
-
-        // Type
-        index = sqlite3_bind_parameter_index(mark_resolved, "@type");
-        if (index == 0) throw csException(EINVAL, "SQL parameter missing: type");
-        if ((rc = sqlite3_bind_int64(mark_resolved,
-            index, static_cast<sqlite3_int64>(type))) != SQLITE_OK)
-            throw csEventsDbException(rc, sqlite3_errstr(rc));
-
-        do {
-            rc = sqlite3_step(mark_resolved);
-            if (rc == SQLITE_BUSY) { usleep(5000); continue; }
-        }
-        while (rc != SQLITE_DONE && rc != SQLITE_ERROR);
+    {
+        csEventsDbStatementScope scope(tombstone_horizon);
 
-        if (rc == SQLITE_ERROR) {
-            rc = sqlite3_errcode(handle);
-            throw csEventsDbException(rc, sqlite3_errstr(rc));
-        }
+        tombstone_horizon.Bind("@keep", static_cast<int64_t>(keep));
 
-        sqlite3_reset(mark_resolved);
+        if (tombstone_horizon.Step() == SQLITE_ROW)
+            seq = tombstone_horizon.GetInt64(0);
     }
-    catch (csException &e) {
-        sqlite3_reset(mark_resolved);
-        throw;
+
+    if (seq < 0) return;
+
+    // Raise the horizon first; readers behind it must reload in full
+    {
+        csEventsDbStatementScope scope(update_horizon);
+
+        update_horizon.Bind("@seq", seq);
+        update_horizon.Step();
     }
+
+    csEventsDbStatementScope scope(purge_tombstones);
+
+    purge_tombstones.Bind("@seq", seq);
+    purge_tombstones.Step();
+
+    csLog::Log(csLog::Debug, "%s: pruned %d tombstone(s) up to: %lld",
+        __PRETTY_FUNCTION__, sqlite3_changes(handle), (long long)seq);
 }
 
-void csEventsDb_sqlite::InsertType(const string &tag, const string &basename)
+int64_t csEventsDb_sqlite::SelectValue(const char *query)
 {
-    int rc, index = 0;
+    int64_t value = 0;
 
-    if (SelectType(tag) != 0) {
-        csLog::Log(csLog::Debug, "%s:%d: Custom type already registered: %s",
-            __PRETTY_FUNCTION__, __LINE__, tag.c_str());
-        return;
+    sql.str("");
+    sql << query;
+    Exec(csEventsDb_sqlite_value, (void *)&value);
+
+    return value;
+}
+
+uint32_t csEventsDb_sqlite::Evict(csEventsDbStatement &stmt,
+    uint32_t mask, uint32_t flags, uint32_t limit)
+{
+    csEventsDbStatementScope scope(stmt);
+
+    if (mask != 0) {
+        stmt.Bind("@mask", static_cast<int64_t>(mask));
+        stmt.Bind("@flags", static_cast<int64_t>(flags));
     }
+    stmt.Bind("@limit", static_cast<int64_t>(limit));
 
-    try {
-        // Tag
-        index = sqlite3_bind_parameter_index(insert_type, "@tag");
-        if (index == 0) throw csException(EINVAL, "SQL parameter missing: tag");
-        if ((rc = sqlite3_bind_text(insert_type, index,
-            tag.c_str(), tag.length(), SQLITE_TRANSIENT)) != SQLITE_OK)
-            throw csEventsDbException(rc, sqlite3_errstr(rc));
-
-        // Basename
-        index = sqlite3_bind_parameter_index(insert_type, "@basename");
-        if (index == 0) throw csException(EINVAL, "SQL parameter missing: basename");
-        if ((rc = sqlite3_bind_text(insert_type, index,
-            basename.c_str(), basename.length(), SQLITE_TRANSIENT)) != SQLITE_OK)
-            throw csEventsDbException(rc, sqlite3_errstr(rc));
-
-        // Run insert type
-        do {
-            rc = sqlite3_step(insert_type);
-            if (rc == SQLITE_BUSY) { usleep(5000); continue; }
-        }
-        while (rc != SQLITE_DONE && rc != SQLITE_ERROR);
+    stmt.Step();
 
-        if (rc == SQLITE_ERROR) {
-            rc = sqlite3_errcode(handle);
-            throw csEventsDbException(rc, sqlite3_errstr(rc));
-        }
+    return (uint32_t)sqlite3_changes(handle);
+}
+
+uint32_t csEventsDb_sqlite::MarkAsResolved(uint32_t type)
+{
+    csEventsDbStatementScope scope(mark_resolved);
+
+    mark_resolved.Bind("@csAF_FLG_RESOLVED",
+        static_cast<int64_t>(csEventsAlert::csAF_FLG_RESOLVED));
+    mark_resolved.Bind("@type", static_cast<int64_t>(type));
+
+    mark_resolved.Step();
+
+    return (uint32_t)sqlite3_changes(handle);
+}
+
+uint32_t csEventsDb_sqlite::MarkAsResolvedById(int64_t id)
+{
+    csEventsDbStatementScope scope(mark_resolved_id);
+
+    mark_resolved_id.Bind("@csAF_FLG_RESOLVED",
+        static_cast<int64_t>(csEventsAlert::csAF_FLG_RESOLVED));
+    mark_resolved_id.Bind("@id", id);
+
+    mark_resolved_id.Step();
+
+    return (uint32_t)sqlite3_changes(handle);
+}
+
+uint32_t csEventsDb_sqlite::MarkAsResolvedByUUID(const string &uuid, uint32_t type)
+{
+    csEventsDbStatementScope scope(mark_resolved_uuid);
+
+    mark_resolved_uuid.Bind("@csAF_FLG_RESOLVED",
+        static_cast<int64_t>(csEventsAlert::csAF_FLG_RESOLVED));
+    mark_resolved_uuid.Bind("@uuid", uuid);
+    mark_resolved_uuid.Bind("@type", static_cast<int64_t>(type));
+
+    // Run mark resolved (alerts_uuid index)
+    mark_resolved_uuid.Step();
+
+    return (uint32_t)sqlite3_changes(handle);
+}
 
-        sqlite3_reset(insert_type);
+uint32_t csEventsDb_sqlite::MarkAsResolvedByHash(const string &hash)
+{
+    csEventsDbStatementScope scope(mark_resolved_hash);
+
+    mark_resolved_hash.Bind("@csAF_FLG_RESOLVED",
+        static_cast<int64_t>(csEventsAlert::csAF_FLG_RESOLVED));
+    mark_resolved_hash.Bind("@hash", hash);
+
+    // Run mark resolved (alerts_hash index)
+    mark_resolved_hash.Step();
+
+    return (uint32_t)sqlite3_changes(handle);
+}
+
+uint32_t csEventsDb_sqlite::SelectSummary(csEventsSummaryVector *result)
+{
+    sql.str("");
+    sql << _EVENTS_DB_SQLITE_SELECT_SUMMARY;
+
+    Exec(csEventsDb_sqlite_select_summary, (void *)result);
+
+    return (uint32_t)result->size();
+}
+
+uint32_t csEventsDb_sqlite::SelectAggregate(csAggregateKey key, uint32_t bucket,
+    const string &where, uint32_t limit, csEventsAggregateVector *result)
+{
+    sql.str("");
+    sql << _EVENTS_DB_SQLITE_SELECT_AGGREGATE;
+
+    switch (key) {
+    case csAK_NONE:
+        sql << "NULL";
+        break;
+    case csAK_TYPE:
+        sql << "alerts.type";
+        break;
+    case csAK_LEVEL:
+        sql << "(alerts.flags & " << (csEventsAlert::csAF_LVL_NORM |
+            csEventsAlert::csAF_LVL_WARN | csEventsAlert::csAF_LVL_CRIT) << ")";
+        break;
+    case csAK_ORIGIN:
+        sql << "ifnull(alerts.origin, '')";
+        break;
+    case csAK_BASENAME:
+        sql << "ifnull(alerts.basename, '')";
+        break;
+    case csAK_BUCKET:
+        if (bucket == 0)
+            throw csEventsDbException(EINVAL, "Invalid aggregate bucket");
+        sql << "(stamps.stamp / @bucket) * @bucket";
+        break;
+    default:
+        throw csEventsDbException(EINVAL, "Invalid aggregate key");
     }
-    catch (csException &e) {
-        sqlite3_reset(insert_type);
-        throw;
+
+    sql << _EVENTS_DB_SQLITE_SELECT_AGGREGATE_FROM << " " << where << ")";
+
+    // A plain count is a single row, even over no alerts at all
+    if (key == csAK_BUCKET)
+        sql << _EVENTS_DB_SQLITE_SELECT_AGGREGATE_BUCKETS;
+    else if (key != csAK_NONE)
+        sql << _EVENTS_DB_SQLITE_SELECT_AGGREGATE_GROUP;
+    else
+        sql << ";";
+
+    // The where clause is the caller's, so this can't be prepared up front
+    csEventsDbStatement select_aggregate(this, "select_aggregate");
+    select_aggregate.Prepare(sql.str().c_str());
+
+    if (key == csAK_BUCKET)
+        select_aggregate.Bind("@bucket", static_cast<int64_t>(bucket));
+    if (key != csAK_NONE)
+        select_aggregate.Bind("@limit", (limit > 0) ? static_cast<int64_t>(limit) : -1);
+
+    while (select_aggregate.Step() == SQLITE_ROW) {
+        csEventsAggregate row;
+
+        row.key = 0;
+        if (key == csAK_ORIGIN || key == csAK_BASENAME)
+            row.name = select_aggregate.GetText(0);
+        else if (! select_aggregate.IsNull(0))
+            row.key = select_aggregate.GetInt64(0);
+        row.count = static_cast<uint32_t>(select_aggregate.GetInt64(1));
+        row.alerts = static_cast<uint32_t>(select_aggregate.GetInt64(2));
+        row.updated = static_cast<time_t>(select_aggregate.GetInt64(3));
+
+        result->push_back(row);
     }
+
+    return (uint32_t)result->size();
 }
 
-void csEventsDb_sqlite::DeleteType(const string &tag)
+uint32_t csEventsDb_sqlite::SelectChanges(uint64_t seq, uint32_t limit,
+    csEventsChangeVector *result, uint64_t *last, uint64_t *horizon)
 {
-    int rc, index = 0;
+    *last = static_cast<uint64_t>(GetLastId("changes"));
+    *horizon = static_cast<uint64_t>(
+        SelectValue(_EVENTS_DB_SQLITE_SELECT_CHANGES_HORIZON));
 
-    try {
-        // Tag
-        index = sqlite3_bind_parameter_index(delete_type, "@tag");
-        if (index == 0) throw csException(EINVAL, "SQL parameter missing: tag");
-        if ((rc = sqlite3_bind_text(delete_type, index,
-            tag.c_str(), tag.length(), SQLITE_TRANSIENT)) != SQLITE_OK)
-            throw csEventsDbException(rc, sqlite3_errstr(rc));
-
-        // Run delete type
-        do {
-            rc = sqlite3_step(delete_type);
-            if (rc == SQLITE_BUSY) { usleep(5000); continue; }
-        }
-        while (rc != SQLITE_DONE && rc != SQLITE_ERROR);
+    csEventsDbStatementScope scope(select_changes);
+
+    select_changes.Bind("@seq", static_cast<int64_t>(seq));
+    select_changes.Bind("@limit", (limit > 0) ? static_cast<int64_t>(limit) : -1);
+
+    while (select_changes.Step() == SQLITE_ROW) {
+        csEventsChange change;
 
-        if (rc == SQLITE_ERROR) {
-            rc = sqlite3_errcode(handle);
-            throw csEventsDbException(rc, sqlite3_errstr(rc));
+        change.seq = static_cast<uint64_t>(select_changes.GetInt64(13));
+        change.id = select_changes.GetInt64(14);
+        change.alert = NULL;
+
+        if (select_changes.GetInt64(15) == 0) {
+            change.alert = ReadAlert(select_changes);
+            ReadAlertGroups(select_changes, 12, change.alert);
         }
 
-        sqlite3_reset(delete_type);
+        result->push_back(change);
     }
-    catch (csException &e) {
-        sqlite3_reset(delete_type);
-        throw;
+
+    return (uint32_t)result->size();
+}
+
+void csEventsDb_sqlite::InsertType(const string &tag,
+    const string &basename, time_t max_age)
+{
+    if (SelectType(tag) != 0) {
+        csLog::Log(csLog::Debug, "%s:%d: Custom type already registered: %s",
+            __PRETTY_FUNCTION__, __LINE__, tag.c_str());
+        return;
     }
+
+    csEventsDbStatementScope scope(insert_type);
+
+    insert_type.Bind("@tag", tag);
+    insert_type.Bind("@basename", basename);
+    insert_type.Bind("@max_age", static_cast<int64_t>(max_age));
+
+    // Run insert type
+    insert_type.Step();
+}
+
+void csEventsDb_sqlite::DeleteType(const string &tag)
+{
+    csEventsDbStatementScope scope(delete_type);
+
+    delete_type.Bind("@tag", tag);
+
+    // Run delete type
+    delete_type.Step();
 }
 
 uint32_t csEventsDb_sqlite::SelectType(const string &tag)
 {
-    int rc, index;
     uint32_t id = 0;
+    csEventsDbStatementScope scope(select_type);
 
-    try {
-        // Type
-        index = sqlite3_bind_parameter_index(select_type, "@tag");
-        if (index == 0) throw csException(EINVAL, "SQL parameter missing: tag");
-        if ((rc = sqlite3_bind_text(select_type, index,
-            tag.c_str(), tag.length(), SQLITE_TRANSIENT)) != SQLITE_OK)
-            throw csEventsDbException(rc, sqlite3_errstr(rc));
-
-        do {
-            rc = sqlite3_step(select_type);
-            if (rc == SQLITE_BUSY) { usleep(5000); continue; }
-            if (rc == SQLITE_ROW) {
-                id = static_cast<uint32_t>(sqlite3_column_int64(select_type, 0));
-                break;
-            }
-        }
-        while (rc != SQLITE_DONE && rc != SQLITE_ERROR);
+    select_type.Bind("@tag", tag);
 
-        if (rc == SQLITE_ERROR) {
-            rc = sqlite3_errcode(handle);
-            csLog::Log(csLog::Debug, "%s: sqlite3_step(%s): %s",
-                __PRETTY_FUNCTION__, "select_type", sqlite3_errstr(rc));
-            throw csEventsDbException(rc, sqlite3_errstr(rc));
-        }
-
-        sqlite3_reset(select_type);
-    }
-    catch (csException &e) {
-        sqlite3_reset(select_type);
-        throw;
-    }
+    if (select_type.Step() == SQLITE_ROW)
+        id = static_cast<uint32_t>(select_type.GetInt64(0));
 
     return id;
 }
@@ -1004,46 +1429,44 @@ uint32_t csEventsDb_sqlite::SelectTypes(csAlertIdMap *result)
     return (uint32_t)result->size();
 }
 
-uint32_t csEventsDb_sqlite::SelectOverride(uint32_t type)
+uint32_t csEventsDb_sqlite::SelectTypeRetention(map<uint32_t, time_t> *result)
 {
-    int rc, index;
-    uint32_t level = csEventsAlert::csAF_NULL;
+    sql.str("");
+    sql << _EVENTS_DB_SQLITE_SELECT_TYPE_RETENTION;
 
-    try {
-        // Type
-        index = sqlite3_bind_parameter_index(select_override, "@type");
-        if (index == 0) throw csException(EINVAL, "SQL parameter missing: type");
-        if ((rc = sqlite3_bind_int64(select_override, index,
-            static_cast<sqlite3_int64>(type))) != SQLITE_OK) {
-            csLog::Log(csLog::Debug, "%s: sqlite3_bind(%s, %s): %s",
-                __PRETTY_FUNCTION__, "select_override", "type", sqlite3_errstr(rc));
-            throw csEventsDbException(rc, sqlite3_errstr(rc));
-        }
+    Exec(csEventsDb_sqlite_select_retention, (void *)result);
 
-        do {
-            rc = sqlite3_step(select_override);
-            if (rc == SQLITE_BUSY) { usleep(5000); continue; }
-            if (rc == SQLITE_ROW) {
-                level = static_cast<uint32_t>(sqlite3_column_int64(select_override, 0));
-                break;
-            }
-        }
-        while (rc != SQLITE_DONE && rc != SQLITE_ERROR);
+    return (uint32_t)result->size();
+}
 
-        if (rc == SQLITE_ERROR) {
-            rc = sqlite3_errcode(handle);
-            csLog::Log(csLog::Debug, "%s: sqlite3_step(%s): %s",
-                __PRETTY_FUNCTION__, "select_override", sqlite3_errstr(rc));
-            throw csEventsDbException(rc, sqlite3_errstr(rc));
+void csEventsDb_sqlite::SetRetention(const map<uint32_t, time_t> &retention)
+{
+    sql.str("");
+    sql << _EVENTS_DB_SQLITE_DELETE_RETENTION;
+
+    if (retention.size()) {
+        sql << _EVENTS_DB_SQLITE_INSERT_RETENTION;
+        for (map<uint32_t, time_t>::const_iterator i = retention.begin();
+            i != retention.end(); i++) {
+            sql << (i == retention.begin() ? " " : ", ") <<
+                "(" << i->first << ", " << (int64_t)i->second << ")";
         }
-
-        sqlite3_reset(select_override);
-    }
-    catch (csException &e) {
-        sqlite3_reset(select_override);
-        throw;
+        sql << ";";
     }
 
+    Exec(csEventsDb_sqlite_exec);
+}
+
+uint32_t csEventsDb_sqlite::SelectOverride(uint32_t type)
+{
+    uint32_t level = csEventsAlert::csAF_NULL;
+    csEventsDbStatementScope scope(select_override);
+
+    select_override.Bind("@type", static_cast<int64_t>(type));
+
+    if (select_override.Step() == SQLITE_ROW)
+        level = static_cast<uint32_t>(select_override.GetInt64(0));
+
     return level;
 }
 
@@ -1059,127 +1482,186 @@ uint32_t csEventsDb_sqlite::SelectOverrides(map<uint32_t, uint32_t> *result)
 
 void csEventsDb_sqlite::InsertOverride(uint32_t type, uint32_t level)
 {
-    int rc, index;
+    csEventsDbStatementScope scope(insert_override);
 
-    try {
-        // Type
-        index = sqlite3_bind_parameter_index(insert_override, "@type");
-        if (index == 0) throw csException(EINVAL, "SQL parameter missing: type");
-        if ((rc = sqlite3_bind_int64(insert_override,
-            index, static_cast<sqlite3_int64>(type))) != SQLITE_OK) {
-            csLog::Log(csLog::Debug, "%s: sqlite3_bind(%s, %s): %s",
-                __PRETTY_FUNCTION__, "insert_override", "type", sqlite3_errstr(rc));
-            throw csEventsDbException(rc, sqlite3_errstr(rc));
-        }
-        // Level
-        index = sqlite3_bind_parameter_index(insert_override, "@level");
-        if (index == 0) throw csException(EINVAL, "SQL parameter missing: level");
-        if ((rc = sqlite3_bind_int64(insert_override,
-            index, static_cast<sqlite3_int64>(level))) != SQLITE_OK) {
-            csLog::Log(csLog::Debug, "%s: sqlite3_bind(%s, %s): %s",
-                __PRETTY_FUNCTION__, "insert_override", "flags", sqlite3_errstr(rc));
-            throw csEventsDbException(rc, sqlite3_errstr(rc));
-        }
+    insert_override.Bind("@type", static_cast<int64_t>(type));
+    insert_override.Bind("@level", static_cast<int64_t>(level));
 
-        do {
-            rc = sqlite3_step(insert_override);
-            if (rc == SQLITE_BUSY) { usleep(5000); continue; }
-        }
-        while (rc != SQLITE_DONE && rc != SQLITE_ERROR);
+    insert_override.Step();
+}
 
-        if (rc == SQLITE_ERROR) {
-            rc = sqlite3_errcode(handle);
-            csLog::Log(csLog::Debug, "%s: sqlite3_step(%s): %s",
-                __PRETTY_FUNCTION__, "insert_override", sqlite3_errstr(rc));
-            throw csEventsDbException(rc, sqlite3_errstr(rc));
-        }
+void csEventsDb_sqlite::UpdateOverride(uint32_t type, uint32_t level)
+{
+    csEventsDbStatementScope scope(update_override);
+
+    update_override.Bind("@type", static_cast<int64_t>(type));
+    update_override.Bind("@level", static_cast<int64_t>(level));
+
+    update_override.Step();
+}
+
+void csEventsDb_sqlite::DeleteOverride(uint32_t type)
+{
+    csEventsDbStatementScope scope(delete_override);
+
+    delete_override.Bind("@type", static_cast<int64_t>(type));
+
+    // Run delete override
+    delete_override.Step();
+}
+
+void csEventsDb_sqlite::BackupBegin(const string &filename)
+{
+    int rc;
+
+    if (backup != NULL)
+        throw csEventsDbException(EBUSY, "Backup already in progress");
 
-        sqlite3_reset(insert_override);
+    // Copy to a temporary file, renamed into place once complete
+    backup_filename = filename;
+    string filename_tmp = backup_filename + ".tmp";
+
+    if ((rc = sqlite3_open(filename_tmp.c_str(), &backup_handle)) != SQLITE_OK) {
+        csLog::Log(csLog::Debug, "%s: sqlite3_open(%s): %s",
+            __PRETTY_FUNCTION__, filename_tmp.c_str(), sqlite3_errstr(rc));
+        BackupEnd();
+        throw csEventsDbException(rc, sqlite3_errstr(rc));
     }
-    catch (csException &e) {
-        sqlite3_reset(insert_override);
-        throw;
+
+    backup = sqlite3_backup_init(backup_handle, "main", handle, "main");
+    if (backup == NULL) {
+        rc = sqlite3_errcode(backup_handle);
+        csLog::Log(csLog::Debug, "%s: sqlite3_backup_init(%s): %s",
+            __PRETTY_FUNCTION__, filename_tmp.c_str(), sqlite3_errstr(rc));
+        BackupEnd();
+        throw csEventsDbException(rc, sqlite3_errstr(rc));
     }
 }
 
-void csEventsDb_sqlite::UpdateOverride(uint32_t type, uint32_t level)
+bool csEventsDb_sqlite::BackupStep(int pages, uint32_t &remaining, uint32_t &total)
 {
-    int rc, index;
+    if (backup == NULL) return false;
 
-    try {
-        // Type
-        index = sqlite3_bind_parameter_index(update_override, "@type");
-        if (index == 0) throw csException(EINVAL, "SQL parameter missing: type");
-        if ((rc = sqlite3_bind_int64(update_override,
-            index, static_cast<sqlite3_int64>(type))) != SQLITE_OK) {
-            csLog::Log(csLog::Debug, "%s: sqlite3_bind(%s, %s): %s",
-                __PRETTY_FUNCTION__, "update_override", "type", sqlite3_errstr(rc));
-            throw csEventsDbException(rc, sqlite3_errstr(rc));
-        }
-        // Level
-        index = sqlite3_bind_parameter_index(update_override, "@level");
-        if (index == 0) throw csException(EINVAL, "SQL parameter missing: level");
-        if ((rc = sqlite3_bind_int64(update_override,
-            index, static_cast<sqlite3_int64>(level))) != SQLITE_OK) {
-            csLog::Log(csLog::Debug, "%s: sqlite3_bind(%s, %s): %s",
-                __PRETTY_FUNCTION__, "update_override", "level", sqlite3_errstr(rc));
-            throw csEventsDbException(rc, sqlite3_errstr(rc));
-        }
+    int rc = sqlite3_backup_step(backup, pages);
 
-        do {
-            rc = sqlite3_step(update_override);
-            if (rc == SQLITE_BUSY) { usleep(5000); continue; }
-        }
-        while (rc != SQLITE_DONE && rc != SQLITE_ERROR);
+    remaining = (uint32_t)sqlite3_backup_remaining(backup);
+    total = (uint32_t)sqlite3_backup_pagecount(backup);
 
-        if (rc == SQLITE_ERROR) {
-            rc = sqlite3_errcode(handle);
-            csLog::Log(csLog::Debug, "%s: sqlite3_step(%s): %s",
-                __PRETTY_FUNCTION__, "update_override", sqlite3_errstr(rc));
-            throw csEventsDbException(rc, sqlite3_errstr(rc));
-        }
+    // Source locked by another connection; try again next step
+    if (rc == SQLITE_OK || rc == SQLITE_BUSY || rc == SQLITE_LOCKED)
+        return true;
 
-        sqlite3_reset(update_override);
+    if (rc != SQLITE_DONE) {
+        csLog::Log(csLog::Debug, "%s: sqlite3_backup_step(%s): %s",
+            __PRETTY_FUNCTION__, backup_filename.c_str(), sqlite3_errstr(rc));
+        BackupEnd();
+        throw csEventsDbException(rc, sqlite3_errstr(rc));
     }
-    catch (csException &e) {
-        sqlite3_reset(update_override);
-        throw;
+
+    string filename_tmp = backup_filename + ".tmp";
+
+    sqlite3_backup_finish(backup);
+    backup = NULL;
+    sqlite3_close(backup_handle);
+    backup_handle = NULL;
+
+    if (rename(filename_tmp.c_str(), backup_filename.c_str()) < 0) {
+        rc = errno;
+        csLog::Log(csLog::Debug, "%s: rename(%s): %s",
+            __PRETTY_FUNCTION__, backup_filename.c_str(), strerror(rc));
+        unlink(filename_tmp.c_str());
+        throw csEventsDbException(rc, strerror(rc));
     }
+
+    return false;
 }
 
-void csEventsDb_sqlite::DeleteOverride(uint32_t type)
+void csEventsDb_sqlite::BackupEnd(void)
 {
-    int rc, index = 0;
+    if (backup == NULL && backup_handle == NULL) return;
 
-    try {
-        // Type
-        index = sqlite3_bind_parameter_index(delete_override, "@type");
-        if (index == 0) throw csException(EINVAL, "SQL parameter missing: type");
-        if ((rc = sqlite3_bind_int64(delete_override,
-            index, static_cast<sqlite3_int64>(type))) != SQLITE_OK) {
-            csLog::Log(csLog::Debug, "%s: sqlite3_bind(%s, %s): %s",
-                __PRETTY_FUNCTION__, "delete_override", "type", sqlite3_errstr(rc));
-            throw csEventsDbException(rc, sqlite3_errstr(rc));
-        }
+    // Abandon an incomplete backup
+    if (backup != NULL) sqlite3_backup_finish(backup);
+    if (backup_handle != NULL) sqlite3_close(backup_handle);
+    backup = NULL;
+    backup_handle = NULL;
 
-        // Run delete type
-        do {
-            rc = sqlite3_step(delete_override);
-            if (rc == SQLITE_BUSY) { usleep(5000); continue; }
-        }
-        while (rc != SQLITE_DONE && rc != SQLITE_ERROR);
+    unlink((backup_filename + ".tmp").c_str());
+}
 
-        if (rc == SQLITE_ERROR) {
-            rc = sqlite3_errcode(handle);
-            throw csEventsDbException(rc, sqlite3_errstr(rc));
-        }
+int csEventsDb_sqlite::BusyHandler(int count)
+{
+    uint64_t now = csEventsDb_sqlite_msec();
 
-        sqlite3_reset(delete_override);
+    if (count == 0) {
+        busy_start = now;
+        if (busy_stats != NULL) busy_stats->busy++;
     }
-    catch (csException &e) {
-        sqlite3_reset(delete_override);
-        throw;
+
+    uint64_t elapsed = now - busy_start;
+    if (busy_deadline > 0 && elapsed >= busy_deadline) {
+        if (busy_stats != NULL) busy_stats->timeouts++;
+        csLog::Log(csLog::Debug, "%s: Database locked for %llums",
+            __PRETTY_FUNCTION__, (unsigned long long)elapsed);
+        return 0;
     }
+
+    // Exponential back-off, capped, and never sleeping past the deadline
+    uint64_t delay = _EVENTS_DB_BUSY_DELAY_MAX;
+    if (count < 16) delay = (uint64_t)_EVENTS_DB_BUSY_DELAY_MIN << count;
+    if (delay > _EVENTS_DB_BUSY_DELAY_MAX) delay = _EVENTS_DB_BUSY_DELAY_MAX;
+    if (busy_deadline > 0 && elapsed + delay > busy_deadline)
+        delay = busy_deadline - elapsed;
+
+    usleep((useconds_t)(delay * 1000));
+    if (busy_stats != NULL) busy_stats->wait_ms += delay;
+
+    return 1;
+}
+
+int csEventsDb_sqlite::Step(sqlite3_stmt *stmt,
+    const char *name, csEventsDbStepStats *stats)
+{
+    stats->steps++;
+
+    busy_stats = stats;
+    int rc = sqlite3_step(stmt);
+    busy_stats = NULL;
+
+    if (rc == SQLITE_ROW || rc == SQLITE_DONE) return rc;
+
+    csLog::Log(csLog::Debug, "%s: sqlite3_step(%s): %s",
+        __PRETTY_FUNCTION__, name, sqlite3_errmsg(handle));
+    throw csEventsDbException(rc, sqlite3_errstr(rc));
+}
+
+bool csEventsDb_sqlite::IsUnavailable(const csEventsDbException &e)
+{
+    switch (e.eint & 0xff) {
+    case SQLITE_BUSY:
+    case SQLITE_LOCKED:
+    case SQLITE_IOERR:
+    case SQLITE_CANTOPEN:
+    case SQLITE_FULL:
+        return true;
+    }
+
+    return false;
+}
+
+void csEventsDb_sqlite::GetStats(csEventsStatsMap &stats)
+{
+    for (map<string, csEventsDbStepStats>::iterator i = step_stats.begin();
+        i != step_stats.end(); i++) {
+        stats["sqlite." + i->first + ".steps"] = i->second.steps;
+        stats["sqlite." + i->first + ".busy"] = i->second.busy;
+        stats["sqlite." + i->first + ".timeouts"] = i->second.timeouts;
+        stats["sqlite." + i->first + ".wait_ms"] = i->second.wait_ms;
+    }
+
+    for (map<string, uint64_t>::iterator i = evicted_total.begin();
+        i != evicted_total.end(); i++)
+        stats["evicted." + i->first] = i->second;
 }
 
 void csEventsDb_sqlite::Exec(int (*callback)(void *, int, char**, char **), void *param)
@@ -1190,12 +1672,13 @@ void csEventsDb_sqlite::Exec(int (*callback)(void *, int, char**, char **), void
         __PRETTY_FUNCTION__, __LINE__, handle, sql.str().c_str());
 
     char *es = NULL;
-    do {
-        rc = sqlite3_exec(handle, sql.str().c_str(), callback, param, &es);
-        if (rc == SQLITE_BUSY) usleep(5000);
-        else break;
-    }
-    while (rc != SQLITE_OK);
+    csEventsDbStepStats *stats = &step_stats["exec"];
+
+    stats->steps++;
+
+    busy_stats = stats;
+    rc = sqlite3_exec(handle, sql.str().c_str(), callback, param, &es);
+    busy_stats = NULL;
 
     if (rc != SQLITE_OK) {
         errstr.str("");
@@ -22,6 +22,20 @@
 #define _EVENTS_DB_SQLITE_USER      "clearsync"
 #define _EVENTS_DB_SQLITE_GROUP     "webconfig"
 
+// Eviction: rows deleted per statement, and statements per EnforceLimits()
+#define _EVENTS_DB_EVICT_BATCH      256
+#define _EVENTS_DB_EVICT_BATCHES    64
+// Level bits (csAF_LVL_*) and csAF_FLG_RESOLVED
+#define _EVENTS_DB_EVICT_MASK       0x00000207
+
+// Lock waits: back-off from/to (ms), and the default deadline (ms)
+#define _EVENTS_DB_BUSY_DELAY_MIN   1
+#define _EVENTS_DB_BUSY_DELAY_MAX   64
+#define _EVENTS_DB_BUSY_DEADLINE    2000
+
+// Change tombstones retained for delta readers
+#define _EVENTS_DB_TOMBSTONES_MAX   16384
+
 class csEventsDbException : public csException
 {
 public:
@@ -29,12 +43,72 @@ public:
         : csException(e, s) { }
 };
 
+typedef struct {
+    uint32_t type;
+    uint32_t level;
+    bool resolved;
+    uint32_t count;
+    time_t updated;
+} csEventsSummary;
+
+typedef vector<csEventsSummary> csEventsSummaryVector;
+
+// One aggregate group: key is the type, level or bucket start (name holds
+// the origin or basename instead), count the matching rows, as select
+// would return them, and alerts the distinct alerts among them
+typedef struct {
+    int64_t key;
+    string name;
+    uint32_t count;
+    uint32_t alerts;
+    time_t updated;
+} csEventsAggregate;
+
+typedef vector<csEventsAggregate> csEventsAggregateVector;
+
+typedef map<string, uint64_t> csEventsStatsMap;
+
+// A changed alert; alert is NULL for a tombstone (the alert was deleted)
+typedef struct {
+    uint64_t seq;
+    int64_t id;
+    csEventsAlert *alert;
+} csEventsChange;
+
+typedef vector<csEventsChange> csEventsChangeVector;
+
+typedef struct {
+    uint64_t steps;
+    uint64_t busy;
+    uint64_t timeouts;
+    uint64_t wait_ms;
+} csEventsDbStepStats;
+
 class csEventsDb
 {
 public:
     enum csDbType {
         csDBT_NULL,
         csDBT_SQLITE,
+        csDBT_LOG,
+    };
+
+    enum csResolveKey {
+        csRK_TYPE,
+        csRK_ID,
+        csRK_UUID,
+        csRK_HASH,
+        csRK_MAX
+    };
+
+    enum csAggregateKey {
+        csAK_NONE,
+        csAK_TYPE,
+        csAK_LEVEL,
+        csAK_ORIGIN,
+        csAK_BASENAME,
+        csAK_BUCKET,
+        csAK_MAX
     };
 
     csEventsDb(csDbType type = csDBT_NULL);
@@ -46,16 +120,61 @@ public:
     virtual void Drop(void) { }
     virtual int64_t GetLastId(const string &table) { return 0; }
 
+    virtual void Begin(void) { }
+    virtual void Commit(void) { }
+    virtual void Rollback(void) { }
+    virtual void SetBusyDeadline(uint32_t ms) { }
+    virtual void GetStats(csEventsStatsMap &stats) { }
+
+    // Did this fail because the database can't be reached or written
+    // right now (locked, I/O, out of space), rather than the request?
+    virtual bool IsUnavailable(const csEventsDbException &e) { return false; }
+
     virtual uint32_t SelectAlert(const string &where, vector<csEventsAlert *> *result) { return 0; }
+    virtual uint32_t SearchAlerts(const string &query, uint32_t limit,
+        vector<csEventsAlert *> *result) { return 0; }
+    virtual uint32_t SelectAlertsByGroup(gid_t gid, uint32_t limit,
+        vector<csEventsAlert *> *result) { return 0; }
     virtual void InsertAlert(csEventsAlert &alert) { }
     virtual void UpdateAlert(const csEventsAlert &alert) { }
     virtual void PurgeAlerts(const csEventsAlert &alert, time_t age) { }
+    virtual uint32_t PurgeAlerts(uint32_t type, time_t age, uint32_t limit) { return 0; }
+    virtual void EnforceLimits(off_t max_size, uint32_t max_alerts) { }
+
+    virtual uint32_t MarkAsResolved(uint32_t type) { return 0; }
+    virtual uint32_t MarkAsResolvedById(int64_t id) { return 0; }
+    virtual uint32_t MarkAsResolvedByUUID(const string &uuid, uint32_t type = 0) { return 0; }
+    virtual uint32_t MarkAsResolvedByHash(const string &hash) { return 0; }
+    uint32_t ResolveAlerts(csResolveKey key,
+        const vector<string> &values, uint32_t type = 0);
 
-    virtual void MarkAsResolved(uint32_t type) { };
+    virtual uint32_t SelectSummary(csEventsSummaryVector *result) { return 0; }
 
-    virtual void InsertType(const string &tag, const string &basename) { }
+    // Count the alerts select would return for where, grouped by key (one
+    // row for csAK_NONE); time buckets are bucket seconds wide, newest
+    // first, other groups largest first.  Zero limit: all groups.
+    virtual uint32_t SelectAggregate(csAggregateKey key, uint32_t bucket,
+        const string &where, uint32_t limit, csEventsAggregateVector *result)
+    {
+        throw csEventsDbException(EINVAL,
+            "Aggregates not supported by database type");
+    }
+
+    // Changes after seq, oldest first.  Readers must reload everything
+    // when seq is below horizon (tombstones pruned) or above last (reset).
+    virtual uint32_t SelectChanges(uint64_t seq, uint32_t limit,
+        csEventsChangeVector *result, uint64_t *last, uint64_t *horizon)
+    {
+        throw csEventsDbException(EINVAL,
+            "Change tracking not supported by database type");
+    }
+
+    virtual void InsertType(const string &tag,
+        const string &basename, time_t max_age = 0) { }
     virtual void DeleteType(const string &tag) { }
     virtual uint32_t SelectTypes(map<uint32_t, string> *result) { return 0; }
+    virtual uint32_t SelectTypeRetention(map<uint32_t, time_t> *result) { return 0; }
+    virtual void SetRetention(const map<uint32_t, time_t> &retention) { }
 
     virtual uint32_t SelectOverride(uint32_t type) { return 0; }
     virtual uint32_t SelectOverrides(map<uint32_t, uint32_t> *result) { return 0; }
@@ -63,16 +182,83 @@ public:
     virtual void UpdateOverride(uint32_t type, uint32_t level) { }
     virtual void DeleteOverride(uint32_t type) { }
 
+    virtual void BackupBegin(const string &filename)
+    {
+        throw csEventsDbException(EINVAL, "Backup not supported by database type");
+    }
+    virtual bool BackupStep(int pages, uint32_t &remaining, uint32_t &total) { return false; }
+    virtual void BackupEnd(void) { }
+
 protected:
     csDbType type;
 };
 
 typedef map<string, string> csEventsDb_sqlite_result;
 
+class csEventsDb_sqlite;
+class csEventsDbStatement
+{
+public:
+    csEventsDbStatement(csEventsDb_sqlite *db, const char *name)
+        : db(db), name(name), stmt(NULL), stats(NULL) { }
+    virtual ~csEventsDbStatement() { Finalize(); }
+
+    void Prepare(const char *query);
+    void Finalize(void);
+
+    const char *GetName(void) const { return name; }
+
+    // Parameter indexes don't change once prepared; hot paths resolve
+    // them with GetIndex() after Prepare() and bind by index.
+    int GetIndex(const char *param);
+
+    // Text is bound without a copy; it must stay valid until Reset()
+    void Bind(int index, int64_t value);
+    void Bind(int index, const char *value, size_t length);
+    void Bind(int index, const string &value)
+        { Bind(index, value.c_str(), value.length()); }
+    void BindNull(int index);
+
+    void Bind(const char *param, int64_t value)
+        { Bind(GetIndex(param), value); }
+    void Bind(const char *param, const char *value, size_t length)
+        { Bind(GetIndex(param), value, length); }
+    void Bind(const char *param, const string &value)
+        { Bind(GetIndex(param), value.c_str(), value.length()); }
+    void BindNull(const char *param) { BindNull(GetIndex(param)); }
+
+    int Step(void);
+    void Reset(void);
+
+    bool IsNull(int column) { return sqlite3_column_type(stmt, column) == SQLITE_NULL; }
+    int64_t GetInt64(int column)
+        { return static_cast<int64_t>(sqlite3_column_int64(stmt, column)); }
+    const char *GetText(int column)
+        { return (const char *)sqlite3_column_text(stmt, column); }
+
+protected:
+    csEventsDb_sqlite *db;
+    const char *name;
+    sqlite3_stmt *stmt;
+    csEventsDbStepStats *stats;
+};
+
+// Resets a statement (and clears its bindings) when leaving scope
+class csEventsDbStatementScope
+{
+public:
+    csEventsDbStatementScope(csEventsDbStatement &stmt) : stmt(stmt) { }
+    ~csEventsDbStatementScope() { stmt.Reset(); }
+
+protected:
+    csEventsDbStatement &stmt;
+};
+
 class csEventsDb_sqlite : public csEventsDb
 {
 public:
-    csEventsDb_sqlite(const string &db_filename);
+    csEventsDb_sqlite(const string &db_filename,
+        bool fts = false, bool templates = false);
     virtual ~csEventsDb_sqlite() { Close(); };
 
     void Open(void);
@@ -81,16 +267,41 @@ public:
     void Drop(void);
     virtual int64_t GetLastId(const string &table);
 
+    void Begin(void);
+    void Commit(void);
+    void Rollback(void);
+    void SetBusyDeadline(uint32_t ms) { busy_deadline = ms; }
+    void GetStats(csEventsStatsMap &stats);
+    bool IsUnavailable(const csEventsDbException &e);
+    int BusyHandler(int count);
+
     uint32_t SelectAlert(const string &where, vector<csEventsAlert *> *result);
+    uint32_t SearchAlerts(const string &query, uint32_t limit,
+        vector<csEventsAlert *> *result);
+    uint32_t SelectAlertsByGroup(gid_t gid, uint32_t limit,
+        vector<csEventsAlert *> *result);
     void InsertAlert(csEventsAlert &alert);
     void PurgeAlerts(const csEventsAlert &alert, time_t age);
+    uint32_t PurgeAlerts(uint32_t type, time_t age, uint32_t limit);
+    void EnforceLimits(off_t max_size, uint32_t max_alerts);
 
-    void MarkAsResolved(uint32_t type);
+    uint32_t MarkAsResolved(uint32_t type);
+    uint32_t MarkAsResolvedById(int64_t id);
+    uint32_t MarkAsResolvedByUUID(const string &uuid, uint32_t type = 0);
+    uint32_t MarkAsResolvedByHash(const string &hash);
 
-    void InsertType(const string &tag, const string &basename);
+    uint32_t SelectSummary(csEventsSummaryVector *result);
+    uint32_t SelectAggregate(csAggregateKey key, uint32_t bucket,
+        const string &where, uint32_t limit, csEventsAggregateVector *result);
+    uint32_t SelectChanges(uint64_t seq, uint32_t limit,
+        csEventsChangeVector *result, uint64_t *last, uint64_t *horizon);
+
+    void InsertType(const string &tag, const string &basename, time_t max_age = 0);
     void DeleteType(const string &tag);
     uint32_t SelectType(const string &tag);
     uint32_t SelectTypes(map<uint32_t, string> *result);
+    uint32_t SelectTypeRetention(map<uint32_t, time_t> *result);
+    void SetRetention(const map<uint32_t, time_t> &retention);
 
     uint32_t SelectOverride(uint32_t type);
     uint32_t SelectOverrides(map<uint32_t, uint32_t> *result);
@@ -98,28 +309,94 @@ public:
     void UpdateOverride(uint32_t type, uint32_t level);
     void DeleteOverride(uint32_t type);
 
+    void BackupBegin(const string &filename);
+    bool BackupStep(int pages, uint32_t &remaining, uint32_t &total);
+    void BackupEnd(void);
+
 protected:
+    friend class csEventsDbStatement;
+
     void Exec(int (*callback)(void *, int, char **, char **), void *param = NULL);
+    int Step(sqlite3_stmt *stmt, const char *name, csEventsDbStepStats *stats);
+    void CreateFullTextSearch(void);
+    void CreateTemplates(void);
+    void CreateRetention(void);
+    int64_t SelectValue(const char *query);
+    uint32_t Evict(csEventsDbStatement &stmt,
+        uint32_t mask, uint32_t flags, uint32_t limit);
+    int64_t SelectTemplate(const string &text);
+    csEventsAlert *ReadAlert(csEventsDbStatement &stmt);
+    void ReadAlertGroups(csEventsDbStatement &stmt, int column, csEventsAlert *alert);
+    void PurgeTombstones(uint32_t keep);
 
     sqlite3 *handle;
-    sqlite3_stmt *insert_alert;
-    sqlite3_stmt *update_alert;
-    sqlite3_stmt *purge_alerts;
-    sqlite3_stmt *insert_stamp;
-    sqlite3_stmt *delete_stamp;
-    sqlite3_stmt *purge_stamps;
-    sqlite3_stmt *last_id;
-    sqlite3_stmt *mark_resolved;
-    sqlite3_stmt *select_by_hash;
-    sqlite3_stmt *insert_type;
-    sqlite3_stmt *delete_type;
-    sqlite3_stmt *select_type;
-    sqlite3_stmt *select_override;
-    sqlite3_stmt *insert_override;
-    sqlite3_stmt *update_override;
-    sqlite3_stmt *delete_override;
+    bool transaction;
+    uint32_t busy_deadline;
+    uint64_t busy_start;
+    csEventsDbStepStats *busy_stats;
+    map<string, csEventsDbStepStats> step_stats;
+    csEventsDbStatement insert_alert;
+    csEventsDbStatement update_alert;
+    csEventsDbStatement purge_alerts;
+    csEventsDbStatement purge_alerts_type;
+    csEventsDbStatement insert_stamp;
+    csEventsDbStatement delete_stamp;
+    csEventsDbStatement insert_group;
+    csEventsDbStatement purge_stamps;
+    csEventsDbStatement last_id;
+    csEventsDbStatement mark_resolved;
+    csEventsDbStatement mark_resolved_id;
+    csEventsDbStatement mark_resolved_uuid;
+    csEventsDbStatement mark_resolved_hash;
+    csEventsDbStatement select_by_hash;
+    csEventsDbStatement insert_type;
+    csEventsDbStatement delete_type;
+    csEventsDbStatement select_type;
+    csEventsDbStatement select_override;
+    csEventsDbStatement insert_override;
+    csEventsDbStatement update_override;
+    csEventsDbStatement delete_override;
+    csEventsDbStatement search_alerts;
+    csEventsDbStatement select_group;
+    csEventsDbStatement select_template;
+    csEventsDbStatement insert_template;
+    csEventsDbStatement evict_stamps;
+    csEventsDbStatement evict_alerts;
+    csEventsDbStatement select_changes;
+    csEventsDbStatement tombstone_horizon;
+    csEventsDbStatement update_horizon;
+    csEventsDbStatement purge_tombstones;
+    map<string, uint64_t> evicted_total;
+
+    // Insert path parameter indexes, resolved once in Create()
+    struct {
+        int hash;
+    } select_by_hash_index;
+    struct {
+        int created, updated, hash, flags, type, user;
+        int origin, basename, uuid, desc, tid, params;
+    } insert_alert_index;
+    struct {
+        int id, stamp, flags, desc, tid, params;
+    } update_alert_index;
+    struct {
+        int id, gid;
+    } insert_group_index;
+    struct {
+        int aid, stamp;
+    } insert_stamp_index;
+    struct {
+        int aid;
+    } delete_stamp_index;
 
     string db_filename;
+    bool fts;
+    bool templates;
+    map<string, int64_t> template_ids;
+
+    sqlite3 *backup_handle;
+    sqlite3_backup *backup;
+    string backup_filename;
     ostringstream sql;
     ostringstream errstr;
     csEventsDb_sqlite_result result;
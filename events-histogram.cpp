@@ -0,0 +1,300 @@
+// ClearSync: System Monitor plugin.
+// Copyright (C) 2011 ClearFoundation <http://www.clearfoundation.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <clearsync/csplugin.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <openssl/sha.h>
+
+#include "events-alert.h"
+#include "events-histogram.h"
+
+csEventsHistogram::csEventsHistogram(const string &filename)
+    : filename(filename), dirty(false)
+{
+}
+
+csEventsHistogram::~csEventsHistogram()
+{
+    Clear();
+}
+
+time_t csEventsHistogram::GetWidth(csEventsHistogramResolution resolution)
+{
+    switch (resolution) {
+    case csHR_MINUTE:
+        return 60;
+    case csHR_HOUR:
+        return 3600;
+    case csHR_DAY:
+        return 86400;
+    default:
+        break;
+    }
+
+    return 0;
+}
+
+uint32_t csEventsHistogram::GetLength(csEventsHistogramResolution resolution)
+{
+    switch (resolution) {
+    case csHR_MINUTE:
+        return _EVENTS_HISTOGRAM_MINUTES;
+    case csHR_HOUR:
+        return _EVENTS_HISTOGRAM_HOURS;
+    case csHR_DAY:
+        return _EVENTS_HISTOGRAM_DAYS;
+    default:
+        break;
+    }
+
+    return 0;
+}
+
+void csEventsHistogram::Load(void)
+{
+    csEventsHistogramFileHeader header;
+
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        if (errno != ENOENT) {
+            csLog::Log(csLog::Warning, "%s: %s: %s",
+                __PRETTY_FUNCTION__, filename.c_str(), strerror(errno));
+        }
+        return;
+    }
+
+    Clear();
+
+    if (read(fd, &header, sizeof(csEventsHistogramFileHeader)) !=
+        sizeof(csEventsHistogramFileHeader) ||
+        header.magic != _EVENTS_HISTOGRAM_MAGIC ||
+        header.version != _EVENTS_HISTOGRAM_VERSION ||
+        header.minutes != _EVENTS_HISTOGRAM_MINUTES ||
+        header.hours != _EVENTS_HISTOGRAM_HOURS ||
+        header.days != _EVENTS_HISTOGRAM_DAYS) {
+        csLog::Log(csLog::Warning, "%s: %s: Invalid or incompatible histogram",
+            __PRETTY_FUNCTION__, filename.c_str());
+        close(fd);
+        return;
+    }
+
+    for (uint32_t i = 0; i < header.types; i++) {
+        uint32_t type;
+        csEventsHistogramRings *entry = new csEventsHistogramRings;
+
+        if (read(fd, &type, sizeof(uint32_t)) != sizeof(uint32_t) ||
+            read(fd, entry, sizeof(csEventsHistogramRings)) !=
+            sizeof(csEventsHistogramRings)) {
+            csLog::Log(csLog::Warning, "%s: %s: Truncated histogram",
+                __PRETTY_FUNCTION__, filename.c_str());
+            delete entry;
+            break;
+        }
+
+        csEventsHistogramRingMap::iterator j = rings.find(type);
+        if (j != rings.end()) delete j->second;
+        rings[type] = entry;
+    }
+
+    close(fd);
+
+    dirty = false;
+}
+
+void csEventsHistogram::Save(void)
+{
+    csEventsHistogramFileHeader header;
+    string filename_tmp = filename + ".tmp";
+
+    int fd = open(filename_tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC,
+        S_IRUSR | S_IWUSR | S_IRGRP);
+    if (fd < 0) {
+        csLog::Log(csLog::Error, "%s: %s: %s",
+            __PRETTY_FUNCTION__, filename_tmp.c_str(), strerror(errno));
+        return;
+    }
+
+    header.magic = _EVENTS_HISTOGRAM_MAGIC;
+    header.version = _EVENTS_HISTOGRAM_VERSION;
+    header.minutes = _EVENTS_HISTOGRAM_MINUTES;
+    header.hours = _EVENTS_HISTOGRAM_HOURS;
+    header.days = _EVENTS_HISTOGRAM_DAYS;
+    header.types = (uint32_t)rings.size();
+
+    bool error = (write(fd, &header, sizeof(csEventsHistogramFileHeader)) !=
+        sizeof(csEventsHistogramFileHeader));
+
+    for (csEventsHistogramRingMap::iterator i = rings.begin();
+        !error && i != rings.end(); i++) {
+        error = (write(fd, &i->first, sizeof(uint32_t)) != sizeof(uint32_t) ||
+            write(fd, i->second, sizeof(csEventsHistogramRings)) !=
+            sizeof(csEventsHistogramRings));
+    }
+
+    if (error) {
+        csLog::Log(csLog::Error, "%s: %s: %s",
+            __PRETTY_FUNCTION__, filename_tmp.c_str(), strerror(errno));
+        close(fd);
+        unlink(filename_tmp.c_str());
+        return;
+    }
+
+    close(fd);
+
+    if (rename(filename_tmp.c_str(), filename.c_str()) < 0) {
+        csLog::Log(csLog::Error, "%s: %s: %s",
+            __PRETTY_FUNCTION__, filename.c_str(), strerror(errno));
+        return;
+    }
+
+    dirty = false;
+}
+
+void csEventsHistogram::Add(uint32_t type, uint32_t flags, time_t stamp)
+{
+    uint32_t level;
+
+    if (flags & csEventsAlert::csAF_LVL_CRIT) level = 2;
+    else if (flags & csEventsAlert::csAF_LVL_WARN) level = 1;
+    else level = 0;
+
+    csEventsHistogramRings *entry;
+    csEventsHistogramRingMap::iterator i = rings.find(type);
+
+    if (i != rings.end()) entry = i->second;
+    else {
+        entry = new csEventsHistogramRings;
+        memset(entry, 0, sizeof(csEventsHistogramRings));
+        rings[type] = entry;
+    }
+
+    for (int r = 0; r < csHR_MAX; r++) {
+        csEventsHistogramResolution resolution = (csEventsHistogramResolution)r;
+        int64_t bucket = (int64_t)stamp / GetWidth(resolution);
+        uint32_t length = GetLength(resolution);
+
+        Advance(entry, resolution, bucket);
+
+        // Too old for this ring
+        if (bucket <= entry->head[r] - length) continue;
+
+        GetRing(entry, resolution, level)[bucket % length]++;
+    }
+
+    dirty = true;
+}
+
+void csEventsHistogram::Select(csEventsHistogramResolution resolution,
+    time_t from, time_t to, const vector<uint32_t> &types,
+    csEventsHistogramSeriesVector &result)
+{
+    time_t width = GetWidth(resolution);
+    uint32_t length = GetLength(resolution);
+    if (width == 0 || length == 0) return;
+
+    // Clamp the range to what a ring can hold, counting back from now
+    int64_t last = (int64_t)((to > 0) ? to : time(NULL)) / width;
+    int64_t first = (int64_t)from / width;
+    if (first <= last - length) first = last - length + 1;
+    if (first > last) return;
+
+    vector<uint32_t> selected = types;
+    if (selected.size() == 0) {
+        for (csEventsHistogramRingMap::iterator i = rings.begin();
+            i != rings.end(); i++) selected.push_back(i->first);
+    }
+
+    for (vector<uint32_t>::iterator i = selected.begin(); i != selected.end(); i++) {
+        csEventsHistogramRingMap::iterator j = rings.find(*i);
+        if (j == rings.end()) continue;
+
+        int64_t head = j->second->head[resolution];
+
+        for (uint32_t level = 0; level < _EVENTS_HISTOGRAM_LEVELS; level++) {
+            uint32_t *ring = GetRing(j->second, resolution, level);
+
+            csEventsHistogramSeries series;
+            series.type = (*i);
+            series.level = (1 << level);
+            series.start = (time_t)(first * width);
+            series.width = width;
+
+            bool empty = true;
+            for (int64_t bucket = first; bucket <= last; bucket++) {
+                uint32_t count = 0;
+                if (bucket <= head && bucket > head - length)
+                    count = ring[bucket % length];
+                if (count) empty = false;
+                series.counts.push_back(count);
+            }
+
+            if (!empty) result.push_back(series);
+        }
+    }
+}
+
+uint32_t *csEventsHistogram::GetRing(csEventsHistogramRings *rings,
+    csEventsHistogramResolution resolution, uint32_t level)
+{
+    switch (resolution) {
+    case csHR_MINUTE:
+        return rings->minutes[level];
+    case csHR_HOUR:
+        return rings->hours[level];
+    case csHR_DAY:
+        return rings->days[level];
+    default:
+        break;
+    }
+
+    return NULL;
+}
+
+void csEventsHistogram::Advance(csEventsHistogramRings *rings,
+    csEventsHistogramResolution resolution, int64_t bucket)
+{
+    int64_t head = rings->head[resolution];
+    if (bucket <= head) return;
+
+    uint32_t length = GetLength(resolution);
+
+    // Zero the buckets being re-used; a jump of a full ring clears it all
+    int64_t start = (bucket - head > length) ? bucket - length + 1 : head + 1;
+    for (int64_t b = start; b <= bucket; b++) {
+        for (uint32_t level = 0; level < _EVENTS_HISTOGRAM_LEVELS; level++)
+            GetRing(rings, resolution, level)[b % length] = 0;
+    }
+
+    rings->head[resolution] = bucket;
+}
+
+void csEventsHistogram::Clear(void)
+{
+    for (csEventsHistogramRingMap::iterator i = rings.begin(); i != rings.end(); i++)
+        delete i->second;
+    rings.clear();
+}
+
+// vi: expandtab shiftwidth=4 softtabstop=4 tabstop=4
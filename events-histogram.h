@@ -0,0 +1,98 @@
+// ClearSync: System Monitor plugin.
+// Copyright (C) 2011 ClearFoundation <http://www.clearfoundation.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef _EVENTS_HISTOGRAM_H
+#define _EVENTS_HISTOGRAM_H
+
+#define _EVENTS_HISTOGRAM_MAGIC         0x48495645  // "EVIH"
+#define _EVENTS_HISTOGRAM_VERSION       1
+
+// Ring lengths: two hours of minutes, seven days of hours, ninety days.
+#define _EVENTS_HISTOGRAM_MINUTES       120
+#define _EVENTS_HISTOGRAM_HOURS         168
+#define _EVENTS_HISTOGRAM_DAYS          90
+#define _EVENTS_HISTOGRAM_LEVELS        3
+
+class csEventsHistogram
+{
+public:
+    enum csEventsHistogramResolution {
+        csHR_MINUTE,
+        csHR_HOUR,
+        csHR_DAY,
+
+        csHR_MAX
+    };
+
+    typedef struct {
+        uint32_t type;
+        uint32_t level;
+        time_t start;
+        time_t width;
+        vector<uint32_t> counts;
+    } csEventsHistogramSeries;
+
+    typedef vector<csEventsHistogramSeries> csEventsHistogramSeriesVector;
+
+    csEventsHistogram(const string &filename);
+    virtual ~csEventsHistogram();
+
+    void Load(void);
+    void Save(void);
+    bool IsDirty(void) { return dirty; }
+
+    void Add(uint32_t type, uint32_t flags, time_t stamp);
+
+    void Select(csEventsHistogramResolution resolution,
+        time_t from, time_t to, const vector<uint32_t> &types,
+        csEventsHistogramSeriesVector &result);
+
+    static time_t GetWidth(csEventsHistogramResolution resolution);
+    static uint32_t GetLength(csEventsHistogramResolution resolution);
+
+protected:
+    typedef struct {
+        int64_t head[csHR_MAX];
+        uint32_t minutes[_EVENTS_HISTOGRAM_LEVELS][_EVENTS_HISTOGRAM_MINUTES];
+        uint32_t hours[_EVENTS_HISTOGRAM_LEVELS][_EVENTS_HISTOGRAM_HOURS];
+        uint32_t days[_EVENTS_HISTOGRAM_LEVELS][_EVENTS_HISTOGRAM_DAYS];
+    } csEventsHistogramRings;
+
+    typedef struct __attribute__ ((__packed__)) {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t minutes;
+        uint32_t hours;
+        uint32_t days;
+        uint32_t types;
+    } csEventsHistogramFileHeader;
+
+    typedef map<uint32_t, csEventsHistogramRings *> csEventsHistogramRingMap;
+
+    uint32_t *GetRing(csEventsHistogramRings *rings,
+        csEventsHistogramResolution resolution, uint32_t level);
+    void Advance(csEventsHistogramRings *rings,
+        csEventsHistogramResolution resolution, int64_t bucket);
+    void Clear(void);
+
+    string filename;
+    bool dirty;
+    csEventsHistogramRingMap rings;
+};
+
+#endif // _EVENTS_HISTOGRAM_H
+
+// vi: expandtab shiftwidth=4 softtabstop=4 tabstop=4
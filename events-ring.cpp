@@ -0,0 +1,234 @@
+// ClearSync: System Monitor plugin.
+// Copyright (C) 2011 ClearFoundation <http://www.clearfoundation.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <clearsync/csplugin.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+
+#include "events-ring.h"
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC                     0x0001U
+#endif
+
+csEventsRing::csEventsRing(uint32_t slots, uint32_t slot_size)
+    : fd(-1), doorbell(-1), size(0), ring(NULL), slots(slots),
+    slot_size(slot_size), tail(0), stall_pos(0), stall_since(0), abandoned(0)
+{
+    if (slots == 0 || (slots & (slots - 1)) != 0)
+        throw csEventsRingException(EINVAL, "Ring slots must be a power of two");
+    if (slot_size < sizeof(csRingSlot) + 64 || slot_size % sizeof(uint64_t))
+        throw csEventsRingException(EINVAL, "Invalid ring slot size");
+
+    size = sizeof(csRingHeader) + (size_t)slots * slot_size;
+
+#ifdef __NR_memfd_create
+    fd = syscall(__NR_memfd_create, "csplugin-events-ring", MFD_CLOEXEC);
+#else
+    errno = ENOSYS;
+#endif
+    if (fd < 0 && errno == ENOSYS) {
+        // Pre-3.17 kernel: an unlinked tmpfs file does just as well
+        char path[] = "/dev/shm/csplugin-events-ring.XXXXXX";
+        if ((fd = mkstemp(path)) >= 0) {
+            unlink(path);
+            fcntl(fd, F_SETFD, FD_CLOEXEC);
+        }
+    }
+    if (fd < 0)
+        throw csEventsRingException(errno, "Create ring memory");
+
+    if (ftruncate(fd, size) < 0)
+        throw csEventsRingException(errno, "Size ring memory");
+
+    Map();
+
+    ring->magic = _EVENTS_RING_MAGIC;
+    ring->slots = slots;
+    ring->slot_size = slot_size;
+    for (uint64_t i = 0; i < slots; i++) GetSlot(i)->seq = i;
+
+    if ((doorbell = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+        throw csEventsRingException(errno, "Create ring doorbell");
+}
+
+csEventsRing::csEventsRing(const int *rights)
+    : fd(rights[0]), doorbell(rights[1]), size(0), ring(NULL), slots(0),
+    slot_size(0), tail(0), stall_pos(0), stall_since(0), abandoned(0)
+{
+    struct stat ring_stat;
+
+    // The descriptors are ours even if they turn out to be unusable
+    try {
+        if (fstat(fd, &ring_stat) < 0)
+            throw csEventsRingException(errno, "Stat ring memory");
+        if ((size_t)ring_stat.st_size < sizeof(csRingHeader))
+            throw csEventsRingException(EINVAL, "Ring memory too small");
+
+        size = (size_t)ring_stat.st_size;
+
+        Map();
+
+        if (ring->magic != _EVENTS_RING_MAGIC)
+            throw csEventsRingException(EINVAL, "Invalid ring magic");
+
+        slots = ring->slots;
+        slot_size = ring->slot_size;
+
+        if (slots == 0 || (slots & (slots - 1)) != 0 ||
+            slot_size < sizeof(csRingSlot) + 64 ||
+            sizeof(csRingHeader) + (size_t)slots * slot_size > size)
+            throw csEventsRingException(EINVAL, "Invalid ring geometry");
+    }
+    catch (csEventsRingException &e) {
+        if (ring != NULL) munmap((void *)ring, size);
+        close(fd);
+        close(doorbell);
+        throw;
+    }
+}
+
+csEventsRing::~csEventsRing()
+{
+    if (ring != NULL) munmap((void *)ring, size);
+    if (fd > -1) close(fd);
+    if (doorbell > -1) close(doorbell);
+}
+
+void csEventsRing::Map(void)
+{
+    void *addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED)
+        throw csEventsRingException(errno, "Map ring memory");
+
+    ring = (csRingHeader *)addr;
+}
+
+bool csEventsRing::Push(const uint8_t *data, size_t length)
+{
+    if (length > GetRecordMax())
+        throw csEventsRingException(EMSGSIZE, "Record too large");
+
+    csRingSlot *slot;
+    uint64_t pos = ring->head;
+
+    // A slot is free for position pos once the reader has set its
+    // sequence to pos; anything behind that means the ring has wrapped
+    for ( ;; ) {
+        slot = GetSlot(pos);
+        int64_t lag = (int64_t)(slot->seq - pos);
+
+        if (lag == 0) {
+            if (__sync_bool_compare_and_swap(&ring->head, pos, pos + 1)) break;
+        }
+        else if (lag < 0) {
+            __sync_fetch_and_add(&ring->full, 1);
+            return false;
+        }
+
+        pos = ring->head;
+    }
+
+    slot->length = (uint32_t)length;
+    memcpy((void *)(slot + 1), data, length);
+
+    __sync_synchronize();
+    slot->seq = pos + 1;
+    __sync_synchronize();
+
+    // Only the first producer to see the reader asleep wakes it
+    if (ring->sleeping && __sync_bool_compare_and_swap(&ring->sleeping, 1, 0)) {
+        uint64_t count = 1;
+        if (write(doorbell, &count, sizeof(uint64_t)) < 0) return true;
+    }
+
+    return true;
+}
+
+bool csEventsRing::Pop(uint8_t *data, size_t &length)
+{
+    csRingSlot *slot;
+
+    for ( ;; ) {
+        slot = GetSlot(tail);
+        uint64_t seq = slot->seq;
+        if (seq == tail + 1) break;
+
+        if (ring->head == tail) {
+            // A producer given up on below has since published into a
+            // slot we freed; nobody can claim it until it's freed again
+            if (seq != tail) __sync_bool_compare_and_swap(&slot->seq, seq, tail);
+            return false;
+        }
+
+        // Claimed but not yet published; give its producer a while
+        time_t now = time(NULL);
+        if (stall_since == 0 || stall_pos != tail) {
+            stall_pos = tail;
+            stall_since = now;
+            return false;
+        }
+        if (now - stall_since < _EVENTS_RING_STALL) return false;
+
+        csLog::Log(csLog::Warning,
+            "Events ring slot abandoned: %llu", (unsigned long long)tail);
+
+        abandoned++;
+        stall_since = 0;
+
+        slot->seq = tail + slots;
+        tail++;
+    }
+
+    __sync_synchronize();
+
+    // A bogus length is the producer's problem; hand back an empty record
+    length = slot->length;
+    if (length > GetRecordMax()) length = 0;
+    memcpy(data, (const void *)(slot + 1), length);
+
+    __sync_synchronize();
+    slot->seq = tail + slots;
+    tail++;
+
+    return true;
+}
+
+bool csEventsRing::Sleep(void)
+{
+    uint64_t count;
+    while (read(doorbell, &count, sizeof(uint64_t)) > 0);
+
+    ring->sleeping = 1;
+    __sync_synchronize();
+
+    // Published between the last Pop() and arming the doorbell?
+    if (! IsReady()) return true;
+
+    ring->sleeping = 0;
+    return false;
+}
+
+// vi: expandtab shiftwidth=4 softtabstop=4 tabstop=4
@@ -0,0 +1,118 @@
+// ClearSync: System Monitor plugin.
+// Copyright (C) 2011 ClearFoundation <http://www.clearfoundation.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef _EVENTS_RING_H
+#define _EVENTS_RING_H
+
+#define _EVENTS_RING_MAGIC              0x47525645  // "EVRG"
+#define _EVENTS_RING_SLOTS              4096
+#define _EVENTS_RING_SLOT_SIZE          1024
+// Seconds a claimed slot may go unpublished before the reader skips it;
+// its producer has most likely died part-way through
+#define _EVENTS_RING_STALL              5
+
+class csEventsRingException : public csException
+{
+public:
+    explicit csEventsRingException(int e, const char *s)
+        : csException(e, s) { }
+};
+
+// Bounded multi-producer ring of fixed-size records in shared memory,
+// read by the plugin alone.  Producers claim a slot by advancing head
+// with a compare-and-swap, fill it, then publish it by setting its
+// sequence number; no locks or system calls are needed unless the reader
+// has gone to sleep, in which case the producer rings the doorbell (an
+// eventfd) once.
+class csEventsRing
+{
+public:
+    // Create a ring (plugin side)
+    csEventsRing(uint32_t slots = _EVENTS_RING_SLOTS,
+        uint32_t slot_size = _EVENTS_RING_SLOT_SIZE);
+    // Map a ring whose memory and doorbell descriptors, in that order,
+    // were passed over the events socket (producer side); takes ownership
+    // of both
+    explicit csEventsRing(const int *rights);
+    virtual ~csEventsRing();
+
+    int GetDescriptor(void) { return fd; }
+    int GetDoorbell(void) { return doorbell; }
+
+    uint32_t GetSlots(void) { return slots; }
+    // Largest record a slot holds
+    size_t GetRecordMax(void) { return slot_size - sizeof(csRingSlot); }
+
+    // Producer: false if the ring is full (counted in GetFull())
+    bool Push(const uint8_t *data, size_t length);
+
+    // Reader: copy out the oldest published record, if any
+    bool Pop(uint8_t *data, size_t &length);
+    // Slots claimed by producers, published or not
+    bool IsPending(void) { return (ring->head != tail); }
+    // The next record is published and can be popped
+    bool IsReady(void) { return (GetSlot(tail)->seq == tail + 1); }
+    // Clear the doorbell and have the next Push() ring it; false if a
+    // record was published meanwhile and the reader should carry on
+    bool Sleep(void);
+
+    uint64_t GetFull(void) { return ring->full; }
+    uint64_t GetAbandoned(void) { return abandoned; }
+
+protected:
+    typedef struct {
+        uint32_t magic;
+        uint32_t slots;
+        uint32_t slot_size;
+        uint32_t reserved;
+        volatile uint64_t full;
+        // Hot fields each get their own cache line
+        volatile uint64_t head __attribute__ ((aligned (64)));
+        volatile uint32_t sleeping __attribute__ ((aligned (64)));
+    } csRingHeader;
+
+    typedef struct {
+        volatile uint64_t seq;
+        uint32_t length;
+        uint32_t reserved;
+    } csRingSlot;
+
+    // Geometry is kept locally; anything in shared memory may have been
+    // scribbled on by a producer
+    csRingSlot *GetSlot(uint64_t pos)
+    {
+        return (csRingSlot *)((uint8_t *)ring + sizeof(csRingHeader) +
+            (size_t)(pos & (slots - 1)) * slot_size);
+    }
+
+    void Map(void);
+
+    int fd;
+    int doorbell;
+    size_t size;
+    csRingHeader *ring;
+    uint32_t slots;
+    uint32_t slot_size;
+
+    uint64_t tail;
+    uint64_t stall_pos;
+    time_t stall_since;
+    uint64_t abandoned;
+};
+
+#endif // _EVENTS_RING_H
+
+// vi: expandtab shiftwidth=4 softtabstop=4 tabstop=4
@@ -23,23 +23,29 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/uio.h>
 #include <linux/un.h>
 
 #include <sstream>
+#include <deque>
 
 #include <sqlite3.h>
 #include <openssl/sha.h>
 
 #include "events-alert.h"
 #include "events-db.h"
+#include "events-histogram.h"
+#include "events-ring.h"
 #include "events-socket.h"
 
-csEventsSocket::csEventsSocket(const string &socket_path)
+csEventsSocket::csEventsSocket(const string &socket_path, int type)
     : socket_path(socket_path), page_size(0), buffer(NULL),
     buffer_pages(0), buffer_length(0), header(NULL), payload(NULL),
-    payload_index(NULL), proto_version(0)
+    payload_index(NULL), proto_version(0), subscribed(false), read_offset(0),
+    read_active(0), write_offset(0), write_active(0), write_rights_count(0)
 {
-    if ((sd = socket(AF_LOCAL, SOCK_STREAM, 0)) < 0)
+    if ((sd = socket(AF_LOCAL, type, 0)) < 0)
         throw csEventsSocketException(errno, "Create socket");
 
     Create();
@@ -48,11 +54,27 @@ csEventsSocket::csEventsSocket(const string &socket_path)
 csEventsSocket::csEventsSocket(int sd, const string &socket_path)
     : sd(sd), socket_path(socket_path), page_size(0), buffer(NULL),
     buffer_pages(0), buffer_length(0), header(NULL), payload(NULL),
-    payload_index(NULL), proto_version(0)
+    payload_index(NULL), proto_version(0), subscribed(false), read_offset(0),
+    read_active(0), write_offset(0), write_active(0), write_rights_count(0)
 {
     Create();
 }
 
+csEventsSocket::csEventsSocket(void)
+    : sd(-1), page_size(0), buffer(NULL),
+    buffer_pages(0), buffer_length(0), header(NULL), payload(NULL),
+    payload_index(NULL), proto_version(0), subscribed(false), read_offset(0),
+    read_active(0), write_offset(0), write_active(0), write_rights_count(0)
+{
+    mode = csSM_SERVER;
+    memset(&sa, 0, sizeof(struct sockaddr_un));
+
+    page_size = ::csGetPageSize();
+    AllocatePayloadBuffer(page_size);
+
+    ResetPacket();
+}
+
 void csEventsSocket::Create(void)
 {
     memset(&sa, 0, sizeof(struct sockaddr_un));
@@ -80,9 +102,15 @@ csEventsSocket::~csEventsSocket()
 void csEventsSocket::AllocatePayloadBuffer(ssize_t length)
 {
     ssize_t buffer_needed = length + sizeof(csEventsHeader);
+    ssize_t payload_offset = (payload_index != NULL) ? payload_index - payload : 0;
+
+    if (buffer_length < buffer_needed) {
+        // Grow by at least half again, so packets that weren't reserved
+        // up front don't realloc page by page
+        if (buffer_needed < buffer_length + buffer_length / 2)
+            buffer_needed = buffer_length + buffer_length / 2;
 
-    while (buffer_length < buffer_needed) {
-        buffer_pages++;
+        buffer_pages = (buffer_needed + page_size - 1) / page_size;
         buffer_length = buffer_pages * page_size;
 
         buffer = (uint8_t *)realloc(buffer, buffer_length);
@@ -93,17 +121,40 @@ void csEventsSocket::AllocatePayloadBuffer(ssize_t length)
 
     header = (csEventsHeader *)buffer;
     payload = buffer + sizeof(csEventsHeader);
+    payload_index = payload + payload_offset;
 }
 
-csEventsOpCode csEventsSocket::ReadPacket(void)
+csEventsOpCode csEventsSocket::ReadPacket(int *rights, size_t count)
 {
     ResetPacket();
 
-    ssize_t bytes = Read((uint8_t *)header, sizeof(csEventsHeader));
+    // Server side takes the next packet already buffered by Receive()
+    if (mode == csSM_SERVER) {
+        if (! IsPacketReady())
+            throw csEventsSocketProtocolException(sd, "Incomplete packet");
+
+        const uint8_t *data = (const uint8_t *)read_buffer.data() + read_offset;
+        memcpy((void *)header, data, sizeof(csEventsHeader));
+        AllocatePayloadBuffer(header->payload_length);
+        memcpy(payload, data + sizeof(csEventsHeader), header->payload_length);
+
+        read_offset += sizeof(csEventsHeader) + header->payload_length;
+        if (read_offset == read_buffer.length()) {
+            read_buffer.clear();
+            read_offset = 0;
+        }
+
+        return (csEventsOpCode)header->opcode;
+    }
+
+    ssize_t bytes = (rights != NULL) ?
+        ReadRights((uint8_t *)header, sizeof(csEventsHeader), rights, count) :
+        Read((uint8_t *)header, sizeof(csEventsHeader));
     if (bytes > 0) {
 //        fprintf(stderr, "Read packet header:\n");
 //        ::csHexDump(stderr, (const void *)header, sizeof(csEventsHeader));
         if (header->payload_length > 0) {
+            AllocatePayloadBuffer(header->payload_length);
             if ((bytes = Read(payload, header->payload_length)) > 0) {
 //                fprintf(stderr, "Read packet payload:\n");
 //                ::csHexDump(
@@ -116,9 +167,28 @@ csEventsOpCode csEventsSocket::ReadPacket(void)
     return (csEventsOpCode)header->opcode;
 }
 
-void csEventsSocket::WritePacket(csEventsOpCode opcode)
+void csEventsSocket::WritePacket(csEventsOpCode opcode,
+    const int *rights, size_t count)
 {
     header->opcode = (uint8_t)opcode;
+
+    // Server side queues the packet; if output is already backed up the
+    // socket is full, so leave it for the next writable wakeup
+    if (mode == csSM_SERVER) {
+        if (rights != NULL && count > 0) {
+            // Descriptors go with the frame's first byte, so it must be
+            // the next one out
+            if (write_queue.size() > 0 || count > _EVENTS_SOCKET_RIGHTS_MAX)
+                throw csEventsSocketException(EINVAL, "Can't pass descriptors", sd);
+            memcpy(write_rights, rights, sizeof(int) * count);
+            write_rights_count = count;
+        }
+
+        QueuePacket();
+        if (write_queue.size() == 1) Flush();
+        return;
+    }
+
     ssize_t bytes = Write(buffer,
         sizeof(csEventsHeader) + header->payload_length);
     if (bytes > 0) {
@@ -135,24 +205,100 @@ void csEventsSocket::WritePacket(csEventsOpCode opcode)
 
 void csEventsSocket::ReadPacketVar(string &v)
 {
-    uint8_t length;
-    uint8_t *ptr = payload_index;
-    memcpy((void *)&length, (const void *)ptr, sizeof(uint8_t));
-    ptr += sizeof(uint8_t);
+    const uint8_t *data;
+    size_t length;
 
-    if (length > 0) {
-        v.assign((const char *)ptr, (size_t)length);
-        ptr += length;
-    }
+    ReadPacketView(data, length);
+
+    if (length > 0) v.assign((const char *)data, length);
     else v.clear();
+}
 
-    payload_index = ptr;
+void csEventsSocket::ReadPacketView(const uint8_t *&data, size_t &length)
+{
+    uint64_t v;
+
+    if (IsProtoV2()) ReadPacketVarint(v);
+    else {
+        uint8_t length_v1;
+        ReadPacketVar((void *)&length_v1, sizeof(uint8_t));
+        v = length_v1;
+    }
+
+    if (v > (uint64_t)GetPayloadRemaining())
+        throw csEventsSocketProtocolException(sd, "Invalid string length");
+
+    data = payload_index;
+    length = (size_t)v;
+    payload_index += length;
 }
 
 void csEventsSocket::ReadPacketVar(csEventsAlert &alert)
 {
     csEventsAlert::csEventsAlertData data;
 
+    data.id = 0;
+    data.created = data.updated = 0;
+    data.flags = data.type = 0;
+    data.user = 0;
+
+    if (IsProtoV2()) {
+        uint64_t fields, v;
+        ReadPacketVarint(fields);
+
+        if (fields & csSMAF_ID) {
+            ReadPacketVarint(v);
+            data.id = (int64_t)v;
+        }
+        if (fields & csSMAF_CREATED) {
+            ReadPacketVarint(v);
+            data.created = (time_t)v;
+        }
+        if (fields & csSMAF_UPDATED) {
+            ReadPacketVarint(v);
+            data.updated = (time_t)v;
+        }
+        if (fields & csSMAF_FLAGS) {
+            ReadPacketVarint(v);
+            data.flags = (uint32_t)v;
+        }
+        if (fields & csSMAF_TYPE) {
+            ReadPacketVarint(v);
+            data.type = (uint32_t)v;
+        }
+        if (fields & csSMAF_USER) {
+            ReadPacketVarint(v);
+            data.user = (uid_t)v;
+        }
+        if (fields & csSMAF_GROUPS) {
+            uint64_t groups;
+            ReadPacketVarint(groups);
+            if (groups > (uint64_t)GetPayloadRemaining()) {
+                throw csEventsSocketProtocolException(sd,
+                    "Invalid alert group count");
+            }
+            for (uint64_t i = 0; i < groups; i++) {
+                ReadPacketVarint(v);
+                data.groups.push_back((gid_t)v);
+            }
+        }
+        if (fields & csSMAF_ORIGIN) ReadPacketVar(data.origin);
+        if (fields & csSMAF_BASENAME) ReadPacketVar(data.basename);
+        if (fields & csSMAF_UUID) ReadPacketVar(data.uuid);
+        if (fields & csSMAF_DESC) ReadPacketVar(data.desc);
+
+        // Skip fields from newer peers
+        for (uint64_t bit = (uint64_t)csSMAF_KNOWN + 1; bit != 0; bit <<= 1) {
+            if (! (fields & bit)) continue;
+            const uint8_t *field;
+            size_t length;
+            ReadPacketView(field, length);
+        }
+
+        alert.SwapData(data);
+        return;
+    }
+
     ReadPacketVar((void *)&data.id, sizeof(int64_t));
     uint32_t stamp;
     ReadPacketVar((void *)&stamp, sizeof(uint32_t));
@@ -177,11 +323,14 @@ void csEventsSocket::ReadPacketVar(csEventsAlert &alert)
     ReadPacketVar(data.uuid);
     ReadPacketVar(data.desc);
 
-    alert.SetData(data);
+    alert.SwapData(data);
 }
 
 void csEventsSocket::ReadPacketVar(void *v, size_t length)
 {
+    if (GetPayloadRemaining() < (ssize_t)length)
+        throw csEventsSocketProtocolException(sd, "Truncated packet");
+
     uint8_t *ptr = payload_index;
     memcpy(v, (const void *)ptr, length);
     ptr += length;
@@ -189,28 +338,140 @@ void csEventsSocket::ReadPacketVar(void *v, size_t length)
     payload_index = ptr;
 }
 
+void csEventsSocket::ReadPacketVarint(uint64_t &v)
+{
+    uint8_t byte;
+
+    v = 0;
+    for (unsigned shift = 0; ; shift += 7) {
+        if (shift > 63)
+            throw csEventsSocketProtocolException(sd, "Invalid varint");
+
+        ReadPacketVar((void *)&byte, sizeof(uint8_t));
+        v |= (uint64_t)(byte & 0x7f) << shift;
+
+        if (! (byte & 0x80)) break;
+    }
+}
+
 void csEventsSocket::WritePacketVar(const string &v)
 {
-    uint8_t length = (uint8_t)v.length();
-    header->payload_length += v.length() + sizeof(uint8_t);
+    size_t length = v.length();
+
+    if (IsProtoV2()) WritePacketVarint(length);
+    else {
+        // v1 lengths are a single byte; longer strings are truncated
+        if (length > 0xff) length = 0xff;
+        uint8_t length_v1 = (uint8_t)length;
+        WritePacketVar((const void *)&length_v1, sizeof(uint8_t));
+    }
 
-    AllocatePayloadBuffer(header->payload_length);
+    if (length > 0) WritePacketVar((const void *)v.data(), length);
+}
 
-    uint8_t *ptr = payload_index;
-    memcpy((void *)ptr, (const void *)&length, sizeof(uint8_t));
-    ptr += sizeof(uint8_t);
+static uint64_t csEventsSocket_alert_fields(
+    const csEventsAlert::csEventsAlertData *data)
+{
+    uint64_t fields = 0;
+
+    if (data->id != 0) fields |= csSMAF_ID;
+    if (data->created != 0) fields |= csSMAF_CREATED;
+    if (data->updated != 0) fields |= csSMAF_UPDATED;
+    if (data->flags != 0) fields |= csSMAF_FLAGS;
+    if (data->type != 0) fields |= csSMAF_TYPE;
+    if (data->user != 0) fields |= csSMAF_USER;
+    if (data->groups.size()) fields |= csSMAF_GROUPS;
+    if (data->origin.length()) fields |= csSMAF_ORIGIN;
+    if (data->basename.length()) fields |= csSMAF_BASENAME;
+    if (data->uuid.length()) fields |= csSMAF_UUID;
+    if (data->desc.length()) fields |= csSMAF_DESC;
+
+    return fields;
+}
+
+size_t csEventsSocket::GetPacketVarintLength(uint64_t v)
+{
+    size_t length = 1;
+    while (v >>= 7) length++;
+    return length;
+}
 
-    if (length > 0) {
-        memcpy((void *)ptr, (const void *)v.c_str(), v.length());
-        ptr += v.length();
+size_t csEventsSocket::GetPacketVarLength(const string &v)
+{
+    if (! IsProtoV2())
+        return sizeof(uint8_t) + ((v.length() > 0xff) ? 0xff : v.length());
+
+    return GetPacketVarintLength(v.length()) + v.length();
+}
+
+size_t csEventsSocket::GetPacketVarLength(const csEventsAlert &alert)
+{
+    const csEventsAlert::csEventsAlertData *data = alert.GetDataPtr();
+    vector<gid_t>::const_iterator i;
+    size_t length;
+
+    if (IsProtoV2()) {
+        uint64_t fields = csEventsSocket_alert_fields(data);
+
+        length = GetPacketVarintLength(fields);
+        if (fields & csSMAF_ID) length += GetPacketVarintLength((uint64_t)data->id);
+        if (fields & csSMAF_CREATED) length += GetPacketVarintLength((uint64_t)data->created);
+        if (fields & csSMAF_UPDATED) length += GetPacketVarintLength((uint64_t)data->updated);
+        if (fields & csSMAF_FLAGS) length += GetPacketVarintLength(data->flags);
+        if (fields & csSMAF_TYPE) length += GetPacketVarintLength(data->type);
+        if (fields & csSMAF_USER) length += GetPacketVarintLength(data->user);
+        if (fields & csSMAF_GROUPS) {
+            length += GetPacketVarintLength(data->groups.size());
+            for (i = data->groups.begin(); i != data->groups.end(); i++)
+                length += GetPacketVarintLength((*i));
+        }
+        if (fields & csSMAF_ORIGIN) length += GetPacketVarLength(data->origin);
+        if (fields & csSMAF_BASENAME) length += GetPacketVarLength(data->basename);
+        if (fields & csSMAF_UUID) length += GetPacketVarLength(data->uuid);
+        if (fields & csSMAF_DESC) length += GetPacketVarLength(data->desc);
+
+        return length;
     }
 
-    payload_index = ptr;
+    length = sizeof(int64_t) + sizeof(uint32_t) * 5 + sizeof(uint8_t);
+    length += sizeof(uint32_t) *
+        ((data->groups.size() > 0xff) ? 0xff : data->groups.size());
+    length += GetPacketVarLength(data->origin);
+    length += GetPacketVarLength(data->basename);
+    length += GetPacketVarLength(data->uuid);
+    length += GetPacketVarLength(data->desc);
+
+    return length;
 }
 
 void csEventsSocket::WritePacketVar(const csEventsAlert &alert)
 {
     const csEventsAlert::csEventsAlertData *data = alert.GetDataPtr();
+    vector<gid_t>::const_iterator i;
+
+    if (IsProtoV2()) {
+        uint64_t fields = csEventsSocket_alert_fields(data);
+
+        WritePacketVarint(fields);
+
+        if (fields & csSMAF_ID) WritePacketVarint((uint64_t)data->id);
+        if (fields & csSMAF_CREATED) WritePacketVarint((uint64_t)data->created);
+        if (fields & csSMAF_UPDATED) WritePacketVarint((uint64_t)data->updated);
+        if (fields & csSMAF_FLAGS) WritePacketVarint(data->flags);
+        if (fields & csSMAF_TYPE) WritePacketVarint(data->type);
+        if (fields & csSMAF_USER) WritePacketVarint(data->user);
+        if (fields & csSMAF_GROUPS) {
+            WritePacketVarint(data->groups.size());
+            for (i = data->groups.begin(); i != data->groups.end(); i++)
+                WritePacketVarint((*i));
+        }
+        if (fields & csSMAF_ORIGIN) WritePacketVar(data->origin);
+        if (fields & csSMAF_BASENAME) WritePacketVar(data->basename);
+        if (fields & csSMAF_UUID) WritePacketVar(data->uuid);
+        if (fields & csSMAF_DESC) WritePacketVar(data->desc);
+
+        return;
+    }
 
     WritePacketVar((const void *)&data->id, sizeof(int64_t));
     uint32_t stamp = (uint32_t)data->created;
@@ -221,11 +482,11 @@ void csEventsSocket::WritePacketVar(const csEventsAlert &alert)
     WritePacketVar((const void *)&data->type, sizeof(uint32_t));
     WritePacketVar((const void *)&data->user, sizeof(uint32_t));
 
-    uint8_t groups = (uint8_t)data->groups.size();
+    uint8_t groups = (uint8_t)((data->groups.size() > 0xff) ?
+        0xff : data->groups.size());
     WritePacketVar((const void *)&groups, sizeof(uint8_t));
 
-    vector<gid_t>::const_iterator i;
-    for (i = data->groups.begin(); i != data->groups.end(); i++)
+    for (i = data->groups.begin(); i != data->groups.begin() + groups; i++)
         WritePacketVar((const void *)&(*i), sizeof(uint32_t));
 
     WritePacketVar(data->origin);
@@ -238,7 +499,8 @@ void csEventsSocket::WritePacketVar(const void *v, size_t length)
 {
     header->payload_length += length;
 
-    AllocatePayloadBuffer(header->payload_length);
+    if ((ssize_t)(sizeof(csEventsHeader) + header->payload_length) > buffer_length)
+        AllocatePayloadBuffer(header->payload_length);
 
     uint8_t *ptr = payload_index;
     memcpy((void *)ptr, v, length);
@@ -247,18 +509,171 @@ void csEventsSocket::WritePacketVar(const void *v, size_t length)
     payload_index = ptr;
 }
 
-csEventsProtoResult csEventsSocket::VersionExchange(void)
+void csEventsSocket::WritePacketVarint(uint64_t v)
+{
+    uint8_t bytes[10];
+    size_t length = 0;
+
+    do {
+        bytes[length] = (uint8_t)(v & 0x7f);
+        v >>= 7;
+        if (v) bytes[length] |= 0x80;
+        length++;
+    } while (v);
+
+    WritePacketVar((const void *)bytes, length);
+}
+
+void csEventsSocket::ReadAlertRecords(uint32_t matches,
+    vector<csEventsAlert *> &result, bool raw)
+{
+    uint32_t records = 0;
+    bool end_marker = (proto_version >= _EVENTS_SOCKET_PROTOVER_FRAMES);
+
+    while (records < matches || end_marker) {
+        if (ReadPacket() != csSMOC_ALERT_RECORD) {
+            throw csEventsSocketProtocolException(sd,
+                "Unexpected protocol op-code");
+        }
+
+        uint64_t count = 1;
+        if (IsProtoV2()) {
+            ReadPacketVarint(count);
+            if (count == 0 && end_marker) {
+                if (records != matches) {
+                    throw csEventsSocketProtocolException(sd,
+                        "Truncated alert records");
+                }
+                break;
+            }
+            if (count == 0 || count > (uint64_t)(matches - records)) {
+                throw csEventsSocketProtocolException(sd,
+                    "Invalid alert record count");
+            }
+        }
+
+        for (uint64_t i = 0; i < count; i++, records++) {
+            csEventsAlert *alert = new csEventsAlert();
+            result.push_back(alert);
+            ReadPacketVar(*alert);
+
+            if (!raw) continue;
+
+            // Raw records append the description template and its parameters
+            uint32_t length;
+            ReadPacketVar((void *)&length, sizeof(uint32_t));
+            if (length > (uint32_t)GetPayloadRemaining()) {
+                throw csEventsSocketProtocolException(sd,
+                    "Invalid template length");
+            }
+            string desc_template((const char *)payload_index, length);
+            payload_index += length;
+
+            uint8_t params;
+            vector<string> desc_params;
+            ReadPacketVar((void *)&params, sizeof(uint8_t));
+            for (uint8_t j = 0; j < params; j++) {
+                string param;
+                ReadPacketVar(param);
+                desc_params.push_back(param);
+            }
+
+            alert->SetTemplate(desc_template, desc_params);
+        }
+    }
+}
+
+void csEventsSocket::WriteAlertRecords(
+    const vector<csEventsAlert *> &records, bool raw)
+{
+    vector<csEventsAlert *>::const_iterator i, j;
+
+    for (i = records.begin(); i != records.end(); ) {
+        size_t length = 0, count = 0;
+
+        // v1 has no record count: one record per frame.  v2 packs records
+        // up to the frame budget.
+        for (j = i; j != records.end(); j++) {
+            size_t record_length = GetAlertRecordLength(*(*j), raw);
+            if (count > 0 && (! IsProtoV2() ||
+                length + record_length > _EVENTS_SOCKET_FRAME_BUDGET)) break;
+            length += record_length;
+            count++;
+        }
+
+        ResetPacket();
+        if (IsProtoV2()) {
+            ReservePacket(GetPacketVarintLength(count) + length);
+            WritePacketVarint(count);
+        }
+        else ReservePacket(length);
+
+        for ( ; i != j; i++) WriteAlertRecord(*(*i), raw);
+
+        WritePacket(csSMOC_ALERT_RECORD);
+    }
+
+    if (proto_version >= _EVENTS_SOCKET_PROTOVER_FRAMES) {
+        ResetPacket();
+        WritePacketVarint(0);
+        WritePacket(csSMOC_ALERT_RECORD);
+    }
+}
+
+size_t csEventsSocket::GetAlertRecordLength(const csEventsAlert &alert, bool raw)
+{
+    size_t length = GetPacketVarLength(alert);
+    if (!raw) return length;
+
+    const csEventsAlert::csEventsAlertData *data = alert.GetDataPtr();
+    size_t count = (data->desc_params.size() > 0xff) ?
+        0xff : data->desc_params.size();
+
+    length += sizeof(uint32_t) + data->desc_template.length();
+    length += sizeof(uint8_t);
+    for (size_t i = 0; i < count; i++)
+        length += GetPacketVarLength(data->desc_params[i]);
+
+    return length;
+}
+
+void csEventsSocket::WriteAlertRecord(const csEventsAlert &alert, bool raw)
+{
+    WritePacketVar(alert);
+    if (!raw) return;
+
+    const csEventsAlert::csEventsAlertData *data = alert.GetDataPtr();
+    uint8_t count = (uint8_t)((data->desc_params.size() > 0xff) ?
+        0xff : data->desc_params.size());
+
+    uint32_t length = (uint32_t)data->desc_template.length();
+    WritePacketVar((const void *)&length, sizeof(uint32_t));
+    WritePacketVar((const void *)data->desc_template.data(), length);
+
+    WritePacketVar((const void *)&count, sizeof(uint8_t));
+    for (uint8_t i = 0; i < count; i++)
+        WritePacketVar(data->desc_params[i]);
+}
+
+csEventsProtoResult csEventsSocket::VersionExchange(uint32_t version)
 {
     csEventsProtoResult result = csSMPR_OK;
 
     if (mode == csSM_CLIENT) {
         ResetPacket();
 
-        proto_version = _EVENTS_SOCKET_PROTOVER;
+        proto_version = version;
         WritePacketVar((void *)&proto_version, sizeof(uint32_t));
         WritePacket(csSMOC_VERSION);
 
-        return ReadResult();
+        result = ReadResult();
+
+        // v2 servers reply with the version both ends will speak
+        if (result == csSMPR_OK &&
+            GetPayloadRemaining() >= (ssize_t)sizeof(uint32_t))
+            ReadPacketVar((void *)&proto_version, sizeof(uint32_t));
+
+        return result;
     }
     else if (mode == csSM_SERVER) {
         ReadPacket();
@@ -277,15 +692,21 @@ csEventsProtoResult csEventsSocket::VersionExchange(void)
 
         ReadPacketVar((void *)&client_proto_version, sizeof(uint32_t));
 
-        if (client_proto_version > _EVENTS_SOCKET_PROTOVER) {
+        if (client_proto_version == 0) {
             WriteResult(csSMPR_VERSION_MISMATCH);
             throw csEventsSocketProtocolException(sd,
                 "Unsupported protocol version");
         }
 
-        proto_version = client_proto_version;
+        // Anything newer than us is at least v2 and can step down to our
+        // version, which we send back.  v1 clients get a bare result.
+        proto_version = (client_proto_version > _EVENTS_SOCKET_PROTOVER) ?
+            _EVENTS_SOCKET_PROTOVER : client_proto_version;
 
-        WriteResult(result);
+        if (IsProtoV2())
+            WriteResult(result, &proto_version, sizeof(uint32_t));
+        else
+            WriteResult(result);
     }
 
     return result;
@@ -305,153 +726,1182 @@ void csEventsSocket::AlertInsert(csEventsAlert &alert)
     }
 }
 
-uint32_t csEventsSocket::AlertSelect(
-    const string &where, vector<csEventsAlert *> &result)
+void csEventsSocket::PackInsertPacket(const csEventsAlert &alert)
 {
-    uint32_t matches = 0;
-
     ResetPacket();
-    WritePacketVar(where);
-    WritePacket(csSMOC_ALERT_SELECT);
-
-    if (ReadResult() != csSMPR_ALERT_MATCHES)
-        throw csEventsSocketProtocolException(sd, "Unexpected result");
+    ReservePacket(sizeof(uint32_t) + GetPacketVarLength(alert));
+    WritePacketVar((const void *)&proto_version, sizeof(uint32_t));
+    WritePacketVar(alert);
+    SetOpCode(csSMOC_ALERT_INSERT);
+}
 
-    ReadPacketVar((void *)&matches, sizeof(uint32_t));
+void csEventsSocket::ReadInsertPacket(size_t length, csEventsAlert &alert)
+{
+    uint32_t version = 0;
 
-    csLog::Log(csLog::Debug, "Select alert matches: %u", matches);
+    if (length < sizeof(csEventsHeader) ||
+        length - sizeof(csEventsHeader) != header->payload_length)
+        throw csEventsSocketProtocolException(sd, "Truncated packet");
+    if (header->opcode != csSMOC_ALERT_INSERT)
+        throw csEventsSocketProtocolException(sd, "Unexpected protocol op-code");
 
-    for (uint32_t i = 0; i < matches; i++) {
-        if (ReadPacket() != csSMOC_ALERT_RECORD) {
-            throw csEventsSocketProtocolException(sd,
-                "Unexpected protocol op-code");
-        }
+    // Newer senders may encode differently; there's no exchange to step
+    // them down
+    ReadPacketVar((void *)&version, sizeof(uint32_t));
+    if (version == 0 || version > _EVENTS_SOCKET_PROTOVER)
+        throw csEventsSocketProtocolException(sd, "Unsupported protocol version");
 
-        csEventsAlert *alert = new csEventsAlert();
-        ReadPacketVar(*alert);
-        result.push_back(alert);
-    }
+    proto_version = version;
+    csEventsSocket::AlertInsert(alert);
 
-    return matches;
+    if (GetPayloadRemaining() != 0)
+        throw csEventsSocketProtocolException(sd, "Trailing packet data");
 }
 
-void csEventsSocket::AlertSelect(csEventsDb *db)
+void csEventsSocket::RingAttach(csEventsRing *&ring)
 {
-    string where;
-    ReadPacketVar(where);
+    if (mode == csSM_CLIENT) {
+        int rights[2] = { -1, -1 };
+        csEventsProtoResult result;
+        string error;
 
-    size_t eol = where.find_first_of(';');
-    if (eol != string::npos) where.resize(eol);
-    if (where.length() < 4)
-        throw csEventsSocketProtocolException(sd, "Invalid where clause");
+        ResetPacket();
+        WritePacket(csSMOC_RING_ATTACH);
 
-    vector<csEventsAlert *> result;
+        // The memfd and doorbell arrive with the reply
+        try {
+            result = ReadResult(rights, 2);
+            if (result == csSMPR_ERROR) ReadPacketVar(error);
+        }
+        catch (csException &e) {
+            if (rights[0] > -1) close(rights[0]);
+            if (rights[1] > -1) close(rights[1]);
+            throw;
+        }
 
-    try {
-        uint32_t matches = db->SelectAlert(where, &result);
+        if (result != csSMPR_OK || rights[0] < 0 || rights[1] < 0) {
+            if (rights[0] > -1) close(rights[0]);
+            if (rights[1] > -1) close(rights[1]);
+            if (result == csSMPR_ERROR)
+                throw csEventsSocketException(EINVAL, error.c_str(), sd);
+            if (result != csSMPR_OK)
+                throw csEventsSocketProtocolException(sd, "Unexpected result");
+            throw csEventsSocketProtocolException(sd, "Ring descriptors missing");
+        }
 
-        WriteResult(csSMPR_ALERT_MATCHES, &matches, sizeof(uint32_t));
+        ring = new csEventsRing(rights);
+    }
+    else if (mode == csSM_SERVER) {
+        if (proto_version < _EVENTS_SOCKET_PROTOVER_RING) {
+            throw csEventsSocketProtocolException(sd,
+                "Ring attach requires a newer protocol version");
+        }
 
-        for (vector<csEventsAlert *>::iterator i = result.begin();
-            i != result.end(); i++) {
-            ResetPacket();
-            WritePacketVar(*(*i));
-            WritePacket(csSMOC_ALERT_RECORD);
+        if (header->payload_length != 0) {
+            throw csEventsSocketProtocolException(sd,
+                "Invalid ring attach length");
         }
-    } catch (csException &e) {
-        for (vector<csEventsAlert *>::iterator i = result.begin();
-            i != result.end(); i++) delete (*i);
-        throw;
-    }
-}
 
-void csEventsSocket::AlertMarkAsResolved(csEventsAlert &alert)
-{
-    uint32_t type;
+        if (ring == NULL) {
+            WriteError("Ring ingest disabled");
+            return;
+        }
+        if (IsWritePending()) {
+            WriteError("Ring attach with replies outstanding");
+            return;
+        }
 
-    if (mode == csSM_CLIENT) {
-        type = alert.GetType();
+        uint8_t rc = (uint8_t)csSMPR_OK;
+        int rights[2] = { ring->GetDescriptor(), ring->GetDoorbell() };
 
         ResetPacket();
-        WritePacketVar((const void *)&type, sizeof(uint32_t));
-        WritePacket(csSMOC_ALERT_MARK_AS_RESOLVED);
-    }
-    else if (mode == csSM_SERVER) {
-        ReadPacketVar((void *)&type, sizeof(uint32_t));
-        alert.SetType(type);
+        WritePacketVar((const void *)&rc, sizeof(uint8_t));
+        WritePacket(csSMOC_RESULT, rights, 2);
     }
 }
 
-void csEventsSocket::TypeRegister(string &tag, string &basename)
+uint32_t csEventsSocket::AlertInsertBatch(const vector<csEventsAlert *> &alerts,
+    csEventsInsertResultVector &results)
 {
-    if (mode == csSM_CLIENT) {
-        ResetPacket();
-        WritePacketVar(tag);
-        WritePacketVar(basename);
-        WritePacket(csSMOC_TYPE_REGISTER);
-    } else if (mode == csSM_SERVER) {
-        ReadPacketVar(tag);
-        ReadPacketVar(basename);
-    }
-}
+    uint32_t count = (uint32_t)alerts.size();
 
-void csEventsSocket::TypeDeregister(string &tag)
-{
-    if (mode == csSM_CLIENT) {
-        ResetPacket();
-        WritePacketVar(tag);
-        WritePacket(csSMOC_TYPE_DEREGISTER);
-    } else if (mode == csSM_SERVER) {
-        ReadPacketVar(tag);
-    }
-}
+    if (count > _EVENTS_SOCKET_BATCH_MAX)
+        throw csEventsSocketException(E2BIG, "Too many alerts in batch", sd);
 
-void csEventsSocket::OverrideSet(uint32_t &type, uint32_t &flags)
-{
-    if (mode == csSM_CLIENT) {
-        ResetPacket();
-        WritePacketVar((const void *)&type, sizeof(uint32_t));
-        WritePacketVar((const void *)&flags, sizeof(uint32_t));
-        WritePacket(csSMOC_OVERRIDE_SET);
-    } else if (mode == csSM_SERVER) {
-        ReadPacketVar((void *)&type, sizeof(uint32_t));
-        ReadPacketVar((void *)&flags, sizeof(uint32_t));
+    size_t length = sizeof(uint32_t);
+    vector<csEventsAlert *>::const_iterator i;
+    for (i = alerts.begin(); i != alerts.end(); i++)
+        length += GetPacketVarLength(*(*i));
+
+    ResetPacket();
+    ReservePacket(length);
+    WritePacketVar((const void *)&count, sizeof(uint32_t));
+    for (i = alerts.begin(); i != alerts.end(); i++) WritePacketVar(*(*i));
+    WritePacket(csSMOC_ALERT_INSERT_BATCH);
+
+    switch (ReadResult()) {
+    case csSMPR_OK:
+        break;
+    case csSMPR_ERROR:
+        {
+            string error;
+            ReadPacketVar(error);
+            throw csEventsSocketException(EINVAL, error.c_str(), sd);
+        }
+    default:
+        throw csEventsSocketProtocolException(sd, "Unexpected result");
     }
-}
 
-void csEventsSocket::OverrideClear(uint32_t &type)
-{
-    if (mode == csSM_CLIENT) {
-        ResetPacket();
-        WritePacketVar((const void *)&type, sizeof(uint32_t));
-        WritePacket(csSMOC_OVERRIDE_CLEAR);
-    } else if (mode == csSM_SERVER) {
-        ReadPacketVar((void *)&type, sizeof(uint32_t));
+    if (GetPayloadRemaining() < (ssize_t)sizeof(uint32_t))
+        throw csEventsSocketProtocolException(sd, "Invalid batch result length");
+
+    ReadPacketVar((void *)&count, sizeof(uint32_t));
+
+    for (uint32_t i = 0; i < count; i++) {
+        csEventsInsertResult result;
+
+        ReadPacketVar((void *)&result.status, sizeof(uint8_t));
+        ReadPacketVar((void *)&result.id, sizeof(int64_t));
+        ReadPacketVar(result.error);
+
+        results.push_back(result);
     }
+
+    return count;
 }
 
-csEventsProtoResult csEventsSocket::ReadResult(void)
+void csEventsSocket::AlertInsertBatch(vector<csEventsAlert *> &alerts)
 {
-    ReadPacket();
+    uint32_t count;
 
-    if (header->opcode != csSMOC_RESULT) {
+    if (proto_version < _EVENTS_SOCKET_PROTOVER_BATCH) {
         throw csEventsSocketProtocolException(sd,
-            "Unexpected protocol op-code");
+            "Batch insert requires a newer protocol version");
     }
 
-    if (header->payload_length < sizeof(uint8_t)) {
+    if (header->payload_length < sizeof(uint32_t)) {
         throw csEventsSocketProtocolException(sd,
-            "Invalid protocol result length");
+            "Invalid batch request length");
     }
 
-    uint8_t rc;
-    ReadPacketVar((void *)&rc, sizeof(uint8_t));
+    ReadPacketVar((void *)&count, sizeof(uint32_t));
 
-    return (csEventsProtoResult)rc;
-}
+    if (count > _EVENTS_SOCKET_BATCH_MAX) {
+        throw csEventsSocketProtocolException(sd,
+            "Too many alerts in batch");
+    }
 
-void csEventsSocket::WriteResult(csEventsProtoResult result,
-    const void *data, uint32_t length)
+    try {
+        for (uint32_t i = 0; i < count; i++) {
+            // The alert decoder checks lengths; this stops a bogus count
+            // from allocating alerts that can't be there.
+            if (GetPayloadRemaining() <= 0) {
+                throw csEventsSocketProtocolException(sd,
+                    "Invalid batch request length");
+            }
+
+            csEventsAlert *alert = new csEventsAlert();
+            alerts.push_back(alert);
+
+            ReadPacketVar(*alert);
+            alert->SetCreated();
+            alert->SetUpdated(alert->GetCreated());
+        }
+    } catch (csException &e) {
+        for (vector<csEventsAlert *>::iterator i = alerts.begin();
+            i != alerts.end(); i++) delete (*i);
+        alerts.clear();
+        throw;
+    }
+}
+
+void csEventsSocket::AlertInsertBatch(const csEventsInsertResultVector &results)
+{
+    uint8_t rc = (uint8_t)csSMPR_OK;
+    uint32_t count = (uint32_t)results.size();
+
+    size_t length = sizeof(uint8_t) + sizeof(uint32_t);
+    csEventsInsertResultVector::const_iterator i;
+    for (i = results.begin(); i != results.end(); i++) {
+        length += sizeof(uint8_t) + sizeof(int64_t);
+        length += GetPacketVarLength((*i).error);
+    }
+
+    ResetPacket();
+    ReservePacket(length);
+    WritePacketVar((const void *)&rc, sizeof(uint8_t));
+    WritePacketVar((const void *)&count, sizeof(uint32_t));
+
+    for (i = results.begin(); i != results.end(); i++) {
+        WritePacketVar((const void *)&(*i).status, sizeof(uint8_t));
+        WritePacketVar((const void *)&(*i).id, sizeof(int64_t));
+        WritePacketVar((*i).error);
+    }
+
+    WritePacket(csSMOC_RESULT);
+}
+
+uint32_t csEventsSocket::AlertSelect(const string &where,
+    vector<csEventsAlert *> &result, bool raw)
+{
+    uint32_t matches = 0;
+
+    ResetPacket();
+    WritePacketVar(where);
+    WritePacket((raw) ? csSMOC_ALERT_SELECT_RAW : csSMOC_ALERT_SELECT);
+
+    switch (ReadResult()) {
+    case csSMPR_ALERT_MATCHES:
+        break;
+    case csSMPR_ERROR:
+        {
+            string error;
+            ReadPacketVar(error);
+            throw csEventsSocketException(EINVAL, error.c_str(), sd);
+        }
+    default:
+        throw csEventsSocketProtocolException(sd, "Unexpected result");
+    }
+
+    ReadPacketVar((void *)&matches, sizeof(uint32_t));
+
+    csLog::Log(csLog::Debug, "Select alert matches: %u", matches);
+
+    ReadAlertRecords(matches, result, raw);
+
+    return matches;
+}
+
+void csEventsSocket::AlertSelect(csEventsDb *db, bool raw)
+{
+    string where;
+    ReadPacketVar(where);
+
+    size_t eol = where.find_first_of(';');
+    if (eol != string::npos) where.resize(eol);
+    if (where.length() < 4)
+        throw csEventsSocketProtocolException(sd, "Invalid where clause");
+
+    vector<csEventsAlert *> result;
+    uint32_t matches = 0;
+
+    try {
+        matches = db->SelectAlert(where, &result);
+    }
+    catch (csEventsDbException &e) {
+        for (vector<csEventsAlert *>::iterator i = result.begin();
+            i != result.end(); i++) delete (*i);
+        WriteError(e.estring);
+        throw;
+    }
+
+    try {
+        WriteResult(csSMPR_ALERT_MATCHES, &matches, sizeof(uint32_t));
+
+        WriteAlertRecords(result, raw);
+    } catch (csException &e) {
+        for (vector<csEventsAlert *>::iterator i = result.begin();
+            i != result.end(); i++) delete (*i);
+        throw;
+    }
+
+    for (vector<csEventsAlert *>::iterator i = result.begin();
+        i != result.end(); i++) delete (*i);
+}
+
+uint32_t csEventsSocket::AlertSearch(const string &query, uint32_t limit,
+    vector<csEventsAlert *> &result)
+{
+    uint32_t matches = 0;
+
+    ResetPacket();
+    WritePacketVar(query);
+    WritePacketVar((const void *)&limit, sizeof(uint32_t));
+    WritePacket(csSMOC_ALERT_SEARCH);
+
+    if (ReadResult() != csSMPR_ALERT_MATCHES)
+        throw csEventsSocketProtocolException(sd, "Unexpected result");
+
+    ReadPacketVar((void *)&matches, sizeof(uint32_t));
+
+    csLog::Log(csLog::Debug, "Search alert matches: %u", matches);
+
+    ReadAlertRecords(matches, result);
+
+    return matches;
+}
+
+void csEventsSocket::AlertSearch(csEventsDb *db)
+{
+    string query;
+    uint32_t limit;
+
+    ReadPacketVar(query);
+    ReadPacketVar((void *)&limit, sizeof(uint32_t));
+
+    if (query.length() == 0)
+        throw csEventsSocketProtocolException(sd, "Invalid search query");
+
+    vector<csEventsAlert *> result;
+
+    try {
+        uint32_t matches = db->SearchAlerts(query, limit, &result);
+
+        WriteResult(csSMPR_ALERT_MATCHES, &matches, sizeof(uint32_t));
+
+        WriteAlertRecords(result);
+    } catch (csException &e) {
+        for (vector<csEventsAlert *>::iterator i = result.begin();
+            i != result.end(); i++) delete (*i);
+        throw;
+    }
+
+    for (vector<csEventsAlert *>::iterator i = result.begin();
+        i != result.end(); i++) delete (*i);
+}
+
+uint32_t csEventsSocket::AlertSelectGroup(gid_t gid, uint32_t limit,
+    vector<csEventsAlert *> &result)
+{
+    uint32_t group = (uint32_t)gid, matches = 0;
+
+    ResetPacket();
+    WritePacketVar((const void *)&group, sizeof(uint32_t));
+    WritePacketVar((const void *)&limit, sizeof(uint32_t));
+    WritePacket(csSMOC_ALERT_SELECT_GROUP);
+
+    if (ReadResult() != csSMPR_ALERT_MATCHES)
+        throw csEventsSocketProtocolException(sd, "Unexpected result");
+
+    ReadPacketVar((void *)&matches, sizeof(uint32_t));
+
+    csLog::Log(csLog::Debug, "Group %u alert matches: %u", group, matches);
+
+    ReadAlertRecords(matches, result);
+
+    return matches;
+}
+
+void csEventsSocket::AlertSelectGroup(csEventsDb *db)
+{
+    uint32_t group, limit;
+
+    if (header->payload_length != sizeof(uint32_t) * 2) {
+        throw csEventsSocketProtocolException(sd,
+            "Invalid group select request length");
+    }
+
+    ReadPacketVar((void *)&group, sizeof(uint32_t));
+    ReadPacketVar((void *)&limit, sizeof(uint32_t));
+
+    vector<csEventsAlert *> result;
+
+    try {
+        uint32_t matches = db->SelectAlertsByGroup((gid_t)group, limit, &result);
+
+        WriteResult(csSMPR_ALERT_MATCHES, &matches, sizeof(uint32_t));
+
+        WriteAlertRecords(result);
+    } catch (csException &e) {
+        for (vector<csEventsAlert *>::iterator i = result.begin();
+            i != result.end(); i++) delete (*i);
+        throw;
+    }
+
+    for (vector<csEventsAlert *>::iterator i = result.begin();
+        i != result.end(); i++) delete (*i);
+}
+
+uint32_t csEventsSocket::AlertChanges(uint64_t seq, uint32_t limit,
+    csEventsChangeVector &result, uint64_t &last, uint64_t &horizon)
+{
+    uint32_t matches = 0;
+
+    ResetPacket();
+    WritePacketVar((const void *)&seq, sizeof(uint64_t));
+    WritePacketVar((const void *)&limit, sizeof(uint32_t));
+    WritePacket(csSMOC_ALERT_CHANGES);
+
+    switch (ReadResult()) {
+    case csSMPR_ALERT_MATCHES:
+        break;
+    case csSMPR_ERROR:
+        {
+            string error;
+            ReadPacketVar(error);
+            throw csEventsSocketException(EINVAL, error.c_str(), sd);
+        }
+    default:
+        throw csEventsSocketProtocolException(sd, "Unexpected result");
+    }
+
+    ReadPacketVar((void *)&matches, sizeof(uint32_t));
+    ReadPacketVar((void *)&last, sizeof(uint64_t));
+    ReadPacketVar((void *)&horizon, sizeof(uint64_t));
+
+    csLog::Log(csLog::Debug, "Alert changes: %u", matches);
+
+    for (uint32_t i = 0; i < matches; i++) {
+        if (ReadPacket() != csSMOC_ALERT_CHANGES) {
+            throw csEventsSocketProtocolException(sd,
+                "Unexpected protocol op-code");
+        }
+
+        csEventsChange change;
+        uint8_t deleted;
+
+        ReadPacketVar((void *)&change.seq, sizeof(uint64_t));
+        ReadPacketVar((void *)&change.id, sizeof(int64_t));
+        ReadPacketVar((void *)&deleted, sizeof(uint8_t));
+
+        change.alert = NULL;
+        if (! deleted) {
+            change.alert = new csEventsAlert();
+            ReadPacketVar(*change.alert);
+        }
+
+        result.push_back(change);
+    }
+
+    return matches;
+}
+
+void csEventsSocket::AlertChanges(csEventsDb *db)
+{
+    uint64_t seq, last = 0, horizon = 0;
+    uint32_t limit;
+
+    if (header->payload_length != sizeof(uint64_t) + sizeof(uint32_t)) {
+        throw csEventsSocketProtocolException(sd,
+            "Invalid changes request length");
+    }
+
+    ReadPacketVar((void *)&seq, sizeof(uint64_t));
+    ReadPacketVar((void *)&limit, sizeof(uint32_t));
+
+    csEventsChangeVector result;
+
+    try {
+        db->SelectChanges(seq, limit, &result, &last, &horizon);
+    }
+    catch (csEventsDbException &e) {
+        for (csEventsChangeVector::iterator i = result.begin();
+            i != result.end(); i++) delete (*i).alert;
+        WriteError(e.estring);
+        throw;
+    }
+
+    uint32_t matches = (uint32_t)result.size();
+    uint8_t data[sizeof(uint32_t) + sizeof(uint64_t) * 2];
+
+    memcpy((void *)data, (const void *)&matches, sizeof(uint32_t));
+    memcpy((void *)(data + sizeof(uint32_t)),
+        (const void *)&last, sizeof(uint64_t));
+    memcpy((void *)(data + sizeof(uint32_t) + sizeof(uint64_t)),
+        (const void *)&horizon, sizeof(uint64_t));
+
+    try {
+        WriteResult(csSMPR_ALERT_MATCHES, data, sizeof(data));
+
+        for (csEventsChangeVector::iterator i = result.begin();
+            i != result.end(); i++) {
+            uint8_t deleted = ((*i).alert == NULL);
+
+            ResetPacket();
+            WritePacketVar((const void *)&(*i).seq, sizeof(uint64_t));
+            WritePacketVar((const void *)&(*i).id, sizeof(int64_t));
+            WritePacketVar((const void *)&deleted, sizeof(uint8_t));
+            if (! deleted) WritePacketVar(*(*i).alert);
+            WritePacket(csSMOC_ALERT_CHANGES);
+        }
+    } catch (csException &e) {
+        for (csEventsChangeVector::iterator i = result.begin();
+            i != result.end(); i++) delete (*i).alert;
+        throw;
+    }
+
+    for (csEventsChangeVector::iterator i = result.begin();
+        i != result.end(); i++) delete (*i).alert;
+}
+
+void csEventsSocket::AlertSubscribe(csEventsSubscription &filter)
+{
+    uint32_t count;
+
+    if (mode == csSM_CLIENT) {
+        count = (uint32_t)filter.types.size();
+
+        ResetPacket();
+        WritePacketVar((const void *)&filter.level_mask, sizeof(uint32_t));
+        WritePacketVar(filter.origin);
+        WritePacketVar((const void *)&count, sizeof(uint32_t));
+        for (vector<uint32_t>::const_iterator i = filter.types.begin();
+            i != filter.types.end(); i++)
+            WritePacketVar((const void *)&(*i), sizeof(uint32_t));
+        WritePacket(csSMOC_ALERT_SUBSCRIBE);
+
+        switch (ReadResult()) {
+        case csSMPR_OK:
+            subscribed = true;
+            return;
+        case csSMPR_ERROR:
+            {
+                string error;
+                ReadPacketVar(error);
+                throw csEventsSocketException(EINVAL, error.c_str(), sd);
+            }
+        default:
+            throw csEventsSocketProtocolException(sd, "Unexpected result");
+        }
+    }
+
+    if (header->payload_length < sizeof(uint32_t) * 2 + sizeof(uint8_t)) {
+        throw csEventsSocketProtocolException(sd,
+            "Invalid subscribe request length");
+    }
+
+    ReadPacketVar((void *)&filter.level_mask, sizeof(uint32_t));
+    ReadPacketVar(filter.origin);
+    ReadPacketVar((void *)&count, sizeof(uint32_t));
+
+    if (GetPayloadRemaining() != (ssize_t)(count * sizeof(uint32_t))) {
+        throw csEventsSocketProtocolException(sd,
+            "Invalid subscribe request length");
+    }
+
+    filter.types.clear();
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t type;
+        ReadPacketVar((void *)&type, sizeof(uint32_t));
+        filter.types.push_back(type);
+    }
+}
+
+void csEventsSocket::AlertWatch(csEventsAlert &alert)
+{
+    fd_set fds;
+
+    // Pushes may be hours apart; wait for one before the timed read
+    do {
+        FD_ZERO(&fds);
+        FD_SET(sd, &fds);
+    } while (select(sd + 1, &fds, NULL, NULL, NULL) < 0 && errno == EINTR);
+
+    if (ReadPacket() != csSMOC_ALERT_RECORD)
+        throw csEventsSocketProtocolException(sd, "Unexpected protocol op-code");
+
+    if (IsProtoV2()) {
+        uint64_t count;
+        ReadPacketVarint(count);
+        if (count != 1) {
+            throw csEventsSocketProtocolException(sd,
+                "Invalid alert record count");
+        }
+    }
+
+    alert.Reset();
+    ReadPacketVar(alert);
+}
+
+bool csEventsSocket::IsSubscribed(const csEventsAlert &alert)
+{
+    if (! subscribed) return false;
+
+    if (subscription.level_mask != 0 &&
+        (alert.GetFlags() & subscription.level_mask) == 0) return false;
+    if (subscription.origin.length() > 0 &&
+        subscription.origin != alert.GetOrigin()) return false;
+    if (subscription.types.size() == 0) return true;
+
+    for (vector<uint32_t>::const_iterator i = subscription.types.begin();
+        i != subscription.types.end(); i++) {
+        if ((*i) == alert.GetType()) return true;
+    }
+
+    return false;
+}
+
+bool csEventsSocket::AlertPush(const csEventsAlert &alert)
+{
+    if (write_queue.size() >= _EVENTS_SOCKET_PUSH_QUEUE_MAX) return false;
+
+    ResetPacket();
+    ReservePacket(GetPacketVarLength(alert) +
+        ((IsProtoV2()) ? GetPacketVarintLength(1) : 0));
+    if (IsProtoV2()) WritePacketVarint(1);
+    WritePacketVar(alert);
+    header->opcode = (uint8_t)csSMOC_ALERT_RECORD;
+
+    QueuePacket();
+
+    return true;
+}
+
+void csEventsSocket::AlertMarkAsResolved(csEventsAlert &alert)
+{
+    uint32_t type;
+
+    if (mode == csSM_CLIENT) {
+        type = alert.GetType();
+
+        ResetPacket();
+        WritePacketVar((const void *)&type, sizeof(uint32_t));
+        WritePacket(csSMOC_ALERT_MARK_AS_RESOLVED);
+    }
+    else if (mode == csSM_SERVER) {
+        ReadPacketVar((void *)&type, sizeof(uint32_t));
+        alert.SetType(type);
+    }
+}
+
+uint32_t csEventsSocket::AlertResolve(csEventsDb::csResolveKey key,
+    const vector<string> &values, uint32_t type)
+{
+    uint8_t k = (uint8_t)key;
+    uint32_t count = (uint32_t)values.size(), resolved = 0;
+
+    ResetPacket();
+    WritePacketVar((const void *)&k, sizeof(uint8_t));
+    WritePacketVar((const void *)&type, sizeof(uint32_t));
+    WritePacketVar((const void *)&count, sizeof(uint32_t));
+    for (vector<string>::const_iterator i = values.begin(); i != values.end(); i++)
+        WritePacketVar((*i));
+    WritePacket(csSMOC_ALERT_RESOLVE);
+
+    switch (ReadResult()) {
+    case csSMPR_OK:
+        ReadPacketVar((void *)&resolved, sizeof(uint32_t));
+        return resolved;
+    case csSMPR_ERROR:
+        {
+            string error;
+            ReadPacketVar(error);
+            throw csEventsSocketException(EINVAL, error.c_str(), sd);
+        }
+    default:
+        throw csEventsSocketProtocolException(sd, "Unexpected result");
+    }
+}
+
+void csEventsSocket::AlertResolve(csEventsDb *db)
+{
+    uint8_t key;
+    uint32_t type, count;
+    vector<string> values;
+
+    if (header->payload_length < sizeof(uint8_t) + sizeof(uint32_t) * 2) {
+        throw csEventsSocketProtocolException(sd,
+            "Invalid resolve request length");
+    }
+
+    ReadPacketVar((void *)&key, sizeof(uint8_t));
+    ReadPacketVar((void *)&type, sizeof(uint32_t));
+    ReadPacketVar((void *)&count, sizeof(uint32_t));
+
+    if (key >= csEventsDb::csRK_MAX) {
+        throw csEventsSocketProtocolException(sd,
+            "Invalid resolve key");
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        string value;
+        ReadPacketVar(value);
+        values.push_back(value);
+    }
+
+    uint32_t resolved = 0;
+
+    try {
+        resolved = db->ResolveAlerts(
+            (csEventsDb::csResolveKey)key, values, type);
+    }
+    catch (csEventsDbException &e) {
+        WriteError(e.estring);
+        throw;
+    }
+
+    WriteResult(csSMPR_OK, &resolved, sizeof(uint32_t));
+}
+
+uint32_t csEventsSocket::AlertSummary(csEventsSummaryVector &result)
+{
+    uint32_t rows = 0, stamp, count, level;
+    uint8_t resolved;
+    csEventsSummary summary;
+
+    ResetPacket();
+    WritePacket(csSMOC_ALERT_SUMMARY);
+
+    if (ReadPacket() != csSMOC_ALERT_SUMMARY) {
+        throw csEventsSocketProtocolException(sd,
+            "Unexpected protocol op-code");
+    }
+
+    ReadPacketVar((void *)&rows, sizeof(uint32_t));
+
+    if (header->payload_length != sizeof(uint32_t) +
+        rows * (sizeof(uint32_t) * 4 + sizeof(uint8_t))) {
+        throw csEventsSocketProtocolException(sd,
+            "Invalid alert summary length");
+    }
+
+    for (uint32_t i = 0; i < rows; i++) {
+        ReadPacketVar((void *)&summary.type, sizeof(uint32_t));
+        ReadPacketVar((void *)&level, sizeof(uint32_t));
+        ReadPacketVar((void *)&resolved, sizeof(uint8_t));
+        ReadPacketVar((void *)&count, sizeof(uint32_t));
+        ReadPacketVar((void *)&stamp, sizeof(uint32_t));
+
+        summary.level = level;
+        summary.resolved = (resolved != 0);
+        summary.count = count;
+        summary.updated = (time_t)stamp;
+        result.push_back(summary);
+    }
+
+    return rows;
+}
+
+void csEventsSocket::AlertSummary(csEventsDb *db)
+{
+    csEventsSummaryVector result;
+    uint32_t rows = db->SelectSummary(&result), stamp;
+    uint8_t resolved;
+
+    // All rows fit in a single reply; there is one per type/level/state,
+    // not one per alert.
+    ResetPacket();
+    WritePacketVar((const void *)&rows, sizeof(uint32_t));
+
+    for (csEventsSummaryVector::iterator i = result.begin(); i != result.end(); i++) {
+        resolved = (uint8_t)(*i).resolved;
+        stamp = (uint32_t)(*i).updated;
+        WritePacketVar((const void *)&(*i).type, sizeof(uint32_t));
+        WritePacketVar((const void *)&(*i).level, sizeof(uint32_t));
+        WritePacketVar((const void *)&resolved, sizeof(uint8_t));
+        WritePacketVar((const void *)&(*i).count, sizeof(uint32_t));
+        WritePacketVar((const void *)&stamp, sizeof(uint32_t));
+    }
+
+    WritePacket(csSMOC_ALERT_SUMMARY);
+}
+
+uint32_t csEventsSocket::AlertAggregate(csEventsDb::csAggregateKey key,
+    const string &where, uint32_t limit, uint32_t bucket,
+    csEventsAggregateVector &result)
+{
+    uint8_t k = (uint8_t)key;
+    uint32_t rows = 0, count, alerts, stamp;
+    csEventsAggregate row;
+
+    if (proto_version < _EVENTS_SOCKET_PROTOVER_AGGREGATE) {
+        throw csEventsSocketProtocolException(sd,
+            "Aggregates require a newer protocol version");
+    }
+
+    ResetPacket();
+    WritePacketVar((const void *)&k, sizeof(uint8_t));
+    WritePacketVar((const void *)&limit, sizeof(uint32_t));
+    WritePacketVar((const void *)&bucket, sizeof(uint32_t));
+    WritePacketVar(where);
+    WritePacket(csSMOC_ALERT_AGGREGATE);
+
+    switch (ReadResult()) {
+    case csSMPR_OK:
+        break;
+    case csSMPR_ERROR:
+        {
+            string error;
+            ReadPacketVar(error);
+            throw csEventsSocketException(EINVAL, error.c_str(), sd);
+        }
+    default:
+        throw csEventsSocketProtocolException(sd, "Unexpected result");
+    }
+
+    ReadPacketVar((void *)&rows, sizeof(uint32_t));
+
+    for (uint32_t i = 0; i < rows; i++) {
+        row.key = 0;
+        row.name.clear();
+        if (key == csEventsDb::csAK_ORIGIN || key == csEventsDb::csAK_BASENAME)
+            ReadPacketVar(row.name);
+        else
+            ReadPacketVar((void *)&row.key, sizeof(int64_t));
+        ReadPacketVar((void *)&count, sizeof(uint32_t));
+        ReadPacketVar((void *)&alerts, sizeof(uint32_t));
+        ReadPacketVar((void *)&stamp, sizeof(uint32_t));
+
+        row.count = count;
+        row.alerts = alerts;
+        row.updated = (time_t)stamp;
+        result.push_back(row);
+    }
+
+    return rows;
+}
+
+void csEventsSocket::AlertAggregate(csEventsDb *db)
+{
+    uint8_t key;
+    uint32_t limit, bucket;
+    string where;
+
+    if (proto_version < _EVENTS_SOCKET_PROTOVER_AGGREGATE) {
+        throw csEventsSocketProtocolException(sd,
+            "Aggregates require a newer protocol version");
+    }
+
+    if (header->payload_length < sizeof(uint8_t) + sizeof(uint32_t) * 2) {
+        throw csEventsSocketProtocolException(sd,
+            "Invalid aggregate request length");
+    }
+
+    ReadPacketVar((void *)&key, sizeof(uint8_t));
+    ReadPacketVar((void *)&limit, sizeof(uint32_t));
+    ReadPacketVar((void *)&bucket, sizeof(uint32_t));
+    ReadPacketVar(where);
+
+    if (key >= csEventsDb::csAK_MAX) {
+        throw csEventsSocketProtocolException(sd,
+            "Invalid aggregate key");
+    }
+
+    // Same rule as select: one statement only
+    size_t eol = where.find_first_of(';');
+    if (eol != string::npos) where.resize(eol);
+
+    csEventsAggregateVector result;
+
+    try {
+        db->SelectAggregate((csEventsDb::csAggregateKey)key,
+            bucket, where, limit, &result);
+    }
+    catch (csEventsDbException &e) {
+        WriteError(e.estring);
+        throw;
+    }
+
+    bool named = (key == csEventsDb::csAK_ORIGIN ||
+        key == csEventsDb::csAK_BASENAME);
+    uint8_t rc = (uint8_t)csSMPR_OK;
+    uint32_t rows = (uint32_t)result.size(), stamp;
+
+    // Groups, not alerts, so one reply holds them all
+    size_t length = sizeof(uint8_t) + sizeof(uint32_t);
+    csEventsAggregateVector::iterator i;
+    for (i = result.begin(); i != result.end(); i++) {
+        length += (named) ? GetPacketVarLength((*i).name) : sizeof(int64_t);
+        length += sizeof(uint32_t) * 3;
+    }
+
+    ResetPacket();
+    ReservePacket(length);
+    WritePacketVar((const void *)&rc, sizeof(uint8_t));
+    WritePacketVar((const void *)&rows, sizeof(uint32_t));
+
+    for (i = result.begin(); i != result.end(); i++) {
+        stamp = (uint32_t)(*i).updated;
+        if (named)
+            WritePacketVar((*i).name);
+        else
+            WritePacketVar((const void *)&(*i).key, sizeof(int64_t));
+        WritePacketVar((const void *)&(*i).count, sizeof(uint32_t));
+        WritePacketVar((const void *)&(*i).alerts, sizeof(uint32_t));
+        WritePacketVar((const void *)&stamp, sizeof(uint32_t));
+    }
+
+    WritePacket(csSMOC_RESULT);
+}
+
+uint32_t csEventsSocket::HistogramSelect(
+    csEventsHistogram::csEventsHistogramResolution resolution,
+    time_t from, time_t to, const vector<uint32_t> &types,
+    csEventsHistogram::csEventsHistogramSeriesVector &result)
+{
+    uint8_t res = (uint8_t)resolution;
+    uint32_t series = 0, stamp, count = (uint32_t)types.size();
+
+    ResetPacket();
+    WritePacketVar((const void *)&res, sizeof(uint8_t));
+    stamp = (uint32_t)from;
+    WritePacketVar((const void *)&stamp, sizeof(uint32_t));
+    stamp = (uint32_t)to;
+    WritePacketVar((const void *)&stamp, sizeof(uint32_t));
+    WritePacketVar((const void *)&count, sizeof(uint32_t));
+    for (vector<uint32_t>::const_iterator i = types.begin(); i != types.end(); i++)
+        WritePacketVar((const void *)&(*i), sizeof(uint32_t));
+    WritePacket(csSMOC_HISTOGRAM_SELECT);
+
+    if (ReadPacket() != csSMOC_HISTOGRAM_SELECT) {
+        throw csEventsSocketProtocolException(sd,
+            "Unexpected protocol op-code");
+    }
+
+    uint8_t *payload_end = payload + header->payload_length;
+
+    ReadPacketVar((void *)&series, sizeof(uint32_t));
+
+    for (uint32_t i = 0; i < series; i++) {
+        csEventsHistogram::csEventsHistogramSeries entry;
+
+        if (payload_index + sizeof(uint32_t) * 5 > payload_end) {
+            throw csEventsSocketProtocolException(sd,
+                "Invalid histogram length");
+        }
+
+        ReadPacketVar((void *)&entry.type, sizeof(uint32_t));
+        ReadPacketVar((void *)&entry.level, sizeof(uint32_t));
+        ReadPacketVar((void *)&stamp, sizeof(uint32_t));
+        entry.start = (time_t)stamp;
+        ReadPacketVar((void *)&stamp, sizeof(uint32_t));
+        entry.width = (time_t)stamp;
+        ReadPacketVar((void *)&count, sizeof(uint32_t));
+
+        if (payload_index + sizeof(uint32_t) * count > payload_end) {
+            throw csEventsSocketProtocolException(sd,
+                "Invalid histogram length");
+        }
+
+        entry.counts.resize(count);
+        if (count > 0)
+            ReadPacketVar((void *)&entry.counts[0], sizeof(uint32_t) * count);
+
+        result.push_back(entry);
+    }
+
+    return series;
+}
+
+void csEventsSocket::HistogramSelect(csEventsHistogram *histogram)
+{
+    uint8_t res;
+    uint32_t from, to, count, type;
+    vector<uint32_t> types;
+    csEventsHistogram::csEventsHistogramSeriesVector result;
+
+    if (header->payload_length < sizeof(uint8_t) + sizeof(uint32_t) * 3) {
+        throw csEventsSocketProtocolException(sd,
+            "Invalid histogram request length");
+    }
+
+    ReadPacketVar((void *)&res, sizeof(uint8_t));
+    ReadPacketVar((void *)&from, sizeof(uint32_t));
+    ReadPacketVar((void *)&to, sizeof(uint32_t));
+    ReadPacketVar((void *)&count, sizeof(uint32_t));
+
+    if (header->payload_length !=
+        sizeof(uint8_t) + sizeof(uint32_t) * 3 + sizeof(uint32_t) * count) {
+        throw csEventsSocketProtocolException(sd,
+            "Invalid histogram request length");
+    }
+    if (res >= csEventsHistogram::csHR_MAX) {
+        throw csEventsSocketProtocolException(sd,
+            "Invalid histogram resolution");
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        ReadPacketVar((void *)&type, sizeof(uint32_t));
+        types.push_back(type);
+    }
+
+    histogram->Select((csEventsHistogram::csEventsHistogramResolution)res,
+        (time_t)from, (time_t)to, types, result);
+
+    ResetPacket();
+    count = (uint32_t)result.size();
+    WritePacketVar((const void *)&count, sizeof(uint32_t));
+
+    for (csEventsHistogram::csEventsHistogramSeriesVector::iterator i = result.begin();
+        i != result.end(); i++) {
+        WritePacketVar((const void *)&(*i).type, sizeof(uint32_t));
+        WritePacketVar((const void *)&(*i).level, sizeof(uint32_t));
+        from = (uint32_t)(*i).start;
+        WritePacketVar((const void *)&from, sizeof(uint32_t));
+        to = (uint32_t)(*i).width;
+        WritePacketVar((const void *)&to, sizeof(uint32_t));
+        count = (uint32_t)(*i).counts.size();
+        WritePacketVar((const void *)&count, sizeof(uint32_t));
+        if (count > 0)
+            WritePacketVar((const void *)&(*i).counts[0], sizeof(uint32_t) * count);
+    }
+
+    WritePacket(csSMOC_HISTOGRAM_SELECT);
+}
+
+void csEventsSocket::TypeRegister(string &tag, string &basename, uint32_t &max_age)
+{
+    if (mode == csSM_CLIENT) {
+        ResetPacket();
+        WritePacketVar(tag);
+        WritePacketVar(basename);
+        WritePacketVar((const void *)&max_age, sizeof(uint32_t));
+        WritePacket(csSMOC_TYPE_REGISTER);
+    } else if (mode == csSM_SERVER) {
+        ReadPacketVar(tag);
+        ReadPacketVar(basename);
+        // Older clients don't send a retention TTL
+        max_age = 0;
+        if (GetPayloadRemaining() >= (ssize_t)sizeof(uint32_t))
+            ReadPacketVar((void *)&max_age, sizeof(uint32_t));
+    }
+}
+
+void csEventsSocket::TypeDeregister(string &tag)
+{
+    if (mode == csSM_CLIENT) {
+        ResetPacket();
+        WritePacketVar(tag);
+        WritePacket(csSMOC_TYPE_DEREGISTER);
+    } else if (mode == csSM_SERVER) {
+        ReadPacketVar(tag);
+    }
+}
+
+void csEventsSocket::DbBackup(string &filename)
+{
+    if (mode == csSM_CLIENT) {
+        ResetPacket();
+        WritePacketVar(filename);
+        WritePacket(csSMOC_DB_BACKUP);
+    } else if (mode == csSM_SERVER) {
+        ReadPacketVar(filename);
+    }
+}
+
+bool csEventsSocket::DbBackupProgress(
+    uint32_t &remaining, uint32_t &total, uint32_t &duration)
+{
+    if (mode == csSM_SERVER) {
+        ResetPacket();
+        WritePacketVar((const void *)&remaining, sizeof(uint32_t));
+        WritePacketVar((const void *)&total, sizeof(uint32_t));
+        WritePacketVar((const void *)&duration, sizeof(uint32_t));
+        WritePacket(csSMOC_DB_BACKUP);
+        return true;
+    }
+
+    // Progress packets until a result; OK carries page count and duration
+    switch (ReadPacket()) {
+    case csSMOC_DB_BACKUP:
+        ReadPacketVar((void *)&remaining, sizeof(uint32_t));
+        ReadPacketVar((void *)&total, sizeof(uint32_t));
+        ReadPacketVar((void *)&duration, sizeof(uint32_t));
+        return true;
+    case csSMOC_RESULT:
+        break;
+    default:
+        throw csEventsSocketProtocolException(sd, "Unexpected protocol op-code");
+    }
+
+    uint8_t rc;
+    ReadPacketVar((void *)&rc, sizeof(uint8_t));
+
+    if (rc == csSMPR_OK) {
+        remaining = 0;
+        ReadPacketVar((void *)&total, sizeof(uint32_t));
+        ReadPacketVar((void *)&duration, sizeof(uint32_t));
+        return false;
+    }
+
+    string error("Backup failed");
+    if (rc == csSMPR_ERROR) ReadPacketVar(error);
+
+    throw csEventsSocketException(EINVAL, error.c_str(), sd);
+}
+
+uint32_t csEventsSocket::Stats(csEventsStatsMap &result)
+{
+    uint32_t count = 0;
+
+    ResetPacket();
+    WritePacket(csSMOC_STATS);
+
+    if (ReadPacket() != csSMOC_STATS) {
+        throw csEventsSocketProtocolException(sd,
+            "Unexpected protocol op-code");
+    }
+
+    ReadPacketVar((void *)&count, sizeof(uint32_t));
+
+    for (uint32_t i = 0; i < count; i++) {
+        string key;
+        uint64_t value;
+
+        ReadPacketVar(key);
+        if (GetPayloadRemaining() < (ssize_t)sizeof(uint64_t)) {
+            throw csEventsSocketProtocolException(sd,
+                "Invalid statistics length");
+        }
+        ReadPacketVar((void *)&value, sizeof(uint64_t));
+
+        result[key] = value;
+    }
+
+    return count;
+}
+
+void csEventsSocket::Stats(const csEventsStatsMap &stats)
+{
+    uint32_t count = (uint32_t)stats.size();
+
+    ResetPacket();
+    WritePacketVar((const void *)&count, sizeof(uint32_t));
+
+    for (csEventsStatsMap::const_iterator i = stats.begin(); i != stats.end(); i++) {
+        WritePacketVar(i->first);
+        WritePacketVar((const void *)&i->second, sizeof(uint64_t));
+    }
+
+    WritePacket(csSMOC_STATS);
+}
+
+void csEventsSocket::OverrideSet(uint32_t &type, uint32_t &flags)
+{
+    if (mode == csSM_CLIENT) {
+        ResetPacket();
+        WritePacketVar((const void *)&type, sizeof(uint32_t));
+        WritePacketVar((const void *)&flags, sizeof(uint32_t));
+        WritePacket(csSMOC_OVERRIDE_SET);
+    } else if (mode == csSM_SERVER) {
+        ReadPacketVar((void *)&type, sizeof(uint32_t));
+        ReadPacketVar((void *)&flags, sizeof(uint32_t));
+    }
+}
+
+void csEventsSocket::OverrideClear(uint32_t &type)
+{
+    if (mode == csSM_CLIENT) {
+        ResetPacket();
+        WritePacketVar((const void *)&type, sizeof(uint32_t));
+        WritePacket(csSMOC_OVERRIDE_CLEAR);
+    } else if (mode == csSM_SERVER) {
+        ReadPacketVar((void *)&type, sizeof(uint32_t));
+    }
+}
+
+csEventsProtoResult csEventsSocket::ReadResult(int *rights, size_t count)
+{
+    ReadPacket(rights, count);
+
+    if (header->opcode != csSMOC_RESULT) {
+        throw csEventsSocketProtocolException(sd,
+            "Unexpected protocol op-code");
+    }
+
+    if (header->payload_length < sizeof(uint8_t)) {
+        throw csEventsSocketProtocolException(sd,
+            "Invalid protocol result length");
+    }
+
+    uint8_t rc;
+    ReadPacketVar((void *)&rc, sizeof(uint8_t));
+
+    return (csEventsProtoResult)rc;
+}
+
+void csEventsSocket::WriteResult(csEventsProtoResult result,
+    const void *data, uint32_t length)
 {
     ResetPacket();
 
@@ -468,6 +1918,163 @@ void csEventsSocket::WriteResult(csEventsProtoResult result,
     WritePacket(csSMOC_RESULT);
 }
 
+void csEventsSocket::WriteError(const string &message)
+{
+    uint8_t rc = (uint8_t)csSMPR_ERROR;
+
+    ResetPacket();
+    WritePacketVar((const void *)&rc, sizeof(uint8_t));
+    WritePacketVar(message);
+    WritePacket(csSMOC_RESULT);
+}
+
+bool csEventsSocket::Receive(void)
+{
+    if (read_offset > 0) {
+        read_buffer.erase(0, read_offset);
+        read_offset = 0;
+    }
+
+    for ( ;; ) {
+        size_t length = read_buffer.length();
+        size_t wanted = _EVENTS_SOCKET_READ_AHEAD;
+
+        if (length >= sizeof(csEventsHeader)) {
+            const csEventsHeader *next = (const csEventsHeader *)read_buffer.data();
+            if (next->payload_length > _EVENTS_SOCKET_PAYLOAD_MAX)
+                throw csEventsSocketProtocolException(sd, "Packet too large");
+
+            // Take the rest of a large packet in one go, but don't buffer
+            // much beyond whole packets already waiting to be processed
+            size_t needed = sizeof(csEventsHeader) + next->payload_length;
+            if (needed > length) {
+                if (needed - length > wanted) wanted = needed - length;
+            }
+            else if (length >= _EVENTS_SOCKET_READ_AHEAD) break;
+        }
+
+        read_buffer.resize(length + wanted);
+        ssize_t bytes = recv(sd, &read_buffer[length], wanted, MSG_DONTWAIT);
+        read_buffer.resize(length + ((bytes > 0) ? bytes : 0));
+
+        if (bytes == 0) {
+            // Serve what was sent before the hang-up first
+            if (IsPacketReady()) break;
+            throw csEventsSocketHangupException(sd);
+        }
+        else if (bytes < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            throw csEventsSocketException(errno, "recv", sd);
+        }
+
+        read_active = time(NULL);
+        if ((size_t)bytes < wanted) break;
+    }
+
+    return IsPacketReady();
+}
+
+bool csEventsSocket::IsPacketReady(void)
+{
+    size_t length = read_buffer.length() - read_offset;
+    if (length < sizeof(csEventsHeader)) return false;
+
+    const csEventsHeader *next =
+        (const csEventsHeader *)(read_buffer.data() + read_offset);
+
+    return (length >= sizeof(csEventsHeader) + next->payload_length);
+}
+
+void csEventsSocket::QueuePacket(void)
+{
+    if (write_queue.size() == 0) write_active = time(NULL);
+
+    write_queue.push_back(string((const char *)buffer,
+        sizeof(csEventsHeader) + header->payload_length));
+}
+
+void csEventsSocket::Flush(void)
+{
+    struct iovec iov[_EVENTS_SOCKET_WRITE_IOV];
+    struct msghdr msg;
+    union {
+        struct cmsghdr align;
+        char buffer[CMSG_SPACE(sizeof(int) * _EVENTS_SOCKET_RIGHTS_MAX)];
+    } control;
+
+    // Buffer-only sockets keep their frames (see csEventsSocketLoopback)
+    if (sd < 0) return;
+
+    while (write_queue.size() > 0) {
+        size_t count = 0, length = 0;
+
+        // Gather as many queued frames as fit into one send
+        for (deque<string>::const_iterator i = write_queue.begin();
+            i != write_queue.end() && count < _EVENTS_SOCKET_WRITE_IOV;
+            i++, count++) {
+            size_t offset = (count == 0) ? write_offset : 0;
+            iov[count].iov_base = (void *)((*i).data() + offset);
+            iov[count].iov_len = (*i).length() - offset;
+            length += iov[count].iov_len;
+        }
+
+        memset(&msg, 0, sizeof(struct msghdr));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count;
+
+        if (write_rights_count > 0) {
+            msg.msg_control = control.buffer;
+            msg.msg_controllen = CMSG_SPACE(sizeof(int) * write_rights_count);
+
+            struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(int) * write_rights_count);
+            memcpy(CMSG_DATA(cmsg), write_rights, sizeof(int) * write_rights_count);
+        }
+
+        ssize_t bytes = sendmsg(sd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+
+        if (bytes < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                return;
+            throw csEventsSocketHangupException(sd);
+        }
+
+        write_active = time(NULL);
+        write_rights_count = 0;
+
+        for (size_t sent = (size_t)bytes; sent > 0; ) {
+            size_t remaining = write_queue.front().length() - write_offset;
+            if (sent < remaining) {
+                write_offset += sent;
+                break;
+            }
+
+            sent -= remaining;
+            write_queue.pop_front();
+            write_offset = 0;
+        }
+
+        if ((size_t)bytes < length) return;
+    }
+}
+
+time_t csEventsSocket::GetDeadline(void)
+{
+    time_t deadline = 0;
+
+    if (read_offset < read_buffer.length() && ! IsPacketReady())
+        deadline = read_active + _EVENTS_SOCKET_TIMEOUT_RW;
+
+    if (write_queue.size() > 0 &&
+        (deadline == 0 || write_active + _EVENTS_SOCKET_TIMEOUT_RW < deadline))
+        deadline = write_active + _EVENTS_SOCKET_TIMEOUT_RW;
+
+    return deadline;
+}
+
 ssize_t csEventsSocket::Read(uint8_t *data, ssize_t length, time_t timeout)
 {
     struct timeval tv, tv_active;
@@ -501,6 +2108,69 @@ ssize_t csEventsSocket::Read(uint8_t *data, ssize_t length, time_t timeout)
     return bytes_read;
 }
 
+ssize_t csEventsSocket::ReadRights(uint8_t *data, ssize_t length,
+    int *rights, size_t count, time_t timeout)
+{
+    struct timeval tv, tv_active;
+    struct iovec iov;
+    struct msghdr msg;
+    union {
+        struct cmsghdr align;
+        char buffer[CMSG_SPACE(sizeof(int) * _EVENTS_SOCKET_RIGHTS_MAX)];
+    } control;
+    ssize_t bytes_read;
+
+    for (size_t i = 0; i < count; i++) rights[i] = -1;
+
+    gettimeofday(&tv_active, NULL);
+
+    // Descriptors ride on the first byte; take that with recvmsg(2) and
+    // leave the rest to Read()
+    for ( ;; ) {
+        iov.iov_base = (void *)data;
+        iov.iov_len = length;
+
+        memset(&msg, 0, sizeof(struct msghdr));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buffer;
+        msg.msg_controllen = sizeof(control.buffer);
+
+        bytes_read = recvmsg(sd, &msg, MSG_CMSG_CLOEXEC);
+
+        if (!bytes_read) throw csEventsSocketHangupException(sd);
+        else if (bytes_read > 0) break;
+
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            gettimeofday(&tv, NULL);
+            if (tv.tv_sec - tv_active.tv_sec <= timeout) {
+                usleep(csSocketRetry);
+                continue;
+            }
+            throw csEventsSocketTimeoutException(sd);
+        }
+        throw csEventsSocketException(errno, "recvmsg", sd);
+    }
+
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+
+        size_t received = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (size_t i = 0; i < received; i++) {
+            int fd;
+            memcpy(&fd, CMSG_DATA(cmsg) + sizeof(int) * i, sizeof(int));
+            if (i < count && rights[i] == -1) rights[i] = fd;
+            else close(fd);
+        }
+    }
+
+    if (bytes_read < length) Read(data + bytes_read, length - bytes_read, timeout);
+
+    return length;
+}
+
 ssize_t csEventsSocket::Write(const uint8_t *data, ssize_t length, time_t timeout)
 {
     struct timeval tv, tv_active;
@@ -510,7 +2180,7 @@ ssize_t csEventsSocket::Write(const uint8_t *data, ssize_t length, time_t timeou
     gettimeofday(&tv_active, NULL);
 
     while (bytes_left > 0) {
-        bytes_wrote = send(sd, (const char *)ptr, bytes_left, 0);
+        bytes_wrote = send(sd, (const char *)ptr, bytes_left, MSG_NOSIGNAL);
 
         if (!bytes_wrote) throw csEventsSocketHangupException(sd);
         else if (bytes_wrote < 0) {
@@ -586,4 +2256,190 @@ csEventsSocketClient *csEventsSocketServer::Accept(void)
     return new csEventsSocketClient(client_sd, socket_path);
 }
 
+csEventsDatagramClient::csEventsDatagramClient(const string &socket_path)
+    : csEventsSocket(socket_path, SOCK_DGRAM)
+{
+    mode = csSM_CLIENT;
+    proto_version = _EVENTS_SOCKET_PROTOVER;
+}
+
+void csEventsDatagramClient::Connect(void)
+{
+    if (connect(sd, (const struct sockaddr *)&sa, sizeof(struct sockaddr_un)) != 0)
+        throw csEventsSocketException(errno, "Socket connect");
+}
+
+void csEventsDatagramClient::AlertInsert(const csEventsAlert &alert)
+{
+    PackInsertPacket(alert);
+
+    if (header->payload_length > _EVENTS_SOCKET_DATAGRAM_MAX)
+        throw csEventsSocketException(EMSGSIZE, "Alert too large", sd);
+
+    WritePacket(csSMOC_ALERT_INSERT);
+}
+
+csEventsDatagramServer::csEventsDatagramServer(const string &socket_path)
+    : csEventsSocket(socket_path, SOCK_DGRAM), accepted(0), rejected(0)
+{
+    mode = csSM_SERVER;
+
+    unlink(socket_path.c_str());
+
+    if (bind(sd, (struct sockaddr *)&sa, sizeof(struct sockaddr_un)) != 0)
+        throw csEventsSocketException(errno, "Binding socket");
+
+    AllocatePayloadBuffer(_EVENTS_SOCKET_DATAGRAM_MAX);
+}
+
+void csEventsDatagramServer::AlertInsert(vector<csEventsAlert *> &alerts)
+{
+    struct iovec iov;
+    struct msghdr msg;
+
+    while (alerts.size() < _EVENTS_SOCKET_BATCH_MAX) {
+        ResetPacket();
+
+        iov.iov_base = (void *)buffer;
+        iov.iov_len = sizeof(csEventsHeader) + _EVENTS_SOCKET_DATAGRAM_MAX;
+
+        memset(&msg, 0, sizeof(struct msghdr));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+
+        ssize_t bytes = recvmsg(sd, &msg, MSG_DONTWAIT);
+
+        if (bytes < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            throw csEventsSocketException(errno, "recvmsg", sd);
+        }
+
+        csEventsAlert *alert = new csEventsAlert();
+
+        try {
+            if (msg.msg_flags & MSG_TRUNC)
+                throw csEventsSocketProtocolException(sd, "Datagram too large");
+            ReadInsertPacket(bytes, *alert);
+        }
+        catch (csEventsSocketProtocolException &e) {
+            delete alert;
+            rejected++;
+            csLog::Log(csLog::Debug, "Events datagram rejected: %s",
+                e.estring.c_str());
+            continue;
+        }
+
+        alerts.push_back(alert);
+        accepted++;
+    }
+}
+
+csEventsRingClient::csEventsRingClient(const string &socket_path)
+    : csEventsSocketClient(socket_path), ring(NULL)
+{
+}
+
+csEventsRingClient::~csEventsRingClient()
+{
+    if (ring != NULL) delete ring;
+}
+
+void csEventsRingClient::Connect(int timeout)
+{
+    csEventsSocketClient::Connect(timeout);
+
+    if (VersionExchange() != csSMPR_OK)
+        throw csEventsSocketException(EINVAL, "Protocol version mismatch", sd);
+    if (proto_version < _EVENTS_SOCKET_PROTOVER_RING)
+        throw csEventsSocketException(ENOTSUP, "Ring ingest not offered", sd);
+
+    if (ring != NULL) delete ring;
+    ring = NULL;
+
+    RingAttach(ring);
+}
+
+bool csEventsRingClient::AlertInsert(const csEventsAlert &alert)
+{
+    if (ring == NULL)
+        throw csEventsSocketException(ENOTCONN, "Ring not attached", sd);
+
+    PackInsertPacket(alert);
+
+    size_t length = sizeof(csEventsHeader) + header->payload_length;
+    if (length > ring->GetRecordMax())
+        throw csEventsSocketException(EMSGSIZE, "Alert too large", sd);
+
+    return ring->Push(buffer, length);
+}
+
+csEventsInsertDecoder::csEventsInsertDecoder(size_t length)
+    : csEventsSocket()
+{
+    AllocatePayloadBuffer(length);
+}
+
+void csEventsInsertDecoder::Decode(size_t length, csEventsAlert &alert)
+{
+    // The header was copied in with the packet; only rewind the payload
+    payload_index = payload;
+    ReadInsertPacket(length, alert);
+}
+
+csEventsSocketLoopback::csEventsSocketLoopback(uint32_t version)
+    : csEventsSocket()
+{
+    proto_version = version;
+}
+
+void csEventsSocketLoopback::TakePackets(string &packets)
+{
+    packets.clear();
+    for (deque<string>::const_iterator i = write_queue.begin();
+        i != write_queue.end(); i++) packets.append((*i));
+    write_queue.clear();
+}
+
+void csEventsSocketLoopback::PutPackets(const string &packets)
+{
+    read_buffer = packets;
+    read_offset = 0;
+}
+
+csEventsRingServer::csEventsRingServer(csEventsRing *ring)
+    : ring(ring), decoder(ring->GetRecordMax()), accepted(0), rejected(0)
+{
+}
+
+csEventsRingServer::~csEventsRingServer()
+{
+    delete ring;
+}
+
+void csEventsRingServer::AlertInsert(vector<csEventsAlert *> &alerts)
+{
+    size_t length;
+
+    while (alerts.size() < _EVENTS_SOCKET_BATCH_MAX) {
+        if (! ring->Pop(decoder.GetBuffer(), length)) break;
+
+        csEventsAlert *alert = new csEventsAlert();
+
+        try {
+            decoder.Decode(length, *alert);
+        }
+        catch (csEventsSocketProtocolException &e) {
+            delete alert;
+            rejected++;
+            csLog::Log(csLog::Debug, "Events ring record rejected: %s",
+                e.estring.c_str());
+            continue;
+        }
+
+        alerts.push_back(alert);
+        accepted++;
+    }
+}
+
 // vi: expandtab shiftwidth=4 softtabstop=4 tabstop=4
@@ -17,9 +17,40 @@
 #ifndef _EVENTS_SOCKET
 #define _EVENTS_SOCKET
 
-#define _EVENTS_SOCKET_PROTOVER         0x20141112
+#define _EVENTS_SOCKET_PROTOVER         0x20261023
+// Oldest protocol version offering csSMOC_ALERT_INSERT_BATCH
+#define _EVENTS_SOCKET_PROTOVER_BATCH   0x20261019
+// Oldest protocol version using v2 framing: varint string lengths,
+// optional alert fields and a record count in csSMOC_ALERT_RECORD frames
+#define _EVENTS_SOCKET_PROTOVER_V2      0x20261020
+// Oldest protocol version whose alert record replies end with an empty
+// (zero count) csSMOC_ALERT_RECORD frame
+#define _EVENTS_SOCKET_PROTOVER_FRAMES  0x20261021
+// Oldest protocol version offering csSMOC_RING_ATTACH
+#define _EVENTS_SOCKET_PROTOVER_RING    0x20261022
+// Oldest protocol version offering csSMOC_ALERT_AGGREGATE
+#define _EVENTS_SOCKET_PROTOVER_AGGREGATE 0x20261023
+// Payload bytes packed into each v2 csSMOC_ALERT_RECORD reply frame; a
+// larger record is sent on its own
+#define _EVENTS_SOCKET_FRAME_BUDGET     65536
+// Alerts accepted per csSMOC_ALERT_INSERT_BATCH packet
+#define _EVENTS_SOCKET_BATCH_MAX        1024
+// Seconds a client may stall part-way through a packet, in either
+// direction, before it's dropped
 #define _EVENTS_SOCKET_TIMEOUT_RW       10
 #define _EVENTS_SOCKET_TIMEOUT_CONNECT  5
+// Frames queued for a subscriber before it's dropped as a slow consumer
+#define _EVENTS_SOCKET_PUSH_QUEUE_MAX   256
+// Queued frames handed to each sendmsg(2) when flushing
+#define _EVENTS_SOCKET_WRITE_IOV        64
+// Bytes read ahead from a client beyond the packets already buffered
+#define _EVENTS_SOCKET_READ_AHEAD       65536
+// Largest packet payload accepted from a client
+#define _EVENTS_SOCKET_PAYLOAD_MAX      0x4000000
+// Largest insert datagram payload
+#define _EVENTS_SOCKET_DATAGRAM_MAX     65536
+// Descriptors passed with a single packet
+#define _EVENTS_SOCKET_RIGHTS_MAX       2
 
 enum csEventsOpCode {
     csSMOC_NULL,
@@ -33,6 +64,19 @@ enum csEventsOpCode {
     csSMOC_TYPE_DEREGISTER,
     csSMOC_OVERRIDE_SET,
     csSMOC_OVERRIDE_CLEAR,
+    csSMOC_ALERT_SUMMARY,
+    csSMOC_HISTOGRAM_SELECT,
+    csSMOC_ALERT_SEARCH,
+    csSMOC_ALERT_SELECT_RAW,
+    csSMOC_DB_BACKUP,
+    csSMOC_STATS,
+    csSMOC_ALERT_RESOLVE,
+    csSMOC_ALERT_SELECT_GROUP,
+    csSMOC_ALERT_CHANGES,
+    csSMOC_ALERT_SUBSCRIBE,
+    csSMOC_ALERT_INSERT_BATCH,
+    csSMOC_RING_ATTACH,
+    csSMOC_ALERT_AGGREGATE,
 
     csSMOC_RESULT = 0xFF,
 };
@@ -41,8 +85,52 @@ enum csEventsProtoResult {
     csSMPR_OK,
     csSMPR_VERSION_MISMATCH,
     csSMPR_ALERT_MATCHES,
+    csSMPR_ERROR,
 };
 
+// v2 alert record field mask; absent fields are zero or empty.  Fields
+// above csSMAF_DESC are skipped by readers that don't know them, so each
+// carries a varint length.
+enum csEventsAlertField {
+    csSMAF_ID = 0x0001,
+    csSMAF_CREATED = 0x0002,
+    csSMAF_UPDATED = 0x0004,
+    csSMAF_FLAGS = 0x0008,
+    csSMAF_TYPE = 0x0010,
+    csSMAF_USER = 0x0020,
+    csSMAF_GROUPS = 0x0040,
+    csSMAF_ORIGIN = 0x0080,
+    csSMAF_BASENAME = 0x0100,
+    csSMAF_UUID = 0x0200,
+    csSMAF_DESC = 0x0400,
+
+    csSMAF_KNOWN = 0x07FF,
+};
+
+// Per-alert outcome of a csSMOC_ALERT_INSERT_BATCH
+enum csEventsInsertStatus {
+    csSMIS_STORED,
+    csSMIS_SPOOLED,
+    csSMIS_IGNORED,
+    csSMIS_DROPPED,
+    csSMIS_ERROR,
+};
+
+typedef struct {
+    uint8_t status;
+    int64_t id;
+    string error;
+} csEventsInsertResult;
+
+typedef vector<csEventsInsertResult> csEventsInsertResultVector;
+
+// Subscription filter; zero/empty fields match any alert
+typedef struct {
+    uint32_t level_mask;
+    string origin;
+    vector<uint32_t> types;
+} csEventsSubscription;
+
 class csEventsSocketException : public csException
 {
 public:
@@ -91,14 +179,19 @@ public:
         uint32_t payload_length;
     } csEventsHeader;
 
-    csEventsSocket(const string &socket_path);
+    csEventsSocket(const string &socket_path, int type = SOCK_STREAM);
     csEventsSocket(int sd, const string &socket_path);
     virtual ~csEventsSocket();
 
     int GetDescriptor(void) { return sd; }
     uint32_t GetProtoVersion(void) { return proto_version; }
+    bool IsProtoV2(void) { return (proto_version >= _EVENTS_SOCKET_PROTOVER_V2); }
     csEventsOpCode GetOpCode(void) { return (csEventsOpCode)header->opcode; }
     ssize_t GetPayloadLength(void) { return (ssize_t)header->payload_length; }
+    ssize_t GetPayloadRemaining(void)
+    {
+        return (ssize_t)header->payload_length - (payload_index - payload);
+    }
 
     void ResetPacket(void)
     {
@@ -106,16 +199,51 @@ public:
         memset((void *)header, 0, sizeof(csEventsHeader));
     }
 
-    csEventsOpCode ReadPacket(void);
-    void WritePacket(csEventsOpCode opcode);
+    // Descriptors passed with a packet (SCM_RIGHTS) are returned in, or
+    // sent from, rights; unused entries are set to -1
+    csEventsOpCode ReadPacket(int *rights = NULL, size_t count = 0);
+    void WritePacket(csEventsOpCode opcode,
+        const int *rights = NULL, size_t count = 0);
+
+    // Server side I/O never blocks: Receive() buffers whatever the client
+    // has sent and returns true once ReadPacket() has a whole packet to
+    // take; written packets are queued and sent by Flush() as the socket
+    // becomes writable.
+    bool Receive(void);
+    bool IsPacketReady(void);
+    bool IsWritePending(void) { return (write_queue.size() > 0); }
+    void Flush(void);
+    // When a part-received packet or queued output stalls; zero if idle
+    time_t GetDeadline(void);
 
     void ReadPacketVar(string &v);
     void ReadPacketVar(csEventsAlert &alert);
     void ReadPacketVar(void *v, size_t length);
+    void ReadPacketVarint(uint64_t &v);
+    // Length-prefixed string as a view into the payload; valid until the
+    // next ReadPacket()
+    void ReadPacketView(const uint8_t *&data, size_t &length);
 
     void WritePacketVar(const string &v);
     void WritePacketVar(const csEventsAlert &alert);
     void WritePacketVar(const void *v, size_t length);
+    void WritePacketVarint(uint64_t v);
+
+    // Encoded sizes, so a packet's buffer can be reserved in one go
+    size_t GetPacketVarLength(const string &v);
+    size_t GetPacketVarLength(const csEventsAlert &alert);
+    static size_t GetPacketVarintLength(uint64_t v);
+    void ReservePacket(size_t length)
+    {
+        AllocatePayloadBuffer(header->payload_length + length);
+    }
+
+    void ReadAlertRecords(uint32_t matches,
+        vector<csEventsAlert *> &result, bool raw = false);
+    void WriteAlertRecords(const vector<csEventsAlert *> &records,
+        bool raw = false);
+    size_t GetAlertRecordLength(const csEventsAlert &alert, bool raw = false);
+    void WriteAlertRecord(const csEventsAlert &alert, bool raw = false);
 
     void SetOpCode(csEventsOpCode opc) { header->opcode = (uint8_t)opc; }
     void SetPayload(uint8_t *data, ssize_t length)
@@ -123,30 +251,95 @@ public:
         header->payload_length = (uint32_t)length;
     }
 
-    csEventsProtoResult VersionExchange(void);
+    csEventsProtoResult VersionExchange(
+        uint32_t version = _EVENTS_SOCKET_PROTOVER);
 
     void AlertInsert(csEventsAlert &alert);
-    uint32_t AlertSelect(const string &where, vector<csEventsAlert *> &result);
-    void AlertSelect(csEventsDb *db);
+    // Client: map the plugin's shared ring (see csEventsRingClient);
+    // server: pass the descriptors of ring, or an error if it's NULL
+    void RingAttach(csEventsRing *&ring);
+    uint32_t AlertInsertBatch(const vector<csEventsAlert *> &alerts,
+        csEventsInsertResultVector &results);
+    void AlertInsertBatch(vector<csEventsAlert *> &alerts);
+    void AlertInsertBatch(const csEventsInsertResultVector &results);
+    uint32_t AlertSelect(const string &where,
+        vector<csEventsAlert *> &result, bool raw = false);
+    void AlertSelect(csEventsDb *db, bool raw = false);
+    uint32_t AlertSearch(const string &query, uint32_t limit,
+        vector<csEventsAlert *> &result);
+    void AlertSearch(csEventsDb *db);
+    uint32_t AlertSelectGroup(gid_t gid, uint32_t limit,
+        vector<csEventsAlert *> &result);
+    void AlertSelectGroup(csEventsDb *db);
+    uint32_t AlertChanges(uint64_t seq, uint32_t limit,
+        csEventsChangeVector &result, uint64_t &last, uint64_t &horizon);
+    void AlertChanges(csEventsDb *db);
+
+    void AlertSubscribe(csEventsSubscription &filter);
+    void AlertWatch(csEventsAlert &alert);
+    void SetSubscription(const csEventsSubscription &filter)
+    {
+        subscription = filter;
+        subscribed = true;
+    }
+    bool IsSubscriber(void) { return subscribed; }
+    bool IsSubscribed(const csEventsAlert &alert);
+    bool AlertPush(const csEventsAlert &alert);
     void AlertMarkAsResolved(csEventsAlert &alert);
-
-    void TypeRegister(string &tag, string &basename);
+    uint32_t AlertResolve(csEventsDb::csResolveKey key,
+        const vector<string> &values, uint32_t type = 0);
+    void AlertResolve(csEventsDb *db);
+    uint32_t AlertSummary(csEventsSummaryVector &result);
+    void AlertSummary(csEventsDb *db);
+    // Counts grouped by key over the alerts select would return for where
+    // (see csEventsDb::SelectAggregate()); bucket is in seconds
+    uint32_t AlertAggregate(csEventsDb::csAggregateKey key,
+        const string &where, uint32_t limit, uint32_t bucket,
+        csEventsAggregateVector &result);
+    void AlertAggregate(csEventsDb *db);
+
+    uint32_t HistogramSelect(
+        csEventsHistogram::csEventsHistogramResolution resolution,
+        time_t from, time_t to, const vector<uint32_t> &types,
+        csEventsHistogram::csEventsHistogramSeriesVector &result);
+    void HistogramSelect(csEventsHistogram *histogram);
+
+    void TypeRegister(string &tag, string &basename, uint32_t &max_age);
     void TypeDeregister(string &tag);
 
     void OverrideSet(uint32_t &type, uint32_t &flags);
     void OverrideClear(uint32_t &type);
 
-    csEventsProtoResult ReadResult(void);
+    void DbBackup(string &filename);
+    bool DbBackupProgress(uint32_t &remaining, uint32_t &total, uint32_t &duration);
+
+    uint32_t Stats(csEventsStatsMap &result);
+    void Stats(const csEventsStatsMap &stats);
+
+    csEventsProtoResult ReadResult(int *rights = NULL, size_t count = 0);
     void WriteResult(csEventsProtoResult result,
         const void *data = NULL, uint32_t length = 0);
+    void WriteError(const string &message);
 
 protected:
+    // Packet buffer only, without a socket (see csEventsInsertDecoder)
+    csEventsSocket(void);
+
     void Create(void);
 
     void AllocatePayloadBuffer(ssize_t length);
+    void QueuePacket(void);
+
+    // Self-contained csSMOC_ALERT_INSERT packets, as sent over the
+    // datagram socket and the shared ring: the sender's uint32 protocol
+    // version followed by the alert
+    void PackInsertPacket(const csEventsAlert &alert);
+    void ReadInsertPacket(size_t length, csEventsAlert &alert);
 
     ssize_t Read(uint8_t *data, ssize_t length,
         time_t timeout = _EVENTS_SOCKET_TIMEOUT_RW);
+    ssize_t ReadRights(uint8_t *data, ssize_t length,
+        int *rights, size_t count, time_t timeout = _EVENTS_SOCKET_TIMEOUT_RW);
     ssize_t Write(const uint8_t *data, ssize_t length,
         time_t timeout = _EVENTS_SOCKET_TIMEOUT_RW);
 
@@ -169,6 +362,19 @@ protected:
     uint32_t proto_version;
 
     vector<csEventsAlert *> alert_matches;
+
+    bool subscribed;
+    csEventsSubscription subscription;
+
+    string read_buffer;
+    size_t read_offset;
+    time_t read_active;
+    deque<string> write_queue;
+    size_t write_offset;
+    time_t write_active;
+    // Sent with the first byte of the frame at the head of write_queue
+    int write_rights[_EVENTS_SOCKET_RIGHTS_MAX];
+    size_t write_rights_count;
 };
 
 class csEventsSocketClient : public csEventsSocket
@@ -194,6 +400,119 @@ public:
 protected:
 };
 
+// Connection-less csSMOC_ALERT_INSERT: each datagram is a packet whose
+// payload is the sender's uint32 protocol version followed by the alert,
+// so no version exchange is needed.  Nothing is sent back.
+class csEventsDatagramClient : public csEventsSocket
+{
+public:
+    csEventsDatagramClient(const string &socket_path);
+    virtual ~csEventsDatagramClient() { }
+
+    void Connect(void);
+
+    void AlertInsert(const csEventsAlert &alert);
+};
+
+class csEventsDatagramServer : public csEventsSocket
+{
+public:
+    csEventsDatagramServer(const string &socket_path);
+    virtual ~csEventsDatagramServer() { }
+
+    // Decode waiting datagrams, up to _EVENTS_SOCKET_BATCH_MAX alerts;
+    // malformed ones are counted and discarded
+    void AlertInsert(vector<csEventsAlert *> &alerts);
+
+    uint64_t GetAccepted(void) { return accepted; }
+    uint64_t GetRejected(void) { return rejected; }
+
+protected:
+    uint64_t accepted;
+    uint64_t rejected;
+};
+
+// Producer side of the shared ring: connects to the events socket once to
+// map the plugin's ring, then inserts alerts with no system calls at all
+// (bar waking the plugin when it's idle).  Like datagrams, nothing is sent
+// back; AlertInsert() returns false, and the alert is lost, if the ring is
+// full.
+class csEventsRingClient : public csEventsSocketClient
+{
+public:
+    csEventsRingClient(const string &socket_path);
+    virtual ~csEventsRingClient();
+
+    void Connect(int timeout = _EVENTS_SOCKET_TIMEOUT_CONNECT);
+
+    bool AlertInsert(const csEventsAlert &alert);
+
+    uint64_t GetFull(void) { return (ring != NULL) ? ring->GetFull() : 0; }
+
+protected:
+    csEventsRing *ring;
+};
+
+// Decodes self-contained csSMOC_ALERT_INSERT packets (see
+// PackInsertPacket()) copied into its buffer from somewhere other than a
+// socket; there is no descriptor behind it
+class csEventsInsertDecoder : protected csEventsSocket
+{
+public:
+    // Room for packets of up to length bytes, header included
+    csEventsInsertDecoder(size_t length);
+    virtual ~csEventsInsertDecoder() { }
+
+    uint8_t *GetBuffer(void) { return buffer; }
+    // Decode the length bytes last copied into GetBuffer()
+    void Decode(size_t length, csEventsAlert &alert);
+};
+
+// Packet buffer looped back on itself, without a socket: packets written
+// are queued, as on the server side, until taken; packets put back are
+// read as if received (eventsctl --fuzz)
+class csEventsSocketLoopback : public csEventsSocket
+{
+public:
+    csEventsSocketLoopback(uint32_t version);
+    virtual ~csEventsSocketLoopback() { }
+
+    // Packets written since the last call, header and all
+    void TakePackets(string &packets);
+    // Replaces anything left unread
+    void PutPackets(const string &packets);
+};
+
+// Plugin side of the shared ring; the descriptor is the ring's doorbell,
+// readable once a producer has rung it
+class csEventsRingServer
+{
+public:
+    // Takes ownership of ring, once constructed
+    csEventsRingServer(csEventsRing *ring);
+    virtual ~csEventsRingServer();
+
+    int GetDescriptor(void) { return ring->GetDoorbell(); }
+    csEventsRing *GetRing(void) { return ring; }
+    bool IsPending(void) { return ring->IsPending(); }
+    bool IsReady(void) { return ring->IsReady(); }
+    bool Sleep(void) { return ring->Sleep(); }
+
+    // Decode published records, up to _EVENTS_SOCKET_BATCH_MAX alerts;
+    // malformed ones are counted and discarded
+    void AlertInsert(vector<csEventsAlert *> &alerts);
+
+    uint64_t GetAccepted(void) { return accepted; }
+    uint64_t GetRejected(void) { return rejected; }
+
+protected:
+    csEventsRing *ring;
+    csEventsInsertDecoder decoder;
+
+    uint64_t accepted;
+    uint64_t rejected;
+};
+
 #endif // _EVENTS_SOCKET
 
 // vi: expandtab shiftwidth=4 softtabstop=4 tabstop=4
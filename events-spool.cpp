@@ -0,0 +1,398 @@
+// ClearSync: System Monitor plugin.
+// Copyright (C) 2011 ClearFoundation <http://www.clearfoundation.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <clearsync/csplugin.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sqlite3.h>
+#include <sys/stat.h>
+
+#include <openssl/sha.h>
+
+#include "events-alert.h"
+#include "events-db.h"
+#include "events-db-log.h"
+#include "events-spool.h"
+
+static void csEventsSpool_put(vector<uint8_t> &payload, const void *v, size_t length)
+{
+    const uint8_t *ptr = (const uint8_t *)v;
+    payload.insert(payload.end(), ptr, ptr + length);
+}
+
+static void csEventsSpool_put(vector<uint8_t> &payload, const string &v)
+{
+    uint32_t length = (uint32_t)v.length();
+    csEventsSpool_put(payload, (const void *)&length, sizeof(uint32_t));
+    payload.insert(payload.end(), v.begin(), v.end());
+}
+
+static void csEventsSpool_get(const vector<uint8_t> &payload,
+    size_t &index, void *v, size_t length)
+{
+    if (index + length > payload.size())
+        throw csEventsSpoolException(EINVAL, "Truncated spool record");
+    memcpy(v, (const void *)&payload[index], length);
+    index += length;
+}
+
+static void csEventsSpool_get(const vector<uint8_t> &payload,
+    size_t &index, string &v)
+{
+    uint32_t length;
+    csEventsSpool_get(payload, index, (void *)&length, sizeof(uint32_t));
+    if (index + length > payload.size())
+        throw csEventsSpoolException(EINVAL, "Truncated spool record");
+    v.assign((const char *)&payload[index], length);
+    index += length;
+}
+
+csEventsSpool::csEventsSpool(const string &filename,
+    csSpoolSync sync, time_t sync_interval, off_t max_size)
+    : filename(filename), sync(sync), sync_interval(sync_interval),
+    max_size(max_size), fd(-1), tail(0), pending(0), dropped(0),
+    dirty(false), overflow(false), last_sync(0)
+{
+    memset(&header, 0, sizeof(csSpoolHeader));
+}
+
+csEventsSpool::~csEventsSpool()
+{
+    Close();
+}
+
+void csEventsSpool::Open(void)
+{
+    Close();
+
+    fd = open(filename.c_str(), O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP);
+    if (fd < 0) {
+        csLog::Log(csLog::Debug, "%s: %s: %s",
+            __PRETTY_FUNCTION__, filename.c_str(), strerror(errno));
+        throw csEventsSpoolException(errno, strerror(errno));
+    }
+
+    ssize_t bytes = pread(fd, &header, sizeof(csSpoolHeader), 0);
+
+    if (bytes != 0 && (bytes != sizeof(csSpoolHeader) ||
+        header.magic != _EVENTS_SPOOL_MAGIC ||
+        header.version != _EVENTS_SPOOL_VERSION)) {
+        csLog::Log(csLog::Error, "%s: %s: Invalid spool header, discarding",
+            __PRETTY_FUNCTION__, filename.c_str());
+        bytes = 0;
+    }
+
+    if (bytes == 0) {
+        if (ftruncate(fd, 0) < 0)
+            throw csEventsSpoolException(errno, strerror(errno));
+        header.magic = _EVENTS_SPOOL_MAGIC;
+        header.version = _EVENTS_SPOOL_VERSION;
+        header.head = sizeof(csSpoolHeader);
+        WriteHeader();
+    }
+
+    Scan();
+
+    if (pending) {
+        csLog::Log(csLog::Info, "%s: %u spooled alert(s) pending replay",
+            filename.c_str(), pending);
+    }
+}
+
+void csEventsSpool::Close(void)
+{
+    if (fd < 0) return;
+
+    Sync(true);
+    close(fd);
+    fd = -1;
+}
+
+void csEventsSpool::Scan(void)
+{
+    struct stat st;
+    vector<uint8_t> payload;
+
+    if (fstat(fd, &st) < 0)
+        throw csEventsSpoolException(errno, strerror(errno));
+
+    if (header.head < sizeof(csSpoolHeader) || (off_t)header.head > st.st_size)
+        header.head = sizeof(csSpoolHeader);
+
+    // Count intact records; anything after the first bad one is the
+    // remains of an interrupted append.
+    pending = 0;
+    for (tail = (off_t)header.head; ReadRecord(tail, payload); pending++)
+        tail += sizeof(csSpoolRecordHeader) + payload.size();
+
+    if (tail < st.st_size) {
+        csLog::Log(csLog::Warning, "%s: Discarding %ld byte(s) of incomplete spool data",
+            filename.c_str(), (long)(st.st_size - tail));
+    }
+
+    if (pending == 0) tail = sizeof(csSpoolHeader);
+    if (tail < st.st_size && ftruncate(fd, tail) < 0)
+        throw csEventsSpoolException(errno, strerror(errno));
+    if (pending == 0 && header.head != sizeof(csSpoolHeader)) {
+        header.head = sizeof(csSpoolHeader);
+        WriteHeader();
+    }
+}
+
+bool csEventsSpool::Append(const csEventsAlert &alert)
+{
+    csSpoolRecordHeader record;
+    vector<uint8_t> payload, buffer;
+
+    if (fd < 0) {
+        dropped++;
+        return false;
+    }
+
+    Encode(alert, payload);
+
+    size_t length = sizeof(csSpoolRecordHeader) + payload.size();
+    if (max_size > 0 && tail + (off_t)length > max_size) {
+        if (!overflow) {
+            csLog::Log(csLog::Error, "%s: Spool full (%ld bytes), dropping alerts",
+                filename.c_str(), (long)tail);
+        }
+        overflow = true;
+        dropped++;
+        return false;
+    }
+
+    record.length = (uint32_t)payload.size();
+    record.crc = csEventsDb_log_crc32(0, &payload[0], payload.size());
+
+    // One write per record, so a crash leaves at most one partial record
+    csEventsSpool_put(buffer, (const void *)&record, sizeof(csSpoolRecordHeader));
+    buffer.insert(buffer.end(), payload.begin(), payload.end());
+
+    if (pwrite(fd, &buffer[0], buffer.size(), tail) != (ssize_t)buffer.size()) {
+        csLog::Log(csLog::Error, "%s: %s: %s",
+            __PRETTY_FUNCTION__, filename.c_str(), strerror(errno));
+        if (ftruncate(fd, tail) < 0) {
+            csLog::Log(csLog::Debug, "%s: ftruncate: %s",
+                __PRETTY_FUNCTION__, strerror(errno));
+        }
+        dropped++;
+        return false;
+    }
+
+    tail += length;
+    pending++;
+    dirty = true;
+
+    Sync(sync == csSS_ALWAYS);
+
+    return true;
+}
+
+uint32_t csEventsSpool::Replay(csEventsDb *db, uint32_t batch)
+{
+    uint32_t replayed = 0;
+    bool corrupt = false;
+    off_t offset = (off_t)header.head;
+    vector<uint8_t> payload;
+    csEventsAlert alert;
+
+    if (fd < 0 || pending == 0) return 0;
+
+    db->Begin();
+
+    try {
+        for ( ; replayed < batch && offset < tail; replayed++) {
+            if (!ReadRecord(offset, payload)) {
+                corrupt = true;
+                break;
+            }
+            Decode(payload, alert);
+            offset += sizeof(csSpoolRecordHeader) + payload.size();
+
+            // A record the database rejects outright would otherwise hold
+            // up the spool for good; skip it, keep the rest of the batch.
+            try {
+                db->InsertAlert(alert);
+            }
+            catch (csEventsDbException &e) {
+                if (db->IsUnavailable(e)) throw;
+                csLog::Log(csLog::Error,
+                    "%s: Discarding spooled alert (type: %u): %s",
+                    filename.c_str(), alert.GetType(), e.estring.c_str());
+            }
+        }
+
+        db->Commit();
+    }
+    catch (csException &e) {
+        db->Rollback();
+        throw;
+    }
+
+    if (corrupt) {
+        csLog::Log(csLog::Error, "%s: Corrupt spool record, discarding %u alert(s)",
+            filename.c_str(), pending - replayed);
+        pending = replayed;
+    }
+
+    pending -= replayed;
+
+    // Advance the head only once the batch is committed; a crash in
+    // between replays the batch again rather than losing it.
+    if (pending == 0) {
+        header.head = sizeof(csSpoolHeader);
+        tail = (off_t)header.head;
+        if (ftruncate(fd, tail) < 0)
+            throw csEventsSpoolException(errno, strerror(errno));
+        overflow = false;
+    }
+    else header.head = (uint64_t)offset;
+
+    WriteHeader();
+    dirty = true;
+    Sync(sync == csSS_ALWAYS);
+
+    return replayed;
+}
+
+void csEventsSpool::Sync(bool force)
+{
+    if (fd < 0 || !dirty) return;
+
+    time_t now = time(NULL);
+
+    if (!force) {
+        if (sync == csSS_NONE) return;
+        if (sync == csSS_INTERVAL && now - last_sync < sync_interval) return;
+    }
+
+    if (fdatasync(fd) < 0) {
+        csLog::Log(csLog::Error, "%s: %s: %s",
+            __PRETTY_FUNCTION__, filename.c_str(), strerror(errno));
+        return;
+    }
+
+    dirty = false;
+    last_sync = now;
+}
+
+void csEventsSpool::WriteHeader(void)
+{
+    if (pwrite(fd, &header, sizeof(csSpoolHeader), 0) != sizeof(csSpoolHeader)) {
+        csLog::Log(csLog::Debug, "%s: %s: %s",
+            __PRETTY_FUNCTION__, filename.c_str(), strerror(errno));
+        throw csEventsSpoolException(errno, strerror(errno));
+    }
+}
+
+bool csEventsSpool::ReadRecord(off_t offset, vector<uint8_t> &payload)
+{
+    csSpoolRecordHeader record;
+
+    if (pread(fd, &record, sizeof(csSpoolRecordHeader), offset) !=
+        sizeof(csSpoolRecordHeader)) return false;
+    if (record.length == 0 || record.length > _EVENTS_DB_LOG_RECORD_MAX)
+        return false;
+
+    payload.resize(record.length);
+    if (pread(fd, &payload[0], record.length,
+        offset + sizeof(csSpoolRecordHeader)) != (ssize_t)record.length)
+        return false;
+
+    return (csEventsDb_log_crc32(0, &payload[0], payload.size()) == record.crc);
+}
+
+void csEventsSpool::Encode(const csEventsAlert &alert, vector<uint8_t> &payload)
+{
+    const csEventsAlert::csEventsAlertData *data = alert.GetDataPtr();
+    int64_t stamp;
+
+    payload.clear();
+    stamp = (int64_t)data->created;
+    csEventsSpool_put(payload, (const void *)&stamp, sizeof(int64_t));
+    stamp = (int64_t)data->updated;
+    csEventsSpool_put(payload, (const void *)&stamp, sizeof(int64_t));
+    csEventsSpool_put(payload, (const void *)&data->flags, sizeof(uint32_t));
+    csEventsSpool_put(payload, (const void *)&data->type, sizeof(uint32_t));
+    csEventsSpool_put(payload, (const void *)&data->user, sizeof(uint32_t));
+
+    uint32_t count = (uint32_t)data->groups.size();
+    csEventsSpool_put(payload, (const void *)&count, sizeof(uint32_t));
+    for (vector<gid_t>::const_iterator i = data->groups.begin();
+        i != data->groups.end(); i++)
+        csEventsSpool_put(payload, (const void *)&(*i), sizeof(uint32_t));
+
+    csEventsSpool_put(payload, data->origin);
+    csEventsSpool_put(payload, data->basename);
+    csEventsSpool_put(payload, data->uuid);
+    csEventsSpool_put(payload, data->desc);
+    csEventsSpool_put(payload, data->desc_template);
+
+    count = (uint32_t)data->desc_params.size();
+    csEventsSpool_put(payload, (const void *)&count, sizeof(uint32_t));
+    for (vector<string>::const_iterator i = data->desc_params.begin();
+        i != data->desc_params.end(); i++)
+        csEventsSpool_put(payload, (*i));
+}
+
+void csEventsSpool::Decode(const vector<uint8_t> &payload, csEventsAlert &alert)
+{
+    csEventsAlert::csEventsAlertData data;
+    size_t index = 0;
+    int64_t stamp;
+    uint32_t count, gid;
+    string param;
+
+    data.id = 0;
+    csEventsSpool_get(payload, index, (void *)&stamp, sizeof(int64_t));
+    data.created = (time_t)stamp;
+    csEventsSpool_get(payload, index, (void *)&stamp, sizeof(int64_t));
+    data.updated = (time_t)stamp;
+    csEventsSpool_get(payload, index, (void *)&data.flags, sizeof(uint32_t));
+    csEventsSpool_get(payload, index, (void *)&data.type, sizeof(uint32_t));
+    csEventsSpool_get(payload, index, (void *)&data.user, sizeof(uint32_t));
+
+    csEventsSpool_get(payload, index, (void *)&count, sizeof(uint32_t));
+    for (uint32_t i = 0; i < count; i++) {
+        csEventsSpool_get(payload, index, (void *)&gid, sizeof(uint32_t));
+        data.groups.push_back((gid_t)gid);
+    }
+
+    csEventsSpool_get(payload, index, data.origin);
+    csEventsSpool_get(payload, index, data.basename);
+    csEventsSpool_get(payload, index, data.uuid);
+    csEventsSpool_get(payload, index, data.desc);
+    csEventsSpool_get(payload, index, data.desc_template);
+
+    csEventsSpool_get(payload, index, (void *)&count, sizeof(uint32_t));
+    for (uint32_t i = 0; i < count; i++) {
+        csEventsSpool_get(payload, index, param);
+        data.desc_params.push_back(param);
+    }
+
+    alert.Reset();
+    alert.SetData(data);
+}
+
+// vi: expandtab shiftwidth=4 softtabstop=4 tabstop=4
@@ -0,0 +1,96 @@
+// ClearSync: System Monitor plugin.
+// Copyright (C) 2011 ClearFoundation <http://www.clearfoundation.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#ifndef _EVENTS_SPOOL_H
+#define _EVENTS_SPOOL_H
+
+#define _EVENTS_SPOOL_MAGIC             0x4c505645  // "EVPL"
+#define _EVENTS_SPOOL_VERSION           1
+#define _EVENTS_SPOOL_MAX_SIZE          (16 * 1024 * 1024)
+#define _EVENTS_SPOOL_BATCH             64
+
+class csEventsSpoolException : public csException
+{
+public:
+    explicit csEventsSpoolException(int e, const char *s)
+        : csException(e, s) { }
+};
+
+// Append-only alert spool; holds alerts, in arrival order, while the
+// database can not accept them.  Records are replayed from the head in
+// batches, and the file is truncated once drained.
+class csEventsSpool
+{
+public:
+    enum csSpoolSync {
+        csSS_NONE,
+        csSS_INTERVAL,
+        csSS_ALWAYS,
+    };
+
+    csEventsSpool(const string &filename,
+        csSpoolSync sync = csSS_ALWAYS, time_t sync_interval = 1,
+        off_t max_size = _EVENTS_SPOOL_MAX_SIZE);
+    virtual ~csEventsSpool();
+
+    void Open(void);
+    void Close(void);
+
+    uint32_t GetPending(void) const { return pending; }
+    uint64_t GetDropped(void) const { return dropped; }
+    off_t GetSize(void) const { return tail; }
+
+    bool Append(const csEventsAlert &alert);
+    uint32_t Replay(csEventsDb *db, uint32_t batch = _EVENTS_SPOOL_BATCH);
+    void Sync(bool force = false);
+
+protected:
+    typedef struct __attribute__ ((__packed__)) {
+        uint32_t magic;
+        uint32_t version;
+        uint64_t head;
+    } csSpoolHeader;
+
+    typedef struct __attribute__ ((__packed__)) {
+        uint32_t length;
+        uint32_t crc;
+    } csSpoolRecordHeader;
+
+    void Encode(const csEventsAlert &alert, vector<uint8_t> &payload);
+    void Decode(const vector<uint8_t> &payload, csEventsAlert &alert);
+    bool ReadRecord(off_t offset, vector<uint8_t> &payload);
+    void WriteHeader(void);
+    void Scan(void);
+
+    string filename;
+    csSpoolSync sync;
+    time_t sync_interval;
+    off_t max_size;
+
+    int fd;
+    csSpoolHeader header;
+    off_t tail;
+    uint32_t pending;
+    uint64_t dropped;
+    bool dirty;
+    bool overflow;
+    time_t last_sync;
+};
+
+#endif // _EVENTS_SPOOL_H
+
+// vi: expandtab shiftwidth=4 softtabstop=4 tabstop=4
@@ -22,21 +22,31 @@
 
 #include <iostream>
 #include <sstream>
+#include <deque>
 #include <locale>
 #include <algorithm>
 
 #include <unistd.h>
 #include <getopt.h>
 #include <fcntl.h>
+#include <sys/socket.h>
 #include <linux/un.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <dirent.h>
 
 #include <sqlite3.h>
 #include <openssl/sha.h>
 
-#include "events-conf.h"
 #include "events-alert.h"
 #include "events-db.h"
+#include "events-db-log.h"
+#include "events-spool.h"
+#include "events-ring.h"
+#include "events-conf.h"
+#include "events-histogram.h"
 #include "events-socket.h"
+#include "events-client.h"
 #include "events-syslog.h"
 #include "csplugin-events.h"
 #include "eventsctl.h"
@@ -105,22 +115,122 @@ static void usage(int rc = 0, bool version = false)
             "  -b <basename>, --basename <basename>");
         csLog::Log(csLog::Info,
             "    Specify an optional basename.");
+        csLog::Log(csLog::Info,
+            "  -I, --stdin");
+        csLog::Log(csLog::Info,
+            "    Send one alert per line of standard input, in batches.");
+        csLog::Log(csLog::Info,
+            "  -Q, --datagram");
+        csLog::Log(csLog::Info,
+            "    Send the alert as a datagram, without a connection; it isn't confirmed.");
+        csLog::Log(csLog::Info,
+            "  -X <count>, --benchmark <count>");
+        csLog::Log(csLog::Info,
+            "    Send the alert <count> times over each ingest path and report the rates,");
+        csLog::Log(csLog::Info,
+            "    then time <count> inserts and two selects on scratch databases of each type");
+        csLog::Log(csLog::Info,
+            "    and desc-encoding, and report their size.");
+        csLog::Log(csLog::Info,
+            "  -g <group>, --group <group>");
+        csLog::Log(csLog::Info,
+            "    Make the alert visible to this group name or GID; may be repeated.");
         csLog::Log(csLog::Info,
             "  -a, --auto-resolve");
         csLog::Log(csLog::Info,
             "    Alert will auto-resolve (ex: firewall panic mode).");
 
-        csLog::Log(csLog::Info, "\nMark alert type as resolved:");
+        csLog::Log(csLog::Info, "\nMark alerts as resolved:\n  # eventsctl -r <-t <type>|-i <id>|-U <uuid>|-H <hash>> [<more>...]\n");
         csLog::Log(csLog::Info,
             "  -r, --mark-resolved");
         csLog::Log(csLog::Info,
             "  -t <type>, --type <type>");
         csLog::Log(csLog::Info,
-            "    Specify an alert type to resolve.");
+            "    Resolve all alerts of this type, or only those matching -U.");
+        csLog::Log(csLog::Info,
+            "  -i <id>, --id <id>");
+        csLog::Log(csLog::Info,
+            "    Resolve an alert by ID.");
+        csLog::Log(csLog::Info,
+            "  -U <uuid>, --uuid <uuid>");
+        csLog::Log(csLog::Info,
+            "    Resolve alerts by UUID.");
+        csLog::Log(csLog::Info,
+            "  -H <hash>, --hash <hash>");
+        csLog::Log(csLog::Info,
+            "    Resolve an alert by hash.");
+        csLog::Log(csLog::Info,
+            "    Further IDs, UUIDs or hashes may follow; all are resolved at once.");
 
-        csLog::Log(csLog::Info, "\nList all alerts:");
+        csLog::Log(csLog::Info, "\nList all alerts:\n  # eventsctl -L [-g <group> [-n <limit>]]\n");
         csLog::Log(csLog::Info,
             "  -L, --list");
+        csLog::Log(csLog::Info,
+            "  -g <group>, --group <group>");
+        csLog::Log(csLog::Info,
+            "    List only alerts visible to this group name or GID, newest first.");
+
+        csLog::Log(csLog::Info, "\nSearch alerts:\n  # eventsctl -F [-n <limit>] <search text>\n");
+        csLog::Log(csLog::Info,
+            "  -F, --search");
+        csLog::Log(csLog::Info,
+            "    Search alert descriptions, origins and basenames; best matches first.");
+        csLog::Log(csLog::Info,
+            "  -n <limit>, --limit <limit>");
+        csLog::Log(csLog::Info,
+            "    Return at most this many alerts.");
+
+        csLog::Log(csLog::Info, "\nList alert changes:\n  # eventsctl -K <seq> [-n <limit>]\n");
+        csLog::Log(csLog::Info,
+            "  -K <seq>, --changes <seq>");
+        csLog::Log(csLog::Info,
+            "    List alerts inserted, updated or deleted after this change sequence.");
+
+        csLog::Log(csLog::Info, "\nWatch for new and changed alerts:\n  # eventsctl -W [-t <type>] [-l <level>] [-o <origin>]\n");
+        csLog::Log(csLog::Info,
+            "  -W, --watch");
+        csLog::Log(csLog::Info,
+            "    Print alerts as they are inserted, repeated or resolved.");
+
+        csLog::Log(csLog::Info, "\nSummarize alerts by type and level:");
+        csLog::Log(csLog::Info,
+            "  -M, --summary");
+
+        csLog::Log(csLog::Info, "\nCount alerts:\n  # eventsctl -A <key> [-t <type>] [-l <level>] [-o <origin>] [-b <basename>] [-T <seconds>] [-N] [-n <limit>]\n");
+        csLog::Log(csLog::Info,
+            "  -A <key>, --aggregate <key>");
+        csLog::Log(csLog::Info,
+            "    Count matching alerts, grouped by: count (no grouping), type, level, origin,");
+        csLog::Log(csLog::Info,
+            "    basename, or time[:<seconds>] (hourly by default).  Largest groups first.");
+        csLog::Log(csLog::Info,
+            "  -T <seconds>, --max-age <seconds>");
+        csLog::Log(csLog::Info,
+            "    Count only alerts seen within this many seconds.");
+        csLog::Log(csLog::Info,
+            "  -N, --unresolved");
+        csLog::Log(csLog::Info,
+            "    Count only unresolved alerts.");
+
+        csLog::Log(csLog::Info, "\nProtocol codec self-test:");
+        csLog::Log(csLog::Info,
+            "  -Y <count>, --fuzz <count>");
+        csLog::Log(csLog::Info,
+            "    Round-trip <count> random alerts through the v1 and v2 codecs, report bytes");
+        csLog::Log(csLog::Info,
+            "    and time per alert, then decode <count> mutated and random packets of each.");
+
+        csLog::Log(csLog::Info, "\nOnline database backup:");
+        csLog::Log(csLog::Info,
+            "  -B <file>, --backup <file>");
+        csLog::Log(csLog::Info,
+            "    Write a consistent copy of the database to file while running.");
+
+        csLog::Log(csLog::Info, "\nRun-time statistics:");
+        csLog::Log(csLog::Info,
+            "  -Z, --stats");
+        csLog::Log(csLog::Info,
+            "    Display database lock contention, eviction and spool counters.");
 
         csLog::Log(csLog::Info, "\nCustom type registration:");
         csLog::Log(csLog::Info,
@@ -139,6 +249,10 @@ static void usage(int rc = 0, bool version = false)
             "  -b <basename>, --basename <basename>");
         csLog::Log(csLog::Info,
             "    Specify a custom alert type basename (registration mode only).");
+        csLog::Log(csLog::Info,
+            "  -T <seconds>, --max-age <seconds>");
+        csLog::Log(csLog::Info,
+            "    Purge resolved alerts of this type after this age (registration mode only).");
 
         csLog::Log(csLog::Info, "\nSet alert level override:");
         csLog::Log(csLog::Info,
@@ -166,11 +280,20 @@ static void usage(int rc = 0, bool version = false)
 int main(int argc, char *argv[])
 {
     int rc;
+    bool batch = false, datagram = false, benchmark = false;
 
     int64_t alert_id = 0;
+    uint64_t seq = 0;
+    uint32_t limit = 0, max_age = 0;
     uint32_t alert_flags = csEventsAlert::csAF_NULL;
     string alert_type, alert_user, alert_origin, alert_basename, alert_uuid;
+    string backup_filename, alert_hash;
     ostringstream alert_desc;
+    csEventsDb::csResolveKey resolve_key = csEventsDb::csRK_TYPE;
+    vector<string> resolve_values, alert_groups;
+    csEventsDb::csAggregateKey aggregate_key = csEventsDb::csAK_NONE;
+    uint32_t aggregate_bucket = 0;
+    bool unresolved = false;
 
     csEventsCtl::csEventsCtlMode mode = csEventsCtl::CTLM_NULL;
 
@@ -188,14 +311,39 @@ int main(int argc, char *argv[])
         { "origin", 1, 0, 'o' },
         { "basename", 1, 0, 'b' },
         { "uuid", 1, 0, 'U' },
+        { "group", 1, 0, 'g' },
         { "auto-resolve", 0, 0, 'a' },
+        { "stdin", 0, 0, 'I' },
+        { "datagram", 0, 0, 'Q' },
+        { "benchmark", 1, 0, 'X' },
         // Mark resolved
         { "mark-resolved", 0, 0, 'r' },
+        { "id", 1, 0, 'i' },
+        { "hash", 1, 0, 'H' },
         // List alerts
         { "list", 0, 0, 'L' },
+        // Search alerts
+        { "search", 0, 0, 'F' },
+        { "limit", 1, 0, 'n' },
+        // Alert changes
+        { "changes", 1, 0, 'K' },
+        // Watch alerts
+        { "watch", 0, 0, 'W' },
+        // Alert summary
+        { "summary", 0, 0, 'M' },
+        // Alert counts
+        { "aggregate", 1, 0, 'A' },
+        { "unresolved", 0, 0, 'N' },
+        // Online database backup
+        { "backup", 1, 0, 'B' },
+        // Run-time statistics
+        { "stats", 0, 0, 'Z' },
+        // Protocol codec self-test
+        { "fuzz", 1, 0, 'Y' },
         // Register/deregister type
         { "register", 0, 0, 'R' },
         { "deregister", 0, 0, 'D' },
+        { "max-age", 1, 0, 'T' },
         // Set alert flags override
         { "set-override", 0, 0, 'S' },
         // Clear alert flags override
@@ -212,7 +360,7 @@ int main(int argc, char *argv[])
     for (optind = 1;; ) {
         int o = 0;
         if ((rc = getopt_long(argc, argv,
-            "Vc:dh?st:u:U:b:o:rl:LRDSCa", options, &o)) == -1) break;
+            "Vc:dh?st:u:U:g:b:o:ri:H:l:LFn:K:WMA:NB:ZY:RDT:SCaIQX:", options, &o)) == -1) break;
         switch (rc) {
         case 'V':
             usage(0, true);
@@ -238,12 +386,25 @@ int main(int argc, char *argv[])
         case 't':
             alert_type = optarg;
             break;
+        case 'I':
+            batch = true;
+            break;
+        case 'Q':
+            datagram = true;
+            break;
+        case 'X':
+            benchmark = true;
+            limit = (uint32_t)strtoul(optarg, NULL, 0);
+            break;
         case 'u':
             alert_user = optarg;
             break;
         case 'U':
             alert_uuid = optarg;
             break;
+        case 'g':
+            alert_groups.push_back(string(optarg));
+            break;
         case 'b':
             alert_basename = optarg;
             break;
@@ -270,15 +431,81 @@ int main(int argc, char *argv[])
         case 'r':
             mode = csEventsCtl::CTLM_MARK_RESOLVED;
             break;
+        case 'i':
+            alert_id = (int64_t)strtoll(optarg, NULL, 0);
+            break;
+        case 'H':
+            alert_hash = optarg;
+            break;
         case 'L':
             mode = csEventsCtl::CTLM_LIST_ALERTS;
             break;
+        case 'F':
+            mode = csEventsCtl::CTLM_SEARCH;
+            break;
+        case 'n':
+            limit = (uint32_t)strtoul(optarg, NULL, 0);
+            break;
+        case 'K':
+            mode = csEventsCtl::CTLM_CHANGES;
+            seq = (uint64_t)strtoull(optarg, NULL, 0);
+            break;
+        case 'W':
+            mode = csEventsCtl::CTLM_WATCH;
+            break;
+        case 'M':
+            mode = csEventsCtl::CTLM_SUMMARY;
+            break;
+        case 'A':
+            mode = csEventsCtl::CTLM_AGGREGATE;
+            if (strcasecmp("count", optarg) == 0)
+                aggregate_key = csEventsDb::csAK_NONE;
+            else if (strcasecmp("type", optarg) == 0)
+                aggregate_key = csEventsDb::csAK_TYPE;
+            else if (strcasecmp("level", optarg) == 0)
+                aggregate_key = csEventsDb::csAK_LEVEL;
+            else if (strcasecmp("origin", optarg) == 0)
+                aggregate_key = csEventsDb::csAK_ORIGIN;
+            else if (strcasecmp("basename", optarg) == 0)
+                aggregate_key = csEventsDb::csAK_BASENAME;
+            else if (strncasecmp("time", optarg, 4) == 0 &&
+                (optarg[4] == '\0' || optarg[4] == ':')) {
+                aggregate_key = csEventsDb::csAK_BUCKET;
+                aggregate_bucket = (optarg[4] == ':') ?
+                    (uint32_t)strtoul(optarg + 5, NULL, 0) : 3600;
+                if (aggregate_bucket == 0) {
+                    csLog::Log(csLog::Error, "Invalid time bucket specified.");
+                    exit(1);
+                }
+            }
+            else {
+                csLog::Log(csLog::Error, "Invalid aggregate key specified.");
+                exit(1);
+            }
+            break;
+        case 'N':
+            unresolved = true;
+            break;
+        case 'B':
+            mode = csEventsCtl::CTLM_BACKUP;
+            backup_filename = optarg;
+            break;
+        case 'Z':
+            mode = csEventsCtl::CTLM_STATS;
+            break;
+        case 'Y':
+            mode = csEventsCtl::CTLM_FUZZ;
+            limit = (uint32_t)strtoul(optarg, NULL, 0);
+            break;
         case 'R':
             mode = csEventsCtl::CTLM_TYPE_REGISTER;
             break;
         case 'D':
             mode = csEventsCtl::CTLM_TYPE_DEREGISTER;
             break;
+        case 'T':
+            max_age = (uint32_t)strtoul(optarg, NULL, 0);
+            break;
         case 'S':
             mode = csEventsCtl::CTLM_OVERRIDE_SET;
             break;
@@ -294,16 +521,67 @@ int main(int argc, char *argv[])
     if (alert_type == "list") mode = csEventsCtl::CTLM_LIST_TYPES;
 
     if (mode == csEventsCtl::CTLM_SEND) {
-        if (argc > optind) alert_desc << argv[optind];
-        for (int i = optind + 1; i < argc; i++) alert_desc << " " << argv[i];
+        if (batch) mode = csEventsCtl::CTLM_SEND_BATCH;
+        else {
+            if (datagram) mode = csEventsCtl::CTLM_SEND_DATAGRAM;
+            else if (benchmark) mode = csEventsCtl::CTLM_SEND_BENCHMARK;
+            if (argc > optind) alert_desc << argv[optind];
+            for (int i = optind + 1; i < argc; i++) alert_desc << " " << argv[i];
+        }
         if (alert_flags == csEventsAlert::csAF_NULL)
             alert_flags |= csEventsAlert::csAF_LVL_NORM;
     }
+    else if (mode == csEventsCtl::CTLM_LIST_ALERTS) {
+        if (alert_groups.size() > 1) {
+            csLog::Log(csLog::Error, "Only one group may be listed at a time.");
+            exit(1);
+        }
+    }
+    else if (mode == csEventsCtl::CTLM_SEARCH) {
+        if (argc > optind) alert_desc << argv[optind];
+        for (int i = optind + 1; i < argc; i++) alert_desc << " " << argv[i];
+        if (alert_desc.tellp() <= 0) {
+            csLog::Log(csLog::Error, "Search text is required.");
+            exit(1);
+        }
+    }
+    else if (mode == csEventsCtl::CTLM_BACKUP) {
+        // The plugin writes the backup, so relative paths are resolved here
+        if (backup_filename[0] != '/') {
+            char *cwd = getcwd(NULL, 0);
+            if (cwd == NULL) {
+                csLog::Log(csLog::Error, "getcwd: %s", strerror(errno));
+                exit(1);
+            }
+            alert_desc << cwd << "/";
+            free(cwd);
+        }
+        alert_desc << backup_filename;
+    }
     else if (mode == csEventsCtl::CTLM_MARK_RESOLVED) {
-        if (alert_type.length() == 0) {
-            csLog::Log(csLog::Error, "Alert type to mark as resolved is required.");
+        if (alert_id > 0) {
+            ostringstream id;
+            id << alert_id;
+            resolve_key = csEventsDb::csRK_ID;
+            resolve_values.push_back(id.str());
+        }
+        else if (alert_hash.length() > 0) {
+            resolve_key = csEventsDb::csRK_HASH;
+            resolve_values.push_back(alert_hash);
+        }
+        else if (alert_uuid.length() > 0) {
+            resolve_key = csEventsDb::csRK_UUID;
+            resolve_values.push_back(alert_uuid);
+        }
+        else if (alert_type.length() == 0) {
+            csLog::Log(csLog::Error,
+                "Alert type, ID, UUID or hash to mark as resolved is required.");
             exit(1);
         }
+        if (resolve_key != csEventsDb::csRK_TYPE) {
+            for (int i = optind; i < argc; i++)
+                resolve_values.push_back(string(argv[i]));
+        }
     }
     else if (mode == csEventsCtl::CTLM_TYPE_REGISTER) {
         if (alert_type.length() == 0) {
@@ -339,10 +617,14 @@ int main(int argc, char *argv[])
     }
 
     if (mode == csEventsCtl::CTLM_SEND ||
+        mode == csEventsCtl::CTLM_SEND_BATCH ||
+        mode == csEventsCtl::CTLM_SEND_DATAGRAM ||
+        mode == csEventsCtl::CTLM_SEND_BENCHMARK ||
         mode == csEventsCtl::CTLM_TYPE_REGISTER ||
         mode == csEventsCtl::CTLM_TYPE_DEREGISTER ||
         mode == csEventsCtl::CTLM_OVERRIDE_SET ||
-        mode == csEventsCtl::CTLM_OVERRIDE_CLEAR) {
+        mode == csEventsCtl::CTLM_OVERRIDE_CLEAR ||
+        mode == csEventsCtl::CTLM_AGGREGATE) {
 
         locale lang;
         for (string::iterator i = alert_type.begin(); i != alert_type.end(); i++) {
@@ -362,7 +644,9 @@ int main(int argc, char *argv[])
         mode,
         alert_id, alert_flags, alert_type,
         alert_user, alert_origin, alert_basename,
-        alert_uuid, alert_desc
+        alert_uuid, alert_desc, limit, max_age,
+        resolve_key, resolve_values, alert_groups, seq,
+        aggregate_key, aggregate_bucket, unresolved
     );
 
     free(conf_filename);
@@ -371,6 +655,25 @@ int main(int argc, char *argv[])
     return rc;
 }
 
+// SQL string literal, for where clauses sent to the plugin; the plugin
+// cuts a where clause short at the first semicolon, so spell those out
+static string csEventsCtl_quote(const string &value)
+{
+    string quoted("'");
+
+    for (string::const_iterator i = value.begin(); i != value.end(); i++) {
+        if ((*i) == ';') {
+            quoted.append("' || char(59) || '");
+            continue;
+        }
+        if ((*i) == '\'') quoted.push_back('\'');
+        quoted.push_back(*i);
+    }
+    quoted.push_back('\'');
+
+    return quoted;
+}
+
 csEventsCtl::csEventsCtl()
     : events_conf(NULL), events_socket(NULL)
 {
@@ -389,19 +692,45 @@ csEventsCtl::~csEventsCtl()
 int csEventsCtl::Exec(csEventsCtlMode mode,
         int64_t id, uint32_t flags, const string &type, const string &user,
         const string &origin, const string &basename, const string &uuid,
-        ostringstream &desc)
+        ostringstream &desc, uint32_t limit, uint32_t max_age,
+        csEventsDb::csResolveKey resolve_key, const vector<string> &resolve_values,
+        const vector<string> &groups, uint64_t seq,
+        csEventsDb::csAggregateKey aggregate_key, uint32_t bucket, bool unresolved)
 {
     csEventsAlert alert;
     csAlertIdMap alert_types;
-    csEventsDb_sqlite *events_db;
+    csEventsDb *events_db;
     vector<csEventsAlert *> result;
+    csEventsSummaryVector summary;
+    csEventsAggregateVector aggregate;
+    csEventsStatsMap stats;
+    csEventsChangeVector changes;
+    uint64_t changes_last = 0, changes_horizon = 0;
+    vector<string> values;
     char alert_flags[5];
     struct tm tm_local;
     char date_time[_CS_MAX_TIMESTAMP];
     string alert_type_name, alert_basename, alert_prio;
     uint32_t type_id = 0;
+    string backup_filename;
+    uint32_t backup_remaining = 0, backup_total = 0, backup_duration = 0;
+    uint32_t batch_counts[5] = { 0, 0, 0, 0, 0 };
+
+    // Needs neither the database nor the plugin
+    if (mode == CTLM_FUZZ) return (Fuzz(limit) ? CTLC_SUCCESS : CTLC_PROTOCOL);
 
-    events_db = new csEventsDb_sqlite(events_conf->GetSqliteDbFilename());
+    switch (events_conf->GetDbType()) {
+    case csEventsDb::csDBT_LOG:
+        events_db = new csEventsDb_log(events_conf->GetLogDbPath(),
+            events_conf->GetLogSegmentSize(), events_conf->GetLogSegmentAge(),
+            events_conf->GetLogSegmentsMax());
+        break;
+    default:
+        events_db = new csEventsDb_sqlite(events_conf->GetSqliteDbFilename(),
+            events_conf->GetSqliteFullTextSearch(),
+            events_conf->GetSqliteTemplateEncoding());
+        break;
+    }
 
     try {
         events_db->Open();
@@ -429,7 +758,11 @@ int csEventsCtl::Exec(csEventsCtlMode mode,
         throw;
     }
 
-    if (mode == CTLM_SEND || mode == CTLM_MARK_RESOLVED || mode == CTLM_LIST_ALERTS ||
+    if (mode == CTLM_SEND || mode == CTLM_SEND_BENCHMARK ||
+        mode == CTLM_MARK_RESOLVED || mode == CTLM_LIST_ALERTS ||
+        mode == CTLM_SUMMARY || mode == CTLM_AGGREGATE ||
+        mode == CTLM_SEARCH || mode == CTLM_BACKUP ||
+        mode == CTLM_STATS || mode == CTLM_CHANGES || mode == CTLM_WATCH ||
         mode == CTLM_TYPE_REGISTER || mode == CTLM_TYPE_DEREGISTER ||
         mode == CTLM_OVERRIDE_SET || mode == CTLM_OVERRIDE_CLEAR) {
 
@@ -452,6 +785,8 @@ int csEventsCtl::Exec(csEventsCtlMode mode,
     try {
         switch (mode) {
         case CTLM_SEND:
+        case CTLM_SEND_DATAGRAM:
+        case CTLM_SEND_BENCHMARK:
             alert.SetFlags(flags);
             alert.SetType(events_conf->GetAlertId(type));
             if (user.length()) alert.SetUser(user);
@@ -459,16 +794,75 @@ int csEventsCtl::Exec(csEventsCtlMode mode,
             if (origin.length()) alert.SetOrigin(origin);
             if (basename.length()) alert.SetBasename(basename);
             if (uuid.length()) alert.SetUUID(uuid);
+            for (vector<string>::const_iterator i = groups.begin();
+                i != groups.end(); i++) alert.AddGroup((*i));
             if (desc.tellp()) alert.SetDescription(desc.str());
 
-            events_socket->AlertInsert(alert);
+            if (mode == CTLM_SEND) events_socket->AlertInsert(alert);
+            else if (mode == CTLM_SEND_BENCHMARK) Benchmark(alert, limit);
+            else {
+                csEventsDatagramClient datagram(
+                    events_conf->GetInsertSocketPath());
+                datagram.Connect();
+                datagram.AlertInsert(alert);
+            }
 
             break;
 
-        case CTLM_MARK_RESOLVED:
+        case CTLM_SEND_BATCH:
+            alert.SetFlags(flags);
             alert.SetType(events_conf->GetAlertId(type));
+            if (user.length()) alert.SetUser(user);
+            else alert.SetUser(geteuid());
+            if (origin.length()) alert.SetOrigin(origin);
+            if (basename.length()) alert.SetBasename(basename);
+            for (vector<string>::const_iterator i = groups.begin();
+                i != groups.end(); i++) alert.AddGroup((*i));
+
+            {
+                csEventsCtlBatchCounter counter;
+                csEventsAsyncClient client(
+                    events_conf->GetEventsSocketPath(), _EVENTS_SOCKET_BATCH_MAX);
+
+                client.Start();
+
+                while (cin.good()) {
+                    string line;
+                    getline(cin, line);
+                    if (! line.length()) continue;
+
+                    alert.SetDescription(line);
+                    while (! client.AlertInsert(alert, &counter)) client.Flush();
+                }
+
+                client.Stop();
+
+                memcpy(batch_counts, counter.counts, sizeof(batch_counts));
+            }
+
+            csLog::Log(csLog::Info,
+                "Stored: %u, spooled: %u, ignored: %u, dropped: %u, failed: %u",
+                batch_counts[csSMIS_STORED], batch_counts[csSMIS_SPOOLED],
+                batch_counts[csSMIS_IGNORED], batch_counts[csSMIS_DROPPED],
+                batch_counts[csSMIS_ERROR]);
+
+            if (batch_counts[csSMIS_ERROR] || batch_counts[csSMIS_DROPPED])
+                return CTLC_EXCEPTION;
+            break;
 
-            events_socket->AlertMarkAsResolved(alert);
+        case CTLM_MARK_RESOLVED:
+            if (resolve_key == csEventsDb::csRK_TYPE) {
+                ostringstream id;
+                id << events_conf->GetAlertId(type);
+                values.push_back(id.str());
+            }
+            else {
+                values = resolve_values;
+                if (type.length() > 0) type_id = events_conf->GetAlertId(type);
+            }
+
+            csLog::Log(csLog::Info, "Resolved %u alert(s).",
+                events_socket->AlertResolve(resolve_key, values, type_id));
 
             break;
 
@@ -482,9 +876,20 @@ int csEventsCtl::Exec(csEventsCtlMode mode,
             break;
 
         case CTLM_LIST_ALERTS:
-            events_socket->AlertSelect("ORDER BY stamp", result);
+        case CTLM_SEARCH:
+            if (mode == CTLM_SEARCH)
+                events_socket->AlertSearch(desc.str(), limit, result);
+            else if (groups.size()) {
+                vector<gid_t> gids;
+                alert.AddGroup(groups[0]);
+                alert.GetGroups(gids);
+                events_socket->AlertSelectGroup(gids[0], limit, result);
+            }
+            else
+                events_socket->AlertSelect("ORDER BY stamp", result);
             if (result.size() == 0) {
-                csLog::Log(csLog::Info, "No alerts in database.");
+                csLog::Log(csLog::Info, (mode == CTLM_SEARCH) ?
+                    "No matching alerts." : "No alerts in database.");
                 break;
             }
             for (vector<csEventsAlert *>::iterator i = result.begin();
@@ -537,10 +942,204 @@ int csEventsCtl::Exec(csEventsCtlMode mode,
             }
             break;
             
+        case CTLM_CHANGES:
+            events_socket->AlertChanges(seq, limit,
+                changes, changes_last, changes_horizon);
+            if (seq < changes_horizon || seq > changes_last) {
+                csLog::Log(csLog::Warning,
+                    "Change sequence %llu is out of range (%llu - %llu); reload all alerts.",
+                    (unsigned long long)seq, (unsigned long long)changes_horizon,
+                    (unsigned long long)changes_last);
+            }
+            for (csEventsChangeVector::iterator i = changes.begin();
+                i != changes.end(); i++) {
+                if ((*i).alert == NULL) {
+                    csLog::Log(csLog::Info, "%-10llu#%-10lld(deleted)",
+                        (unsigned long long)(*i).seq, (long long)(*i).id);
+                    continue;
+                }
+                csLog::Log(csLog::Info, "%-10llu#%-10lld%s",
+                    (unsigned long long)(*i).seq, (long long)(*i).id,
+                    (*i).alert->GetDescription().c_str());
+                delete (*i).alert;
+            }
+            csLog::Log(csLog::Info, "Last change: %llu",
+                (unsigned long long)changes_last);
+            break;
+
+        case CTLM_WATCH:
+            {
+                csEventsSubscription filter;
+                filter.level_mask = flags & (csEventsAlert::csAF_LVL_NORM |
+                    csEventsAlert::csAF_LVL_WARN | csEventsAlert::csAF_LVL_CRIT);
+                filter.origin = origin;
+                if (type.length() > 0)
+                    filter.types.push_back(events_conf->GetAlertId(type));
+
+                events_socket->AlertSubscribe(filter);
+            }
+            for ( ;; ) {
+                events_socket->AlertWatch(alert);
+
+                const time_t stamp = alert.GetUpdated();
+                if (localtime_r(&stamp, &tm_local) == NULL ||
+                    strftime(date_time, _CS_MAX_TIMESTAMP, "%c", &tm_local) <= 0)
+                    date_time[0] = '\0';
+
+                try {
+                    alert_type_name = events_conf->GetAlertType(alert.GetType());
+                } catch (csException &e) {
+                    alert_type_name = "UNKNOWN";
+                }
+
+                csLog::Log(csLog::Info, "#%-10lld%-30s%s%s: %s",
+                    (long long)alert.GetId(), date_time,
+                    (alert.GetFlags() & csEventsAlert::csAF_FLG_RESOLVED) ?
+                        "[resolved] " : "",
+                    alert_type_name.c_str(), alert.GetDescription().c_str());
+            }
+            break;
+
+        case CTLM_SUMMARY:
+            events_socket->AlertSummary(summary);
+            if (summary.size() == 0) {
+                csLog::Log(csLog::Info, "No alerts in database.");
+                break;
+            }
+            for (csEventsSummaryVector::iterator i = summary.begin();
+                i != summary.end(); i++) {
+
+                const time_t stamp = (*i).updated;
+                if (localtime_r(&stamp, &tm_local) == NULL ||
+                    strftime(date_time, _CS_MAX_TIMESTAMP, "%c", &tm_local) <= 0)
+                    date_time[0] = '\0';
+
+                try {
+                    alert_type_name = events_conf->GetAlertType((*i).type);
+                } catch (csException &e) {
+                    alert_type_name = "UNKNOWN";
+                }
+
+                if ((*i).level & csEventsAlert::csAF_LVL_CRIT)
+                    alert_prio = "CRITICAL";
+                else if ((*i).level & csEventsAlert::csAF_LVL_WARN)
+                    alert_prio = "WARNING";
+                else
+                    alert_prio = "NORMAL";
+
+                csLog::Log(csLog::Info, "%-24s%-10s%-10s%8u  %s",
+                    alert_type_name.c_str(), alert_prio.c_str(),
+                    ((*i).resolved) ? "resolved" : "active",
+                    (*i).count, date_time);
+            }
+            break;
+
+        case CTLM_AGGREGATE:
+            {
+                ostringstream where;
+
+                // Same filter clauses as a select
+                if (type.length() > 0)
+                    where << " AND alerts.type = " << events_conf->GetAlertId(type);
+                if (flags & (csEventsAlert::csAF_LVL_NORM |
+                    csEventsAlert::csAF_LVL_WARN | csEventsAlert::csAF_LVL_CRIT)) {
+                    where << " AND (alerts.flags & " << (flags &
+                        (csEventsAlert::csAF_LVL_NORM | csEventsAlert::csAF_LVL_WARN |
+                        csEventsAlert::csAF_LVL_CRIT)) << ") != 0";
+                }
+                if (unresolved) {
+                    where << " AND (alerts.flags & " <<
+                        csEventsAlert::csAF_FLG_RESOLVED << ") = 0";
+                }
+                if (origin.length() > 0)
+                    where << " AND alerts.origin = " << csEventsCtl_quote(origin);
+                if (basename.length() > 0)
+                    where << " AND alerts.basename = " << csEventsCtl_quote(basename);
+                if (max_age > 0)
+                    where << " AND stamps.stamp >= " << (time(NULL) - (time_t)max_age);
+
+                events_socket->AlertAggregate(aggregate_key,
+                    where.str(), limit, bucket, aggregate);
+            }
+            for (csEventsAggregateVector::iterator i = aggregate.begin();
+                i != aggregate.end(); i++) {
+
+                const time_t stamp = (*i).updated;
+                if ((*i).count == 0 || localtime_r(&stamp, &tm_local) == NULL ||
+                    strftime(date_time, _CS_MAX_TIMESTAMP, "%c", &tm_local) <= 0)
+                    date_time[0] = '\0';
+
+                switch (aggregate_key) {
+                case csEventsDb::csAK_TYPE:
+                    try {
+                        alert_type_name = events_conf->GetAlertType((uint32_t)(*i).key);
+                    } catch (csException &e) {
+                        alert_type_name = "UNKNOWN";
+                    }
+                    break;
+                case csEventsDb::csAK_LEVEL:
+                    if ((*i).key & csEventsAlert::csAF_LVL_CRIT)
+                        alert_type_name = "CRITICAL";
+                    else if ((*i).key & csEventsAlert::csAF_LVL_WARN)
+                        alert_type_name = "WARNING";
+                    else
+                        alert_type_name = "NORMAL";
+                    break;
+                case csEventsDb::csAK_ORIGIN:
+                case csEventsDb::csAK_BASENAME:
+                    alert_type_name = ((*i).name.length()) ? (*i).name : "(none)";
+                    break;
+                case csEventsDb::csAK_BUCKET:
+                    {
+                        char bucket_time[_CS_MAX_TIMESTAMP];
+                        const time_t start = (time_t)(*i).key;
+                        if (localtime_r(&start, &tm_local) == NULL ||
+                            strftime(bucket_time, _CS_MAX_TIMESTAMP,
+                                "%Y-%m-%d %H:%M:%S", &tm_local) <= 0)
+                            bucket_time[0] = '\0';
+                        alert_type_name = bucket_time;
+                    }
+                    break;
+                default:
+                    alert_type_name = "Total";
+                    break;
+                }
+
+                csLog::Log(csLog::Info, "%-24s%10u alerts%10u times  %s",
+                    alert_type_name.c_str(), (*i).alerts, (*i).count, date_time);
+            }
+            break;
+
+        case CTLM_BACKUP:
+            backup_filename = desc.str();
+            events_socket->DbBackup(backup_filename);
+
+            while (events_socket->DbBackupProgress(
+                backup_remaining, backup_total, backup_duration)) {
+                csLog::Log(csLog::Info, "Backup: %u/%u pages (%u%%)",
+                    backup_total - backup_remaining, backup_total,
+                    (backup_total > 0) ?
+                        (backup_total - backup_remaining) * 100 / backup_total : 0);
+            }
+
+            csLog::Log(csLog::Info, "Backup complete: %s: %u pages in %u.%03u seconds",
+                backup_filename.c_str(), backup_total,
+                backup_duration / 1000, backup_duration % 1000);
+            break;
+
+        case CTLM_STATS:
+            events_socket->Stats(stats);
+            for (csEventsStatsMap::iterator i = stats.begin();
+                i != stats.end(); i++) {
+                csLog::Log(csLog::Info, "%-40s%20llu",
+                    i->first.c_str(), (unsigned long long)i->second);
+            }
+            break;
+
         case CTLM_TYPE_REGISTER:
             alert_type_name = type;
             alert_basename = basename;
-            events_socket->TypeRegister(alert_type_name, alert_basename);
+            events_socket->TypeRegister(alert_type_name, alert_basename, max_age);
             break;
 
         case CTLM_TYPE_DEREGISTER:
@@ -584,4 +1183,493 @@ int csEventsCtl::Exec(csEventsCtlMode mode,
     return CTLC_SUCCESS;
 }
 
+static double csEventsCtl_elapsed(const struct timeval &start)
+{
+    struct timeval now, elapsed;
+
+    gettimeofday(&now, NULL);
+    timersub(&now, &start, &elapsed);
+
+    return elapsed.tv_sec + elapsed.tv_usec / 1000000.0;
+}
+
+static void csEventsCtl_report(const char *path, uint32_t count,
+    const struct timeval &start)
+{
+    double seconds = csEventsCtl_elapsed(start);
+    csLog::Log(csLog::Info, "%-10s%10u alerts in %7.3f seconds: %10.0f/s",
+        path, count, seconds, (seconds > 0) ? count / seconds : 0);
+}
+
+uint64_t csEventsCtl::BenchmarkProcessed(const string &prefix)
+{
+    csEventsStatsMap stats;
+    events_socket->Stats(stats);
+
+    return stats[prefix + ".accepted"] + stats[prefix + ".rejected"];
+}
+
+bool csEventsCtl::BenchmarkWait(const string &prefix, uint64_t target)
+{
+    uint64_t processed = 0, last = 0;
+    time_t active = time(NULL);
+
+    while ((processed = BenchmarkProcessed(prefix)) < target) {
+        if (processed != last) {
+            last = processed;
+            active = time(NULL);
+        }
+        else if (time(NULL) - active > _EVENTS_SOCKET_TIMEOUT_RW) {
+            csLog::Log(csLog::Warning, "%s: %llu alerts unaccounted for",
+                prefix.c_str(), (unsigned long long)(target - processed));
+            return false;
+        }
+        usleep(10000);
+    }
+
+    return true;
+}
+
+void csEventsCtl::Benchmark(const csEventsAlert &alert, uint32_t count)
+{
+    csEventsAlert stream_alert(alert);
+    csEventsStatsMap stats;
+    struct timeval start;
+    uint64_t target;
+
+    // The stats round trip is answered once every insert queued ahead of
+    // it has been processed
+    gettimeofday(&start, NULL);
+    for (uint32_t i = 0; i < count; i++) events_socket->AlertInsert(stream_alert);
+    events_socket->Stats(stats);
+    csEventsCtl_report("stream", count, start);
+
+    // Datagrams and ring records aren't answered at all; poll the stats
+    // until the plugin has caught up
+    if (events_conf->GetInsertSocketPath().length() > 0) {
+        csEventsDatagramClient datagram(events_conf->GetInsertSocketPath());
+        datagram.Connect();
+
+        target = BenchmarkProcessed("datagram") + count;
+
+        gettimeofday(&start, NULL);
+        for (uint32_t i = 0; i < count; i++) datagram.AlertInsert(alert);
+        if (BenchmarkWait("datagram", target))
+            csEventsCtl_report("datagram", count, start);
+    }
+
+    try {
+        csEventsRingClient ring(events_conf->GetEventsSocketPath());
+        ring.Connect();
+
+        target = BenchmarkProcessed("ring") + count;
+
+        gettimeofday(&start, NULL);
+        for (uint32_t i = 0; i < count; ) {
+            if (ring.AlertInsert(alert)) i++;
+            else sched_yield();
+        }
+        if (BenchmarkWait("ring", target))
+            csEventsCtl_report("ring", count, start);
+
+        csLog::Log(csLog::Info, "Ring found full: %llu times",
+            (unsigned long long)ring.GetFull());
+    } catch (csEventsSocketException &e) {
+        csLog::Log(csLog::Warning, "Ring: %s", e.estring.c_str());
+    }
+
+    BenchmarkDb(alert, count);
+}
+
+// Bytes used by a database file, or by the files in a log store directory
+static off_t csEventsCtl_disk_usage(const string &path)
+{
+    struct stat path_stat;
+    if (stat(path.c_str(), &path_stat) < 0) return 0;
+    if (! S_ISDIR(path_stat.st_mode)) return path_stat.st_size;
+
+    off_t usage = 0;
+    DIR *dh = opendir(path.c_str());
+    if (dh == NULL) return 0;
+
+    struct dirent *entry;
+    while ((entry = readdir(dh)) != NULL) {
+        if (! strcmp(entry->d_name, ".") || ! strcmp(entry->d_name, "..")) continue;
+        usage += csEventsCtl_disk_usage(path + "/" + entry->d_name);
+    }
+    closedir(dh);
+
+    return usage;
+}
+
+static void csEventsCtl_remove(const string &path)
+{
+    DIR *dh = opendir(path.c_str());
+    if (dh != NULL) {
+        struct dirent *entry;
+        while ((entry = readdir(dh)) != NULL) {
+            if (! strcmp(entry->d_name, ".") || ! strcmp(entry->d_name, "..")) continue;
+            csEventsCtl_remove(path + "/" + entry->d_name);
+        }
+        closedir(dh);
+        rmdir(path.c_str());
+    }
+    else unlink(path.c_str());
+}
+
+void csEventsCtl::BenchmarkDb(const csEventsAlert &alert, uint32_t count)
+{
+    char root[] = "/tmp/eventsctl-XXXXXX";
+    if (mkdtemp(root) == NULL) {
+        csLog::Log(csLog::Warning, "Database benchmark: %s", strerror(errno));
+        return;
+    }
+
+    // The same synthetic corpus for each database type: count occurrences
+    // of count / 16 distinct alerts, one per second, whose descriptions
+    // are rendered from a template with a host name parameter
+    string desc_template(alert.GetDescription().length() ?
+        alert.GetDescription() : string("Benchmark alert"));
+    desc_template += " from ";
+    desc_template.push_back(_EVENTS_ALERT_TEMPLATE_MARKER);
+    desc_template.push_back((char)1);
+
+    uint32_t distinct = (count > 16) ? count / 16 : 1;
+    time_t base = time(NULL) - (time_t)count;
+
+    const char *names[] = { "sqlite", "template", "log" };
+    const string paths[] = {
+        string(root) + "/text.db", string(root) + "/template.db",
+        string(root) + "/log"
+    };
+
+    for (int n = 0; n < 3; n++) {
+        csEventsDb *db = NULL;
+
+        try {
+            if (n < 2)
+                db = new csEventsDb_sqlite(paths[n], false, (n == 1));
+            else
+                db = new csEventsDb_log(paths[n]);
+
+            db->Open();
+            db->Create();
+
+            // Committed in batches, as the plugin does
+            struct timeval start;
+            gettimeofday(&start, NULL);
+
+            for (uint32_t i = 0; i < count; ) {
+                db->Begin();
+                for (uint32_t j = 0; j < _EVENTS_SOCKET_BATCH_MAX && i < count; j++, i++) {
+                    csEventsAlert occurrence(alert);
+                    ostringstream value;
+                    vector<string> params;
+                    string desc;
+
+                    value << "bench-" << (i % distinct);
+                    occurrence.SetUUID(value.str());
+                    value.str("");
+                    value << "host-" << (i % 61);
+                    params.push_back(value.str());
+
+                    csEventsAlert::TemplateRender(desc_template, params, desc);
+                    occurrence.SetDescription(desc);
+                    occurrence.SetTemplate(desc_template, params);
+                    occurrence.SetCreated(base + (time_t)i);
+                    occurrence.SetUpdated(base + (time_t)i);
+
+                    db->InsertAlert(occurrence);
+                }
+                db->Commit();
+            }
+
+            csEventsCtl_report(names[n], count, start);
+
+            // Newest occurrences, then a window over the last tenth
+            vector<csEventsAlert *> result;
+            ostringstream where;
+            double latest, window;
+            uint32_t latest_rows, window_rows;
+
+            gettimeofday(&start, NULL);
+            latest_rows = db->SelectAlert("ORDER BY updated DESC LIMIT 100", &result);
+            latest = csEventsCtl_elapsed(start);
+            for (vector<csEventsAlert *>::iterator i = result.begin();
+                i != result.end(); i++) delete (*i);
+            result.clear();
+
+            where << "AND stamps.stamp >= " << (base + (time_t)(count - count / 10));
+            where << " ORDER BY stamp";
+
+            gettimeofday(&start, NULL);
+            window_rows = db->SelectAlert(where.str(), &result);
+            window = csEventsCtl_elapsed(start);
+            for (vector<csEventsAlert *>::iterator i = result.begin();
+                i != result.end(); i++) delete (*i);
+
+            db->Close();
+
+            csLog::Log(csLog::Info,
+                "%-10slatest %u rows in %.3f ms, window %u rows in %.3f ms, %llu KiB",
+                "", latest_rows, latest * 1000.0, window_rows, window * 1000.0,
+                (unsigned long long)(csEventsCtl_disk_usage(paths[n]) / 1024));
+        } catch (csException &e) {
+            csLog::Log(csLog::Warning, "Database benchmark: %s: %s",
+                names[n], e.estring.c_str());
+        }
+
+        if (db != NULL) delete db;
+    }
+
+    csEventsCtl_remove(root);
+}
+
+static uint32_t csEventsCtl_random(uint32_t range)
+{
+    return (uint32_t)(random() % range);
+}
+
+static string csEventsCtl_random_string(size_t max)
+{
+    string value;
+    size_t length = csEventsCtl_random(max + 1);
+
+    for (size_t i = 0; i < length; i++)
+        value.push_back((char)(' ' + csEventsCtl_random(95)));
+
+    return value;
+}
+
+// Each field is left unset now and then, to vary the v2 field mask; the
+// same alerts go through both versions, so strings are kept within v1's
+// 255 bytes
+static void csEventsCtl_random_alert(csEventsAlert &alert)
+{
+    time_t now = time(NULL);
+
+    if (csEventsCtl_random(4)) alert.SetId(csEventsCtl_random(1000000) + 1);
+    if (csEventsCtl_random(4)) alert.SetCreated(now - csEventsCtl_random(86400));
+    if (csEventsCtl_random(4)) alert.SetUpdated(now);
+    if (csEventsCtl_random(4)) {
+        alert.SetFlags((csEventsAlert::csAF_LVL_NORM << csEventsCtl_random(3)) |
+            (csEventsCtl_random(8) << 8));
+    }
+    if (csEventsCtl_random(4)) alert.SetType(1000 + csEventsCtl_random(100000));
+    if (csEventsCtl_random(4)) alert.SetUser((uid_t)csEventsCtl_random(65536));
+    for (uint32_t i = csEventsCtl_random(4); i > 0; i--)
+        alert.AddGroup((gid_t)csEventsCtl_random(65536));
+    if (csEventsCtl_random(4)) alert.SetOrigin(csEventsCtl_random_string(32));
+    if (csEventsCtl_random(4)) alert.SetBasename(csEventsCtl_random_string(32));
+    if (csEventsCtl_random(4)) alert.SetUUID(csEventsCtl_random_string(36));
+    if (csEventsCtl_random(4))
+        alert.SetDescription(csEventsCtl_random_string(255));
+}
+
+static bool csEventsCtl_alert_equal(const csEventsAlert &a, const csEventsAlert &b)
+{
+    const csEventsAlert::csEventsAlertData *x = a.GetDataPtr();
+    const csEventsAlert::csEventsAlertData *y = b.GetDataPtr();
+
+    return (x->id == y->id && x->created == y->created &&
+        x->updated == y->updated && x->flags == y->flags &&
+        x->type == y->type && x->user == y->user && x->groups == y->groups &&
+        x->origin == y->origin && x->basename == y->basename &&
+        x->uuid == y->uuid && x->desc == y->desc);
+}
+
+// Flip, drop or insert bytes; truncated and extended packets get a header
+// to match, so they are parsed rather than rejected as incomplete
+static void csEventsCtl_mutate(string &packets)
+{
+    const size_t header_length = sizeof(csEventsSocket::csEventsHeader);
+    size_t offset;
+
+    switch (csEventsCtl_random(3)) {
+    case 0:
+        for (uint32_t i = csEventsCtl_random(4) + 1; i > 0; i--) {
+            offset = csEventsCtl_random(packets.length());
+            packets[offset] ^= (char)(csEventsCtl_random(255) + 1);
+        }
+        return;
+    case 1:
+        if (packets.length() <= header_length) return;
+        offset = header_length + csEventsCtl_random(packets.length() - header_length);
+        packets.resize(offset);
+        break;
+    default:
+        offset = header_length + csEventsCtl_random(packets.length() - header_length + 1);
+        packets.insert(offset,
+            csEventsCtl_random_string(csEventsCtl_random(16) + 1));
+        break;
+    }
+
+    // Whatever follows the first packet is left to run on
+    csEventsSocket::csEventsHeader header;
+    memcpy(&header, packets.data(), header_length);
+    if (packets.length() - header_length < header.payload_length ||
+        csEventsCtl_random(2)) {
+        header.payload_length = (uint32_t)(packets.length() - header_length);
+        packets.replace(0, header_length, (const char *)&header, header_length);
+    }
+}
+
+bool csEventsCtl::Fuzz(uint32_t count)
+{
+    // Logged so a failing run can be repeated
+    unsigned seed = (unsigned)(time(NULL) ^ getpid());
+    csLog::Log(csLog::Info, "Random seed: %u", seed);
+    srandom(seed);
+
+    if (count == 0) count = 1;
+
+    vector<csEventsAlert *> alerts;
+    for (uint32_t n = 0; n < count; n++) {
+        csEventsAlert *alert = new csEventsAlert();
+        csEventsCtl_random_alert(*alert);
+        alerts.push_back(alert);
+    }
+
+    bool passed = FuzzVersion("v1", _EVENTS_SOCKET_PROTOVER_BATCH, alerts);
+    if (! FuzzVersion("v2", _EVENTS_SOCKET_PROTOVER, alerts)) passed = false;
+
+    for (vector<csEventsAlert *>::iterator i = alerts.begin();
+        i != alerts.end(); i++) delete (*i);
+
+    return passed;
+}
+
+bool csEventsCtl::FuzzVersion(const char *name, uint32_t version,
+    const vector<csEventsAlert *> &alerts)
+{
+    csEventsSocketLoopback loopback(version);
+    uint32_t count = (uint32_t)alerts.size();
+    vector<csEventsAlert *> result;
+    vector<csEventsAlert> decoded(count);
+    vector<csEventsAlert *>::const_iterator i;
+    vector<csEventsAlert *>::iterator j;
+    struct timeval start;
+    double encode, decode;
+    string packets, label;
+    uint32_t mismatched = 0;
+
+    // One alert per packet, as inserted over the stream socket
+    gettimeofday(&start, NULL);
+    for (i = alerts.begin(); i != alerts.end(); i++) {
+        loopback.ResetPacket();
+        loopback.WritePacketVar(*(*i));
+        loopback.WritePacket(csSMOC_ALERT_INSERT);
+    }
+    encode = csEventsCtl_elapsed(start);
+    loopback.TakePackets(packets);
+    loopback.PutPackets(packets);
+
+    gettimeofday(&start, NULL);
+    for (uint32_t n = 0; n < count; n++) {
+        loopback.ReadPacket();
+        loopback.ReadPacketVar(decoded[n]);
+    }
+    decode = csEventsCtl_elapsed(start);
+
+    for (uint32_t n = 0; n < count; n++)
+        if (! csEventsCtl_alert_equal(*alerts[n], decoded[n])) mismatched++;
+
+    label = string(name) + " insert";
+    csLog::Log(csLog::Info,
+        "%-10s%10u alerts, %7.1f bytes, encode %7.3f us, decode %7.3f us per alert",
+        label.c_str(), count, (double)packets.length() / count,
+        encode * 1000000.0 / count, decode * 1000000.0 / count);
+
+    // Select replies, framed as the plugin sends them
+    gettimeofday(&start, NULL);
+    loopback.WriteAlertRecords(alerts);
+    encode = csEventsCtl_elapsed(start);
+    loopback.TakePackets(packets);
+    loopback.PutPackets(packets);
+
+    gettimeofday(&start, NULL);
+    loopback.ReadAlertRecords(count, result);
+    decode = csEventsCtl_elapsed(start);
+
+    for (uint32_t n = 0; n < count; n++)
+        if (! csEventsCtl_alert_equal(*alerts[n], *result[n])) mismatched++;
+    for (j = result.begin(); j != result.end(); j++) delete (*j);
+    result.clear();
+
+    label = string(name) + " record";
+    csLog::Log(csLog::Info,
+        "%-10s%10u alerts, %7.1f bytes, encode %7.3f us, decode %7.3f us per alert",
+        label.c_str(), count, (double)packets.length() / count,
+        encode * 1000000.0 / count, decode * 1000000.0 / count);
+
+    // Mutated packets, and now and then one of random bytes; either may
+    // decode to something, but anything other than a protocol error is a bug
+    uint32_t accepted = 0, rejected = 0, failed = 0;
+
+    for (uint32_t n = 0; n < count; n++) {
+        bool records = (n & 1);
+        uint32_t matches = csEventsCtl_random(8) + 1;
+
+        if (csEventsCtl_random(8)) {
+            if (records) {
+                vector<csEventsAlert *> batch;
+                for (uint32_t k = 0; k < matches; k++)
+                    batch.push_back(alerts[csEventsCtl_random(count)]);
+                loopback.WriteAlertRecords(batch);
+            }
+            else {
+                loopback.ResetPacket();
+                loopback.WritePacketVar(*alerts[csEventsCtl_random(count)]);
+                loopback.WritePacket(csSMOC_ALERT_INSERT);
+            }
+            loopback.TakePackets(packets);
+            csEventsCtl_mutate(packets);
+        }
+        else {
+            csEventsSocket::csEventsHeader header;
+            string payload(csEventsCtl_random(256), '\0');
+            for (size_t k = 0; k < payload.length(); k++)
+                payload[k] = (char)random();
+
+            header.opcode = (uint8_t)(records ? csSMOC_ALERT_RECORD : csSMOC_ALERT_INSERT);
+            header.payload_length = (uint32_t)payload.length();
+            packets.assign((const char *)&header, sizeof(header));
+            packets.append(payload);
+        }
+
+        loopback.PutPackets(packets);
+
+        try {
+            if (records) loopback.ReadAlertRecords(matches, result);
+            else {
+                csEventsAlert alert;
+                loopback.ReadPacket();
+                loopback.ReadPacketVar(alert);
+            }
+            accepted++;
+        } catch (csEventsSocketProtocolException &e) {
+            rejected++;
+        } catch (csException &e) {
+            csLog::Log(csLog::Warning, "%s %s: %s", name,
+                records ? "record" : "insert", e.estring.c_str());
+            failed++;
+        }
+
+        for (j = result.begin(); j != result.end(); j++) delete (*j);
+        result.clear();
+    }
+
+    label = string(name) + " fuzz";
+    csLog::Log(csLog::Info,
+        "%-10s%10u packets, %u decoded, %u rejected, %u failed",
+        label.c_str(), count, accepted, rejected, failed);
+
+    if (mismatched > 0) {
+        csLog::Log(csLog::Warning, "%s: %u alerts changed in a round trip",
+            name, mismatched);
+    }
+
+    return (mismatched == 0 && failed == 0);
+}
+
 // vi: expandtab shiftwidth=4 softtabstop=4 tabstop=4
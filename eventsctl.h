@@ -17,6 +17,25 @@
 #ifndef _EVENTSCTL_H
 #define _EVENTSCTL_H
 
+// Tallies csEventsAsyncClient outcomes for eventsctl --stdin
+class csEventsCtlBatchCounter : public csEventsAsyncCallback
+{
+public:
+    csEventsCtlBatchCounter() { memset(counts, 0, sizeof(counts)); }
+
+    virtual void AlertInserted(const csEventsAlert &alert,
+        const csEventsInsertResult &result)
+    {
+        if (result.status <= csSMIS_ERROR) counts[result.status]++;
+        if (result.status == csSMIS_ERROR) {
+            csLog::Log(csLog::Warning, "Alert rejected: %s",
+                result.error.c_str());
+        }
+    }
+
+    uint32_t counts[csSMIS_ERROR + 1];
+};
+
 class csEventsCtl : public csEventClient
 {
 public:
@@ -24,6 +43,9 @@ public:
     {
         CTLM_NULL,
         CTLM_SEND,
+        CTLM_SEND_BATCH,
+        CTLM_SEND_DATAGRAM,
+        CTLM_SEND_BENCHMARK,
         CTLM_LIST_TYPES,
         CTLM_LIST_ALERTS,
         CTLM_MARK_RESOLVED,
@@ -31,6 +53,14 @@ public:
         CTLM_TYPE_DEREGISTER,
         CTLM_OVERRIDE_SET,
         CTLM_OVERRIDE_CLEAR,
+        CTLM_SUMMARY,
+        CTLM_SEARCH,
+        CTLM_BACKUP,
+        CTLM_STATS,
+        CTLM_CHANGES,
+        CTLM_WATCH,
+        CTLM_AGGREGATE,
+        CTLM_FUZZ,
     };
 
     enum csEventsCtlExitCode
@@ -48,11 +78,25 @@ public:
     int Exec(csEventsCtlMode mode,
         int64_t id, uint32_t flags, const string &type,
         const string &user, const string &origin, const string &basename,
-        const string &uuid, ostringstream &desc);
+        const string &uuid, ostringstream &desc, uint32_t limit = 0,
+        uint32_t max_age = 0,
+        csEventsDb::csResolveKey resolve_key = csEventsDb::csRK_TYPE,
+        const vector<string> &resolve_values = vector<string>(),
+        const vector<string> &groups = vector<string>(), uint64_t seq = 0,
+        csEventsDb::csAggregateKey aggregate_key = csEventsDb::csAK_NONE,
+        uint32_t bucket = 0, bool unresolved = false);
 
 protected:
     friend class csPluginXmlParser;
 
+    void Benchmark(const csEventsAlert &alert, uint32_t count);
+    uint64_t BenchmarkProcessed(const string &prefix);
+    bool BenchmarkWait(const string &prefix, uint64_t target);
+    void BenchmarkDb(const csEventsAlert &alert, uint32_t count);
+    bool Fuzz(uint32_t count);
+    bool FuzzVersion(const char *name, uint32_t version,
+        const vector<csEventsAlert *> &alerts);
+
     csEventsConf *events_conf;
     csEventsSocketClient *events_socket;
 };
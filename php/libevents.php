@@ -6,11 +6,21 @@ define('csSMOC_ALERT_INSERT', 2);
 define('csSMOC_ALERT_SELECT', 3);
 define('csSMOC_ALERT_MARK_AS_READ', 4);
 define('csSMOC_ALERT_RECORD', 5);
+define('csSMOC_ALERT_SUMMARY', 10);
+define('csSMOC_HISTOGRAM_SELECT', 11);
+define('csSMOC_STATS', 15);
+define('csSMOC_ALERT_RESOLVE', 16);
+define('csSMOC_ALERT_SELECT_GROUP', 17);
+define('csSMOC_ALERT_CHANGES', 18);
+define('csSMOC_ALERT_SUBSCRIBE', 19);
+define('csSMOC_ALERT_INSERT_BATCH', 20);
+define('csSMOC_ALERT_AGGREGATE', 22);
 define('csSMOC_RESULT', 0xFF);
 
 define('csSMPR_OK', 0);
 define('csSMPR_VERSION_MISMATCH', 1);
 define('csSMPR_ALERT_MATCHES', 2);
+define('csSMPR_ERROR', 3);
 
 define('csAF_NULL', 0);
 define('csAF_LVL_NORM', 0x00000001);
@@ -22,7 +32,46 @@ define('csAF_MAX', 0xFFFFFFFF);
 
 define('csAT_NULL', 0);
 
-define('csEVENTS_PROTOVER', 0x20141112);
+define('csHR_MINUTE', 0);
+define('csHR_HOUR', 1);
+define('csHR_DAY', 2);
+
+define('csRK_TYPE', 0);
+define('csRK_ID', 1);
+define('csRK_UUID', 2);
+define('csRK_HASH', 3);
+
+define('csAK_NONE', 0);
+define('csAK_TYPE', 1);
+define('csAK_LEVEL', 2);
+define('csAK_ORIGIN', 3);
+define('csAK_BASENAME', 4);
+define('csAK_BUCKET', 5);
+
+define('csSMAF_ID', 0x0001);
+define('csSMAF_CREATED', 0x0002);
+define('csSMAF_UPDATED', 0x0004);
+define('csSMAF_FLAGS', 0x0008);
+define('csSMAF_TYPE', 0x0010);
+define('csSMAF_USER', 0x0020);
+define('csSMAF_GROUPS', 0x0040);
+define('csSMAF_ORIGIN', 0x0080);
+define('csSMAF_BASENAME', 0x0100);
+define('csSMAF_UUID', 0x0200);
+define('csSMAF_DESC', 0x0400);
+define('csSMAF_KNOWN', 0x07FF);
+
+define('csSMIS_STORED', 0);
+define('csSMIS_SPOOLED', 1);
+define('csSMIS_IGNORED', 2);
+define('csSMIS_DROPPED', 3);
+define('csSMIS_ERROR', 4);
+
+define('csEVENTS_PROTOVER', 0x20261023);
+define('csEVENTS_PROTOVER_V2', 0x20261020);
+define('csEVENTS_PROTOVER_FRAMES', 0x20261021);
+define('csEVENTS_PROTOVER_AGGREGATE', 0x20261023);
+define('csEVENTS_BATCH_MAX', 1024);
 
 class libEventsAlert
 {
@@ -75,6 +124,17 @@ class libEventsAlert
             'version' => array('format' => 'L', 'size' => 4),
             'result' => array('format' => 'C', 'size' => 1),
             'matches' => array('format' => 'L', 'size' => 4),
+            'level' => array('format' => 'L', 'size' => 4),
+            'resolved' => array('format' => 'C', 'size' => 1),
+            'count' => array('format' => 'L', 'size' => 4),
+            'resolution' => array('format' => 'C', 'size' => 1),
+            'stamp' => array('format' => 'L', 'size' => 4),
+            'value' => array('format' => 'Q', 'size' => 8),
+            'key' => array('format' => 'C', 'size' => 1),
+            'seq' => array('format' => 'LL', 'size' => 8),
+            'deleted' => array('format' => 'C', 'size' => 1),
+            'status' => array('format' => 'C', 'size' => 1),
+            'bucket' => array('format' => 'L', 'size' => 4),
         );
     }
 
@@ -239,14 +299,17 @@ libEventsAlert::init_field_sizes();
 class libEventsitor
 {
     const PATH_SOCKET = '/var/lib/csplugin-events/eventsctl.socket';
+    const PATH_INSERT_SOCKET = '/var/lib/csplugin-events/insert.socket';
     const FILE_CONFIG = '/etc/clearsync.d/csplugin-events.conf';
 
     protected $sd;
+    protected $sd_datagram;
     protected $socket_path;
     protected $header;
     protected $header_field_sizes;
     protected $payload;
     protected $payload_index;
+    protected $proto_version;
     protected $alert_type_map;
 
     public function __construct($socket_path = self::PATH_SOCKET)
@@ -261,6 +324,7 @@ class libEventsitor
         if (! is_resource($this->sd))
             throw new Exception(socket_strerror(socket_last_error()));
         $this->socket_path = $socket_path;
+        $this->proto_version = 0;
 
         $this->reset_packet();
 
@@ -283,13 +347,21 @@ class libEventsitor
     public function __destruct()
     {
         if (is_resource($this->sd)) socket_close($this->sd);
+        if (is_resource($this->sd_datagram)) socket_close($this->sd_datagram);
     }
 
-    public function connect()
+    // Servers older than csEVENTS_PROTOVER_V2 refuse newer clients; pass
+    // an older $protover (on a new instance) to talk to them.
+    public function connect($protover = csEVENTS_PROTOVER)
     {
         if (socket_connect($this->sd, $this->socket_path) === false)
             throw new Exception(socket_strerror(socket_last_error($this->sd)));
-        $this->version_exchange();
+        $this->version_exchange($protover);
+    }
+
+    public function get_proto_version()
+    {
+        return $this->proto_version;
     }
 
     public function get_type_id($name)
@@ -310,33 +382,363 @@ class libEventsitor
         $this->write_packet(csSMOC_ALERT_INSERT);
     }
 
+    // Fire-and-forget insert over the datagram socket; no connect() is
+    // needed.  Nothing comes back: rejected and dropped alerts are only
+    // counted (see get_stats(), datagram.*).
+    public function send_alert_datagram($alert,
+        $socket_path = self::PATH_INSERT_SOCKET)
+    {
+        if (! is_resource($this->sd_datagram)) {
+            $this->sd_datagram = socket_create(AF_UNIX, SOCK_DGRAM, 0);
+            if (! is_resource($this->sd_datagram))
+                throw new Exception(socket_strerror(socket_last_error()));
+        }
+
+        // Datagrams carry their own protocol version
+        $proto_version = $this->proto_version;
+        $this->proto_version = csEVENTS_PROTOVER;
+
+        $this->reset_packet();
+        $this->write_packet_var(csEVENTS_PROTOVER, 'version');
+        $this->write_packet_alert($alert);
+        $this->proto_version = $proto_version;
+
+        $buffer = $this->pack_packet(csSMOC_ALERT_INSERT);
+        if (socket_sendto($this->sd_datagram,
+            $buffer, strlen($buffer), 0, $socket_path) === false) {
+            throw new Exception(
+                socket_strerror(socket_last_error($this->sd_datagram)));
+        }
+    }
+
+    // Insert up to csEVENTS_BATCH_MAX alerts in one request.  Returns one
+    // array('status', 'id', 'error') per alert, in order; 'id' is only set
+    // for csSMIS_STORED alerts.
+    public function send_alerts($alerts)
+    {
+        if (count($alerts) > csEVENTS_BATCH_MAX)
+            throw new Exception('Too many alerts in batch');
+
+        $this->reset_packet();
+        $this->write_packet_var(count($alerts), 'count');
+        foreach ($alerts as $alert)
+            $this->write_packet_alert($alert);
+        $this->write_packet(csSMOC_ALERT_INSERT_BATCH);
+
+        $result = $this->read_result();
+        if ($result == csSMPR_ERROR) {
+            $this->read_packet_string($error);
+            throw new Exception("Batch insert failed: $error");
+        }
+        if ($result != csSMPR_OK)
+            throw new Exception('Unexpected result: ' . $result);
+
+        $results = array();
+        $this->read_packet_var($count, 'count');
+
+        for ($i = 0; $i < $count; $i++) {
+            $row = array();
+            $this->read_packet_var($row['status'], 'status');
+            $this->read_packet_var($row['id'], 'value');
+            $this->read_packet_string($row['error']);
+            $results[] = $row;
+        }
+
+        return $results;
+    }
+
     public function get_alerts($where = 'ORDER BY updated')
     {
         $this->reset_packet();
         $this->write_packet_string($where);
         $this->write_packet(csSMOC_ALERT_SELECT);
 
+        $result = $this->read_result();
+        if ($result == csSMPR_ERROR) {
+            $this->read_packet_string($error);
+            throw new Exception("Select failed: $error");
+        }
+        if ($result != csSMPR_ALERT_MATCHES) {
+            throw new Exception(
+                'Unexpected result code: ' . $this->header['opcode']
+            );
+        }
+
+        $this->read_packet_var($matches, 'matches');
+
+        return $this->read_alert_records($matches);
+    }
+
+    public function get_alerts_by_group($group, $limit = 0)
+    {
+        if (is_string($group)) {
+            $grent = posix_getgrnam($group);
+            if ($grent === false)
+                throw new Exception("Group not found: $group");
+            $group = $grent['gid'];
+        }
+
+        $this->reset_packet();
+        $this->write_packet_var($group, 'group');
+        $this->write_packet_var($limit, 'count');
+        $this->write_packet(csSMOC_ALERT_SELECT_GROUP);
+
         if ($this->read_result() != csSMPR_ALERT_MATCHES) {
             throw new Exception(
                 'Unexpected result code: ' . $this->header['opcode']
             );
         }
 
-        $alerts = array();
         $this->read_packet_var($matches, 'matches');
 
+        return $this->read_alert_records($matches);
+    }
+
+    // Alerts inserted, updated or deleted after change sequence $seq, oldest
+    // first.  Deleted alerts are returned as their ID only.  When 'reload' is
+    // set, $seq is too old (or the database was reset) and the caller must
+    // fetch all alerts again, then continue from 'last'.
+    public function get_changes($seq, $limit = 0)
+    {
+        $this->reset_packet();
+        $this->write_packet_var($seq, 'seq');
+        $this->write_packet_var($limit, 'count');
+        $this->write_packet(csSMOC_ALERT_CHANGES);
+
+        $result = $this->read_result();
+        if ($result == csSMPR_ERROR) {
+            $this->read_packet_string($error);
+            throw new Exception("Changes failed: $error");
+        }
+        if ($result != csSMPR_ALERT_MATCHES)
+            throw new Exception('Unexpected result: ' . $result);
+
+        $this->read_packet_var($matches, 'matches');
+        $this->read_packet_var($last, 'value');
+        $this->read_packet_var($horizon, 'value');
+
+        $changes = array(
+            'last' => $last,
+            'horizon' => $horizon,
+            'reload' => ($seq < $horizon || $seq > $last),
+            'alerts' => array(),
+            'deleted' => array(),
+        );
+
         for ($i = 0; $i < $matches; $i++) {
-            if ($this->read_packet() != csSMOC_ALERT_RECORD) {
+            if ($this->read_packet() != csSMOC_ALERT_CHANGES) {
                 throw new Exception(
                     'Unexpected op-code: ' . $this->header['opcode']
                 );
             }
+            $this->read_packet_var($change_seq, 'value');
+            $this->read_packet_var($id, 'value');
+            $this->read_packet_var($deleted, 'deleted');
+            if ($deleted) {
+                $changes['deleted'][] = $id;
+                continue;
+            }
             $alert = new libEventsAlert();
             $this->read_packet_alert($alert);
-            $alerts[] = $alert;
+            $changes['alerts'][] = $alert;
         }
 
-        return $alerts;
+        return $changes;
+    }
+
+    // After subscribing, this connection only receives alerts; use another
+    // connection for queries.  Zero/empty filters match any alert.
+    public function subscribe($types = array(), $level_mask = 0, $origin = '')
+    {
+        $this->reset_packet();
+        $this->write_packet_var($level_mask, 'flags');
+        $this->write_packet_string($origin);
+        $this->write_packet_var(count($types), 'count');
+        foreach ($types as $type)
+            $this->write_packet_var($type, 'type');
+        $this->write_packet(csSMOC_ALERT_SUBSCRIBE);
+
+        $result = $this->read_result();
+        if ($result == csSMPR_ERROR) {
+            $this->read_packet_string($error);
+            throw new Exception("Subscribe failed: $error");
+        }
+        if ($result != csSMPR_OK)
+            throw new Exception('Unexpected result: ' . $result);
+    }
+
+    public function wait_alert()
+    {
+        if ($this->read_packet() != csSMOC_ALERT_RECORD) {
+            throw new Exception(
+                'Unexpected op-code: ' . $this->header['opcode']
+            );
+        }
+        if ($this->proto_version >= csEVENTS_PROTOVER_V2) {
+            $this->read_packet_varint($count);
+            if ($count != 1)
+                throw new Exception('Invalid alert record count');
+        }
+        $alert = new libEventsAlert();
+        $this->read_packet_alert($alert);
+
+        return $alert;
+    }
+
+    public function get_summary()
+    {
+        $this->reset_packet();
+        $this->write_packet(csSMOC_ALERT_SUMMARY);
+
+        if ($this->read_packet() != csSMOC_ALERT_SUMMARY) {
+            throw new Exception(
+                'Unexpected op-code: ' . $this->header['opcode']
+            );
+        }
+
+        $summary = array();
+        $this->read_packet_var($rows, 'matches');
+
+        for ($i = 0; $i < $rows; $i++) {
+            $row = array();
+            $this->read_packet_var($row['type'], 'type');
+            $this->read_packet_var($row['level'], 'level');
+            $this->read_packet_var($row['resolved'], 'resolved');
+            $this->read_packet_var($row['count'], 'count');
+            $this->read_packet_var($row['updated'], 'updated');
+            $row['resolved'] = ($row['resolved'] != 0);
+            $summary[] = $row;
+        }
+
+        return $summary;
+    }
+
+    // Count the alerts get_alerts($where) would return, grouped by $key
+    // (csAK_*); csAK_NONE returns a single row.  $bucket is the width of
+    // csAK_BUCKET time buckets in seconds, newest first; other groups come
+    // largest first.  Each row is array('key', 'count', 'alerts',
+    // 'updated'): 'count' is rows as get_alerts() returns them (one per
+    // occurrence), 'alerts' distinct alerts.
+    public function get_aggregate($key = csAK_NONE,
+        $where = '', $limit = 0, $bucket = 0)
+    {
+        if ($this->proto_version < csEVENTS_PROTOVER_AGGREGATE)
+            throw new Exception('Aggregates require a newer protocol version');
+
+        $this->reset_packet();
+        $this->write_packet_var($key, 'key');
+        $this->write_packet_var($limit, 'count');
+        $this->write_packet_var($bucket, 'bucket');
+        $this->write_packet_string($where);
+        $this->write_packet(csSMOC_ALERT_AGGREGATE);
+
+        $result = $this->read_result();
+        if ($result == csSMPR_ERROR) {
+            $this->read_packet_string($error);
+            throw new Exception("Aggregate failed: $error");
+        }
+        if ($result != csSMPR_OK)
+            throw new Exception('Unexpected result: ' . $result);
+
+        $aggregate = array();
+        $this->read_packet_var($rows, 'matches');
+
+        for ($i = 0; $i < $rows; $i++) {
+            $row = array();
+            if ($key == csAK_ORIGIN || $key == csAK_BASENAME)
+                $this->read_packet_string($row['key']);
+            else
+                $this->read_packet_var($row['key'], 'value');
+            $this->read_packet_var($row['count'], 'count');
+            $this->read_packet_var($row['alerts'], 'count');
+            $this->read_packet_var($row['updated'], 'updated');
+            $aggregate[] = $row;
+        }
+
+        return $aggregate;
+    }
+
+    public function get_histogram($resolution = csHR_HOUR,
+        $from = 0, $to = 0, $types = array())
+    {
+        $this->reset_packet();
+        $this->write_packet_var($resolution, 'resolution');
+        $this->write_packet_var($from, 'stamp');
+        $this->write_packet_var($to, 'stamp');
+        $this->write_packet_var(count($types), 'count');
+        foreach ($types as $type)
+            $this->write_packet_var($type, 'type');
+        $this->write_packet(csSMOC_HISTOGRAM_SELECT);
+
+        if ($this->read_packet() != csSMOC_HISTOGRAM_SELECT) {
+            throw new Exception(
+                'Unexpected op-code: ' . $this->header['opcode']
+            );
+        }
+
+        $histogram = array();
+        $this->read_packet_var($series, 'count');
+
+        for ($i = 0; $i < $series; $i++) {
+            $entry = array('counts' => array());
+            $this->read_packet_var($entry['type'], 'type');
+            $this->read_packet_var($entry['level'], 'level');
+            $this->read_packet_var($entry['start'], 'stamp');
+            $this->read_packet_var($entry['width'], 'stamp');
+            $this->read_packet_var($buckets, 'count');
+            for ($j = 0; $j < $buckets; $j++) {
+                $this->read_packet_var($count, 'count');
+                $entry['counts'][] = $count;
+            }
+            $histogram[] = $entry;
+        }
+
+        return $histogram;
+    }
+
+    public function get_stats()
+    {
+        $this->reset_packet();
+        $this->write_packet(csSMOC_STATS);
+
+        if ($this->read_packet() != csSMOC_STATS) {
+            throw new Exception(
+                'Unexpected op-code: ' . $this->header['opcode']
+            );
+        }
+
+        $stats = array();
+        $this->read_packet_var($count, 'count');
+
+        for ($i = 0; $i < $count; $i++) {
+            $this->read_packet_string($key);
+            $this->read_packet_var($stats[$key], 'value');
+        }
+
+        return $stats;
+    }
+
+    public function resolve_alerts($key, $values, $type = 0)
+    {
+        $this->reset_packet();
+        $this->write_packet_var($key, 'key');
+        $this->write_packet_var($type, 'type');
+        $this->write_packet_var(count($values), 'count');
+        foreach ($values as $value)
+            $this->write_packet_string((string)$value);
+        $this->write_packet(csSMOC_ALERT_RESOLVE);
+
+        $result = $this->read_result();
+        if ($result == csSMPR_ERROR) {
+            $this->read_packet_string($error);
+            throw new Exception("Resolve failed: $error");
+        }
+        if ($result != csSMPR_OK)
+            throw new Exception('Unexpected result: ' . $result);
+
+        $this->read_packet_var($resolved, 'count');
+
+        return $resolved;
     }
 
     public function mark_as_read($id)
@@ -360,10 +762,10 @@ class libEventsitor
         return $this->header_field_sizes[$field]['format'];
     }
 
-    protected function version_exchange()
+    protected function version_exchange($protover)
     {
         $this->reset_packet();
-        $this->write_packet_var(csEVENTS_PROTOVER, 'version');
+        $this->write_packet_var($protover, 'version');
         $this->write_packet(csSMOC_VERSION);
 
         if ($this->read_result() != csSMPR_OK) {
@@ -371,6 +773,45 @@ class libEventsitor
                 'Unexpected result code: ' . $this->header['opcode']
             );
         }
+
+        // v2 servers reply with the version both ends will speak
+        $this->proto_version = $protover;
+        if ($this->header['payload_length'] - $this->payload_index >= 4)
+            $this->read_packet_var($this->proto_version, 'version');
+    }
+
+    protected function read_alert_records($matches)
+    {
+        $alerts = array();
+        $end_marker = ($this->proto_version >= csEVENTS_PROTOVER_FRAMES);
+
+        while (count($alerts) < $matches || $end_marker) {
+            if ($this->read_packet() != csSMOC_ALERT_RECORD) {
+                throw new Exception(
+                    'Unexpected op-code: ' . $this->header['opcode']
+                );
+            }
+
+            $count = 1;
+            if ($this->proto_version >= csEVENTS_PROTOVER_V2) {
+                $this->read_packet_varint($count);
+                if ($count == 0 && $end_marker) {
+                    if (count($alerts) != $matches)
+                        throw new Exception('Truncated alert records');
+                    break;
+                }
+                if ($count == 0 || $count > $matches - count($alerts))
+                    throw new Exception('Invalid alert record count');
+            }
+
+            for ($i = 0; $i < $count; $i++) {
+                $alert = new libEventsAlert();
+                $this->read_packet_alert($alert);
+                $alerts[] = $alert;
+            }
+        }
+
+        return $alerts;
     }
 
     protected function reset_packet()
@@ -393,18 +834,40 @@ class libEventsitor
         $this->payload_index += $length;
     }
 
+    protected function read_packet_varint(&$v)
+    {
+        $v = 0;
+        for ($shift = 0; ; $shift += 7) {
+            if ($shift > 63 ||
+                $this->payload_index >= $this->header['payload_length'])
+                throw new Exception('Invalid varint');
+
+            $byte = ord($this->payload[$this->payload_index++]);
+            $v |= ($byte & 0x7f) << $shift;
+
+            if (! ($byte & 0x80)) break;
+        }
+    }
+
     protected function read_packet_string(&$v)
     {
-        $format = libEventsAlert::get_field_format('string');
-        $length = libEventsAlert::get_field_length('string');
+        if ($this->proto_version >= csEVENTS_PROTOVER_V2)
+            $this->read_packet_varint($length);
+        else {
+            $format = libEventsAlert::get_field_format('string');
+            $length = libEventsAlert::get_field_length('string');
 
-        $u = unpack(
-            $format,
-            substr($this->payload, $this->payload_index, $length)
-        );
-        $this->payload_index += $length;
+            $u = unpack(
+                $format,
+                substr($this->payload, $this->payload_index, $length)
+            );
+            $this->payload_index += $length;
+            $length = $u[1];
+        }
+
+        if ($length > $this->header['payload_length'] - $this->payload_index)
+            throw new Exception('Invalid string length');
 
-        $length = $u[1];
         if ($length == 0) $v = '';
         else {
             $v = substr($this->payload, $this->payload_index, $length);
@@ -416,6 +879,11 @@ class libEventsitor
     {
         $v->reset();
 
+        if ($this->proto_version >= csEVENTS_PROTOVER_V2) {
+            $this->read_packet_alert_v2($v);
+            return;
+        }
+
         $format = libEventsAlert::get_field_format('id');
         $length = libEventsAlert::get_field_length('id');
 
@@ -463,6 +931,63 @@ class libEventsitor
         if (strlen($u)) $v->set_description($u);
     }
 
+    protected function read_packet_alert_v2(&$v)
+    {
+        $this->read_packet_varint($fields);
+
+        // Absent fields are zero or empty, not reset() defaults
+        $u = 0;
+        if ($fields & csSMAF_ID) $this->read_packet_varint($u);
+        $v->set_id($u);
+        $u = 0;
+        if ($fields & csSMAF_CREATED) $this->read_packet_varint($u);
+        $v->set_created($u);
+        $u = 0;
+        if ($fields & csSMAF_UPDATED) $this->read_packet_varint($u);
+        $v->set_updated($u);
+        $u = 0;
+        if ($fields & csSMAF_FLAGS) $this->read_packet_varint($u);
+        $v->set_flags($u);
+        $u = 0;
+        if ($fields & csSMAF_TYPE) $this->read_packet_varint($u);
+        $v->set_type($u);
+        $u = 0;
+        if ($fields & csSMAF_USER) $this->read_packet_varint($u);
+        $v->set_user($u);
+
+        if ($fields & csSMAF_GROUPS) {
+            $this->read_packet_varint($groups);
+            for ($i = 0; $i < $groups; $i++) {
+                $this->read_packet_varint($u);
+                $v->add_group($u);
+            }
+        }
+
+        if ($fields & csSMAF_ORIGIN) {
+            $this->read_packet_string($u);
+            $v->set_origin($u);
+        }
+        if ($fields & csSMAF_BASENAME) {
+            $this->read_packet_string($u);
+            $v->set_basename($u);
+        }
+        if ($fields & csSMAF_UUID) {
+            $this->read_packet_string($u);
+            $v->set_uuid($u);
+        }
+        if ($fields & csSMAF_DESC) {
+            $this->read_packet_string($u);
+            $v->set_description($u);
+        }
+
+        // Skip fields from newer servers
+        for ($bit = csSMAF_KNOWN + 1; $bit > 0; $bit <<= 1) {
+            if (! ($fields & $bit)) continue;
+            $this->read_packet_varint($length);
+            $this->payload_index += $length;
+        }
+    }
+
     protected function write_packet_var($v, $field)
     {
         $format = libEventsAlert::get_field_format($field);
@@ -483,13 +1008,31 @@ class libEventsitor
         $this->header['payload_length'] += $length;
     }
 
+    protected function write_packet_varint($v)
+    {
+        do {
+            $byte = $v & 0x7f;
+            // Logical shift; ids are the only values that can be negative
+            $v = ($v >> 7) & (PHP_INT_MAX >> 6);
+            if ($v) $byte |= 0x80;
+            $this->payload .= chr($byte);
+            $this->header['payload_length']++;
+        } while ($v);
+    }
+
     protected function write_packet_string($v)
     {
-        $format = libEventsAlert::get_field_format('string');
-        $length = libEventsAlert::get_field_length('string');
+        if ($this->proto_version >= csEVENTS_PROTOVER_V2)
+            $this->write_packet_varint(strlen($v));
+        else {
+            // v1 lengths are a single byte; longer strings are truncated
+            $format = libEventsAlert::get_field_format('string');
+            $length = libEventsAlert::get_field_length('string');
 
-        $this->payload .= pack($format, strlen($v));
-        $this->header['payload_length'] += $length;
+            if (strlen($v) > 0xff) $v = substr($v, 0, 0xff);
+            $this->payload .= pack($format, strlen($v));
+            $this->header['payload_length'] += $length;
+        }
         if (strlen($v) > 0) {
             $this->payload .= $v;
             $this->header['payload_length'] += strlen($v);
@@ -498,6 +1041,11 @@ class libEventsitor
 
     protected function write_packet_alert($v)
     {
+        if ($this->proto_version >= csEVENTS_PROTOVER_V2) {
+            $this->write_packet_alert_v2($v);
+            return;
+        }
+
         $this->write_packet_var($v->get_id(), 'id');
         $this->write_packet_var($v->get_created(), 'created');
         $this->write_packet_var($v->get_updated(), 'updated');
@@ -516,6 +1064,44 @@ class libEventsitor
         $this->write_packet_string($v->get_description());
     }
 
+    protected function write_packet_alert_v2($v)
+    {
+        $groups = $v->get_groups();
+        $values = array(
+            csSMAF_ID => $v->get_id(),
+            csSMAF_CREATED => $v->get_created(),
+            csSMAF_UPDATED => $v->get_updated(),
+            csSMAF_FLAGS => $v->get_flags(),
+            csSMAF_TYPE => $v->get_type(),
+            csSMAF_USER => $v->get_user(),
+        );
+        $strings = array(
+            csSMAF_ORIGIN => $v->get_origin(),
+            csSMAF_BASENAME => $v->get_basename(),
+            csSMAF_UUID => $v->get_uuid(),
+            csSMAF_DESC => $v->get_description(),
+        );
+
+        $fields = 0;
+        foreach ($values as $bit => $value)
+            if ($value) $fields |= $bit;
+        if (count($groups)) $fields |= csSMAF_GROUPS;
+        foreach ($strings as $bit => $value)
+            if (strlen($value)) $fields |= $bit;
+
+        $this->write_packet_varint($fields);
+
+        foreach ($values as $bit => $value)
+            if ($fields & $bit) $this->write_packet_varint($value);
+        if ($fields & csSMAF_GROUPS) {
+            $this->write_packet_varint(count($groups));
+            foreach ($groups as $group)
+                $this->write_packet_varint($group);
+        }
+        foreach ($strings as $bit => $value)
+            if ($fields & $bit) $this->write_packet_string($value);
+    }
+
     protected function read_packet()
     {
         $this->reset_packet();
@@ -539,16 +1125,28 @@ class libEventsitor
         if ($this->header['payload_length'] == 0)
             $this->payload = null;
         else {
-            $this->payload = socket_read(
-                $this->sd,
-                $this->header['payload_length']
-            );
+            // Multi-record frames are larger than a single read returns
+            $this->payload = '';
+            while (strlen($this->payload) < $this->header['payload_length']) {
+                $buffer = socket_read(
+                    $this->sd,
+                    $this->header['payload_length'] - strlen($this->payload)
+                );
+                if ($buffer === false || $buffer === '')
+                    throw new Exception('Short read from events socket');
+                $this->payload .= $buffer;
+            }
         }
 
         return $this->header['opcode'];
     }
 
     protected function write_packet($opcode)
+    {
+        socket_write($this->sd, $this->pack_packet($opcode));
+    }
+
+    protected function pack_packet($opcode)
     {
         $this->header['opcode'] = $opcode;
         $format = $this->get_header_format('opcode');
@@ -558,7 +1156,7 @@ class libEventsitor
         if ($this->header['payload_length'] > 0)
             $buffer .= $this->payload;
 
-        socket_write($this->sd, $buffer);
+        return $buffer;
     }
 
     protected function read_result()